@@ -227,6 +227,31 @@ void cprintf(char* fmt, ...)
 	va_end(list);
 }
 
+/**
+ * Nothing else runs during boot so mutexes are never contended.
+ */
+void kmutex_init(kmutex_t* m)
+{
+	m->locked = 0;
+}
+
+void kmutex_lock(kmutex_t* m)
+{
+	m->locked = 1;
+}
+
+void kmutex_unlock(kmutex_t* m)
+{
+	m->locked = 0;
+}
+
+/**
+ * Only the boot cpu is running, there are no other TLBs to flush.
+ */
+void vm_tlb_shootdown(pgdir_t* dir)
+{
+}
+
 void panic(char* fmt, ...)
 {
 	asm volatile("addl $0x08, %esp");
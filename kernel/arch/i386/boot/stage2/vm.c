@@ -63,7 +63,7 @@ static void vm_stable_page_pool(void)
 	entry++;
 	entry->addr_low =    0x100000;
 	entry->addr_high =   0x00000000;
-	entry->length_low =  0x10000000;
+	entry->length_low =  VM_POOL_E - 0x100000;
 	//entry->length_low =  0x1fffe000;
 	entry->length_high = 0x00000000;
 	entry->type = 1;
@@ -4,8 +4,7 @@
 #include "trap.h"
 #include "panic.h"
 
-extern context_t k_context;
-extern struct vm_segment_descriptor global_descriptor_table[];
+extern struct vm_segment_descriptor global_descriptor_table[CPU_MAX][SEG_COUNT];
 
 void context_switch(struct proc* p)
 {
@@ -14,14 +13,16 @@ void context_switch(struct proc* p)
         uintptr_t limit = sizeof(struct task_segment);
         unsigned int type = TSS_DEFAULT_FLAGS | TSS_PRESENT;
         unsigned int flag = TSS_AVAILABILITY;
-
-        global_descriptor_table[SEG_TSS].limit_1 = (uint16_t) limit;
-        global_descriptor_table[SEG_TSS].base_1 = (uint16_t) base;
-        global_descriptor_table[SEG_TSS].base_2 = (uint8_t)(base>>16);
-        global_descriptor_table[SEG_TSS].type = type;
-        global_descriptor_table[SEG_TSS].flags_limit_2 =
+        struct vm_segment_descriptor* gdt =
+                global_descriptor_table[cpu_this()->id];
+
+        gdt[SEG_TSS].limit_1 = (uint16_t) limit;
+        gdt[SEG_TSS].base_1 = (uint16_t) base;
+        gdt[SEG_TSS].base_2 = (uint8_t)(base>>16);
+        gdt[SEG_TSS].type = type;
+        gdt[SEG_TSS].flags_limit_2 =
                 (uint_8)(limit >> 16) | flag;
-        global_descriptor_table[SEG_TSS].base_3 = (base >> 24);
+        gdt[SEG_TSS].base_3 = (base >> 24);
 
         /* Switch to the user's page directory (stack access) */
         vm_enable_paging(p->pgdir);
@@ -32,12 +33,16 @@ void context_switch(struct proc* p)
         ts->ss = SEG_USER_DATA << 3;
         ltr(SEG_TSS << 3);
 
+        /* Floating point instructions trap unless we hold p's registers */
+        fpu_switch_in(p);
+
         if(p->state == PROC_READY)
         {
                 p->state = PROC_RUNNING;
                 x86_drop_priv(&k_context, p->tf->esp, (void*)p->entry_point);
 
                 /* When we get back here, the process is done running for now. */
+                fpu_switch_out(p);
                 return;
         }
         if(p->state != PROC_RUNNABLE)
@@ -47,6 +52,7 @@ void context_switch(struct proc* p)
 
         /* Go from kernel context to process context */
         x86_context_switch(&k_context, p->context);
+        fpu_switch_out(p);
 }
 
 void context_restore(uintptr_t* old_context, uintptr_t new_context)
@@ -0,0 +1,70 @@
+/**
+ * Driver for the I/O Advanced Programmable Interrupt Controller, which
+ * routes device interrupts to the local interrupt controllers.
+ */
+
+#include <stdlib.h>
+
+#include "x86.h"
+#include "devman.h"
+#include "drivers/ioapic.h"
+#include "panic.h"
+
+// #define DEBUG
+
+/* Memory mapped registers */
+#define IOAPIC_REGSEL 	(0x00 / 4) /* Register select */
+#define IOAPIC_WIN	(0x10 / 4) /* Register window */
+
+/* Registers */
+#define IOAPIC_REG_ID	0x00
+#define IOAPIC_REG_VER	0x01
+#define IOAPIC_REG_TABLE 0x10 /* Start of the redirection table */
+
+#define IOAPIC_MASKED	0x00010000
+
+#define IOAPIC_SIZE 0x1000
+
+static volatile uint* ioapic;
+
+static uint ioapic_read(int reg)
+{
+	ioapic[IOAPIC_REGSEL] = reg;
+	return ioapic[IOAPIC_WIN];
+}
+
+static void ioapic_write(int reg, uint value)
+{
+	ioapic[IOAPIC_REGSEL] = reg;
+	ioapic[IOAPIC_WIN] = value;
+}
+
+void ioapic_init(uintptr_t phy, int id)
+{
+	ioapic = dev_new_mapping(phy, IOAPIC_SIZE);
+	if(!ioapic) return;
+
+	int max_irq = (ioapic_read(IOAPIC_REG_VER) >> 16) & 0xFF;
+#ifdef DEBUG
+	if(((ioapic_read(IOAPIC_REG_ID) >> 24) & 0x0F) != id)
+		cprintf("ioapic: id doesn't match the MP table\n");
+	cprintf("ioapic: %d interrupts\n", max_irq + 1);
+#endif
+
+	/* Mask everything */
+	int irq;
+	for(irq = 0;irq <= max_irq;irq++)
+	{
+		ioapic_write(IOAPIC_REG_TABLE + irq * 2, IOAPIC_MASKED);
+		ioapic_write(IOAPIC_REG_TABLE + irq * 2 + 1, 0);
+	}
+}
+
+void ioapic_enable(int irq, int vector, int hw_id)
+{
+	if(!ioapic) return;
+
+	/* Edge triggered, active high, fixed delivery to one cpu */
+	ioapic_write(IOAPIC_REG_TABLE + irq * 2, vector);
+	ioapic_write(IOAPIC_REG_TABLE + irq * 2 + 1, hw_id << 24);
+}
@@ -0,0 +1,201 @@
+/**
+ * Driver for the local Advanced Programmable Interrupt Controller. Every
+ * cpu has its own local interrupt controller, mapped at the same address.
+ * It is used to send interrupts between cpus and as the timer of the cpus
+ * that don't drive the timer wheel.
+ */
+
+#include <stdlib.h>
+
+#include "x86.h"
+#include "devman.h"
+#include "ktimer.h"
+#include "drivers/lapic.h"
+#include "panic.h"
+
+// #define DEBUG
+
+/* Register offsets (in 32 bit words) */
+#define LAPIC_ID	(0x0020 / 4) /* ID */
+#define LAPIC_VER	(0x0030 / 4) /* Version */
+#define LAPIC_TPR	(0x0080 / 4) /* Task priority */
+#define LAPIC_EOI	(0x00B0 / 4) /* End of interrupt */
+#define LAPIC_SVR	(0x00F0 / 4) /* Spurious interrupt vector */
+#define LAPIC_ESR	(0x0280 / 4) /* Error status */
+#define LAPIC_ICRLO	(0x0300 / 4) /* Interrupt command, low word */
+#define LAPIC_ICRHI	(0x0310 / 4) /* Interrupt command, high word */
+#define LAPIC_TIMER	(0x0320 / 4) /* Local vector table: timer */
+#define LAPIC_PCINT	(0x0340 / 4) /* Local vector table: perf counter */
+#define LAPIC_LINT0	(0x0350 / 4) /* Local vector table: LINT0 */
+#define LAPIC_LINT1	(0x0360 / 4) /* Local vector table: LINT1 */
+#define LAPIC_ERROR	(0x0370 / 4) /* Local vector table: error */
+#define LAPIC_TICR	(0x0380 / 4) /* Timer initial count */
+#define LAPIC_TCCR	(0x0390 / 4) /* Timer current count */
+#define LAPIC_TDCR	(0x03E0 / 4) /* Timer divide configuration */
+
+/* Register bits */
+#define LAPIC_SVR_ENABLE	0x00000100
+#define LAPIC_MASKED		0x00010000
+#define LAPIC_EXTINT		0x00000700
+#define LAPIC_NMI		0x00000400
+#define LAPIC_TIMER_X1		0x0000000B /* Divide the bus clock by 1 */
+
+/* Interrupt command bits */
+#define ICR_INIT	0x00000500
+#define ICR_STARTUP	0x00000600
+#define ICR_DELIVS	0x00001000 /* Delivery status */
+#define ICR_ASSERT	0x00004000
+#define ICR_LEVEL	0x00008000
+
+#define LAPIC_SIZE 0x1000
+
+/* Ticks to measure the timer frequency over */
+#define LAPIC_CALIBRATE_TICKS 5
+
+static volatile uint* lapic; /* The mapped local interrupt controller */
+static uint lapic_tick_count; /* Timer counts in one timer wheel tick */
+
+static void lapic_write(int reg, uint value)
+{
+	lapic[reg] = value;
+	/* Wait for the write to finish */
+	(void)lapic[LAPIC_ID];
+}
+
+void lapic_map(uintptr_t phy)
+{
+	lapic = dev_new_mapping(phy, LAPIC_SIZE);
+}
+
+int lapic_present(void)
+{
+	return lapic != NULL;
+}
+
+void lapic_init(int boot_cpu)
+{
+	/* Enable the controller, spurious interrupts go to their own vector */
+	lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | INT_LAPIC_SPURIOUS);
+
+	/* The timer is only started by lapic_timer_oneshot */
+	lapic_write(LAPIC_TDCR, LAPIC_TIMER_X1);
+	lapic_write(LAPIC_TIMER, LAPIC_MASKED | INT_LAPIC_TIMER);
+	lapic_write(LAPIC_TICR, 0);
+
+	/**
+	 * The PICs are wired to LINT0 of the boot cpu (virtual wire mode).
+	 * The other cpus don't take device interrupts.
+	 */
+	if(boot_cpu) lapic_write(LAPIC_LINT0, LAPIC_EXTINT);
+	else lapic_write(LAPIC_LINT0, LAPIC_MASKED);
+	if(boot_cpu) lapic_write(LAPIC_LINT1, LAPIC_NMI);
+	else lapic_write(LAPIC_LINT1, LAPIC_MASKED);
+
+	/* Disable performance counter overflow interrupts if present */
+	if(((lapic[LAPIC_VER] >> 16) & 0xFF) >= 4)
+		lapic_write(LAPIC_PCINT, LAPIC_MASKED);
+
+	/* Errors get their own vector */
+	lapic_write(LAPIC_ERROR, INT_LAPIC_ERROR);
+
+	/* Clear the error status (needs back to back writes) */
+	lapic_write(LAPIC_ESR, 0);
+	lapic_write(LAPIC_ESR, 0);
+
+	/* Acknowledge anything that is still outstanding */
+	lapic_write(LAPIC_EOI, 0);
+
+	/* Accept all interrupts */
+	lapic_write(LAPIC_TPR, 0);
+}
+
+int lapic_id(void)
+{
+	if(!lapic) return 0;
+	return lapic[LAPIC_ID] >> 24;
+}
+
+void lapic_eoi(void)
+{
+	if(lapic) lapic_write(LAPIC_EOI, 0);
+}
+
+/**
+ * Wait for the last interrupt command to be delivered.
+ */
+static void lapic_icr_wait(void)
+{
+	while(lapic[LAPIC_ICRLO] & ICR_DELIVS)
+		cpu_relax();
+}
+
+void lapic_ipi(int hw_id, int vector)
+{
+	lapic_icr_wait();
+	lapic_write(LAPIC_ICRHI, hw_id << 24);
+	lapic_write(LAPIC_ICRLO, vector);
+}
+
+/**
+ * Wait for about us microseconds. Only used during startup.
+ */
+static void lapic_delay(int us)
+{
+	uint64_t end = ktimer_ns() + us * 1000ULL;
+	while(ktimer_ns() < end)
+		ktimer_poll();
+}
+
+void lapic_start_ap(int hw_id, uintptr_t entry)
+{
+	/* INIT, then wait for the processor to reset */
+	lapic_icr_wait();
+	lapic_write(LAPIC_ICRHI, hw_id << 24);
+	lapic_write(LAPIC_ICRLO, ICR_INIT | ICR_LEVEL | ICR_ASSERT);
+	lapic_delay(200);
+	lapic_write(LAPIC_ICRLO, ICR_INIT | ICR_LEVEL);
+	lapic_delay(10000);
+
+	/**
+	 * Send the startup interrupt twice, the second one is ignored if
+	 * the first one worked.
+	 */
+	int x;
+	for(x = 0;x < 2;x++)
+	{
+		lapic_icr_wait();
+		lapic_write(LAPIC_ICRHI, hw_id << 24);
+		lapic_write(LAPIC_ICRLO, ICR_STARTUP | (entry >> 12));
+		lapic_delay(200);
+	}
+}
+
+void lapic_timer_calibrate(void)
+{
+	/* Count down from the top and see how far it gets */
+	lapic_write(LAPIC_TICR, 0xFFFFFFFF);
+	uint64_t end = ktimer_ns() + LAPIC_CALIBRATE_TICKS * KTIMER_TICK_NS;
+	while(ktimer_ns() < end)
+		ktimer_poll();
+	uint counted = 0xFFFFFFFF - lapic[LAPIC_TCCR];
+	lapic_write(LAPIC_TICR, 0);
+
+	lapic_tick_count = counted / LAPIC_CALIBRATE_TICKS;
+	if(!lapic_tick_count) lapic_tick_count = 1;
+
+#ifdef DEBUG
+	cprintf("lapic: %d timer counts per tick\n", lapic_tick_count);
+#endif
+}
+
+uint lapic_timer_oneshot(uint ticks)
+{
+	/* The counter is 32 bits wide */
+	uint max = 0xFFFFFFFF / lapic_tick_count;
+	if(ticks > max) ticks = max;
+	if(!ticks) ticks = 1;
+
+	lapic_write(LAPIC_TIMER, INT_LAPIC_TIMER);
+	lapic_write(LAPIC_TICR, ticks * lapic_tick_count);
+	return ticks;
+}
@@ -0,0 +1,207 @@
+/**
+ * Parser for the Intel MultiProcessor Specification tables. The BIOS
+ * leaves a floating pointer structure in low memory that points to a
+ * configuration table, which lists the processors and interrupt
+ * controllers of the system. Low memory is directly mapped so the tables
+ * can be read in place.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "x86.h"
+#include "cpu.h"
+#include "drivers/mp.h"
+#include "panic.h"
+
+// #define DEBUG
+
+/* The floating pointer structure */
+struct mp_float
+{
+	char signature[4]; /* "_MP_" */
+	uint32_t config; /* Physical address of the configuration table */
+	uint8_t length; /* Length in 16 byte units (1) */
+	uint8_t spec_rev; /* Version of the specification */
+	uint8_t checksum; /* All bytes have to add up to 0 */
+	uint8_t type; /* Default configuration type, 0 if there is a table */
+	uint8_t imcr; /* Bit 7 is set if the IMCR is present */
+	uint8_t reserved[3];
+};
+
+/* The header of the configuration table */
+struct mp_table
+{
+	char signature[4]; /* "PCMP" */
+	uint16_t length; /* Length of the base table with the header */
+	uint8_t version; /* Version of the specification */
+	uint8_t checksum; /* All bytes have to add up to 0 */
+	char product[20]; /* OEM and product id */
+	uint32_t oem_table; /* Physical address of the OEM table */
+	uint16_t oem_length; /* Length of the OEM table */
+	uint16_t entries; /* Amount of entries after the header */
+	uint32_t lapic; /* Physical address of the local APICs */
+	uint16_t ext_length; /* Length of the extended table */
+	uint8_t ext_checksum; /* Checksum of the extended table */
+	uint8_t reserved;
+};
+
+/* Entry types */
+#define MP_PROC		0x00
+#define MP_BUS		0x01
+#define MP_IOAPIC	0x02
+#define MP_IOINTR	0x03
+#define MP_LINTR	0x04
+
+/* Processor entry */
+struct mp_proc
+{
+	uint8_t type; /* MP_PROC */
+	uint8_t apic_id; /* The id of the local APIC */
+	uint8_t version; /* Version of the local APIC */
+	uint8_t flags; /* See below */
+	uint8_t signature[4]; /* cpuid signature */
+	uint32_t feature; /* cpuid features */
+	uint8_t reserved[8];
+};
+
+#define MP_PROC_ENABLED	0x01 /* The processor can be used */
+#define MP_PROC_BOOT	0x02 /* This is the boot processor */
+
+/* I/O APIC entry */
+struct mp_ioapic
+{
+	uint8_t type; /* MP_IOAPIC */
+	uint8_t apic_id; /* The id of the I/O APIC */
+	uint8_t version; /* The version of the I/O APIC */
+	uint8_t flags; /* Bit 0 is set if the I/O APIC can be used */
+	uint32_t address; /* Physical address of the I/O APIC */
+};
+
+#define MP_ENTRY_SIZE 8 /* Size of every entry but processor entries */
+
+/**
+ * Returns the sum of all of the bytes in the range.
+ */
+static uint8_t mp_sum(const uint8_t* bytes, int length)
+{
+	uint8_t sum = 0;
+	int x;
+	for(x = 0;x < length;x++)
+		sum += bytes[x];
+	return sum;
+}
+
+/**
+ * Search for the floating pointer structure in the physical range. It is
+ * always 16 byte aligned.
+ */
+static struct mp_float* mp_search(uintptr_t start, size_t length)
+{
+	uintptr_t addr;
+	for(addr = start;addr + sizeof(struct mp_float) <= start + length;
+			addr += 16)
+	{
+		struct mp_float* mp = (struct mp_float*)addr;
+		if(!memcmp(mp->signature, "_MP_", 4)
+				&& !mp_sum((uint8_t*)mp, sizeof(struct mp_float)))
+			return mp;
+	}
+
+	return NULL;
+}
+
+/**
+ * The floating pointer is either in the first KB of the extended BIOS data
+ * area, in the last KB of base memory or in the BIOS ROM.
+ */
+static struct mp_float* mp_find(void)
+{
+	const uint8_t* bda = (const uint8_t*)0x400;
+	struct mp_float* mp;
+
+	uintptr_t ebda = ((bda[0x0F] << 8) | bda[0x0E]) << 4;
+	if(ebda && (mp = mp_search(ebda, 1024)))
+		return mp;
+
+	uintptr_t base_kb = (bda[0x14] << 8) | bda[0x13];
+	if(base_kb && (mp = mp_search(base_kb * 1024 - 1024, 1024)))
+		return mp;
+
+	return mp_search(0xF0000, 0x10000);
+}
+
+int mp_detect(struct mp_config* conf)
+{
+	memset(conf, 0, sizeof(struct mp_config));
+
+	struct mp_float* mp = mp_find();
+	/* Default configurations aren't supported */
+	if(!mp || !mp->config) return -1;
+
+	struct mp_table* table = (struct mp_table*)mp->config;
+	if(memcmp(table->signature, "PCMP", 4)) return -1;
+	if(table->version != 1 && table->version != 4) return -1;
+	if(mp_sum((uint8_t*)table, table->length)) return -1;
+
+	conf->lapic = table->lapic;
+	conf->imcr = (mp->imcr & 0x80) ? 1 : 0;
+
+	uint8_t* entry = (uint8_t*)(table + 1);
+	uint8_t* end = (uint8_t*)table + table->length;
+	while(entry < end)
+	{
+		switch(*entry)
+		{
+			case MP_PROC:
+			{
+				struct mp_proc* proc = (struct mp_proc*)entry;
+				entry += sizeof(struct mp_proc);
+				if(!(proc->flags & MP_PROC_ENABLED)) break;
+				if(conf->cpu_count >= CPU_MAX) break;
+
+				/* Keep the boot processor first */
+				if(proc->flags & MP_PROC_BOOT)
+				{
+					memmove(conf->cpu_ids + 1, conf->cpu_ids,
+						sizeof(int) * conf->cpu_count);
+					conf->cpu_ids[0] = proc->apic_id;
+				} else {
+					conf->cpu_ids[conf->cpu_count] =
+						proc->apic_id;
+				}
+				conf->cpu_count++;
+				break;
+			}
+			case MP_IOAPIC:
+			{
+				struct mp_ioapic* io = (struct mp_ioapic*)entry;
+				entry += MP_ENTRY_SIZE;
+				/* Only the first I/O APIC is used */
+				if(!(io->flags & 0x01) || conf->ioapic) break;
+				conf->ioapic = io->address;
+				conf->ioapic_id = io->apic_id;
+				break;
+			}
+			case MP_BUS: case MP_IOINTR: case MP_LINTR:
+				entry += MP_ENTRY_SIZE;
+				break;
+			default:
+				/* Unknown entry, the rest can't be parsed */
+#ifdef DEBUG
+				cprintf("mp: unknown entry type %d\n", *entry);
+#endif
+				entry = end;
+				break;
+		}
+	}
+
+	if(!conf->cpu_count) return -1;
+
+#ifdef DEBUG
+	cprintf("mp: %d cpus, lapic at 0x%x, ioapic at 0x%x\n",
+			conf->cpu_count, conf->lapic, conf->ioapic);
+#endif
+
+	return 0;
+}
@@ -4,8 +4,15 @@
  * Driver for the 80*86 Programmable Interval Timer.
  */
 
+#include <stdlib.h>
+
 #include "x86.h"
 #include "drivers/pic.h"
+#include "drivers/pit.h"
+#include "ktimer.h"
+#include "panic.h"
+
+// #define DEBUG
 
 #define TIMER_FREQ 1193182
 
@@ -14,11 +21,105 @@
 #define PORT_PIT_CHANNEL_2_DATA 0x42
 #define PORT_PIT_COMMAND 	0x43
 
-#define TICKS_PER_SECOND 1
-// FAST i
+/* The first interrupt, after that the timer wheel sets the interrupts */
 #define TICKS_DIVISOR (8192)
-// SLOWEST
-// #define TICKS_DIVISOR 6553
+
+#define PORT_PIT_GATE 0x61 /* Gate of channel 2 and the pc speaker */
+#define PIT_GATE_ENABLE 0x01 /* Channel 2 counts while this is set */
+#define PIT_GATE_SPEAKER 0x02 /* Connect channel 2 to the speaker */
+#define PIT_GATE_OUT 0x20 /* Output of channel 2 */
+
+/* The counter is 16 bits wide */
+#define PIT_MAX_COUNT 0xFFFF
+#define PIT_MAX_US 54900
+
+/* Length of a timer clock in nanoseconds (838.0953ns) */
+#define PIT_CLOCK_NS 838
+
+/* Clocks to measure the time stamp counter over (10ms) */
+#define PIT_CALIBRATE_CLOCKS 11932
+#define PIT_CALIBRATE_NS 10000000
+
+/* Fraction bits of the nanoseconds per time stamp counter cycle */
+#define PIT_TSC_SHIFT 24
+
+/**
+ * The counter of channel 0 is only used for the deadline, in one shot
+ * mode it wraps around every 55ms and can't tell how often it did. Time
+ * is kept with the time stamp counter instead, which doesn't wrap.
+ */
+static uint64_t pit_tsc_last; /* The tsc when time was last reported */
+static uint pit_tsc_mult; /* ns per tsc cycle << PIT_TSC_SHIFT */
+static uint pit_tsc_max; /* Most tsc cycles reported at once */
+static uint pit_ns_frac; /* Leftover fractions of a nanosecond */
+
+/**
+ * Returns the whole 64 bit time stamp counter.
+ */
+static uint64_t pit_tsc(void)
+{
+	uint low;
+	uint high;
+	asm volatile("rdtsc" : "=a" (low), "=d" (high));
+	return ((uint64_t)high << 32) | low;
+}
+
+/**
+ * Measure how many nanoseconds a cycle of the time stamp counter takes
+ * by letting channel 2 count down once.
+ */
+static void pit_calibrate(void)
+{
+	/* Keep the speaker quiet and stop channel 2 */
+	uchar gate = inb(PORT_PIT_GATE) & ~PIT_GATE_SPEAKER;
+	outb(PORT_PIT_GATE, gate & ~PIT_GATE_ENABLE);
+
+	/* Channel 2, Lo/Hi mode, interrupt on terminal count, binary */
+	outb(PORT_PIT_COMMAND, (2 << 6) | (3 << 4) | (0 << 1));
+	outb(PORT_PIT_CHANNEL_2_DATA, (uchar)PIT_CALIBRATE_CLOCKS);
+	outb(PORT_PIT_CHANNEL_2_DATA, (uchar)(PIT_CALIBRATE_CLOCKS >> 8));
+
+	/* The counter starts when the gate goes up */
+	outb(PORT_PIT_GATE, gate | PIT_GATE_ENABLE);
+	uint64_t start = pit_tsc();
+	while(!(inb(PORT_PIT_GATE) & PIT_GATE_OUT));
+	uint cycles = pit_tsc() - start;
+	outb(PORT_PIT_GATE, gate & ~PIT_GATE_ENABLE);
+	if(!cycles) cycles = 1;
+
+	/**
+	 * There is no 64 bit division in the kernel, but divl takes a 64
+	 * bit dividend as long as the quotient fits into 32 bits, which it
+	 * does for any tsc faster than 4MHz.
+	 */
+	uint64_t dividend = (uint64_t)PIT_CALIBRATE_NS << PIT_TSC_SHIFT;
+	uint mult;
+	uint rem;
+	asm volatile("divl %4" : "=a" (mult), "=d" (rem)
+			: "a" ((uint)dividend), "d" ((uint)(dividend >> 32)),
+			"rm" (cycles));
+	pit_tsc_mult = mult;
+
+	/* Report at most 100ms at once so the nanoseconds fit into a uint */
+	pit_tsc_max = cycles * 10;
+	pit_tsc_last = pit_tsc();
+	pit_ns_frac = 0;
+
+#ifdef DEBUG
+	cprintf("pit: %d tsc cycles in %d ns\n", cycles, PIT_CALIBRATE_NS);
+#endif
+}
+
+/**
+ * Load a new value into the counter of channel 0.
+ */
+static void pit_load(uint count)
+{
+	/* Write the divisor (low) */
+	outb(PORT_PIT_CHANNEL_0_DATA, (uchar)count);
+	/* Write the divisor (high) */
+	outb(PORT_PIT_CHANNEL_0_DATA, (uchar)(count >> 8));
+}
 
 void pit_init(void)
 {
@@ -29,29 +130,58 @@ void pit_init(void)
 	/* Access mode */
 	command |= 3 << 4; /* Lo/Hi mode */
 	/* Output mode */
-	command |= 2 << 1; /* Rate generator */
+	command |= 0 << 1; /* Interrupt on terminal count (one shot) */
 	/* BCD / Binary */
 	command |= 0; /* Input is binary, not BCD */
 
 	/* Write the command */
 	outb(PORT_PIT_COMMAND, command);
 
-	/* Calculate the correct divisor. */
-	uint divisor = TICKS_DIVISOR;
-	/* Write the divisor (low) */
-	outb(PORT_PIT_CHANNEL_0_DATA, (uchar)divisor);
-	/* Write the divisor (high) */
-	outb(PORT_PIT_CHANNEL_0_DATA, (uchar)(divisor >> 8));
+	pit_calibrate();
+	pit_load(TICKS_DIVISOR);
 	pic_enable(INT_PIC_TIMER);
 }
 
 void pit_reset(void)
 {
-	/* Calculate the correct divisor. */
-	uint divisor = TICKS_DIVISOR;
-	/* Write the divisor (low) */
-	outb(PORT_PIT_CHANNEL_0_DATA, (uchar)divisor);
-	/* Write the divisor (high) */
-	outb(PORT_PIT_CHANNEL_0_DATA, (uchar)(divisor >> 8));
+	pit_load(TICKS_DIVISOR);
 	pic_enable(INT_PIC_TIMER);
 }
+
+uint pit_elapsed_ns(void)
+{
+	/* Cycles that don't fit are reported by the next call */
+	uint64_t now = pit_tsc();
+	uint cycles = pit_tsc_max;
+	if(now - pit_tsc_last < pit_tsc_max)
+		cycles = now - pit_tsc_last;
+	pit_tsc_last += cycles;
+
+	uint64_t ns = (uint64_t)cycles * pit_tsc_mult + pit_ns_frac;
+	pit_ns_frac = ns & ((1 << PIT_TSC_SHIFT) - 1);
+
+	return ns >> PIT_TSC_SHIFT;
+}
+
+uint pit_oneshot(uint ns)
+{
+	/* Convert to clocks (1.193182 clocks per us), rounding up */
+	uint us = ns / 1000;
+	uint clocks = PIT_MAX_COUNT;
+	if(us < PIT_MAX_US)
+		clocks = us * 1193 / 1000 + us * 182 / 1000000 + 2;
+
+	pit_load(clocks);
+
+	return clocks * PIT_CLOCK_NS;
+}
+
+uint ktimer_clock_elapsed(void)
+{
+	return pit_elapsed_ns();
+}
+
+uint ktimer_clock_oneshot(uint ns)
+{
+	return pit_oneshot(ns);
+}
@@ -11,4 +11,28 @@ void fpu_init(void);
  */
 void fpu_reset(void);
 
+/**
+ * Save the floating point registers into dst, which has to be 16 byte
+ * aligned. The floating point unit has to be enabled.
+ */
+void fpu_save(void* dst);
+
+/**
+ * Load the floating point registers from src, which has to be 16 byte
+ * aligned. The floating point unit has to be enabled.
+ */
+void fpu_restore(void* src);
+
+/**
+ * Clear the task switched flag so that floating point instructions don't
+ * trap anymore.
+ */
+void fpu_enable(void);
+
+/**
+ * Set the task switched flag so that the next floating point instruction
+ * raises a device not available trap.
+ */
+void fpu_disable(void);
+
 #endif
@@ -0,0 +1,16 @@
+#ifndef _IOAPIC_H_
+#define _IOAPIC_H_
+
+/**
+ * Map in the I/O interrupt controller at the given physical address and
+ * mask all of its interrupts. Device interrupts keep coming from the PICs
+ * until they are routed with ioapic_enable.
+ */
+void ioapic_init(uintptr_t phy, int id);
+
+/**
+ * Route the device interrupt irq to the cpu with the given lapic id.
+ */
+void ioapic_enable(int irq, int vector, int hw_id);
+
+#endif
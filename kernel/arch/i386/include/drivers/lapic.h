@@ -0,0 +1,56 @@
+#ifndef _LAPIC_H_
+#define _LAPIC_H_
+
+/**
+ * Map in the local interrupt controllers at the given physical address.
+ * This has to be called once before any other lapic function.
+ */
+void lapic_map(uintptr_t phy);
+
+/**
+ * Returns 1 if the local interrupt controllers are mapped, 0 otherwise.
+ */
+int lapic_present(void);
+
+/**
+ * Enable the local interrupt controller of this cpu. The boot cpu keeps
+ * taking its device interrupts from the PICs.
+ */
+void lapic_init(int boot_cpu);
+
+/**
+ * Returns the id of the local interrupt controller of this cpu.
+ */
+int lapic_id(void);
+
+/**
+ * We are done handling the current local interrupt.
+ */
+void lapic_eoi(void);
+
+/**
+ * Send the interrupt vector to the cpu with the given lapic id.
+ */
+void lapic_ipi(int hw_id, int vector);
+
+/**
+ * Start the application processor with the given lapic id. The processor
+ * starts in real mode at the physical address entry, which has to be
+ * page aligned and below 1MB.
+ */
+void lapic_start_ap(int hw_id, uintptr_t entry);
+
+/**
+ * Measure how many timer counts fit in one timer wheel tick. The timer
+ * wheel has to be running already. (boot cpu only)
+ */
+void lapic_timer_calibrate(void);
+
+/**
+ * Make the timer of this cpu interrupt once after ticks timer wheel ticks.
+ * Returns the amount of ticks the timer was set for, which is less if the
+ * timer can't wait that long.
+ */
+uint lapic_timer_oneshot(uint ticks);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef _MP_H_
+#define _MP_H_
+
+/**
+ * What the MultiProcessor configuration table describes.
+ */
+struct mp_config
+{
+	uintptr_t lapic; /* Physical address of the local APICs */
+	int cpu_count; /* The amount of cpus found */
+	int cpu_ids[CPU_MAX]; /* The lapic ids of the cpus, boot cpu first */
+	uintptr_t ioapic; /* Physical address of the I/O APIC, 0 if none */
+	int ioapic_id; /* The id of the I/O APIC */
+	int imcr; /* Whether the PICs are behind the IMCR */
+};
+
+/**
+ * Find the MultiProcessor configuration table that the BIOS left behind.
+ * Returns 0 on success, -1 if there is no valid table.
+ */
+int mp_detect(struct mp_config* conf);
+
+#endif
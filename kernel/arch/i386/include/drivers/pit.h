@@ -2,16 +2,31 @@
 #define _PIT_H_
 
 /**
- * Initilize the Programmable Interrupt Timer. The frequency, ticks, is defined 
- * in number of interrupts per second. 
+ * Initilize the Programmable Interrupt Timer in one shot mode. The timer
+ * interrupts once, after that it has to be set again with pit_oneshot.
+ * The time stamp counter, which keeps the time, is calibrated first.
  * WARNING: This will generate spurious interrupts so make sure interrupts
  * 	are disabled before initilizing pit. 
  */
 void pit_init(void);
 
 /**
- * Reload the reset value of the timer.
+ * Make the timer interrupt once more after the initial interval.
  */
 void pit_reset(void);
 
+/**
+ * Returns the amount of nanoseconds that have passed since the last call,
+ * measured with the time stamp counter. At most 100ms are returned at
+ * once, the rest is returned by the next call.
+ */
+uint pit_elapsed_ns(void);
+
+/**
+ * Make the timer interrupt once after ns nanoseconds, or after about 55ms
+ * if ns is longer than that. Returns the amount of nanoseconds the timer
+ * was set for.
+ */
+uint pit_oneshot(uint ns);
+
 #endif
@@ -3,6 +3,12 @@
 
 void trap_init(void);
 
+/**
+ * Load the interrupt table on one of the other cpus. trap_init has to be
+ * called on the boot cpu first.
+ */
+void trap_cpu_init(void);
+
 #define GATE_USER 	(0x3 << 13)
 #define GATE_KERNEL 	(0x00)
 #define GATE_TASK_CONST	(0x8500)
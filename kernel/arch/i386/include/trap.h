@@ -8,7 +8,8 @@
 #define SEG_USER_CODE   0x03 /* data must be 1 away from code (sysexit) */
 #define SEG_USER_DATA   0x04
 #define SEG_TSS         0x05
-#define SEG_COUNT       0x06
+#define SEG_CPU         0x06 /* gs points to the struct cpu of each cpu */
+#define SEG_COUNT       0x07
 
 #define SYS_EXIT_BASE   ((SEG_USER_CODE << 3) - 16)
 
@@ -108,6 +109,46 @@ void tp_trap_return(void) __attribute__ ((noreturn));
  */
 void tp_mktf(void) __attribute__ ((noreturn));
 
+/**
+ * Interrupt handler for while the cpu is idle. Acknowledges the interrupt
+ * and returns.
+ */
+void tp_idle(void);
+
+/**
+ * Same as tp_idle for interrupts that come from the local APIC.
+ */
+void tp_idle_lapic(void);
+
+/**
+ * Same as tp_idle for spurious interrupts, which aren't acknowledged.
+ */
+void tp_idle_spurious(void);
+
+/**
+ * Halt the cpu until an interrupt arrives. Interrupts are disabled again
+ * when this returns.
+ */
+void trap_idle(void);
+
+/**
+ * Entry point of the sysenter instruction.
+ */
+void tp_sysenter(void);
+
+/**
+ * Handle a system call that came in through sysenter. Returns 0 if the
+ * process can go back with sysexit, 1 if it has to go through iret.
+ */
+int trap_sysenter(struct trap_frame* tf);
+
+/**
+ * The code of the vsyscall page (see trap/asm.S).
+ */
+extern char vsyscall_start[];
+extern char vsyscall_return[];
+extern char vsyscall_end[];
+
 #endif
 
 #endif
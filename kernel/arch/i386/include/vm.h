@@ -130,12 +130,20 @@
 #define SVM_KSTACK_S	0xFEFEE000 /* swap stack start */
 #define SVM_KSTACK_G2	0xFEFED000 /* swap stack bottom guard page */
 
+#define KVM_CPUSTACK_E	0xFEFED000 /* End of the scheduler stacks of the cpus */
+#define KVM_CPUSTACK_S	0xFEFBD000 /* Start of the scheduler stacks of the cpus */
+#define KVM_CPUSTACK_SZ	0x6000 /* A guard page and 5 stack pages per cpu */
+
+#define KVM_VSYSCALL	0xFEFBC000 /* User readable system call entry code */
+
 #define KVM_KMALLOC_E   0xFE000000 /* Where kmalloc ends */
 #define KVM_KMALLOC_S   0xFDFF8000 /* Where kmalloc starts */
 
 #define KVM_HARDWARE_E  0xFDFF7FFF /* End of hardware mappings */
 #define KVM_HARDWARE_S  0xFD000000 /* Start of hardware mappings */
 
+#define VM_POOL_E	0x10100000 /* Highest physical address in the page pool */
+
 /* Booting addresses */
 
 /* The end of the second stage boot loader (exclusive) */
@@ -298,6 +306,12 @@ extern void vm_pop_pgdir(pgdir_t* dir);
  */
 extern int vm_seg_init(void);
 
+/**
+ * Load the segment table of the given cpu on this cpu and point gs at the
+ * cpu structure. The boot cpu does this in vm_seg_init.
+ */
+extern void vm_seg_load(int id);
+
 /**
  * Initilize the page allocator.
  */
@@ -336,6 +350,46 @@ extern void vm_enable_paging(pgdir_t* pgdir);
  */
 extern void vm_disable_paging(void);
 
+/**
+ * Allow 4MB pages to be used in page directories (PSE).
+ */
+extern void vm_enable_large_pages(void);
+
+/**
+ * Replace every page table from start to end in dir that maps 4MB of
+ * contiguous physical memory with a single large page. Large pages must
+ * be enabled first. Returns the amount of page tables that were replaced.
+ */
+extern int vm_map_lgpages(vmpage_t start, vmpage_t end, pgdir_t* dir);
+
+/**
+ * Allocate all of the kernel page tables in the kernel page directory.
+ * These tables are shared by every page directory, so anything mapped
+ * into the kernel later on shows up in every process.
+ */
+extern void vm_alloc_kvm_tables(void);
+
+
+/**
+ * Allocate a page that ends at or below the physical address limit. Returns
+ * 0 if there is no free page that low.
+ */
+extern pypage_t palloc_below(pypage_t limit);
+
+/**
+ * The mappings of the page directory have changed. Make every other cpu
+ * that is running in the page directory flush its TLB. Returns once all
+ * of them have flushed, so the old pages can be freed afterwards.
+ */
+extern void vm_tlb_shootdown(pgdir_t* dir);
+
+/**
+ * Flush the TLB of this cpu if another cpu is waiting for it in
+ * vm_tlb_shootdown. Interrupts are off in the kernel, so cpus that spin on
+ * a lock call this to keep the cpu that holds the lock from waiting on
+ * them forever.
+ */
+extern void vm_tlb_flush(void);
 
 /**
  * Enable kernel readonly protection. Exceptions will now be thrown
@@ -362,6 +416,19 @@ extern void vm_set_stack(uintptr_t stack, void* callback) __attribute__ ((noretu
  */
 #define vm_get_page_fault_address x86_get_cr2
 
+/**
+ * An instruction that accesses user memory and where to continue if it
+ * faults on a page that can't be paged in (see vm/uaccess.S).
+ */
+struct uaccess_fixup
+{
+	uintptr_t insn;
+	uintptr_t fixup;
+};
+
+extern const struct uaccess_fixup uaccess_fixups[];
+extern const struct uaccess_fixup uaccess_fixups_end[];
+
 #endif /* !ASM_ONLY */
 
 /** Prevent the generic vm.h from checking for this file */
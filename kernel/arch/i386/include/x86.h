@@ -46,12 +46,15 @@
 
 
 /* CR0 bits */
+#define CR0_PE          (0x01 << 0)
 #define CR0_MP          (0x01 << 1)
 #define CR0_EM          (0x01 << 2)
+#define CR0_TS          (0x01 << 3)
 #define CR0_WP		(0x01 << 16)
 #define CR0_PGENABLE 	(0x01 << 31)
 
 /* CR4 bits */
+#define CR4_PSE         (0x01 << 4)
 #define CR4_OSFXSR      (0x01 << 9)
 #define CR4_OSXMMEXCPT  (0x01 << 10)
 
@@ -245,6 +248,47 @@ static inline int xchg(volatile int *addr, int newval)
 	return result;
 }
 
+/**
+ * Compare the value in addr with oldval and if they are equal, replace it
+ * with newval. Returns the original value of addr. This happens atomically.
+ */
+static inline int cmpxchg(volatile int* addr, int oldval, int newval)
+{
+	int result;
+	asm volatile("lock; cmpxchgl %2, %1" :
+			"=a" (result), "+m" (*addr) :
+			"r" (newval), "0" (oldval) :
+			"memory", "cc");
+	return result;
+}
+
+/**
+ * Tell the cpu that we are spinning on a lock.
+ */
+static inline void cpu_relax(void)
+{
+	asm volatile("pause" ::: "memory");
+}
+
+/**
+ * Returns the low 32 bits of the time stamp counter.
+ */
+static inline uint rdtsc(void)
+{
+	uint low;
+	uint high;
+	asm volatile("rdtsc" : "=a" (low), "=d" (high));
+	return low;
+}
+
+/**
+ * Write the 64 bit model specific register msr.
+ */
+static inline void wrmsr(uint msr, uint low, uint high)
+{
+	asm volatile("wrmsr" : : "c" (msr), "a" (low), "d" (high));
+}
+
 /**
  * Returns the value in the 0th control register.
  */
@@ -336,6 +380,16 @@ extern void x86_shutdown(void);
 #define INT_PIC_ATA1_CODE       0x0E
 #define INT_PIC_ATA2_CODE       0x0F
 
+/**
+ * Vectors used by the local interrupt controllers. The spurious vector has
+ * to end in 0xF on older controllers.
+ */
+#define INT_LAPIC_TIMER		0x40
+#define INT_LAPIC_RESCHED	0x41
+#define INT_LAPIC_TLB		0x42
+#define INT_LAPIC_ERROR		0x43
+#define INT_LAPIC_SPURIOUS	0xFF
+
 #ifndef __ASM_ONLY__
 struct task_segment
 {
@@ -5,20 +5,161 @@
  * A standard lock library implementation.
  */
 
+#include <stdlib.h>
 #include <stdlock.h>
 #include "x86.h"
+#include "cpu.h"
+#include "panic.h"
 
-void slock_acquire(slock_t* lock)
+/* The longest a spin lock waiter backs off between two checks */
+#define SLOCK_BACKOFF_MAX 0x40
+
+/**
+ * Nodes for waiters and holders of queued locks. Every cpu has its own
+ * nodes, one for each queued lock it holds or waits for at the same time.
+ */
+#define QLOCK_DEPTH 0x10
+static struct qlock_node qlock_nodes[CPU_MAX][QLOCK_DEPTH];
+static int qlock_exhausted; /* Did a cpu run out of nodes? */
+
+unsigned int lock_timestamp(void)
 {
-	while(xchg(&lock->val, 1) == 1);
+	return rdtsc();
 }
 
+void slock_acquire(slock_t* lock)
+{
+	int spins = 0;
+	int backoff = 1;
+	while(xchg(&lock->val, 1) == 1)
+	{
+		/* Only try again once the lock looks free */
+		do
+		{
+			int x;
+			for(x = 0;x < backoff;x++)
+				cpu_relax();
+			vm_tlb_flush();
+			if(backoff < SLOCK_BACKOFF_MAX)
+				backoff <<= 1;
+			spins++;
+		} while(lock->val);
+	}
+
+#ifdef LOCK_STATS
+	lock_stats_acquired(lock->stats, spins);
+#endif
+}
 
 void tlock_acquire(tlock_t* lock)
 {
-	int turn;
-	do
+	/* Draw a ticket once and wait until it gets served */
+	int turn = fetch_and_add((int*)&lock->next_ticket, 1);
+	int spins = 0;
+	while(lock->currently_serving != turn)
 	{
-		turn = fetch_and_add(&lock->next_ticket, 1);
-	} while(turn != lock->currently_serving);
+		cpu_relax();
+		vm_tlb_flush();
+		spins++;
+	}
+
+#ifdef LOCK_STATS
+	lock_stats_acquired(lock->stats, spins);
+#endif
+}
+
+/**
+ * Take a free node from the nodes of this cpu. Interrupt handlers on the
+ * same cpu might take nodes too, so a node is claimed with xchg.
+ */
+static struct qlock_node* qlock_node_alloc(void)
+{
+	int id = cpu_current()->id;
+	struct qlock_node* nodes = qlock_nodes[id];
+	int x;
+	for(x = 0;x < QLOCK_DEPTH;x++)
+	{
+		if(!nodes[x].used && !xchg(&nodes[x].used, 1))
+			return nodes + x;
+	}
+
+	/**
+	 * Waiting doesn't help, the locks this cpu is holding can't be
+	 * released while it spins here. panic takes queued locks itself, so
+	 * only the first cpu that runs out gets to panic.
+	 */
+	if(!xchg(&qlock_exhausted, 1))
+		panic("qlock: cpu %d holds more than %d queued locks\n",
+				id, QLOCK_DEPTH);
+	for(;;);
+}
+
+void qlock_acquire(qlock_t* lock)
+{
+	struct qlock_node* node = qlock_node_alloc();
+	node->next = NULL;
+	node->locked = 1;
+
+	/* Get in line */
+	struct qlock_node* prev = (struct qlock_node*)
+		xchg((volatile int*)&lock->tail, (int)node);
+
+	int spins = 0;
+	if(prev)
+	{
+		/* Wait for the node in front of us to hand us the lock */
+		prev->next = node;
+		while(node->locked)
+		{
+			cpu_relax();
+			vm_tlb_flush();
+			spins++;
+		}
+	}
+
+	lock->owner = node;
+
+#ifdef LOCK_STATS
+	lock_stats_acquired(lock->stats, spins);
+#endif
+}
+
+void qlock_release(qlock_t* lock)
+{
+#ifdef LOCK_STATS
+	lock_stats_released(lock->stats);
+#endif
+
+	struct qlock_node* node = lock->owner;
+	lock->owner = NULL;
+	lock_barrier();
+
+	if(!node->next)
+	{
+		/* If nobody is in line, the lock is free now */
+		if(cmpxchg((volatile int*)&lock->tail, (int)node, 0)
+				== (int)node)
+		{
+			node->used = 0;
+			return;
+		}
+
+		/* Somebody is getting in line, wait for them */
+		while(!node->next)
+			cpu_relax();
+	}
+
+	node->next->locked = 0;
+	node->used = 0;
+}
+
+int qlock_held(qlock_t* lock)
+{
+	/**
+	 * A queued lock stays on the cpu that acquired it until it is
+	 * released, only the holder can have one of our nodes as the owner.
+	 */
+	struct qlock_node* nodes = qlock_nodes[cpu_current()->id];
+	struct qlock_node* owner = lock->owner;
+	return owner >= nodes && owner < nodes + QLOCK_DEPTH;
 }
@@ -19,11 +19,13 @@ int elf_check_binary_path(const char* path)
 }
 
 uintptr_t elf_load_binary_path(const char* path, pgdir_t* pgdir, 
-	uintptr_t* start, uintptr_t* end, int user)
+	uintptr_t* start, uintptr_t* end, int user,
+	struct vm_area_table* areas)
 {
         inode ino = fs_open(path, O_RDONLY, 0644, 0x0, 0x0);
         if(!ino) return 0;
-        uintptr_t result = elf_load_binary_inode(ino, pgdir, start, end, user);
+        uintptr_t result = elf_load_binary_inode(ino, pgdir, start, end, 
+			user, areas);
         fs_close(ino);
         return result;
 }
@@ -52,8 +54,54 @@ int elf_check_binary_inode(inode ino)
 	return 0;
 }
 
+/**
+ * Record the segment as a virtual memory area so that its pages are read
+ * from the file the first time they are touched. Returns 1 if the segment
+ * will be paged in on demand, 0 if it has to be loaded right away.
+ */
+static int elf_load_segment_lazy(inode ino, pgdir_t* pgdir,
+		struct vm_area_table* areas, uintptr_t hd_addr, off_t offset,
+		size_t file_sz, size_t mem_sz,
+		vmflags_t dir_flags, vmflags_t tbl_flags)
+{
+	if(!areas || !mem_sz) return 0;
+
+	/* The file has to contain the entire segment */
+	if(offset + file_sz > ino->st.st_size)
+		return 0;
+
+	if(file_sz > mem_sz)
+		file_sz = mem_sz;
+
+	/**
+	 * Segments that share a page with a segment that has already 
+	 * been loaded can't be loaded lazily.
+	 */
+	if(vm_findpg(PGROUNDDOWN(hd_addr), 0, pgdir, 0, 0) ||
+		vm_findpg(PGROUNDDOWN(hd_addr + mem_sz - 1), 0, pgdir, 0, 0))
+		return 0;
+
+	struct vm_area area;
+	memset(&area, 0, sizeof(struct vm_area));
+	area.type = VM_AREA_FILE;
+	area.start = PGROUNDDOWN(hd_addr);
+	area.end = PGROUNDUP(hd_addr + mem_sz);
+	area.dir_flags = dir_flags;
+	area.tbl_flags = tbl_flags;
+	area.ino = ino;
+	area.data_start = hd_addr;
+	area.data_end = hd_addr + file_sz;
+	area.offset = offset;
+
+	/* This will fail if another area uses any of these pages */
+	if(vm_area_add(areas, &area))
+		return 0;
+
+	return 1;
+}
+
 uintptr_t elf_load_binary_inode(inode ino, pgdir_t* pgdir, uintptr_t* seg_start, 
-		uintptr_t* seg_end, int user)
+		uintptr_t* seg_end, int user, struct vm_area_table* areas)
 {
 	if(!ino) return 0;
 
@@ -115,17 +163,13 @@ uintptr_t elf_load_binary_inode(inode ino, pgdir_t* pgdir, uintptr_t* seg_start,
 			if(curr_header.flags & ELF_PH_FLAG_X)
                                 tbl_flags |= VM_TBL_EXEC;
 
-			/* Map the pages into memory */
-			if(vm_mappages(hd_addr, mem_sz, pgdir, 
-					dir_flags, tbl_flags))
-				return 0;
+			/* Should we make these pages writable? */
+			if(!(curr_header.flags & ELF_PH_FLAG_W))
+				tbl_flags &= ~VM_TBL_WRIT;
 
 			if(hd_addr + mem_sz > elf_end)
 				elf_end = hd_addr + mem_sz;
 
-                        /* zero this region */
-                        memset((void*)hd_addr, 0, mem_sz);
-
 			/* Is this a new start? */
 			if((uintptr_t)hd_addr < code_start)
 				code_start = (uintptr_t)hd_addr;
@@ -134,13 +178,35 @@ uintptr_t elf_load_binary_inode(inode ino, pgdir_t* pgdir, uintptr_t* seg_start,
 			if((uintptr_t)(hd_addr + mem_sz) > code_end)
 				code_end = (uintptr_t)(hd_addr + mem_sz);
 
+			/* Try to have this segment paged in on demand */
+			if(elf_load_segment_lazy(ino, pgdir, areas, hd_addr,
+					offset, file_sz, mem_sz, 
+					dir_flags, tbl_flags))
+				continue;
+
+			/**
+			 * Load the segment right now. Populate anything that
+			 * shares a page with a lazy segment first.
+			 */
+			if(areas && vm_area_prefault(areas, hd_addr, 
+						mem_sz, pgdir))
+				return 0;
+
+			/* Map the pages into memory */
+			if(vm_mappages(hd_addr, mem_sz, pgdir, 
+					dir_flags, tbl_flags | VM_TBL_WRIT))
+				return 0;
+
+                        /* zero this region */
+                        memset((void*)hd_addr, 0, mem_sz);
+
                         /* Load the section */
                         if(fs_read(ino, (void*)hd_addr, file_sz, offset) 
 					!= file_sz)
 				return 0;
 
 			/* Should we make these pages writable? */
-			if(!(curr_header.flags & ELF_PH_FLAG_W))
+			if(!(tbl_flags & VM_TBL_WRIT))
 			{
 				if(vm_pgsreadonly((uintptr_t)hd_addr, 
 						(uintptr_t)hd_addr 
@@ -0,0 +1,99 @@
+/**
+ * Lazy floating point context switching. A cpu leaves the floating point
+ * registers of the last process that used them loaded and sets the task
+ * switched flag whenever it switches to another process. The first
+ * floating point instruction of that process traps, which is when the
+ * registers of the previous owner get saved and the ones of the new owner
+ * get loaded.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "proc.h"
+#include "cpu.h"
+#include "panic.h"
+#include "drivers/fpu.h"
+
+// #define DEBUG
+
+/**
+ * The state of a process that hasn't used the floating point unit yet: the
+ * default control word, every exception masked and empty registers.
+ */
+static const char fpu_clean[FPU_STATE_SZ]
+	__attribute__((aligned(FPU_STATE_ALIGN))) =
+{
+	[0] = 0x7F, [1] = 0x03, /* fcw */
+	[24] = 0x80, [25] = 0x1F /* mxcsr */
+};
+
+void fpu_switch_in(struct proc* p)
+{
+	if(cpu_this()->fpu_owner == p)
+		fpu_enable();
+	else fpu_disable();
+}
+
+void fpu_switch_out(struct proc* p)
+{
+	struct cpu* c = cpu_this();
+	if(cpu_count == 1 || c->fpu_owner != p)
+		return;
+
+	/* The owner was running, so the unit is still enabled */
+	fpu_save(p->fpu_state);
+	c->fpu_owner = NULL;
+	fpu_disable();
+}
+
+void fpu_trap(void)
+{
+	struct cpu* c = cpu_this();
+	fpu_enable();
+	if(c->fpu_owner == rproc)
+		return;
+
+#ifdef DEBUG
+	cprintf("fpu: %s:%d takes the fpu from %d\n", rproc->name, rproc->pid,
+			c->fpu_owner ? c->fpu_owner->pid : -1);
+#endif
+
+	if(c->fpu_owner)
+		fpu_save(c->fpu_owner->fpu_state);
+	if(rproc->fpu_used)
+		fpu_restore(rproc->fpu_state);
+	else {
+		fpu_restore((void*)fpu_clean);
+		rproc->fpu_used = 1;
+	}
+	c->fpu_owner = rproc;
+}
+
+void fpu_flush(struct proc* p)
+{
+	if(cpu_this()->fpu_owner == p)
+		fpu_save(p->fpu_state);
+	else if(!p->fpu_used)
+	{
+		memmove(p->fpu_state, fpu_clean, FPU_STATE_SZ);
+		p->fpu_used = 1;
+	}
+}
+
+void fpu_forget(struct proc* p)
+{
+	struct cpu* c = cpu_this();
+	if(c->fpu_owner != p)
+		return;
+
+	c->fpu_owner = NULL;
+	fpu_disable();
+}
+
+void fpu_copy(struct proc* p)
+{
+	fpu_flush(rproc);
+	memmove(p->fpu_state, rproc->fpu_state, FPU_STATE_SZ);
+	p->fpu_used = 1;
+}
@@ -5,15 +5,66 @@
 #include "stdlock.h"
 #include "proc.h"
 
-extern int k_ticks;
 extern struct rtc_t k_time;
 
 void proc_init()
 {
         next_pid = 0;
-        memset(ptable, 0, sizeof(struct proc) * PTABLE_SIZE);
+        proc_list = NULL;
         rproc = NULL;
-        k_ticks = 0;
         memset(&k_time, 0, sizeof(struct rtc_t));
-        slock_init(&ptable_lock);
+        qlock_init(&ptable_lock);
+}
+
+struct proc* kproc_spawn(const char* name, void (*entry)(void* arg),
+                void* arg)
+{
+        struct proc* p = alloc_proc();
+        if(!p) return NULL;
+
+        qlock_acquire(&ptable_lock);
+
+        p->pid = next_pid++;
+        p->tid = p->pid;
+        p->tgid = p->pid;
+        p->pgid = p->pid; /* Signals to our group shouldn't reach it */
+        p->parent = p;
+        proc_link(p, NULL);
+        strncpy(p->name, name, MAX_PROC_NAME);
+        p->name[MAX_PROC_NAME - 1] = 0;
+        strncpy(p->cwd, "/", MAX_PATH_LEN);
+
+        /* Only the kernel and a kernel stack are mapped */
+        p->pgdir = (pgdir_t*)palloc();
+        vm_copy_kvm(p->pgdir);
+        vm_mappages(UVM_KSTACK_S, UVM_KSTACK_E - UVM_KSTACK_S, p->pgdir,
+                        VM_DIR_READ | VM_DIR_WRIT,
+                        VM_TBL_READ | VM_TBL_WRIT);
+        p->k_stack = (context_t)PGROUNDUP(UVM_KSTACK_E);
+        p->tf = (struct trap_frame*)(p->k_stack - sizeof(struct trap_frame));
+        p->tss = (struct task_segment*)(UVM_KSTACK_S);
+
+        /* Build the first context on the new stack like fork does */
+        vm_set_swap_stack(rproc->pgdir, p->pgdir);
+        struct trap_frame* tf = (struct trap_frame*)
+                ((char*)p->tf - SVM_DISTANCE);
+        memset(tf, 0, sizeof(struct trap_frame));
+
+        /* entry(arg) is called with a return address that is never used */
+        uintptr_t* stack = (uintptr_t*)tf;
+        *--stack = (uintptr_t)arg;
+        *--stack = 0xFFFFFFFF;
+
+        struct context* c = (struct context*)stack - 1;
+        memset(c, 0, sizeof(struct context));
+        c->eip = (uintptr_t)entry;
+        c->cr0 = (uintptr_t)p->pgdir;
+        p->context = (uintptr_t)c + SVM_DISTANCE;
+        vm_clear_swap_stack(rproc->pgdir);
+
+        p->state = PROC_RUNNABLE;
+        sched_enqueue(p);
+        qlock_release(&ptable_lock);
+
+        return p;
 }
@@ -36,6 +36,7 @@ static int default_actions[NSIG];
 
 void* mmap(void* hint, uint sz, int protection,
         int flags, int fd, off_t offset);
+int munmap(void* addr, size_t length);
 
 /* Signal table */
 static struct signal_t sigtable[SIG_TABLE_SZ];
@@ -79,6 +80,7 @@ static void sig_free(struct signal_t* sig)
 void sig_init(void)
 {
 	slock_init(&sigtable_lock);
+	slock_name(&sigtable_lock, "sigtable");
 	memset(sigtable, 0, sizeof(struct signal_t) * NSIG);
 
 	int x;
@@ -173,10 +175,16 @@ int sig_proc(struct proc* p, int sig)
 	/* Check to see if a program needs to be woken up. */
 	if(signal->default_action == SIGDEFAULT_CONT
 			&& p->state == PROC_STOPPED)
+	{
 		p->state = PROC_RUNNABLE;
+		sched_enqueue(p);
+	}
 
 	if(p->state == PROC_SIGNAL || sig == SIGKILL)
+	{
 		p->state = PROC_RUNNABLE;
+		sched_enqueue(p);
+	}
 
 	return 0;
 }
@@ -190,6 +198,10 @@ int sig_cleanup(void)
 	memmove((char*)rproc->k_stack - sizeof(struct trap_frame), 
 			&rproc->sig_saved, 
 			sizeof(struct trap_frame));
+
+	/* Restore the floating point registers from before the handler */
+	memmove(rproc->fpu_state, &rproc->sig_saved, FPU_STATE_SZ);
+	fpu_forget(rproc);
 	sig_dequeue(rproc);
 	return 0;
 }
@@ -289,12 +301,8 @@ int sig_handle(void)
 					MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
 
 			/* Unmap all guard pages */
-			int x;
-			for(x = 0;x < SIG_DEFAULT_GUARD;x++)
-			{
-				vm_unmappage(end, rproc->pgdir);
-				end += PGSIZE;
-			}
+			munmap((void*)end, SIG_DEFAULT_GUARD * PGSIZE);
+			end += SIG_DEFAULT_GUARD * PGSIZE;
 
 			/* Set sig stack start */
 			rproc->sig_stack_start = end + 
@@ -308,6 +316,10 @@ int sig_handle(void)
 			memmove(&rproc->sig_saved, 
 					(char*)rproc->k_stack - sizeof(struct trap_frame),
 					sizeof(struct trap_frame));
+
+			/* The fpu area of the trap frame holds our registers */
+			fpu_flush(rproc);
+			memmove(&rproc->sig_saved, rproc->fpu_state, FPU_STATE_SZ);
 		}
 
 		pstack_t stack = rproc->sig_stack_start;
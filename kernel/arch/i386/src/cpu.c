@@ -1,34 +1,51 @@
 #include "cpu.h"
 #include "panic.h"
 #include "x86.h"
+#include "trap.h"
 
 int x86_check_interrupt(void);
 
-static int cli_count = 0;
+struct cpu cpus[CPU_MAX];
+int cpu_count = 1;
+
+struct cpu* cpu_current(void)
+{
+	/* gs isn't setup until the segment table is loaded */
+	if(!cpus[0].self) return cpus;
+	return cpu_this();
+}
+
 void push_cli(void)
 {
+	int* cli_count = &cpu_current()->cli_count;
 	/**
 	 * If we pushcli and interrupts are disabled, a popcli could 
 	 * enable interrupts. To prevent this, we are setting cli_count to 1.
 	 */
-	if(cli_count == 0 && !x86_check_interrupt()) cli_count = 1;
-	if(cli_count < 0) cli_count = 0;
-	cli_count++;
+	if(*cli_count == 0 && !x86_check_interrupt()) *cli_count = 1;
+	if(*cli_count < 0) *cli_count = 0;
+	(*cli_count)++;
 	// asm volatile("cli");
 	//if(cli_count == 1) cprintf("Interrupts disabled.\n");
 }
 
 void pop_cli(void)
 {
-	cli_count--;
-	if(cli_count < 1)
+	int* cli_count = &cpu_current()->cli_count;
+	(*cli_count)--;
+	if(*cli_count < 1)
 	{
 		//cprintf("Interrupts enabled.\n");
-		cli_count = 0;
+		*cli_count = 0;
 		// asm volatile("sti");
 	}
 }
 
+void cpu_idle(void)
+{
+	trap_idle();
+}
+
 void qemu_shutdown()
 {
 	char *p = "Shutdown";
@@ -38,7 +55,7 @@ void qemu_shutdown()
 
 void reset_cli(void)
 {
-	cli_count = 0;
+	cpu_current()->cli_count = 0;
 }
 
 void cpu_reboot(void)
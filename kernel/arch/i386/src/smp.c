@@ -0,0 +1,182 @@
+/**
+ * Multiprocessor startup. The boot cpu finds the other cpus in the MP
+ * tables and starts each of them with the startup code in ap.S. Every cpu
+ * then runs its own scheduler loop on its own stack.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "kstdlib.h"
+#include "x86.h"
+#include "stdlock.h"
+#include "trap.h"
+#include "idt.h"
+#include "proc.h"
+#include "vm.h"
+#include "cpu.h"
+#include "ktimer.h"
+#include "drivers/lapic.h"
+#include "drivers/ioapic.h"
+#include "drivers/mp.h"
+#include "drivers/fpu.h"
+#include "panic.h"
+
+// #define DEBUG
+
+/* The startup code and its arguments (ap.S) */
+extern char ap_start[];
+extern char ap_end[];
+extern char ap_arg_stack[];
+extern char ap_arg_entry[];
+extern char ap_arg_id[];
+
+/* How long to wait for a cpu to check in */
+#define SMP_START_TICKS (KTIMER_HZ / 10)
+
+/**
+ * The interrupt mode configuration register switches the PICs between
+ * being wired straight to the boot cpu and going through its local APIC.
+ */
+#define IMCR_SELECT	0x22
+#define IMCR_DATA	0x23
+
+/**
+ * The cpu that is being started, -1 if none. The new cpu claims its start
+ * by setting this back to -1 so a cpu that shows up after the boot cpu has
+ * given up on it can't run.
+ */
+static volatile int smp_starting = -1;
+
+/**
+ * First function an application processor runs with paging enabled.
+ */
+static void ap_main(int id)
+{
+	struct cpu* c = cpus + id;
+
+	/* The boot cpu gave up on us, don't touch anything */
+	if(cmpxchg(&smp_starting, id, -1) != id)
+		for(;;) asm volatile("hlt");
+
+	/* Get the segments, interrupts and the fpu going like the boot cpu */
+	vm_seg_load(id);
+	trap_cpu_init();
+	fpu_init();
+	vm_enforce_kernel_readonly();
+	lapic_init(0);
+
+#ifdef DEBUG
+	cprintf("smp: cpu %d (lapic %d) started\n", id, c->hw_id);
+#endif
+
+	c->started = 1;
+	sched();
+	panic("smp: scheduler returned.\n");
+}
+
+/**
+ * Map the scheduler stack of the cpu into the kernel. This has to be done
+ * before any process exists, every page directory gets a copy of it.
+ */
+static uintptr_t smp_map_stack(int id)
+{
+	vmflags_t dir_flags = VM_DIR_READ | VM_DIR_WRIT;
+	vmflags_t tbl_flags = VM_TBL_READ | VM_TBL_WRIT;
+
+	/* The first page of every stack is left unmapped as a guard */
+	uintptr_t base = KVM_CPUSTACK_S + id * KVM_CPUSTACK_SZ;
+	vm_mappages(base + PGSIZE, KVM_CPUSTACK_SZ - PGSIZE, k_pgdir,
+		dir_flags, tbl_flags);
+	return base + KVM_CPUSTACK_SZ;
+}
+
+int smp_init(void)
+{
+	struct mp_config conf;
+	if(mp_detect(&conf)) return cpu_count;
+
+	/* Send the PICs through the local APIC of the boot cpu */
+	if(conf.imcr)
+	{
+		outb(IMCR_SELECT, 0x70);
+		outb(IMCR_DATA, inb(IMCR_DATA) | 0x01);
+	}
+
+	lapic_map(conf.lapic);
+	lapic_init(1);
+	if(conf.ioapic) ioapic_init(conf.ioapic, conf.ioapic_id);
+	cpus[0].hw_id = lapic_id();
+	cpus[0].started = 1;
+
+	if(conf.cpu_count < 2) return cpu_count;
+	lapic_timer_calibrate();
+
+	/* The startup code has to be in a page below 1MB */
+	uintptr_t entry = palloc_below(0x100000);
+	if(!entry) return cpu_count;
+	memmove((void*)entry, ap_start, ap_end - ap_start);
+	uint* arg_stack = (uint*)(entry + (ap_arg_stack - ap_start));
+	uint* arg_entry = (uint*)(entry + (ap_arg_entry - ap_start));
+	uint* arg_id = (uint*)(entry + (ap_arg_id - ap_start));
+
+	int failed = 0;
+	int x;
+	for(x = 0;x < conf.cpu_count;x++)
+	{
+		/* The boot cpu is already running */
+		if(conf.cpu_ids[x] == cpus[0].hw_id) continue;
+
+		int id = cpu_count;
+		struct cpu* c = cpus + id;
+		c->hw_id = conf.cpu_ids[x];
+
+		*arg_stack = smp_map_stack(id);
+		*arg_entry = (uint)ap_main;
+		*arg_id = id;
+		smp_starting = id;
+
+		lapic_start_ap(c->hw_id, entry);
+
+		/* Wait for the cpu to check in */
+		uint start = ktimer_ticks();
+		while(smp_starting == id
+				&& ktimer_ticks() - start < SMP_START_TICKS)
+			ktimer_poll();
+
+		if(cmpxchg(&smp_starting, id, -1) == id)
+		{
+			cprintf("smp: cpu with lapic %d didn't start.\n",
+					c->hw_id);
+			failed = 1;
+			break;
+		}
+
+		while(!c->started)
+			cpu_relax();
+		cpu_count++;
+	}
+
+	/* A cpu that didn't start might still run the startup code */
+	if(!failed) pfree(entry);
+	return cpu_count;
+}
+
+void cpu_reschedule(struct cpu* c)
+{
+	if(c == cpu_this() || !c->started) return;
+	lapic_ipi(c->hw_id, INT_LAPIC_RESCHED);
+}
+
+void cpu_timer_arm(unsigned int ticks)
+{
+	cpu_this()->timer_ticks = lapic_timer_oneshot(ticks);
+}
+
+int cpu_timer_interrupt(void)
+{
+	struct cpu* c = cpu_this();
+	int ticks = c->timer_ticks;
+	c->timer_ticks = 0;
+	return ticks;
+}
@@ -4,11 +4,12 @@
 #include "proc.h"
 #include "syscall.h"
 #include "ktime.h"
+#include "ktimer.h"
 #include "drivers/rtc.h"
 
 int sys_select_next_fd(int curr_fd, fd_set* set, int max_fd)
 {
-        for(;curr_fd < PROC_MAX_FDS && curr_fd < max_fd;curr_fd++)
+        for(;curr_fd < rproc->fdtab->size && curr_fd < max_fd;curr_fd++)
         {
                 if(FD_ISSET(curr_fd, set))
                         return curr_fd;
@@ -70,9 +71,9 @@ int sys_select(void)
 #endif
 
 	int dev_found = 0;
-	unsigned int endtime = 0;
+	uint endtime = 0;
 	if(timeout)
-		endtime = ktime_seconds() + timeout->tv_sec;
+		endtime = ktimer_ticks() + ktimer_timeval_ticks(timeout);
 	while(!dev_found)
 	{
 		int fd;
@@ -90,9 +91,9 @@ int sys_select(void)
 				}
 
 				/* Acquire the lock for this fd */
-				slock_acquire(&rproc->fdtab[fd]->lock);
+				kmutex_lock(&rproc->fdtab->fds[fd]->lock);
 
-				switch(rproc->fdtab[fd]->type)
+				switch(rproc->fdtab->fds[fd]->type)
 				{
 					case FD_TYPE_FILE:
 						/** 
@@ -105,11 +106,11 @@ int sys_select(void)
 					case FD_TYPE_DEVICE: /** Going over the 80 limit here ---- */
 
 						/* Does this device support read 'peek'? */
-						if(rproc->fdtab[fd]->device->ready_read)
+						if(rproc->fdtab->fds[fd]->device->ready_read)
 						{
 							/* Does the device have something for us? */
-							if(rproc->fdtab[fd]->device->ready_read(
-										rproc->fdtab[fd]->device->context))
+							if(rproc->fdtab->fds[fd]->device->ready_read(
+										rproc->fdtab->fds[fd]->device->context))
 							{
 								FD_SET(fd, &ret_readfds);
 								dev_found = 1;
@@ -123,7 +124,7 @@ int sys_select(void)
 						break;
 				}
 
-				slock_release(&rproc->fdtab[fd]->lock);
+				kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 				fd++;
 			}
 		}
@@ -141,9 +142,9 @@ int sys_select(void)
                                 }
 
                                 /* Acquire the lock for this fd */
-                                slock_acquire(&rproc->fdtab[fd]->lock);
+                                kmutex_lock(&rproc->fdtab->fds[fd]->lock);
 
-				switch(rproc->fdtab[fd]->type)
+				switch(rproc->fdtab->fds[fd]->type)
 				{
 					case FD_TYPE_FILE:
 						/** 
@@ -156,11 +157,11 @@ int sys_select(void)
 					case FD_TYPE_DEVICE: /** Going over the 80 limit here ---- */
 
 						/* Does this device support write 'peek'? */
-						if(rproc->fdtab[fd]->device->ready_write)
+						if(rproc->fdtab->fds[fd]->device->ready_write)
 						{
 							/* Is this output device ready? */
-							if(rproc->fdtab[fd]->device->ready_write(
-										rproc->fdtab[fd]->device->context))
+							if(rproc->fdtab->fds[fd]->device->ready_write(
+										rproc->fdtab->fds[fd]->device->context))
 							{
 								FD_SET(fd, &ret_writefds);
 								dev_found = 1;
@@ -173,7 +174,7 @@ int sys_select(void)
 						break;
 				}
 
-				slock_release(&rproc->fdtab[fd]->lock);
+				kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 				fd++;
 			}
 		}
@@ -181,17 +182,17 @@ int sys_select(void)
 
 		if(!dev_found)
 		{
-			/* yield for a cycle */
-			yield();
-
 			/* Is our timeout up? */
-			if(timeout && ktime_seconds() >= endtime)
+			if(timeout && (int)(endtime - ktimer_ticks()) <= 0)
 			{
 #ifdef DEBUG_SELECT
 				cprintf("select: timeout expired.\n");
 #endif
 				return 0;
 			}
+
+			/* Sleep until the next tick and check again */
+			ktimer_sleep(0);
 		}
 
 	}	
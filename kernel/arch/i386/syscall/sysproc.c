@@ -12,6 +12,7 @@
 #include "stdlock.h"
 #include "syscall.h"
 #include "ktime.h"
+#include "ktimer.h"
 #include "x86.h"
 #include "drivers/rtc.h"
 #include "elf.h"
@@ -26,23 +27,35 @@ int sys_fork(void)
 {
 	struct proc* new_proc = alloc_proc();
 	if(!new_proc) return -1;
-	slock_acquire(&ptable_lock);
-	/* Save the fdtab and lock */
+	qlock_acquire(&ptable_lock);
+	/* Save the fdtab and floating point area */
 	fdtab_t fdtab = new_proc->fdtab;
-	slock_t* fdtab_lock = new_proc->fdtab_lock;
+	void* fpu_state = new_proc->fpu_state;
 	/* Copy the entire process */
 	memmove(new_proc, rproc, sizeof(struct proc));
 	new_proc->fdtab = fdtab;
-	new_proc->fdtab_lock = fdtab_lock;
+	new_proc->fpu_state = fpu_state;
+	new_proc->trace = NULL;
+	new_proc->iobatch = NULL; /* The ring isn't inherited */
+	fpu_copy(new_proc);
 	new_proc->pid = next_pid++;
 	new_proc->ppid = rproc->pid;
 	new_proc->tid = new_proc->pid;
 	new_proc->tgid = new_proc->pid;
 	new_proc->next_tid = new_proc->pid + 1;
 	new_proc->parent = rproc;
+	proc_link(new_proc, rproc);
 	new_proc->state = PROC_RUNNABLE;
+	new_proc->rq_queued = 0;
+	new_proc->on_cpu = 0;
+	new_proc->wq = NULL;
+	waitqueue_init(&new_proc->child_wait, 0);
+	ktimer_setup(&new_proc->alarm_timer, proc_alarm, new_proc);
+	sched_enqueue(new_proc);
 	new_proc->pgdir = (pgdir_t*) palloc();
 	vm_copy_kvm(new_proc->pgdir);
+	/* Pages that haven't been touched yet are still backed by the file */
+	vm_area_dup(&new_proc->vm_areas);
 
 #ifndef __ALLOW_VM_SHARE__
 	vm_copy_uvm(new_proc->pgdir, rproc->pgdir);
@@ -55,30 +68,9 @@ int sys_fork(void)
 	vm_cpy_user_kstack(new_proc->pgdir, rproc->pgdir);
 #endif
 
-	/* Copy the table (NO MAP) */
+	/* Copy the table and take the inode and pipe references (NO MAP) */
 	fd_tab_copy(new_proc, rproc);
 
-	/* Increment file references for all inodes */
-	int i;
-	for(i = 0;i < PROC_MAX_FDS;i++)
-	{
-		if(!fd_ok(i)) continue;
-		switch(new_proc->fdtab[i]->type)
-		{
-			case FD_TYPE_FILE:
-				fs_add_inode_reference(new_proc->fdtab[i]->i);
-				break;
-			case FD_TYPE_PIPE:
-				if(rproc->fdtab[i]->pipe_type
-						== FD_PIPE_MODE_WRITE)
-					rproc->fdtab[i]->pipe->write_ref++;
-				if(rproc->fdtab[i]->pipe_type
-						== FD_PIPE_MODE_READ)
-					rproc->fdtab[i]->pipe->read_ref++;
-				break;
-		}
-	}
-
 	/**
 	 * A quick note on the swap stack:
 	 *
@@ -109,7 +101,7 @@ int sys_fork(void)
 	vm_clear_swap_stack(rproc->pgdir);
 
 	/* release ptable lock */
-	slock_release(&ptable_lock);
+	qlock_release(&ptable_lock);
 
 	return new_proc->pid;
 }
@@ -127,18 +119,28 @@ static int clone(unsigned long flags, void* child_stack,
 #endif
 
 	struct proc* main_proc = get_proc_pid(rproc->tgid);
-	slock_acquire(&ptable_lock);
-	/* Save the fdtab and lock */
+	qlock_acquire(&ptable_lock);
+	/* Save the fdtab and floating point area */
 	fdtab_t fdtab = new_proc->fdtab;
-	slock_t* fdtab_lock = new_proc->fdtab_lock;
+	void* fpu_state = new_proc->fpu_state;
 	/* Copy the entire process */
 	memmove(new_proc, main_proc, sizeof(struct proc));
 	new_proc->state = PROC_EMBRYO;
+	new_proc->rq_queued = 0;
+	new_proc->on_cpu = 0;
+	new_proc->wq = NULL;
+	waitqueue_init(&new_proc->child_wait, 0);
+	ktimer_setup(&new_proc->alarm_timer, proc_alarm, new_proc);
 	new_proc->fdtab = fdtab;
-	new_proc->fdtab_lock = fdtab_lock;
+	new_proc->fpu_state = fpu_state;
+	new_proc->trace = NULL;
+	new_proc->iobatch = NULL; /* The ring isn't inherited */
+	fpu_copy(new_proc);
 	new_proc->pid = next_pid++;
 	new_proc->tid = main_proc->next_tid++;
 	new_proc->parent = main_proc;
+	proc_link(new_proc, main_proc);
+	vm_area_dup(&new_proc->vm_areas);
 
 #ifndef __ALLOW_VM_SHARE__
 	/* Create a new page directory */
@@ -146,29 +148,8 @@ static int clone(unsigned long flags, void* child_stack,
 	vm_copy_kvm(new_proc->pgdir);
 	vm_copy_uvm(new_proc->pgdir, rproc->pgdir);
 
-	/* Copy the table (NO MAP) */
+	/* Copy the table and take the inode and pipe references (NO MAP) */
 	fd_tab_copy(new_proc, rproc);
-
-	/* Increment file references for all inodes */
-	int i;
-	for(i = 0;i < PROC_MAX_FDS;i++)
-	{
-		if(!fd_ok(i)) continue;
-		switch(new_proc->fdtab[i]->type)
-		{
-			case FD_TYPE_FILE:
-				fs_add_inode_reference(new_proc->fdtab[i]->i);
-				break;
-			case FD_TYPE_PIPE:
-				if(rproc->fdtab[i]->pipe_type
-						== FD_PIPE_MODE_WRITE)
-					rproc->fdtab[i]->pipe->write_ref++;
-				if(rproc->fdtab[i]->pipe_type
-						== FD_PIPE_MODE_READ)
-					rproc->fdtab[i]->pipe->read_ref++;
-				break;
-		}
-	}
 #endif
 
 	/* Create a copy of the kernel stack */
@@ -193,7 +174,6 @@ static int clone(unsigned long flags, void* child_stack,
 	{
 		/* Copy the file table over */
 		new_proc->fdtab = main_proc->fdtab;
-		new_proc->fdtab_lock = main_proc->fdtab_lock;
 
 #ifdef __ALLOW_VM_SHARE__
 		/* Map the page directory */
@@ -202,34 +182,49 @@ static int clone(unsigned long flags, void* child_stack,
 
 		/* Allow the child to run */
 		new_proc->state = PROC_RUNNABLE;
+		sched_enqueue(new_proc);
+
+		/* The child is gone once the wait is over */
+		int tid = new_proc->tid;
 
 #ifdef __ALLOW_VM_SHARE__
 		/* Wait for the child to exit */
 		while(waitpid_nolock_noharvest(new_proc->pid)
 				!= new_proc->pid);
+
+		/**
+		 * The child shares our page directory, so harvest it by
+		 * hand. Freeing its areas can sleep, so hide it and tear it
+		 * down without the ptable lock, like waitpid does.
+		 */
+		waitqueue_remove(new_proc);
+		sched_dequeue(new_proc);
+		proc_unlink(new_proc);
+		qlock_release(&ptable_lock);
+		ktimer_del(&new_proc->alarm_timer);
+		vm_area_free(&new_proc->vm_areas, NULL);
+		iobatch_release(new_proc);
+		qlock_acquire(&ptable_lock);
+		free_proc(new_proc);
 #else
+		/* waitpid harvests the child */
 		while(waitpid_nolock(new_proc->pid, NULL, 0)
 				!= new_proc->pid);
 #endif
 
-		/* Harvest the child */
-		memset(new_proc, 0, sizeof(struct proc));
-		new_proc->state = PROC_UNUSED;
-
 		/* Parent is allowed to return now */
-		slock_release(&ptable_lock);
-		return new_proc->tid;
+		qlock_release(&ptable_lock);
+		return tid;
 	}
 
 	/* Should we use our parent's fd table? */
 	if(flags & CLONE_FILES)
 	{
 		new_proc->fdtab = main_proc->fdtab;
-		new_proc->fdtab_lock = main_proc->fdtab_lock;
 	}
 
 
-	slock_release(&ptable_lock);
+	qlock_release(&ptable_lock);
 	return -1;
 }
 
@@ -248,9 +243,9 @@ int sys_clone(void)
 	int start_pos = sizeof(long) / sizeof(int);
 	if(syscall_get_buffer_ptr(&child_stack, 0x1000, start_pos))
 		return -1;
-	if(syscall_get_buffer_ptr(&ptid, sizeof(pid_t), start_pos + 1))
+	if(syscall_get_output_ptr(&ptid, sizeof(pid_t), start_pos + 1))
 		return -1;
-	if(syscall_get_buffer_ptr(&ctid, sizeof(pid_t), start_pos + 2))
+	if(syscall_get_output_ptr(&ctid, sizeof(pid_t), start_pos + 2))
 		return -1;
 	if(syscall_get_buffer_ptr((void*)&regs, sizeof(struct pt_regs),
 				start_pos + 3))
@@ -307,8 +302,12 @@ int execve(const char* path, char* const argv[], char* const envp[])
 		return -1;
 	}
 
-	/* acquire ptable lock */
-	slock_acquire(&ptable_lock);
+	/**
+	 * Writing back the old file mappings and loading the binary can
+	 * sleep, which needs the ptable lock. Everything up to the
+	 * permissions only touches our own address space, so the ptable
+	 * lock isn't taken until then.
+	 */
 
 	/* Create a temporary address space */
 	pgdir_t* tmp_pgdir = (pgdir_t*)palloc();
@@ -416,7 +415,8 @@ int execve(const char* path, char* const argv[], char* const envp[])
 	/* Is this a thread? */
 	if(rproc->pid == rproc->tgid || 1)
 	{
-		/* Free user memory */
+		/* Write back file mappings and free user memory */
+		vm_area_free(&rproc->vm_areas, rproc->pgdir);
 		vm_free_uvm(rproc->pgdir);
 	} else {
 		cprintf("Thread called exec!\n");
@@ -442,13 +442,12 @@ int execve(const char* path, char* const argv[], char* const envp[])
 	uintptr_t code_start;
 	uintptr_t code_end;
 	uintptr_t entry = elf_load_binary_path(program_path, rproc->pgdir,
-			&code_start, &code_end, 1);
+			&code_start, &code_end, 1, &rproc->vm_areas);
 	if(entry == 0)
 	{
 		memmove(rproc->cwd, cwd_tmp, MAX_PATH_LEN);
 		/* Free temporary directory */
 		freepgdir(tmp_pgdir);
-		slock_release(&ptable_lock);
 		return -1;
 	}
 
@@ -456,8 +455,13 @@ int execve(const char* path, char* const argv[], char* const envp[])
 	rproc->code_end = code_end;
 	rproc->entry_point = entry;
 
+	/* The new program starts out with clean floating point registers */
+	fpu_forget(rproc);
+	rproc->fpu_used = 0;
+
 	/* Change name */
-	strncpy(rproc->name, program_path, FILE_MAX_PATH);
+	strncpy(rproc->name, program_path, MAX_PROC_NAME);
+	rproc->name[MAX_PROC_NAME - 1] = 0;
 
 	/* We now have the esp and ebp. */
 	rproc->tf->esp = uvm_stack;
@@ -485,14 +489,13 @@ int execve(const char* path, char* const argv[], char* const envp[])
 	if(!i)
 	{
 		cprintf("exec: file was deleted while reading.\n");
-		slock_release(&ptable_lock);
 		return -1;
 	}
 
 	struct stat st;
 	if(fs_stat(i, &st))
 	{
-		slock_release(&ptable_lock);
+		fs_close(i);
 		return -1;
 	}
 	if(st.st_mode & S_ISUID)
@@ -501,6 +504,8 @@ int execve(const char* path, char* const argv[], char* const envp[])
 		setuid = 1;
 	fs_close(i);
 
+	qlock_acquire(&ptable_lock);
+
 	/* change permission if needed */
 	if(setuid)
 		rproc->euid = rproc->uid = st.st_uid;
@@ -525,7 +530,10 @@ int execve(const char* path, char* const argv[], char* const envp[])
 		PGROUNDDOWN(uvm_stack) - UVM_MIN_STACK;
 
 	/* Release the ptable lock */
-	slock_release(&ptable_lock);
+	qlock_release(&ptable_lock);
+
+	/* The old I/O batch ring went away with the address space */
+	iobatch_release(rproc);
 
 #ifdef DEBUG
 	cprintf("%s:%d: Binary load success.\n",
@@ -544,11 +552,11 @@ int sys_gettimeofday(void)
 	struct timezone* tz;
 	/* timezone is not used by any OS ever. It is purely historical. */
 	if(syscall_get_int((int*)&tv, 0)) return -1;
-	if(tv && syscall_get_buffer_ptr((void**)&tv,
+	if(tv && syscall_get_output_ptr((void**)&tv,
 				sizeof(struct timeval), 0)) return -1;
 	/* Is timezone specified? */
 	if(syscall_get_int((int*)&tz, 1)) return -1;
-	if(tz && syscall_get_buffer_ptr((void**)&tz,
+	if(tz && syscall_get_output_ptr((void**)&tz,
 				sizeof(struct timeval), 1)) return -1;
 
 	int seconds = ktime_seconds();
@@ -572,16 +580,56 @@ int sys_sleep(void)
 {
 	uint seconds;
 	if(syscall_get_int((int*)&seconds, 0)) return -1;
-	slock_acquire(&ptable_lock);
-	rproc->block_type = PROC_BLOCKED_SLEEP;
-	int end = seconds + ktime_seconds() + 1;
-	rproc->sleep_time = end;
-	rproc->state = PROC_BLOCKED;
-	while(1)
+	if(seconds > KTIMER_MAX_TICKS / KTIMER_HZ)
+		seconds = KTIMER_MAX_TICKS / KTIMER_HZ;
+
+	/* Return the amount of seconds we didn't sleep */
+	uint left = ktimer_sleep(seconds * KTIMER_HZ);
+	return (left + KTIMER_HZ - 1) / KTIMER_HZ;
+}
+
+/* int nanosleep(const struct timespec* req, struct timespec* rem) */
+int sys_nanosleep(void)
+{
+	struct timespec* req;
+	struct timespec* rem;
+	if(syscall_get_buffer_ptr((void**)&req,
+				sizeof(struct timespec), 0)) return -1;
+	if(syscall_get_int((int*)&rem, 1)) return -1;
+	if(rem && syscall_get_output_ptr((void**)&rem,
+				sizeof(struct timespec), 1)) return -1;
+
+	if(req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000)
+		return -1;
+
+	uint left = ktimer_sleep(ktimer_timespec_ticks(req));
+	if(!left) return 0;
+
+	/* We got interrupted */
+	if(rem) ktimer_ticks_timespec(left, rem);
+	return -1;
+}
+
+/* int clock_gettime(clockid_t clock_id, struct timespec* tp) */
+int sys_clock_gettime(void)
+{
+	int clock_id;
+	struct timespec* tp;
+	if(syscall_get_int(&clock_id, 0)) return -1;
+	if(syscall_get_output_ptr((void**)&tp,
+				sizeof(struct timespec), 1)) return -1;
+
+	switch(clock_id)
 	{
-		yield_withlock();
-		if(ktime_seconds() >= end) break;
-		slock_acquire(&ptable_lock);
+		case CLOCK_REALTIME:
+			tp->tv_sec = ktime_seconds();
+			tp->tv_nsec = 0;
+			break;
+		case CLOCK_MONOTONIC:
+			ktimer_clock(tp);
+			break;
+		default:
+			return -1;
 	}
 
 	return 0;
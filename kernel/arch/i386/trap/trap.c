@@ -32,6 +32,8 @@
 #include "drivers/pit.h"
 #include "drivers/cmos.h"
 #include "drivers/rtc.h"
+#include "drivers/lapic.h"
+#include "ktimer.h"
 
 #define TRAP_COUNT 256
 #define INTERRUPT_TABLE_SIZE (sizeof(struct int_gate) * TRAP_COUNT)
@@ -69,7 +71,20 @@ char* trap_names[] = {
 extern struct rtc_t k_time;
 struct int_gate interrupt_table[TRAP_COUNT];
 extern uint trap_handlers[];
-extern int k_ticks;
+
+/* While the cpu is idle, interrupts only wake the cpu up */
+struct int_gate idle_interrupt_table[TRAP_COUNT];
+
+/**
+ * Point sysenter at the kernel stack of whatever process is running. The
+ * kernel stack is at the same address in every process.
+ */
+static void trap_sysenter_init(void)
+{
+	wrmsr(SYSENTER_CS_MSR, SEG_KERNEL_CODE << 3, 0);
+	wrmsr(SYSENTER_ESP_MSR, PGROUNDUP(UVM_KSTACK_E), 0);
+	wrmsr(SYSENTER_EIP_MSR, (uint)tp_sysenter, 0);
+}
 
 void trap_init(void)
 {
@@ -82,9 +97,39 @@ void trap_init(void)
 			(trap_handlers[x] >> 16) & 0xFFFF;
 		interrupt_table[x].segment_selector = SEG_KERNEL_CODE << 3;
 		interrupt_table[x].flags = GATE_INT_CONST | GATE_USER;
+
+		/* Interrupts from the local APIC get acknowledged there */
+		uint idle = (uint)tp_idle;
+		if(x == INT_LAPIC_SPURIOUS) idle = (uint)tp_idle_spurious;
+		else if(x >= INT_LAPIC_TIMER && x <= INT_LAPIC_ERROR)
+			idle = (uint)tp_idle_lapic;
+
+		idle_interrupt_table[x].offset_1 = idle & 0xFFFF;
+		idle_interrupt_table[x].offset_2 = (idle >> 16) & 0xFFFF;
+		idle_interrupt_table[x].segment_selector = SEG_KERNEL_CODE << 3;
+		idle_interrupt_table[x].flags = GATE_INT_CONST;
 	}
 
 	lidt((uint)interrupt_table, INTERRUPT_TABLE_SIZE);		
+	trap_sysenter_init();
+}
+
+void trap_cpu_init(void)
+{
+	lidt((uint)interrupt_table, INTERRUPT_TABLE_SIZE);
+	trap_sysenter_init();
+}
+
+void trap_idle(void)
+{
+	/**
+	 * The interrupt table can't handle interrupts from the kernel, so
+	 * use the idle table while we wait. sti only takes effect after hlt
+	 * so the interrupt can't be missed.
+	 */
+	lidt((uint)idle_interrupt_table, INTERRUPT_TABLE_SIZE);
+	asm volatile("sti; hlt; cli");
+	lidt((uint)interrupt_table, INTERRUPT_TABLE_SIZE);
 }
 
 int trap_pf(uintptr_t address)
@@ -98,6 +143,10 @@ int trap_pf(uintptr_t address)
 	uintptr_t stack_bottom = rproc->stack_end;
 	uintptr_t stack_tolerance = stack_bottom - STACK_TOLERANCE * PGSIZE;
 
+	/* Is this a page that hasn't been loaded yet? */
+	if(!vm_area_fault(&rproc->vm_areas, address, rproc->pgdir))
+		return 0;
+
 	if(address < stack_bottom && address >= stack_tolerance){
 		uintptr_t address_down = PGROUNDDOWN(address);
 		if(address_down <= PGROUNDUP(rproc->heap_end))
@@ -124,10 +173,42 @@ int trap_pf(uintptr_t address)
 	return 0;
 }
 
-void trap_handler(struct trap_frame* tf, void* ret_frame)
+int trap_sysenter(struct trap_frame* tf)
 {
 	rproc->tf = tf;
-	
+
+	/* The vsyscall page pushed 3 registers and its return address */
+	rproc->tf->eax = syscall_handler((int*)tf->esp + 4);
+
+	if(rproc->sig_queue && !rproc->sig_handling)
+	{
+		qlock_acquire(&ptable_lock);
+		sig_handle();
+		qlock_release(&ptable_lock);
+	}
+
+	tf->eflags |= EFLAGS_IF;
+
+	/* exec and signal handlers change where the process continues */
+	uintptr_t ret = KVM_VSYSCALL + (vsyscall_return - vsyscall_start);
+	return tf->eip != ret;
+}
+
+/**
+ * Returns where to continue if the instruction at eip was allowed to fault
+ * on user memory, 0 otherwise.
+ */
+static uintptr_t trap_fixup(uintptr_t eip)
+{
+	const struct uaccess_fixup* f;
+	for(f = uaccess_fixups;f < uaccess_fixups_end;f++)
+		if(f->insn == eip)
+			return f->fixup;
+	return 0;
+}
+
+void trap_handler(struct trap_frame* tf, void* ret_frame)
+{
 	int trap = tf->trap_number;
 	char fault_string[64];
 	int syscall_ret = -1;
@@ -140,8 +221,10 @@ void trap_handler(struct trap_frame* tf, void* ret_frame)
 	uintptr_t ret_eip = tf->eip;
 #endif
 
+	/* A fault in the kernel must not replace the frame of the process */
 	if(!(tf->cs & 0x3))
 		kernel_fault = 1;
+	else rproc->tf = tf;
 
 	/**
 	 * A couple of quick optimizations:
@@ -166,10 +249,19 @@ void trap_handler(struct trap_frame* tf, void* ret_frame)
 		rproc->tf->eax = syscall_ret;
 	} else if(trap == INT_PIC_TIMER)
 	{
-		rproc->user_ticks++;
-		k_ticks++;
 		pic_eoi(INT_PIC_TIMER_CODE);
-		yield();
+		/* Fire the timers that have expired */
+		int ticks = ktimer_clock_interrupt();
+		rproc->user_ticks += ticks;
+		/* Only give up the cpu when the time slice is over */
+		if(sched_tick(ticks)) yield();
+	} else if(trap == INT_LAPIC_TIMER)
+	{
+		/* The clock of the cpus that don't drive the timer wheel */
+		lapic_eoi();
+		int ticks = cpu_timer_interrupt();
+		rproc->user_ticks += ticks;
+		if(sched_tick(ticks)) yield();
 	} else if(tf->eip == SIG_MAGIC && rproc->sig_handling)
 	{
 		/* We're done handling this signal! */
@@ -182,6 +274,8 @@ void trap_handler(struct trap_frame* tf, void* ret_frame)
 	switch(trap)
 	{
 		case INT_PIC_KEYBOARD: case INT_PIC_COM1:
+			/* The io scheduler polls these devices */
+			pic_eoi(trap);
 			handled = 1;
 			break;
 			// cprintf("Keyboard interrupt.\n");
@@ -191,6 +285,26 @@ void trap_handler(struct trap_frame* tf, void* ret_frame)
 			pic_eoi(INT_PIC_COM1_CODE);
 			handled = 1;
 			break;
+		case INT_LAPIC_RESCHED:
+			/* Another cpu queued something for this cpu */
+			lapic_eoi();
+			if(sched_tick(0)) yield();
+			handled = 1;
+			break;
+		case INT_LAPIC_TLB:
+			/* Another cpu changed our page directory */
+			lapic_eoi();
+			vm_tlb_flush();
+			handled = 1;
+			break;
+		case INT_LAPIC_ERROR:
+			lapic_eoi();
+			handled = 1;
+			break;
+		case INT_LAPIC_SPURIOUS:
+			/* Spurious interrupts don't get acknowledged */
+			handled = 1;
+			break;
 		case INT_PIC_CMOS:
 			/* Update the system time */
 			pic_eoi(INT_PIC_CMOS_CODE);
@@ -228,7 +342,9 @@ void trap_handler(struct trap_frame* tf, void* ret_frame)
 			user_problem = 1;
 			break;
 		case TRAP_NM:
-			strncpy(fault_string, "Device not available", 64);
+			/* The running process wants the floating point unit */
+			fpu_trap();
+			handled = 1;
 			break;
 		case TRAP_DF:
 			strncpy(fault_string, "Double Fault", 64);
@@ -253,6 +369,26 @@ void trap_handler(struct trap_frame* tf, void* ret_frame)
 		case TRAP_PF:
 			if(kernel_fault) 
 			{
+				/**
+				 * The kernel is allowed to touch user pages
+				 * that haven't been paged in yet.
+				 */
+				if(vm_get_page_fault_address() <= UVM_TOP
+					&& !trap_pf(vm_get_page_fault_address()))
+				{
+					handled = 1;
+					break;
+				}
+
+				/* User access functions fail gracefully */
+				uintptr_t fixup = trap_fixup(tf->eip);
+				if(fixup)
+				{
+					tf->eip = fixup;
+					handled = 1;
+					break;
+				}
+
 				strncpy(fault_string, "Seg Fault", 64);
                                 tf->error = vm_get_page_fault_address();
 				break;
@@ -305,8 +441,7 @@ TRAP_DONE:
 	{
 		cprintf("%s: 0x%x", fault_string, tf->error);
 		cprintf("%s: EIP: 0x%x ESP: 0x%x EBP: 0x%x\n",
-			rproc->name, rproc->tf->eip,
-			rproc->tf->esp, rproc->tf->ebp);
+			rproc->name, tf->eip, tf->esp, tf->ebp);
 
 #ifdef PANIC_ON_ANY_FAULT
 		user_problem = 0;
@@ -324,25 +459,31 @@ TRAP_DONE:
 		}
 	}
 
+	/* The kernel goes right back to where it faulted */
+	if(kernel_fault) goto TRAP_RETURN;
 
 	/* Do we have any signals waiting? */
 	if(rproc->sig_queue && !rproc->sig_handling)
 	{
-		slock_acquire(&ptable_lock);
+		qlock_acquire(&ptable_lock);
 		cprintf("Process %s is handling signal...\n", rproc->name);
 		sig_handle();
-		slock_release(&ptable_lock);
+		qlock_release(&ptable_lock);
 	}
 
 
 	/* Make sure that the interrupt flags is set */
 	tf->eflags |= EFLAGS_IF;
 
+	/* Make sure the clock interrupts when the time slice is over */
+	sched_arm_clock();
+
 	//cprintf("Process %d is leaving trap handler.\n", rproc->pid);
 
 	/* While were here, clear the timer interrupt */
 	// pic_eoi(INT_PIC_TIMER_CODE);
 
+TRAP_RETURN:
 	/* Warning: Black magic below, this will be fixed later */
 	/* Force return */
 	asm volatile("movl %ebp, %esp");
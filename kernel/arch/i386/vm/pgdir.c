@@ -31,6 +31,9 @@
 #define PGDIR_ACESS (1 << 0x5)
 #define PGDIR_LGPGS (1 << 0x7)
 
+/* Large (PSE) pages map an entire page table worth of memory */
+#define PGDIR_LGSIZE 0x400000
+
 /* Page table flags */
 #define PGTBL_PRSNT (1 << 0x0)
 #define PGTBL_WRITE (1 << 0x1)
@@ -41,11 +44,16 @@
 #define PGTBL_DIRTY (1 << 0x6)
 #define PGTBL_GLOBL (1 << 0x8)
 
-#ifdef __ALLOW_VM_SHARE__
 /* There are 3 available page table flags on x86. They are allocated below: */
+#ifdef __ALLOW_VM_SHARE__
 #define PGTBL_SHARE (1 << 0x9) /* Marks the page as shared */
 #define PGTBL_CONWR (1 << 0xa) /* Marks the page is copy on write (cow) */
 #endif
+#define PGTBL_FILE  (1 << 0xb) /* The page is owned by the storage cache */
+
+/* Page table flags that can be moved into a large page directory entry */
+#define PGTBL_LGMASK (PGTBL_PRSNT | PGTBL_WRITE | PGTBL_USERP \
+		| PGTBL_WRTHR | PGTBL_CACHD | PGTBL_GLOBL)
 
 /** Default kernel directory and table flags for i386 */
 #define DEFAULT_DIRFLAGS (VM_DIR_PRES)
@@ -58,6 +66,15 @@ void __kvm_swap__(pgdir_t* kvm);
 
 extern pgdir_t* k_pgdir;
 
+/**
+ * The kernel page directory is shared by every cpu and __kvm_swap__ maps
+ * the kernel stack of the running process into it, so only one cpu can be
+ * working in the kernel page directory at a time. The lock is held from
+ * the outermost vm_push_pgdir to the matching vm_pop_pgdir. The lock is
+ * used before anything gets initilized, a zeroed lock is unlocked.
+ */
+static slock_t kvm_lock;
+
 /**
  * Turn generic flags for a page directory into flags for an i386
  * page directory. Returns the correcponding flags for an i386 page
@@ -135,6 +152,8 @@ static vmflags_t vm_tbl_flags(vmflags_t flags)
 		result |= PGTBL_WRITE;
 	if(flags & VM_TBL_PRES)
 		result |= PGTBL_PRSNT;
+	if(flags & VM_TBL_FILE)
+		result |= PGTBL_FILE;
 
 #ifdef __ALLOW_VM_SHARE__
 	if(flags & VM_TBL_SHAR)
@@ -168,6 +187,8 @@ static vmflags_t vm_gen_tbl_flags(vmflags_t flags)
 		result |= VM_TBL_WRIT;
 	if(flags & PGTBL_PRSNT)
 		result |= VM_TBL_PRES;
+	if(flags & PGTBL_FILE)
+		result |= VM_TBL_FILE;
 
 #ifdef __ALLOW_VM_SHARE__
 	if(flags & PGTBL_SHARE)
@@ -191,6 +212,8 @@ pgdir_t* vm_push_pgdir(void)
 {
 	/* If we are modifying the address space, turn of interrupts. */
 	push_cli();
+	if(!cpu_current()->kvm_depth++)
+		slock_acquire(&kvm_lock);
 
 	/* Is paging even enabled? */
 	if(!vm_check_paging()) return NULL;
@@ -206,6 +229,8 @@ pgdir_t* vm_push_pgdir(void)
 
 void vm_pop_pgdir(pgdir_t* dir)
 {
+	if(!--cpu_current()->kvm_depth)
+		slock_release(&kvm_lock);
 	pop_cli();
 	if(dir == NULL) return;
 	if(!vm_check_paging()) return;
@@ -213,6 +238,56 @@ void vm_pop_pgdir(pgdir_t* dir)
 	vm_enable_paging(dir);
 }
 
+/**
+ * Every page directory shares the page tables for the kernel, except for
+ * the directory entry that holds the kernel, user and swap stacks. Returns
+ * 1 if the directory entry is shared, 0 otherwise.
+ */
+static int vm_kvm_shared(int dir_index)
+{
+	if(dir_index < PGDIRINDEX(UVM_KVM_S))
+		return 0;
+	if(dir_index == PGDIRINDEX(UVM_KSTACK_S))
+		return 0;
+	return 1;
+}
+
+/**
+ * Turn the large page at dir_index back into a page table so that single
+ * pages can be changed. Does nothing if the entry isn't a large page.
+ * Returns 0 on success, -1 if there wasn't enough memory.
+ */
+static int vm_split_lgpage(pgdir_t* dir, int dir_index)
+{
+	if(!(dir[dir_index] & PGDIR_LGPGS))
+		return 0;
+
+	pgdir_t* save = vm_push_pgdir();
+
+	pgtbl_t* tbl = (pgtbl_t*)palloc();
+	if(!tbl)
+	{
+		vm_pop_pgdir(save);
+		return -1;
+	}
+
+	vmpage_t base = dir[dir_index] & ~(PGDIR_LGSIZE - 1);
+	vmflags_t flags = dir[dir_index] & PGTBL_LGMASK;
+	int x;
+	for(x = 0;x < PGSIZE / sizeof(pgtbl_t);x++)
+		tbl[x] = (base + (x << PGSHIFT)) | flags;
+
+	dir[dir_index] = (vmpage_t)tbl | (flags & ~PGTBL_GLOBL);
+
+	/* Make sure the large page isn't used anymore */
+	if(dir == k_pgdir)
+		vm_enable_paging(k_pgdir);
+
+	vm_pop_pgdir(save);
+
+	return 0;
+}
+
 static int vm_mappage_native(pypage_t phy, vmpage_t virt, pgdir_t* dir,
 		vmflags_t dir_flags, vmflags_t tbl_flags)
 {
@@ -224,6 +299,15 @@ static int vm_mappage_native(pypage_t phy, vmpage_t virt, pgdir_t* dir,
 	int tbl_index = PGTBLINDEX(virt);
 	/* Do we need to allocate a new page table? */
 	if(!dir[dir_index]) dir[dir_index] = palloc() | dir_flags;
+	if(vm_split_lgpage(dir, dir_index))
+	{
+		vm_pop_pgdir(save);
+		return -1;
+	}
+
+	/* A user page in a kernel table needs a user directory entry */
+	if(dir_flags & PGDIR_USERP)
+		dir[dir_index] |= PGDIR_USERP;
 
 	pgtbl_t* tbl = (pgtbl_t*)(PGROUNDDOWN(dir[dir_index]));
 	if(!tbl[tbl_index])
@@ -300,7 +384,7 @@ vmpage_t vm_unmappage(vmpage_t virt, pgdir_t* dir)
 	int dir_index = PGDIRINDEX(virt);
 	int tbl_index = PGTBLINDEX(virt);
 
-	if(!dir[dir_index])
+	if(!dir[dir_index] || vm_split_lgpage(dir, dir_index))
 	{
 		vm_pop_pgdir(save);
 		return 0;
@@ -312,6 +396,7 @@ vmpage_t vm_unmappage(vmpage_t virt, pgdir_t* dir)
 		vmpage_t page = PGROUNDDOWN(tbl[tbl_index]);
 		tbl[tbl_index] = 0;
 		vm_pop_pgdir(save);
+		vm_tlb_shootdown(dir);
 
 		return page;
 	}
@@ -351,6 +436,15 @@ static vmpage_t vm_findpg_native(vmpage_t virt, int create, pgdir_t* dir,
 		}
 	}
 
+	/* Large pages don't have a page table */
+	if(dir[dir_index] & PGDIR_LGPGS)
+	{
+		vmpage_t page = (dir[dir_index] & ~(PGDIR_LGSIZE - 1))
+			| (virt & (PGDIR_LGSIZE - 1));
+		vm_pop_pgdir(save);
+		return page;
+	}
+
 	pgtbl_t* tbl = (pgtbl_t*)(PGROUNDDOWN(dir[dir_index]));
 	vmpage_t page;
 	if(!(page = tbl[tbl_index]))
@@ -390,6 +484,14 @@ static vmflags_t vm_findpgflags_native(vmpage_t virt, pgdir_t* dir)
 		return 0;
 	}
 
+	/* The flags of a large page are in the directory entry */
+	if(dir[dir_index] & PGDIR_LGPGS)
+	{
+		vmflags_t flags = dir[dir_index] & (PGSIZE - 1);
+		vm_pop_pgdir(save);
+		return flags & ~PGDIR_LGPGS;
+	}
+
 	pgtbl_t* tbl = (pgtbl_t*)(PGROUNDDOWN(dir[dir_index]));
 	vmpage_t page;
 	if(!(page = tbl[tbl_index]))
@@ -442,7 +544,7 @@ int vm_setpgflags(vmpage_t virt, pgdir_t* dir, vmflags_t pg_flags)
 	int dir_index = PGDIRINDEX(virt);
 	int tbl_index = PGTBLINDEX(virt);
 
-	if(!dir[dir_index])
+	if(!dir[dir_index] || vm_split_lgpage(dir, dir_index))
 	{
 		vm_pop_pgdir(save);
 		return -1;
@@ -461,6 +563,7 @@ int vm_setpgflags(vmpage_t virt, pgdir_t* dir, vmflags_t pg_flags)
 	}
 
 	vm_pop_pgdir(save);
+	vm_tlb_shootdown(dir);
 
 	return 0;
 }
@@ -474,7 +577,7 @@ int vm_pgreadonly(vmpage_t virt, pgdir_t* dir)
 	int dir_index = PGDIRINDEX(virt);
 	int tbl_index = PGTBLINDEX(virt);
 
-	if(!dir[dir_index])
+	if(!dir[dir_index] || vm_split_lgpage(dir, dir_index))
 	{
 		vm_pop_pgdir(save);
 		return -1;
@@ -559,12 +662,97 @@ size_t vm_memmove(void* dst, const void* src, size_t sz,
 	return bytes;
 }
 
+void vm_alloc_kvm_tables(void)
+{
+	pgdir_t* save = vm_push_pgdir();
+
+	vmflags_t dir_flags = vm_dir_flags(DEFAULT_DIRFLAGS
+			| VM_DIR_READ | VM_DIR_WRIT);
+	int dir_index;
+	for(dir_index = PGDIRINDEX(UVM_KVM_S);
+			dir_index < PGSIZE / sizeof(pgdir_t);dir_index++)
+	{
+		if(vm_kvm_shared(dir_index) && !k_pgdir[dir_index])
+			k_pgdir[dir_index] = palloc() | dir_flags;
+	}
+
+	vm_pop_pgdir(save);
+}
+
+int vm_map_lgpages(vmpage_t start, vmpage_t end, pgdir_t* dir)
+{
+	pgdir_t* save = vm_push_pgdir();
+
+	start = (start + PGDIR_LGSIZE - 1) & ~(PGDIR_LGSIZE - 1);
+	end &= ~(PGDIR_LGSIZE - 1);
+
+	int replaced = 0;
+	vmpage_t x;
+	for(x = start;x < end;x += PGDIR_LGSIZE)
+	{
+		int dir_index = PGDIRINDEX(x);
+		if(!dir[dir_index] || (dir[dir_index] & PGDIR_LGPGS))
+			continue;
+
+		/**
+		 * Every entry in the table has to be present, have the same
+		 * flags and map physical memory contiguously.
+		 */
+		pgtbl_t* tbl = (pgtbl_t*)PGROUNDDOWN(dir[dir_index]);
+		vmpage_t base = PGROUNDDOWN(tbl[0]);
+		vmflags_t flags = tbl[0] & (PGSIZE - 1)
+			& ~(PGTBL_ACESS | PGTBL_DIRTY);
+		if(base & (PGDIR_LGSIZE - 1)) continue;
+		if(!(flags & PGTBL_PRSNT) || (flags & ~PGTBL_LGMASK))
+			continue;
+
+		int entry;
+		for(entry = 0;entry < PGSIZE / sizeof(pgtbl_t);entry++)
+		{
+			if(PGROUNDDOWN(tbl[entry]) != base + (entry << PGSHIFT))
+				break;
+			if((tbl[entry] & (PGSIZE - 1)
+					& ~(PGTBL_ACESS | PGTBL_DIRTY)) != flags)
+				break;
+		}
+		if(entry != PGSIZE / sizeof(pgtbl_t)) continue;
+
+		/* The directory entry also restricts access */
+		if(!(dir[dir_index] & PGDIR_WRITE))
+			flags &= ~PGTBL_WRITE;
+		if(!(dir[dir_index] & PGDIR_USERP))
+			flags &= ~PGTBL_USERP;
+		dir[dir_index] = base | flags | PGDIR_LGPGS;
+
+		/* Flush the old table out of the TLB before freeing it */
+		if(dir == k_pgdir)
+			vm_enable_paging(k_pgdir);
+		pfree((vmpage_t)tbl);
+		replaced++;
+	}
+
+	vm_pop_pgdir(save);
+
+	return replaced;
+}
+
 int vm_copy_kvm(pgdir_t* dir)
 {
 	pgdir_t* save = vm_push_pgdir();
 
+	/* Most of the kernel page tables are shared */
+	int dir_index;
+	for(dir_index = PGDIRINDEX(UVM_KVM_S);
+			dir_index < PGSIZE / sizeof(pgdir_t);dir_index++)
+	{
+		if(vm_kvm_shared(dir_index))
+			dir[dir_index] = k_pgdir[dir_index];
+	}
+
+	/* The stack entry has to be copied page by page */
+	vmpage_t start = PGDIRINDEX(UVM_KSTACK_S) << 22;
 	vmpage_t x;
-	for(x = UVM_KVM_S;x < PGROUNDDOWN(UVM_KVM_E); x+= PGSIZE)
+	for(x = start;x < start + PGDIR_LGSIZE; x+= PGSIZE)
 	{
 		vmpage_t page = vm_findpg(x, 0, k_pgdir, 0, 0);
 		vmflags_t pg_flags = vm_findpgflags_native(x, k_pgdir);
@@ -611,6 +799,13 @@ void vm_map_uvm(pgdir_t* dst_dir, pgdir_t* src_dir)
 		{
 			unsigned int entry = table[pg_index];
 			vmpage_t pg = (x << 22) | (pg_index << 12);
+			/* Storage cache pages are faulted in again */
+			if(entry & PGTBL_FILE)
+			{
+				table[pg_index] = 0x0;
+				continue;
+			}
+
 			if(entry & PGTBL_SHARE)
 			{
 				/* Add a reference count */
@@ -663,6 +858,10 @@ void vm_copy_uvm(pgdir_t* dst_dir, pgdir_t* src_dir)
 		vmflags_t src_pgflags = vm_findpgflags_native(x, src_dir);
 		vmflags_t src_tblflags = vm_findtblflags_native(x, src_dir);
 
+		/* Storage cache pages are faulted in again by the child */
+		if(src_pgflags & PGTBL_FILE)
+			continue;
+
 #ifdef __ALLOW_VM_SHARE__
 		/* Is this page shared? */
 		if(src_pgflags & PGTBL_SHARE)
@@ -759,6 +958,8 @@ void vm_free_uvm(pgdir_t* dir)
 		for(entry = 0;entry < PGSIZE / sizeof(pgtbl_t);entry++)
 		{
 			if(!table[entry]) continue;
+			/* The storage cache owns these pages */
+			if(table[entry] & PGTBL_FILE) continue;
 			pfree(table[entry]);
 		}
 
@@ -786,10 +987,10 @@ void freepgdir(pgdir_t* dir)
 		if(freed) pfree(freed);
 	}
 
-	/* Free directory pages */
+	/* Free directory pages, the shared kernel tables stay */
 	vmpage_t x;
 	for(x = 0;x < (PGSIZE / sizeof(uint));x++)
-		if(dir[x]) pfree(dir[x]);
+		if(dir[x] && !vm_kvm_shared(x)) pfree(dir[x]);
 
 	/* free directory */
 	pfree((vmpage_t)dir);
@@ -801,10 +1002,10 @@ void vm_freepgdir_struct(pgdir_t* dir)
 {
 	pgdir_t* save = vm_push_pgdir();
 
-	/* Free directory pages */
+	/* Free directory pages, the shared kernel tables stay */
 	vmpage_t x;
 	for(x = 0;x < (PGSIZE / sizeof(uint));x++)
-		if(dir[x]) pfree(dir[x]);
+		if(dir[x] && !vm_kvm_shared(x)) pfree(dir[x]);
 
 	/* free directory */
 	pfree((vmpage_t)dir);
@@ -866,6 +1067,8 @@ int vm_print_pgdir(vmpage_t last_page, pgdir_t* dir)
 				cprintf("DIRTY ");
 			if(pg_flags & PGTBL_GLOBL)
 				cprintf("GLOBL ");
+			if(pg_flags & PGTBL_FILE)
+				cprintf("FILE ");
 #ifdef __ALLOW_VM_SHARE__
 			if(pg_flags & PGTBL_SHARE)
 				cprintf("SHARE ");
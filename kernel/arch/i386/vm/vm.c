@@ -19,18 +19,20 @@
 #include "panic.h"
 #include "context.h"
 
+#include "drivers/lapic.h"
+
 /* We need some graphics config for bootup */
 #include "k/drivers/console.h"
 
-context_t k_context; /* The kernel context */
 pstack_t k_stack; /* Kernel stack */
 pgdir_t* k_pgdir; /* Kernel page directory */
 int video_mode; /* The video mode dectected on boot */
-extern slock_t global_mem_lock;
+extern qlock_t global_mem_lock;
 
 int vm_init(void)
 {
-	slock_init(&global_mem_lock);
+	qlock_init(&global_mem_lock);
+	qlock_name(&global_mem_lock, "global_mem");
 #ifdef __ALLOW_VM_SHARE__
 	vm_share_init(); /* Setup shared memory */
 #endif
@@ -51,6 +53,20 @@ int vm_init(void)
 	vm_mappages(KVM_KSTACK_S, KVM_KSTACK_E - KVM_KSTACK_S, k_pgdir, 
 		dir_flags, tbl_flags);
 
+	/* Processes can enter the kernel with sysenter through this page */
+	pypage_t vsyscall = palloc();
+	memmove((void*)vsyscall, vsyscall_start,
+			vsyscall_end - vsyscall_start);
+	vm_mappage(vsyscall, KVM_VSYSCALL, k_pgdir,
+			dir_flags | VM_DIR_USRP, VM_TBL_READ | VM_TBL_USRP);
+
+	/* Use large pages for the direct mapped page pool */
+	vm_enable_large_pages();
+	vm_map_lgpages(0x0, UVM_KVM_S, k_pgdir);
+
+	/* Kernel page tables are shared with every process */
+	vm_alloc_kvm_tables();
+
 	/* Add bootstrap code to the memory pool (includes stack) */
 	int boot2_s = PGROUNDDOWN(BOOT2_S) + PGSIZE;
 	int boot2_e = PGROUNDUP(BOOT2_E);
@@ -66,18 +82,87 @@ int vm_init(void)
 }
 
 #define GDT_SIZE (sizeof(struct vm_segment_descriptor) * SEG_COUNT)
-struct vm_segment_descriptor global_descriptor_table[] = 
+static const struct vm_segment_descriptor gdt_template[SEG_COUNT] =
 {
 	MKVMSEG_NULL, 
 	MKVMSEG(SEG_KERN, SEG_EXE, SEG_READ,  0x0, VM_MAX),
 	MKVMSEG(SEG_KERN, SEG_DATA, SEG_WRITE, 0x0, VM_MAX),
 	MKVMSEG(SEG_USER, SEG_EXE, SEG_READ,  0x0, VM_MAX),
 	MKVMSEG(SEG_USER, SEG_DATA, SEG_WRITE, 0x0, VM_MAX),
-	MKVMSEG_NULL /* Will become TSS*/
+	MKVMSEG_NULL, /* Will become TSS*/
+	MKVMSEG(SEG_KERN, SEG_DATA, SEG_WRITE, 0x0, VM_MAX) /* Based at cpu */
 };
 
+/* Every cpu has its own table, the TSS and cpu segments differ per cpu */
+struct vm_segment_descriptor global_descriptor_table[CPU_MAX][SEG_COUNT];
+
+void vm_seg_load(int id)
+{
+	struct cpu* c = cpus + id;
+	c->self = c;
+	c->id = id;
+
+	struct vm_segment_descriptor* gdt = global_descriptor_table[id];
+	memmove(gdt, gdt_template, GDT_SIZE);
+
+	/* gs:0 is the pointer to the cpu structure */
+	uintptr_t base = (uintptr_t)c;
+	gdt[SEG_CPU].base_1 = (uint16_t)base;
+	gdt[SEG_CPU].base_2 = (uint8_t)(base >> 16);
+	gdt[SEG_CPU].base_3 = (uint8_t)(base >> 24);
+
+	lgdt((uint)gdt, GDT_SIZE);
+	asm volatile("movw %w0, %%gs" : : "r" (SEG_CPU << 3));
+}
+
 int vm_seg_init(void)
 {
-	lgdt((uint)global_descriptor_table, GDT_SIZE);
+	vm_seg_load(0);
 	return 0;
 }
+
+void vm_tlb_shootdown(pgdir_t* dir)
+{
+	if(cpu_count < 2) return;
+
+	/* The request every cpu has to get to before we can go on */
+	int wait[CPU_MAX];
+	struct cpu* self = cpu_this();
+	int x;
+	for(x = 0;x < cpu_count;x++)
+	{
+		struct cpu* c = cpus + x;
+		struct proc* p = c->proc;
+		wait[x] = 0;
+		if(c == self || !p || p->pgdir != dir)
+			continue;
+
+		wait[x] = fetch_and_add((int*)&c->tlb_req, 1) + 1;
+		lapic_ipi(c->hw_id, INT_LAPIC_TLB);
+	}
+
+	for(x = 0;x < cpu_count;x++)
+	{
+		if(!wait[x]) continue;
+
+		/* Another cpu might be shooting us down at the same time */
+		while((int)(cpus[x].tlb_done - wait[x]) < 0)
+		{
+			vm_tlb_flush();
+			cpu_relax();
+		}
+	}
+}
+
+void vm_tlb_flush(void)
+{
+	if(cpu_count < 2) return;
+
+	struct cpu* c = cpu_current();
+	int req = c->tlb_req;
+	if(c->tlb_done == req) return;
+
+	/* Flush first, the other cpu frees the pages once we are done */
+	vm_enable_paging(vm_curr_pgdir());
+	c->tlb_done = req;
+}
@@ -37,20 +37,21 @@ static int k_start_pages; /* How many pages did the vm start with? */
 static int k_pages; /* How many pages are left? */
 static struct vm_free_node* head; /* Start of the free list */
 
-slock_t global_mem_lock; /* memory lock for free page list */
+qlock_t global_mem_lock; /* memory lock for free page list */
 
 void vm_alloc_init(void)
 {
 	k_start_pages = 0;
 	k_pages = 0;
 	head = NULL;
-	slock_init(&global_mem_lock);
+	qlock_init(&global_mem_lock);
 }
 
 vmpage_t palloc(void)
 {
-	slock_acquire(&global_mem_lock);
+	/* The kvm lock has to be taken before the memory lock */
 	pgdir_t* save = vm_push_pgdir();
+	qlock_acquire(&global_mem_lock);
         if(head == NULL) panic("No more free pages");
        	k_pages--;
         vmpage_t addr = (vmpage_t)head;
@@ -66,11 +67,41 @@ vmpage_t palloc(void)
         cprintf("Page allocated: 0x%x\n", addr);
 #endif
 
+	qlock_release(&global_mem_lock);
 	vm_pop_pgdir(save);
-	slock_release(&global_mem_lock);
         return addr;
 }
 
+vmpage_t palloc_below(vmpage_t limit)
+{
+	pgdir_t* save = vm_push_pgdir();
+	qlock_acquire(&global_mem_lock);
+
+	/* Search the free list for a page that is low enough */
+	struct vm_free_node* prev = NULL;
+	struct vm_free_node* node = head;
+	while(node && (vmpage_t)node + PGSIZE > limit)
+	{
+		prev = node;
+		node = (struct vm_free_node*)node->next;
+	}
+
+	vmpage_t addr = 0;
+	if(node)
+	{
+		if(prev) prev->next = node->next;
+		else head = (struct vm_free_node*)node->next;
+		k_pages--;
+
+		addr = (vmpage_t)node;
+		memset((void*)addr, 0, PGSIZE);
+	}
+
+	qlock_release(&global_mem_lock);
+	vm_pop_pgdir(save);
+	return addr;
+}
+
 void pfree(vmpage_t pg)
 {
 	pg = PGROUNDDOWN(pg);
@@ -79,27 +110,28 @@ void pfree(vmpage_t pg)
 	if(!pg) panic("Freed null page!!\n");
 #endif
 	if(!pg) return;
-	slock_acquire(&global_mem_lock);
 	pgdir_t* save = vm_push_pgdir();
-        k_pages++;
-	/* Make sure that the page doesn't have any flags: */
+	qlock_acquire(&global_mem_lock);
 
 #ifdef __ALLOW_VM_SHARE__
 	/* Was this page shared? */
 	if(vm_pgunshare((pypage_t)pg))
 	{
-		slock_release(&global_mem_lock);
+		qlock_release(&global_mem_lock);
+		vm_pop_pgdir(save);
 		return; /* Something still needs this page */
 	}
 #endif
 
+        k_pages++;
+
 	pg = PGROUNDDOWN(pg);
         struct vm_free_node* new_free = (struct vm_free_node*)pg;
         new_free->next = (vmpage_t)head;
         new_free->magic = (int)KVM_MAGIC;
         head = new_free;
+	qlock_release(&global_mem_lock);
 	vm_pop_pgdir(save);
-	slock_release(&global_mem_lock);
 
 #ifdef DEBUG
         cprintf("Page freed: 0x%x\n", pg);
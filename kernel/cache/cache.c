@@ -76,7 +76,7 @@ void* cache_query(void* data, struct cache* cache, void* context)
 {
 	if(!data || !cache->query) return NULL;
 
-	slock_acquire(&cache->lock);
+	qlock_acquire(&cache->lock);
 	void* result = NULL;
 
 	int x;
@@ -95,7 +95,7 @@ void* cache_query(void* data, struct cache* cache, void* context)
 		}
 	}
 
-	slock_release(&cache->lock);
+	qlock_release(&cache->lock);
 
 #ifdef CACHE_DEBUG_VER
 	if(result) cprintf("%s cache: query success.\n", cache->name);
@@ -176,7 +176,9 @@ int cache_init(void* cache_area, size_t sz, size_t data_sz,
 		- (entries << cache->entry_shift);
 	cache->last_entry = (int)(cache->entries + (entries - 1));
 	strncpy(cache->name, name, 64);
-	slock_init(&cache->lock);
+	qlock_init(&cache->lock);
+	qlock_name(&cache->lock, cache->name);
+	kmutex_init(&cache->populate_lock);
 	memset(cache_area, 0, sz); /* Clear to 0 */
 
 	/* Setup slab pointers */
@@ -285,6 +287,21 @@ static void* cache_alloc(int id, struct cache* cache, void* context)
 	return result;
 }
 
+/**
+ * Returns the entry that holds the given slab.
+ */
+static struct cache_entry* cache_get_entry(void* ptr, struct cache* cache)
+{
+	struct cache_entry* entry = cache->entries;
+	int val = (uintptr_t)ptr - (uintptr_t)cache->slabs;
+	/* If shift is available then use it (fast) */
+	if(cache->slab_shift)
+		entry += (uintptr_t)(val >> cache->slab_shift);
+	else entry += (val / cache->slab_sz);
+
+	return entry;
+}
+
 static int cache_force_free(void* ptr, struct cache* cache)
 {
 	struct cache_entry* entry = cache->entries;
@@ -457,10 +474,10 @@ static int cache_dereference_nolock(void* ptr, struct cache* cache,
 
 int cache_dereference(void* ptr, struct cache* cache, void* context)
 {
-	slock_acquire(&cache->lock);
+	qlock_acquire(&cache->lock);
 	int result = cache_dereference_nolock(ptr, cache, context);
 
-	slock_release(&cache->lock);
+	qlock_release(&cache->lock);
 	return result;
 }
 
@@ -492,63 +509,106 @@ static void* cache_search_nolock(int id, struct cache* cache, void* context)
 
 void* cache_search(int id, struct cache* cache, void* context)
 {
-	slock_acquire(&cache->lock);
+	qlock_acquire(&cache->lock);
 	void* result = cache_search_nolock(id, cache, context);
-	slock_release(&cache->lock);
+	qlock_release(&cache->lock);
 	return result;
 }
 
 void* cache_addreference(int id, struct cache* cache, void* context)
 {
 	void* result = NULL;
-	slock_acquire(&cache->lock);
+	qlock_acquire(&cache->lock);
 	/* First search */
+	result = cache_search_nolock(id, cache, context);
+	qlock_release(&cache->lock);
+	if(result) return result;
+
+	/**
+	 * cache_reference hides an entry from searches while it populates
+	 * it. Misses wait for the populate lock so that they don't create a
+	 * second entry for the same object.
+	 */
+	kmutex_lock(&cache->populate_lock);
+	qlock_acquire(&cache->lock);
 	if(!(result = cache_search_nolock(id, cache, context)))
 	{
 		/* Not already cached. */
 		result = cache_alloc(id, cache, context);
 		/* Do not populate. */
 	}
-	slock_release(&cache->lock);
+	qlock_release(&cache->lock);
+	kmutex_unlock(&cache->populate_lock);
 	return result;
 }
 
 void* cache_reference(int id, struct cache* cache, void* context)
 {
 	void* result = NULL;
-	slock_acquire(&cache->lock);
+	qlock_acquire(&cache->lock);
 	/* First search */
-	if(!(result = cache_search_nolock(id, cache, context)))
+	result = cache_search_nolock(id, cache, context);
+	if(result) cache->cache_hits++;
+	qlock_release(&cache->lock);
+	if(result) return result;
+
+	/**
+	 * Populating can take a while, don't hold the cache lock for it.
+	 * Misses are serialized by the populate lock so the same object
+	 * never gets loaded twice.
+	 */
+	kmutex_lock(&cache->populate_lock);
+	qlock_acquire(&cache->lock);
+
+	/* Somebody might have loaded it while we were waiting */
+	if((result = cache_search_nolock(id, cache, context)))
 	{
-		cache->cache_miss++;
-		/* Not already cached. */
-		result = cache_alloc(id, cache, context);
-		/* Call the populate function */
-		if(cache->populate)
+		cache->cache_hits++;
+		qlock_release(&cache->lock);
+		kmutex_unlock(&cache->populate_lock);
+		return result;
+	}
+
+	cache->cache_miss++;
+	/* Not already cached. */
+	result = cache_alloc(id, cache, context);
+	struct cache_entry* entry = NULL;
+	if(result && cache->populate)
+	{
+		/* Hide the entry from searches until it is populated */
+		entry = cache_get_entry(result, cache);
+		entry->valid = 0;
+	}
+	qlock_release(&cache->lock);
+
+	/* Call the populate function */
+	if(entry)
+	{
+		/* Populate the entry */
+		int failed = cache->populate(result, id, context);
+
+		qlock_acquire(&cache->lock);
+		if(failed)
 		{
-			/* Populate the entry */
-			if(cache->populate(result, id, context))
-			{
-				/* The resource is unavailable. */
-				cache_force_free(result, cache);
-				result = NULL;
-			}
-		} else {
+			/* The resource is unavailable. */
+			cache_force_free(result, cache);
+			result = NULL;
+		} else entry->valid = 1;
+		qlock_release(&cache->lock);
+	} else if(result) {
 #ifdef CACHE_DEBUG
-			cprintf("%s cache: no populate function assigned.\n",
-					cache->name);
+		cprintf("%s cache: no populate function assigned.\n",
+				cache->name);
 #endif
-		}
-	} else {
-		cache->cache_hits++;
 	}
 
+	kmutex_unlock(&cache->populate_lock);
+
 #ifdef CACHE_DEBUG
-	cprintf("%s cache: references for %d: %d\n", cache->name, id,
-		cache_count_refs(result, cache));
+	if(result) cprintf("%s cache: references for %d: %d\n", cache->name,
+		id, cache_count_refs(result, cache));
 #endif
 
-	slock_release(&cache->lock);
 	return result;
 }	
 
@@ -14,7 +14,8 @@
 
 
 /**
- * Represents a cache node linked list.
+ * Represents a cache node linked list. The free nodes are kept in address
+ * order so that freed space can be merged with its neighbors.
  */
 struct cman_node
 {
@@ -22,6 +23,7 @@ struct cman_node
 	struct cman_node* next; /* Next node in the list */
 };
 
+static slock_t cman_lock;
 static struct cman_node* head;
 
 void cman_init(void)
@@ -29,8 +31,10 @@ void cman_init(void)
 	/* Zero our space */
 	size_t sz = PGROUNDUP(KVM_DISK_E - KVM_DISK_S);
 	memset((void*)KVM_DISK_S, 0, sz);
+	slock_init(&cman_lock);
 	head = (void*)KVM_DISK_S;
 	head->sz = sz;
+	head->next = NULL;
 }
 
 void* cman_alloc(size_t sz)
@@ -38,52 +42,75 @@ void* cman_alloc(size_t sz)
 	if(sz == 0) return NULL;
 
 	sz = PGROUNDUP(sz);
-	struct cman_node* curr = head;
-	struct cman_node* last = NULL;
+	slock_acquire(&cman_lock);
+	struct cman_node** link = &head;
 	struct cman_node* result = NULL;
 
 	/* Search for a node with enough room */
-	while(curr)
+	for(;*link;link = &(*link)->next)
 	{
-		if(curr->sz >= sz)
-		{
-			result = curr;
+		if((*link)->sz >= sz)
 			break;
-		}
-		last = curr;
-		curr = curr->next;
 	}
 
 	/* Did we find anything? */
-	if(!result)
+	if(!*link)
 	{
+		slock_release(&cman_lock);
 		cprintf("cman: Disk cache out of space!\n");
 		return NULL;
 	}
 
-	if(sz == result->sz)
+	struct cman_node* curr = *link;
+	if(sz == curr->sz)
 	{
 		/* Consume the node */
-		if(last)
-		{
-			/* update the head */
-			head = result->next;
-		} else {
-			/* Update the broken pointer */
-			last->next = result->next;
-		}
+		*link = curr->next;
+		result = curr;
 	} else {
-		/* Partition this node */
-		
-		curr = result;
-		/* Assign result */
-		result = (struct cman_node*)(((char*)curr) + sz);
-		/* Modify the size */
+		/* Carve the space off of the end, the node stays in place */
 		curr->sz -= sz;
+		result = (struct cman_node*)(((char*)curr) + curr->sz);
 	}
+	slock_release(&cman_lock);
 
-	result->next = NULL;
+	/* Freed space isn't clean anymore */
+	memset(result, 0, sz);
 	return (void*)result;
 }
 
-void cman_free(void* ptr, size_t sz){}
+void cman_free(void* ptr, size_t sz)
+{
+	if(!ptr || sz == 0) return;
+
+	sz = PGROUNDUP(sz);
+	struct cman_node* node = ptr;
+	node->sz = sz;
+
+	slock_acquire(&cman_lock);
+	/* Find the last free node below ptr */
+	struct cman_node* prev = NULL;
+	struct cman_node* next = head;
+	while(next && next < node)
+	{
+		prev = next;
+		next = next->next;
+	}
+
+	/* Merge with the node above */
+	if(next && (char*)node + node->sz == (char*)next)
+	{
+		node->sz += next->sz;
+		next = next->next;
+	}
+	node->next = next;
+
+	/* Merge with the node below */
+	if(prev && (char*)prev + prev->sz == (char*)node)
+	{
+		prev->sz += node->sz;
+		prev->next = node->next;
+	} else if(prev) prev->next = node;
+	else head = node;
+	slock_release(&cman_lock);
+}
@@ -9,6 +9,7 @@
 #include "pipe.h"
 #include "device.h"
 #include "vm.h"
+#include "systrace.h"
 #include "panic.h"
 
 static slock_t device_table_lock;
@@ -185,6 +186,12 @@ int devman_init()
     device->init = io_zero_init;
     dev_zero = device;
 
+    /* Statistics for every system call */
+    device = dev_alloc();
+    device->type = DEV_IO;
+    snprintf(device->node, FILE_MAX_PATH, "/dev/syscallstats");
+    device->init = syscall_stats_init;
+
     /* Do final init on all io devices */
 	dev_t x;
     for(x = 0;x < MAX_DEVICES;x++)
@@ -1248,12 +1248,13 @@ static int _ext2_read(void* dst, fileoff_t start, size_t sz,
  * of blocks. This will make sequential writes very very fast. A huge
  * performance gain here is to ask: when should we replace blocks? When
  * they cause a fragment? When they are on a 'seam'?
+ *
+ * This only moves the range that is about to be written onto new blocks,
+ * copying the partial blocks at either end. Returns 0 on success.
  */
-static int _ext2_write(const void* src, fileoff_t start, fileoff_t sz, 
+static int ext2_write_alloc(fileoff_t start, fileoff_t sz,
 		int group_hint, disk_inode* ino, context* context)
 {
-	char* block;
-
 	/* 
 	 * If we're writing past the end of the file, we 
 	 * need to add blocks where were writing
@@ -1323,6 +1324,21 @@ static int _ext2_write(const void* src, fileoff_t start, fileoff_t sz,
 		if(lba) ext2_free_block(lba, context);
 	}
 
+	return 0;
+}
+
+/**
+ * Write sz bytes from src into the file starting at start. Returns the
+ * amount of bytes written, -1 on failure.
+ */
+static int _ext2_write(const void* src, fileoff_t start, fileoff_t sz, 
+		int group_hint, disk_inode* ino, context* context)
+{
+	char* block;
+
+	if(ext2_write_alloc(start, sz, group_hint, ino, context))
+		return -1;
+
 	const char* src_c = src;
 	size_t bytes = 0;
 	size_t write = 0;
@@ -1350,7 +1366,7 @@ static int _ext2_write(const void* src, fileoff_t start, fileoff_t sz,
 	bytes += write;
 
 	/* write middle blocks */
-	x = start_index + 1;
+	int x = start_index + 1;
 	for(;x < end_index;x++)
 	{
 		lba = ext2_block_address(x, ino, context);
@@ -1383,6 +1399,63 @@ static int _ext2_write(const void* src, fileoff_t start, fileoff_t sz,
 	return sz;
 }
 
+/**
+ * Walk the blocks between start and start + sz once, moving the data
+ * between them and the iovec buffers in order. If write is set the data
+ * goes into the blocks, which must already be allocated. Returns sz on
+ * success, -1 on failure.
+ */
+static int _ext2_copyv(const struct iovec* iov, fileoff_t start, size_t sz,
+		int write, disk_inode* ino, context* context)
+{
+	size_t bytes = 0;
+	size_t iov_pos = 0;
+	int index = start >> context->blockshift;
+	size_t offset = start & (context->blocksize - 1);
+
+	while(bytes < sz)
+	{
+		size_t chunk = context->blocksize - offset;
+		if(chunk > sz - bytes) chunk = sz - bytes;
+
+		/* Blocks that are completely overwritten don't need a read */
+		char* block;
+		int lba = ext2_block_address(index, ino, context);
+		if(write && chunk == context->blocksize)
+			block = context->fs->addreference(lba, context->fs);
+		else block = context->fs->reference(lba, context->fs);
+		if(!block) return -1;
+
+		/* The chunk might be spread over more than one buffer */
+		size_t done = 0;
+		while(done < chunk)
+		{
+			while(iov_pos == iov->iov_len)
+			{
+				iov++;
+				iov_pos = 0;
+			}
+
+			size_t part = iov->iov_len - iov_pos;
+			if(part > chunk - done) part = chunk - done;
+
+			char* buff = (char*)iov->iov_base + iov_pos;
+			if(write) memmove(block + offset + done, buff, part);
+			else memmove(buff, block + offset + done, part);
+
+			done += part;
+			iov_pos += part;
+		}
+
+		context->fs->dereference(block, context->fs);
+		bytes += chunk;
+		offset = 0;
+		index++;
+	}
+
+	return sz;
+}
+
 /**
  * Read a directory entry. Returns 0 on success.
  */
@@ -1826,7 +1899,7 @@ static int ext2_fsck_dir(inode* ino, context* context)
 		struct dirent dir;
 		int res = context->fs->getdents(ino, &dir, 1, pos, context);
 		if(res <= 0) break;
-		pos += res;
+		pos = dir.d_off;
 
 		if(!strcmp(dir.d_name, ".")) continue;
 		if(!strcmp(dir.d_name, "..")) continue;
@@ -1873,10 +1946,13 @@ static int ext2_read(inode* ino, void* dst, fileoff_t start, size_t sz,
 		context* context);
 static int ext2_write(inode* ino, const void* src, fileoff_t start, size_t sz,
 		context* context);
+static int ext2_readv(inode* ino, const struct iovec* iov, int iovcnt,
+		fileoff_t start, context* context);
+static int ext2_writev(inode* ino, const struct iovec* iov, int iovcnt,
+		fileoff_t start, context* context);
+static void* ext2_getpage(inode* ino, fileoff_t start, context* context);
 static int ext2_rename(const char* src, const char* dst, context* context);
 static int ext2_unlink(const char* file, context* context);
-static int ext2_readdir(inode* dir, int index, struct dirent* dst,
-		context* context);
 static int ext2_fsstat(struct fs_stat* dst, context* context);
 static int ext2_getdents(inode* dir, struct dirent* dst_arr, int count,
 		fileoff_t pos, context* context);
@@ -2031,7 +2107,6 @@ int ext2_init(struct FSDriver* fs)
 
 	fs->opened = (void*)ext2_opened;
 	fs->open = (void*)ext2_open;
-	fs->readdir = (void*)ext2_readdir;
 	fs->close = (void*)ext2_close;
 	fs->chmod = (void*)ext2_chmod;
 	fs->chown = (void*)ext2_chown;
@@ -2043,6 +2118,9 @@ int ext2_init(struct FSDriver* fs)
 	fs->create = (void*)ext2_create;
 	fs->read = (void*)ext2_read;
 	fs->write = (void*)ext2_write;
+	fs->readv = (void*)ext2_readv;
+	fs->writev = (void*)ext2_writev;
+	fs->getpage = (void*)ext2_getpage;
 	fs->link = (void*)ext2_link;
 	fs->rmdir = (void*)ext2_rmdir;
 	fs->symlink = (void*)ext2_symlink;
@@ -2468,6 +2546,77 @@ int ext2_write(inode* ino, const void* src, fileoff_t start, size_t sz,
 			ino->inode_group, ino->ino, context);
 }
 
+/**
+ * Add up the lengths of the buffers in iov.
+ */
+static size_t ext2_iov_length(const struct iovec* iov, int iovcnt)
+{
+	size_t sz = 0;
+	int x;
+	for(x = 0;x < iovcnt;x++)
+		sz += iov[x].iov_len;
+	return sz;
+}
+
+int ext2_readv(inode* ino, const struct iovec* iov, int iovcnt,
+		fileoff_t start, context* context)
+{
+	disk_inode* dino = ino->ino;
+	uint64_t file_size = dino->lower_size |
+		((uint64_t)dino->upper_size << 32);
+
+	size_t sz = ext2_iov_length(iov, iovcnt);
+	if(start >= file_size) return 0; /* End of file */
+	if(start + sz > file_size)
+		sz = file_size - start;
+	if(!sz) return 0;
+
+	return _ext2_copyv(iov, start, sz, 0, dino, context);
+}
+
+int ext2_writev(inode* ino, const struct iovec* iov, int iovcnt,
+		fileoff_t start, context* context)
+{
+	size_t sz = ext2_iov_length(iov, iovcnt);
+	if(!sz) return 0;
+
+	/* Allocate the blocks for all of the buffers at once */
+	if(ext2_write_alloc(start, sz, ino->inode_group, ino->ino, context))
+		return -1;
+
+	return _ext2_copyv(iov, start, sz, 1, ino->ino, context);
+}
+
+void* ext2_getpage(inode* ino, fileoff_t start, context* context)
+{
+	disk_inode* dino = ino->ino;
+	uint64_t file_size = dino->lower_size |
+		((uint64_t)dino->upper_size << 32);
+
+	/* Only whole, page aligned pages in the file can be shared */
+	if(start & (PGSIZE - 1)) return NULL;
+	if(start + PGSIZE > file_size) return NULL;
+
+	/**
+	 * The blocks have to be contiguous on the disk and line up with
+	 * a single page in the cache.
+	 */
+	int bpp = context->fs->bpp;
+	int start_index = start >> context->blockshift;
+	int lba = ext2_block_address(start_index, dino, context);
+	if(lba <= 0 || (lba & (bpp - 1))) return NULL;
+
+	int x;
+	for(x = 1;x < bpp;x++)
+	{
+		if(ext2_block_address(start_index + x, dino, context)
+				!= lba + x)
+			return NULL;
+	}
+
+	return context->fs->reference(lba, context->fs);
+}
+
 int ext2_rename(const char* src, const char* dst, context* context)
 {
 	/**
@@ -2567,39 +2716,6 @@ int ext2_unlink(const char* file, context* context)
 	return success;
 }
 
-int ext2_readdir(inode* dir, int index, struct dirent* dst, 
-		context* context)
-{
-	uint64_t file_size = dir->ino->lower_size |
-		((uint64_t)dir->ino->upper_size << 32);
-
-	struct ext2_dirent diren;
-
-	int x;
-	int pos;
-	for(x = 0, pos = 0;x < index + 1 && pos < file_size;x++)
-	{
-		if(_ext2_readdir(&diren, pos, dir->ino, context))
-			return -1;
-
-		if(x == index)
-		{
-			/* convert ext2 dirent to dirent */
-			memset(dst, 0, sizeof(struct dirent));
-			dst->d_ino = diren.inode;
-			dst->d_off = pos + diren.size;
-			dst->d_reclen = sizeof(struct dirent);
-			strncpy(dst->d_name, diren.name, FILE_MAX_NAME);
-
-			return 0;
-		}
-
-		pos += diren.size;
-	}
-
-	return 1;
-}
-
 int ext2_getdents(inode* dir, struct dirent* dst_arr, int count, 
 		fileoff_t pos, context* context)
 {
@@ -2618,6 +2734,9 @@ int ext2_getdents(inode* dir, struct dirent* dst_arr, int count,
 					dir->ino, context))
 			return -1;
 
+		/* An empty record would never get us to the next entry */
+		if(!diren.size) return x ? x : -1;
+
 		/* convert ext2 dirent to dirent */
 		memset(dst_arr + x, 0, sizeof(struct dirent));
 		dst_arr[x].d_ino = diren.inode;
@@ -2656,7 +2775,7 @@ int ext2_getdents(inode* dir, struct dirent* dst_arr, int count,
 		bytes_read += diren.size;
 	}
 
-	return bytes_read;
+	return x;
 }
 
 void ext2_sync(context* context)
@@ -470,7 +470,6 @@ static int lwfs_write(inode* ino, const void* src, intptr_t start, size_t sz,
                 context* context);
 static int lwfs_rename(const char* src, const char* dst, context* context);
 static int lwfs_unlink(const char* file, context* context);
-static int lwfs_readdir(inode* dir, int index, struct dirent* dst, context* context);
 static int lwfs_getdents(inode* dir, struct dirent* dst_arr, size_t count,
                 off_t posistion, context* context);
 static int lwfs_fsstat(struct fs_stat* dst, context* context);
@@ -618,7 +617,6 @@ int lwfs_init(size_t size, struct FSDriver* driver)
 	driver->write = (void*)lwfs_write;
 	driver->rename = (void*)lwfs_rename;
 	driver->unlink = (void*)lwfs_unlink;
-	driver->readdir = (void*)lwfs_readdir;
 	driver->getdents = (void*)lwfs_getdents;
 	driver->fsstat = (void*)lwfs_fsstat;
 	driver->opened = (void*)lwfs_opened;
@@ -984,12 +982,12 @@ int lwfs_unlink(const char* file, context* context)
 	return 0;
 }
 
-int lwfs_readdir(inode* dir, int index, struct dirent* dst, context* context)
+/**
+ * Read the directory entry at offset into dst. Returns 0 on success.
+ */
+static int lwfs_readdir(inode* dir, off_t offset, struct dirent* dst,
+		context* context)
 {
-	off_t offset = index << context->dirent_shifter;
-	if(offset >= dir->size) 
-		return -1; /* end if dir*/
-
 	dirent d;
 	if(_read(dir, &d, offset, sizeof(dirent), context) != sizeof(dirent))
 		return -1;
@@ -1013,14 +1011,18 @@ int lwfs_getdents(inode* dir, struct dirent* dst_arr, size_t count,
 	position += sizeof(dirent) - 1;
 	position &= ~(sizeof(dirent) - 1);
 
+	if(position >= dir->size)
+		return 0; /* end of directory */
 	int left = (dir->size - position) >> context->dirent_shifter;
 	if(count > left) count = left;
-	if(count == 0) 
-		return 0; /* end of directory */
 
-	if(_read(dir, dst_arr, position, count << context->dirent_shifter, 
-				context) != count << context->dirent_shifter)
-		return -1;
+	int x;
+	for(x = 0;x < count;x++)
+	{
+		if(lwfs_readdir(dir, position, dst_arr + x, context))
+			return x ? x : -1;
+		position += sizeof(dirent);
+	}
 
 	return count;
 }
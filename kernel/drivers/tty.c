@@ -113,6 +113,8 @@ void tty_init(tty_t t, int num, char type, int cursor_enabled,
 
     /* Init keyboard lock */
     slock_init(&t->key_lock);
+    waitqueue_init(&t->io_wait, WAITQUEUE_INTERACTIVE);
+    poll_source_init(&t->poll);
 
     /* Set the window spec */
     t->window.ws_row = CONSOLE_ROWS;
@@ -130,24 +132,24 @@ void tty_init(tty_t t, int num, char type, int cursor_enabled,
 
 int tty_connected(tty_t t)
 {
-	slock_acquire(&ptable_lock);
+	qlock_acquire(&ptable_lock);
 	int result = 0;
-	int x;
-	for(x = 0;x < PTABLE_SIZE;x++)
+	struct proc* p;
+	for(p = proc_list;p;p = p->all_next)
 	{
-		if(ptable[x].t == t)
+		if(p->t == t)
 		{
 			result = 1;
 			break;
 		}
 	}
-	slock_release(&ptable_lock);
+	qlock_release(&ptable_lock);
 	return result;
 }
 
 void tty_disconnect_proc(struct proc* p)
 {
-	slock_acquire(&ptable_lock);
+	qlock_acquire(&ptable_lock);
 	/* disconnect stdin, stdout and stderr */
 	fd_free(p, 0);
 	fd_free(p, 1);
@@ -157,7 +159,7 @@ void tty_disconnect_proc(struct proc* p)
 
 	/* remove controlling terminal */
 	p->t = NULL;
-	slock_release(&ptable_lock);
+	qlock_release(&ptable_lock);
 
 	if(p->sid == p->sid)
 		tty_disconnect_all(t);
@@ -165,29 +167,29 @@ void tty_disconnect_proc(struct proc* p)
 
 void tty_disconnect_all(tty_t t)
 {
-	int x;
-	for(x = 0;x < PTABLE_SIZE;x++)
+	struct proc* p;
+	for(p = proc_list;p;p = p->all_next)
 	{
-		if(ptable[x].t == t)
-			tty_disconnect_proc(ptable + x);
+		if(p->t == t)
+			tty_disconnect_proc(p);
 	}
 }
 
 void tty_set_proc_ctty(struct proc* p, tty_t t)
 {
-	slock_acquire(&ptable_lock);
+	qlock_acquire(&ptable_lock);
 	rproc->t = t;
 	if(fd_new(p, 0, 1) == -1) return;
 	if(fd_new(p, 1, 1) == -1) return;
 	if(fd_new(p, 2, 1) == -1) return;
 
-	rproc->fdtab[0]->device = t->driver;
-	rproc->fdtab[0]->type = FD_TYPE_DEVICE;
-	rproc->fdtab[1]->device = t->driver;
-	rproc->fdtab[1]->type = FD_TYPE_DEVICE;
-	rproc->fdtab[2]->device = t->driver;
-	rproc->fdtab[2]->type = FD_TYPE_DEVICE;
-	slock_release(&ptable_lock);
+	rproc->fdtab->fds[0]->device = t->driver;
+	rproc->fdtab->fds[0]->type = FD_TYPE_DEVICE;
+	rproc->fdtab->fds[1]->device = t->driver;
+	rproc->fdtab->fds[1]->type = FD_TYPE_DEVICE;
+	rproc->fdtab->fds[2]->device = t->driver;
+	rproc->fdtab->fds[2]->type = FD_TYPE_DEVICE;
+	qlock_release(&ptable_lock);
 }
 
 int tty_spawn(tty_t t)
@@ -197,24 +199,25 @@ int tty_spawn(tty_t t)
 	if(!p) return -1; /* Could we find an unused process? */
 
 	/* Get the process table lock */
-	slock_acquire(&ptable_lock);
+	qlock_acquire(&ptable_lock);
 
 	/* Setup the new process */
 	p->t = t;
 	p->pid = next_pid++;
+	proc_link(p, NULL);
 	p->uid = 0; /* init is owned by root */
 	p->gid = 0; /* group is also root */
 
 	/* Setup stdin, stdout and stderr */
 	if(fd_next(p) != 0) panic("spawn_tty: wrong fd for stdin\n");
-	p->fdtab[0]->type = FD_TYPE_DEVICE;
-	p->fdtab[0]->device = t->driver;
+	p->fdtab->fds[0]->type = FD_TYPE_DEVICE;
+	p->fdtab->fds[0]->device = t->driver;
 	if(fd_next(p) != 1) panic("spawn_tty: wrong fd for stdout\n");
-	p->fdtab[1]->type = FD_TYPE_DEVICE;
-	p->fdtab[1]->device = t->driver;
+	p->fdtab->fds[1]->type = FD_TYPE_DEVICE;
+	p->fdtab->fds[1]->device = t->driver;
 	if(fd_next(p) != 2) panic("spawn_tty: wrong fd for stderr\n");
-	p->fdtab[2]->type = FD_TYPE_DEVICE;
-	p->fdtab[2]->device = t->driver;
+	p->fdtab->fds[2]->type = FD_TYPE_DEVICE;
+	p->fdtab->fds[2]->device = t->driver;
 
 	p->stack_start = PGROUNDUP(UVM_TOP);
 	p->stack_end = p->stack_start - PGSIZE;
@@ -273,7 +276,7 @@ int tty_spawn(tty_t t)
 	uintptr_t code_start;
 	uintptr_t code_end;
 	uintptr_t entry = elf_load_binary_path("/bin/init", p->pgdir,
-			&code_start, &code_end, 1);
+			&code_start, &code_end, 1, &p->vm_areas);
 	p->code_start = code_start;
 	p->code_end = code_end;
 	p->entry_point = entry;
@@ -285,7 +288,8 @@ int tty_spawn(tty_t t)
 		PGROUNDUP(UVM_TOP) - UVM_MIN_STACK;
 
 	p->state = PROC_READY;
-	slock_release(&ptable_lock);
+	sched_enqueue(p);
+	qlock_release(&ptable_lock);
 
 	/* Return Success */
 	return 0;
@@ -9,6 +9,7 @@
 #include "panic.h"
 #include "tty.h"
 #include "proc.h"
+#include "drivers/serial.h"
 
 // #define DEBUG
 // #define KEY_DEBUG
@@ -34,6 +35,7 @@ int tty_io_setup(struct IODevice* device, int tty_num)
 	device->ready_read = tty_io_ready_read;
 	device->ready_write = tty_io_ready_write;
 	device->pathconf = tty_io_pathconf;
+	if(t) device->poll = &t->poll;
 	return 0;
 }
 
@@ -90,6 +92,14 @@ static int tty_io_read(void* dst, fileoff_t start_read, size_t sz, void* context
 static int tty_io_write(void* src, fileoff_t start_write, size_t sz, void* context)
 {
 	tty_t t = context;
+
+	/* Serial ttys don't parse console codes, send the buffer at once */
+	if(t->type == TTY_TYPE_SERIAL)
+	{
+		if(t->active) serial_write(src, sz);
+		return sz;
+	}
+
 	char* src_c = src;
 	int x;
 	for(x = 0;x < sz;x++, src_c++)
@@ -295,122 +305,56 @@ static int tty_io_ioctl(unsigned long request, void* arg, tty_t t)
 	return 0;	
 }
 
-static struct proc* tty_dequeue(tty_t t)
-{
-	struct proc* p = NULL;
-	/* Grab the IO queue lock */
-	slock_acquire(&t->io_queue_lock);
-	if(t->io_queue)
-	{
-		p = t->io_queue;
-#ifdef QUEUE_DEBUG
-		cprintf("tty_queue: %s dequeued.\n", p->name);
-#endif
-		if(p)
-		{
-			t->io_queue = p->io_next;
-			p->io_next = NULL;
-		} else {
-			t->io_queue = NULL;
-		}
-	} else {
-#ifdef QUEUE_DEBUG
-		cprintf("tty_queue: NULL DEQUEUE!!.\n", p->name);
-#endif
-	}
-	slock_release(&t->io_queue_lock);
-
-	return p;
-}
-
-static void tty_enqueue(struct proc* p, tty_t t)
-{
-	/* Grab the IO queue lock */
-	slock_acquire(&t->io_queue_lock);
-
-#ifdef QUEUE_DEBUG
-	cprintf("tty_queue: %s enqueued.\n", p->name);
-#endif
-
-	if(!t->io_queue)
-	{
-		t->io_queue = p;
-#ifdef QUEUE_DEBUG
-		cprintf("tty_queue: %s is first!\n", p->name);
-#endif
-	} else {
-#ifdef QUEUE_DEBUG
-		cprintf("tty_queue: %s is not first!.\n", p->name);
-#endif
-		struct proc* next = t->io_queue;
-		while(next->io_next)
-			next = next->io_next;
-		next->io_next = p;
-	}
-
-	p->io_next = NULL;
-	slock_release(&t->io_queue_lock);
-}
-
 int tty_gets(char* dst, int sz, tty_t t)
 {
 	/* Check for bad request */
 	if(!sz || !dst) return 0;
 
-	/* Acquire the ptable lock */
-	slock_acquire(&ptable_lock);
-
 	rproc->io_dst = (void*)dst;
 	memset(dst, 0, sz);
 
-io_sleep:
-	/* Put our process in the wait queue */
-	tty_enqueue(rproc, t);
-
-	/* Go to sleep */
-	rproc->state = PROC_BLOCKED;
-	rproc->block_type = PROC_BLOCKED_IO;
-	rproc->io_recieved = 0;
-	rproc->io_request = sz;
+	do
+	{
+		rproc->io_recieved = 0;
+		rproc->io_request = sz;
 
 #ifdef KEY_DEBUG
-	cprintf("tty: %s:%d is now waiting for io.\n", 
-		rproc->name, rproc->pid);
+		cprintf("tty: %s:%d is now waiting for io.\n", 
+			rproc->name, rproc->pid);
 #endif
 
-	yield_withlock();
+		/* Sleep until the keyboard fills our buffer */
+		waitqueue_sleep(&t->io_wait, PROC_BLOCKED_IO, NULL);
 
 #ifdef KEY_DEBUG
-        cprintf("tty: %s:%d is now running again!\n",
-                rproc->name, rproc->pid);
+		cprintf("tty: %s:%d is now running again!\n",
+			rproc->name, rproc->pid);
 #endif
 
-	/* When we wake up here, we should have something in our buffer. */
-	slock_acquire(&ptable_lock);
-
-	/* Did we get anything? */
-	if(rproc->io_recieved == 0)
-	{
-		cprintf("tty: extraneous proc wakeup.\n");
-		goto io_sleep;
-	}
+		/* Did we get anything? */
+		if(rproc->io_recieved == 0)
+			cprintf("tty: extraneous proc wakeup.\n");
+	} while(rproc->io_recieved == 0);
 
 #ifdef KEY_DEBUG
         cprintf("tty: %s:%d received %d 0x%x %c\n",
                 rproc->name, rproc->pid, *dst, *dst, *dst);
 #endif
-	slock_release(&ptable_lock);
 
 	return rproc->io_recieved;
 }
 
-/* ptable and key lock must be held here. */
+/* key lock must be held here. */
 void tty_signal_io_ready(tty_t t)
 {
 	char canon = t->term.c_lflag & ICANON;
 
+	/* Let the event sets know that there is input */
+	if(tty_io_ready_read(t))
+		poll_notify(&t->poll, POLLIN);
+
 	/* Keyboard signaled. */
-	struct proc* p = tty_dequeue(t);
+	struct proc* p = waitqueue_first(&t->io_wait);
 	if(!p)
 	{
 #ifdef KEY_DEBUG
@@ -487,10 +431,10 @@ void tty_signal_io_ready(tty_t t)
 #ifdef KEY_DEBUG
 		cprintf("tty: %s:%d woke up!\n", p->name, p->pid);
 #endif
-		p->state = PROC_RUNNABLE;
-		p->block_type = PROC_BLOCKED_NONE;
+		waitqueue_wake_proc(p);
 	} else {
-		cprintf("tty: why wasn't I woken up?\n");
-		// for(;;);
+#ifdef KEY_DEBUG
+		cprintf("tty: %s:%d keeps waiting.\n", p->name, p->pid);
+#endif
 	}
 }
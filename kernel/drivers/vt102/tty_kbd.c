@@ -57,7 +57,7 @@ void tty_clear_input(tty_t t)
 	slock_release(&t->key_lock);
 }
 
-extern slock_t ptable_lock;
+extern qlock_t ptable_lock;
 static int tty_handle_char(char c, tty_t t);
 void tty_keyboard_interrupt_handler(void)
 {
@@ -67,7 +67,7 @@ void tty_keyboard_interrupt_handler(void)
 		return;
 	}
 
-	slock_acquire(&ptable_lock);
+	qlock_acquire(&ptable_lock);
 	slock_acquire(&active_tty->key_lock);
 	char c = 0;
 	do
@@ -100,7 +100,8 @@ void tty_keyboard_interrupt_handler(void)
 	int x;
 	for(x = 0;x < MAX_TTYS;x++)
 	{
-		if((t + x)->io_queue && (t + x)->driver->ready_read(t + x))
+		if(waitqueue_first(&(t + x)->io_wait)
+				&& (t + x)->driver->ready_read(t + x))
 		{
 #ifdef KEY_DEBUG
 			cprintf("tty: tty %d needed to be woken up again!\n", x);
@@ -110,7 +111,7 @@ void tty_keyboard_interrupt_handler(void)
 		}
 	}
 
-	slock_release(&ptable_lock);
+	qlock_release(&ptable_lock);
 	slock_release(&active_tty->key_lock);
 }
 
@@ -265,6 +266,9 @@ static int tty_shandle(int pressed, int special, int val, int ctrl, int alt,
 			case '3':
 				fd_print_table();
 				break;
+			case '4':
+				lock_stats_print();
+				break;
 		}
 
 		return 0;
@@ -104,7 +104,9 @@ int fs_add_inode_reference(struct inode_t* i)
 				i->name);
 #endif
 
+	slock_acquire(&i->ref_lock);
 	i->references++;
+	slock_release(&i->ref_lock);
 	return 0;
 }
 
@@ -260,6 +262,8 @@ static struct inode_t* fs_find_inode(void)
 		if(itable[x].valid == 0)
 		{
 			itable[x].valid = 1;
+			kmutex_init(&itable[x].lock);
+			slock_init(&itable[x].ref_lock);
 			result = itable + x;
 			break;
 		}
@@ -425,12 +429,18 @@ inode fs_open(const char* path, int flags, mode_t permissions,
 
 int fs_close(inode i)
 {
+	slock_acquire(&i->ref_lock);
+	int last = !--i->references;
+	slock_release(&i->ref_lock);
+
 	/* Close the file system file */
-	i->references--;	
-	if(i->references == 0)
+	if(last)
 	{ 
+		kmutex_lock(&i->lock);
 		int close_result = i->fs->close(i->inode_ptr, 
 				i->fs->context);
+		/* Nobody else can reference the inode now */
+		kmutex_unlock(&i->lock);
 		fs_free_inode(i);
 		return close_result;
 	} else {
@@ -447,7 +457,9 @@ int fs_close(inode i)
 int fs_stat(inode i, struct stat* dst)
 {
 	/* Return the cached version */
+	kmutex_lock(&i->lock);
 	memmove(dst, &i->st, sizeof(struct stat));
+	kmutex_unlock(&i->lock);
 	return 0;
 }
 
@@ -526,12 +538,28 @@ int fs_sync(void)
 	return 0;
 }
 
+int fs_fsync(inode i)
+{
+	int result = 0;
+	kmutex_lock(&i->lock);
+	if(i->fs->fsync && i->fs->fsync(i->inode_ptr, i->fs->context) < 0)
+		result = -1;
+	kmutex_unlock(&i->lock);
+
+	/* The data blocks are in the caches of the file system */
+	if(i->fs->sync) i->fs->sync(i->fs->context);
+
+	return result;
+}
+
 int fs_truncate(inode i, int sz)
 {
+	kmutex_lock(&i->lock);
 	int result = i->fs->truncate(i->inode_ptr, 
 			sz, i->fs->context);
-	if(result < 0) return -1;
+	if(result < 0) result = -1;
 	else i->st.st_size = result;
+	kmutex_unlock(&i->lock);
 	return result;
 }
 
@@ -573,7 +601,9 @@ int fs_mkdir(const char* path, int flags,
 
 int fs_read(inode i, void* dst, size_t sz, fileoff_t start)
 {
+	kmutex_lock(&i->lock);
 	int bytes = i->fs->read(i->inode_ptr, dst, start, sz, i->fs->context);
+	kmutex_unlock(&i->lock);
 	/* Check for read error */
 	if(bytes < 0) return -1;
 	return bytes;
@@ -581,16 +611,22 @@ int fs_read(inode i, void* dst, size_t sz, fileoff_t start)
 
 int fs_write(inode i, void* src, size_t sz, fileoff_t start)
 {
+	kmutex_lock(&i->lock);
 	int bytes = i->fs->write(i->inode_ptr,
 			src, start, sz, i->fs->context);
 	/* Check for read error */
-	if(bytes < 0) return -1;
+	if(bytes < 0)
+	{
+		kmutex_unlock(&i->lock);
+		return -1;
+	}
 
 	/* Update our file position */
 	i->file_pos += bytes;
 
 	/* The file properties may have changed */
 	fs_sync_inode(i);
+	kmutex_unlock(&i->lock);
 
 	/* TODO: Temporary: write disk after every write */
 	// fs_sync();
@@ -598,6 +634,85 @@ int fs_write(inode i, void* src, size_t sz, fileoff_t start)
 	return bytes;
 }
 
+int fs_readv(inode i, const struct iovec* iov, int iovcnt, fileoff_t start)
+{
+	kmutex_lock(&i->lock);
+	int bytes = 0;
+	if(i->fs->readv)
+	{
+		bytes = i->fs->readv(i->inode_ptr, iov, iovcnt,
+				start, i->fs->context);
+	} else {
+		/* Fall back on one driver read per buffer */
+		int x;
+		for(x = 0;x < iovcnt;x++)
+		{
+			int read = i->fs->read(i->inode_ptr, iov[x].iov_base,
+					start + bytes, iov[x].iov_len,
+					i->fs->context);
+			if(read < 0 && !bytes) bytes = -1;
+			if(read > 0) bytes += read;
+			if(read != iov[x].iov_len) break;
+		}
+	}
+	kmutex_unlock(&i->lock);
+
+	if(bytes < 0) return -1;
+	return bytes;
+}
+
+int fs_writev(inode i, const struct iovec* iov, int iovcnt, fileoff_t start)
+{
+	kmutex_lock(&i->lock);
+	int bytes = 0;
+	if(i->fs->writev)
+	{
+		bytes = i->fs->writev(i->inode_ptr, iov, iovcnt,
+				start, i->fs->context);
+	} else {
+		/* Fall back on one driver write per buffer */
+		int x;
+		for(x = 0;x < iovcnt;x++)
+		{
+			int written = i->fs->write(i->inode_ptr,
+					iov[x].iov_base, start + bytes,
+					iov[x].iov_len, i->fs->context);
+			if(written < 0 && !bytes) bytes = -1;
+			if(written > 0) bytes += written;
+			if(written != iov[x].iov_len) break;
+		}
+	}
+
+	if(bytes < 0)
+	{
+		kmutex_unlock(&i->lock);
+		return -1;
+	}
+
+	/* Update our file position */
+	i->file_pos += bytes;
+
+	/* Sync the inode once for all of the buffers */
+	fs_sync_inode(i);
+	kmutex_unlock(&i->lock);
+
+	return bytes;
+}
+
+void* fs_getpage(inode i, fileoff_t start)
+{
+	if(!i->fs->getpage) return NULL;
+	kmutex_lock(&i->lock);
+	void* page = i->fs->getpage(i->inode_ptr, start, i->fs->context);
+	kmutex_unlock(&i->lock);
+	return page;
+}
+
+void fs_putpage(inode i, void* page)
+{
+	i->fs->dereference(page, i->fs);
+}
+
 int fs_rename(const char* src, const char* dst)
 {
 	/**
@@ -660,9 +775,14 @@ int fs_unlink(const char* file)
 	return result;
 }
 
-int fs_readdir(inode i, int index, struct dirent* dst)
+int fs_getdents(inode i, struct dirent* dst, int count, fileoff_t pos)
 {
-	return i->fs->readdir(i->inode_ptr, index, dst, i->fs->context);
+	if(count <= 0) return -1;
+	kmutex_lock(&i->lock);
+	int result = i->fs->getdents(i->inode_ptr, dst, count, pos,
+			i->fs->context);
+	kmutex_unlock(&i->lock);
+	return result;
 }
 
 int fs_mount(const char* device, const char* point)
@@ -779,7 +899,7 @@ int fs_pathconf(int config, const char* path)
     switch(config)
     {
         case _PC_PIPE_BUF:
-			return 8192;
+			return PIPE_BUF;
 		case _PC_VDISABLE: /* FIXME: this should call the driver's pathconf */
 			return 0;
 		case _PC_MAX_CANON: /* FIXME: this should call the driver's pathconf */
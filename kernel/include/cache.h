@@ -1,6 +1,8 @@
 #ifndef _CACHE_H_
 #define _CACHE_H_
 
+#include "kmutex.h"
+
 #define CACHE_DEBUG_NAME_LEN 64
 
 struct cache
@@ -12,7 +14,8 @@ struct cache
 	char* slabs; /* Pointer to the first slab */
 	int slab_shift; /* Quick shift is available for log2(slab)*/
 	size_t slab_sz; /* How big are the slabs? */
-	slock_t lock; /* Lock needed to change the cache */
+	qlock_t lock; /* Lock needed to change the cache */
+	kmutex_t populate_lock; /* Held while an object is loaded */
 	int clock; /* Points to the last entry allocated */
 	char name[CACHE_DEBUG_NAME_LEN]; /* name of the cache (DEBUG) */
 	int cache_hits; /* How many times have we gotten a cache hit? */
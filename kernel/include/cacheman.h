@@ -7,12 +7,14 @@
 void cman_init(void);
 
 /**
- * Allocate some cache space
+ * Allocate some cache space. The size is rounded up to whole pages and the
+ * space is zeroed. Returns NULL if there isn't enough room left.
  */
 void* cman_alloc(size_t sz);
 
 /**
- * Free the cache space.
+ * Free the cache space. sz has to be the size that was passed to
+ * cman_alloc.
  */
 void cman_free(void* ptr, size_t size);
 
@@ -4,6 +4,13 @@
 /* Chronos traps */
 #define TRAP_SC 		0x80 /* System call trap*/
 
+/**
+ * Faster system call entry. Calling this address does the same as int
+ * $0x80 with the same stack, it just takes the sysenter path into the
+ * kernel. The page is mapped into every process.
+ */
+#define VSYSCALL_ENTRY	0xFEFBC000
+
 #define SYS_fork 		0x01
 #define SYS_wait 		0x02
 #define SYS_exec 		0x03
@@ -97,11 +104,45 @@
 #define SYS_setreuid	0x5B
 #define SYS_setregid	0x5C
 #define SYS_reboot		0x5D
+#define SYS_nice		0x5E
+#define SYS_getpriority	0x5F
+#define SYS_setpriority	0x60
+#define SYS_nanosleep	0x61
+#define SYS_clock_gettime	0x62
+#define SYS_readv		0x63
+#define SYS_writev		0x64
+#define SYS_preadv		0x65
+#define SYS_pwritev	0x66
+#define SYS_sendfile	0x67
+#define SYS_splice		0x68
+#define SYS_poll		0x69
+#define SYS_event_create	0x6A
+#define SYS_event_ctl	0x6B
+#define SYS_event_wait	0x6C
+#define SYS_getrlimit	0x6D
+#define SYS_setrlimit	0x6E
+#define SYS_iobatch_setup	0x6F
+#define SYS_iobatch_enter	0x70
+#define SYS_trace_ctl	0x71
+#define SYS_trace_read	0x72
 
 // Options for reboot system call
 #define CHRONOS_RB_REBOOT 	0x01
 #define CHRONOS_RB_SHUTDOWN 0x02
 
+// Options for the getpriority and setpriority system calls
+#ifndef PRIO_PROCESS
+#define PRIO_PROCESS	0x00
+#define PRIO_PGRP	0x01
+#define PRIO_USER	0x02
+#endif
+
+// Resources for the getrlimit and setrlimit system calls (Linux Compliant)
+#ifndef RLIMIT_NOFILE
+#define RLIMIT_NOFILE	0x07 /* Open file descriptors */
+#define RLIM_INFINITY	(~0UL)
+#endif
+
 // #define SYS_semctl	0x5B
 // #define SYS_semget	0x5C
 // #define SYS_semop	0x5D
@@ -110,6 +151,9 @@
 #ifndef __CHRONOS_ASM_ONLY__
 #ifndef __ASM_ONLY__
 extern int reboot(int type);
+extern int nice(int inc);
+extern int getpriority(int which, int who);
+extern int setpriority(int which, int who, int prio);
 
 extern int __chronos_syscall(int num, ...);
 #endif
@@ -150,11 +194,171 @@ extern int __chronos_syscall(int num, ...);
 #define SEG_USER_CODE   0x03 /* data must be 1 away from code (sysexit) */
 #define SEG_USER_DATA   0x04
 #define SEG_TSS		0x05
+#define SEG_CPU		0x06
 
-#define SEG_COUNT 	0x06
+#define SEG_COUNT 	0x07
 
 #define SYS_EXIT_BASE	((SEG_USER_CODE << 3) - 16)
 
+/**
+ * fcntl commands for the capacity of a pipe (Linux Compliant)
+ */
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ	1031
+#define F_GETPIPE_SZ	1032
+#endif
+
+/**
+ * Events for poll and the event system calls (Linux Compliant)
+ */
+#ifndef POLLIN
+#define POLLIN		0x001 /* There is data to read */
+#define POLLPRI		0x002 /* There is urgent data to read */
+#define POLLOUT		0x004 /* Writing won't block */
+#define POLLERR		0x008 /* Error condition (output only) */
+#define POLLHUP		0x010 /* The other end hung up (output only) */
+#define POLLNVAL	0x020 /* Invalid file descriptor (output only) */
+#endif
+
+/**
+ * Batched I/O rings (iobatch_setup, iobatch_enter). Reads, writes and
+ * fsyncs of files at a position are run by a kernel worker while the
+ * process goes on, their results show up in the completion ring during a
+ * later iobatch_enter. The other operations finish in iobatch_enter. A
+ * ring isn't inherited by fork or clone.
+ */
+#define IOBATCH_RING_ENTRIES 0x40 /* Slots in each ring (power of 2) */
+#define IOBATCH_MAX_IO	0x10000 /* Longer worker transfers are cut short */
+
+#define IOBATCH_OP_NOP		0x00 /* Just post a completion */
+#define IOBATCH_OP_READ		0x01 /* Read len bytes into addr */
+#define IOBATCH_OP_WRITE	0x02 /* Write len bytes from addr */
+#define IOBATCH_OP_FSYNC	0x03 /* Write the file back to the disk */
+#define IOBATCH_OP_OPENAT	0x04 /* Open the path addr with the flags len */
+
+#define IOBATCH_POS_CURRENT	0xFFFFFFFF /* Use and move the seek of the fd */
+
+#ifndef AT_FDCWD
+#define AT_FDCWD	-100 /* Paths are relative to the working directory */
+#endif
+
+/**
+ * System call statistics (/dev/syscallstats) and tracing (trace_ctl,
+ * trace_read)
+ */
+#define SYSCALL_HIST_BUCKETS 0x20 /* One bucket per power of 2 cycles */
+#define TRACE_ARGS	0x04 /* Arguments recorded for each traced call */
+#define TRACE_LOST	0x00 /* Marks events that were dropped (result) */
+
+/**
+ * Operations for event_ctl
+ */
+#define EVENT_CTL_ADD	0x01 /* Start watching a file descriptor */
+#define EVENT_CTL_DEL	0x02 /* Stop watching a file descriptor */
+#define EVENT_CTL_MOD	0x03 /* Change the watched events */
+
+#ifndef __CHRONOS_ASM_ONLY__
+#ifndef __ASM_ONLY__
+#ifndef _SYS_POLL_H
+/**
+ * One file descriptor that is given to poll.
+ */
+struct pollfd
+{
+	int fd; /* The file descriptor to check */
+	short events; /* The events that are interesting */
+	short revents; /* The events that happened */
+};
+#endif
+
+#ifndef _SYS_RESOURCE_H
+/**
+ * A soft and a hard limit for getrlimit and setrlimit.
+ */
+struct rlimit
+{
+	unsigned long rlim_cur; /* The soft limit */
+	unsigned long rlim_max; /* The hard limit (ceiling for rlim_cur) */
+};
+#endif
+
+/**
+ * One operation that is handed to the kernel through an I/O batch ring.
+ */
+struct iobatch_sqe
+{
+	unsigned int opcode; /* What to do (IOBATCH_OP_*) */
+	int fd; /* The file descriptor, the directory for openat */
+	unsigned int off; /* Position in the file or IOBATCH_POS_CURRENT */
+	void* addr; /* The buffer, the path for openat */
+	unsigned int len; /* Length of the buffer, the flags for openat */
+	unsigned int mode; /* Permissions for files created by openat */
+	void* user_data; /* Given back in the completion */
+};
+
+/**
+ * The result of an operation, posted by the kernel.
+ */
+struct iobatch_cqe
+{
+	void* user_data; /* user_data of the submission */
+	int result; /* What the system call would have returned */
+};
+
+/**
+ * A submission and a completion ring that live in the memory of the
+ * process. The head and tail counters never wrap into the slot index, the
+ * slot is counter & (IOBATCH_RING_ENTRIES - 1). The process owns sq_tail and
+ * cq_head, the kernel owns sq_head and cq_tail.
+ */
+struct iobatch_ring
+{
+	unsigned int sq_head; /* Next submission the kernel takes */
+	unsigned int sq_tail; /* Next free submission slot */
+	unsigned int cq_head; /* Next completion the process takes */
+	unsigned int cq_tail; /* Next free completion slot */
+	struct iobatch_sqe sq[IOBATCH_RING_ENTRIES];
+	struct iobatch_cqe cq[IOBATCH_RING_ENTRIES];
+};
+
+/**
+ * What /dev/syscallstats holds for each system call, indexed by the system
+ * call number. Times are in cpu cycles.
+ */
+struct syscall_stat
+{
+	unsigned int calls; /* How many times was the call made? */
+	unsigned int errors; /* How many calls returned a negative value? */
+	unsigned long long cycles; /* Time spent in all of the calls */
+	unsigned int max_cycles; /* The slowest call */
+	/* hist[n] counts the calls that took 2^n to 2^(n + 1) - 1 cycles */
+	unsigned int hist[SYSCALL_HIST_BUCKETS];
+};
+
+/**
+ * A system call made by a traced process, returned by trace_read. If the
+ * trace ring overflowed, an event with the number TRACE_LOST comes first
+ * and its result is how many events were dropped.
+ */
+struct trace_event
+{
+	unsigned int num; /* The system call number */
+	int result; /* What the call returned */
+	unsigned int args[TRACE_ARGS]; /* The first arguments as raw words */
+	unsigned int cycles; /* How long the call took */
+};
+
+/**
+ * A file descriptor that is ready, returned by event_wait.
+ */
+struct event
+{
+	unsigned int events; /* The events that happened */
+	void* data; /* The data given to event_ctl */
+};
+#endif
+#endif
+
 /**
  * Protectections for mmap and mprotect
  */
@@ -1,6 +1,55 @@
 #ifndef _CPU_H_
 #define _CPU_H_
 
+#include "context.h"
+
+/* The most cpus the kernel will start */
+#define CPU_MAX 8
+
+struct proc;
+
+/**
+ * The state of one cpu. Every cpu runs its own scheduler loop on its own
+ * stack and has its own running process.
+ */
+struct cpu
+{
+	struct cpu* self; /* Points to this structure, has to be first */
+	int id; /* The index of this cpu in cpus */
+	int hw_id; /* The id of the local interrupt controller of this cpu */
+	volatile int started; /* Whether or not this cpu is scheduling */
+	volatile int idle; /* Whether or not this cpu is halted */
+	struct proc* proc; /* The process running on this cpu */
+	context_t context; /* The context of the scheduler of this cpu */
+	int cli_count; /* The depth of the cli stack */
+	int kvm_depth; /* The depth of the kernel page directory stack */
+	unsigned int timer_ticks; /* Ticks the local timer was set for */
+	struct proc* fpu_owner; /* The process whose fpu registers are loaded */
+	volatile int tlb_req; /* TLB flushes other cpus have asked for */
+	volatile int tlb_done; /* The last TLB flush request handled */
+};
+
+extern struct cpu cpus[CPU_MAX];
+extern int cpu_count; /* The amount of cpus that were found */
+
+/**
+ * Returns the cpu this code is running on.
+ */
+#ifdef ARCH_i386
+static inline struct cpu* cpu_this(void)
+{
+	struct cpu* c;
+	asm volatile("movl %%gs:0, %0" : "=r" (c));
+	return c;
+}
+#endif
+
+/**
+ * Returns the cpu this code is running on. Unlike cpu_this, this also works
+ * before the segment table of the boot cpu has been loaded.
+ */
+struct cpu* cpu_current(void);
+
 /**
  * Push an interrupt request onto the cli stack. pop_cli must be called
  * before the function returns.
@@ -18,6 +67,84 @@ void pop_cli(void);
  */
 void reset_cli(void);
 
+/**
+ * Halt the cpu until the next interrupt arrives. Interrupts are disabled
+ * again when this returns.
+ */
+void cpu_idle(void);
+
+/**
+ * Find the other cpus and start their scheduler loops. Returns the amount
+ * of cpus that are running.
+ */
+int smp_init(void);
+
+/**
+ * Interrupt the cpu so that it runs its scheduler again. Does nothing if
+ * the cpu is the one running this code.
+ */
+void cpu_reschedule(struct cpu* c);
+
+/**
+ * Make the local timer of this cpu interrupt after ticks timer wheel ticks.
+ * Only the cpus that don't drive the timer wheel use this.
+ */
+void cpu_timer_arm(unsigned int ticks);
+
+/**
+ * The local timer of this cpu has interrupted. Returns the amount of ticks
+ * the timer was set for.
+ */
+int cpu_timer_interrupt(void);
+
+/* The size and alignment of the saved floating point registers */
+#define FPU_STATE_SZ 512
+#define FPU_STATE_ALIGN 16
+
+/**
+ * The floating point registers of a cpu belong to the last process that
+ * used them and are only saved once another process uses the floating
+ * point unit on that cpu. Processes that never touch the floating point
+ * unit don't pay anything for it.
+ */
+
+/**
+ * The process p is about to run on this cpu. Makes floating point
+ * instructions trap unless this cpu still holds the registers of p.
+ */
+void fpu_switch_in(struct proc* p);
+
+/**
+ * The process p has left this cpu. If other cpus are running, p might get
+ * picked up by one of them so its registers are saved right away.
+ */
+void fpu_switch_out(struct proc* p);
+
+/**
+ * The running process used the floating point unit while it was disabled.
+ * Saves the registers of the previous owner and loads the ones of the
+ * running process.
+ */
+void fpu_trap(void);
+
+/**
+ * Make sure the saved floating point state of the running process is up
+ * to date. The registers stay loaded.
+ */
+void fpu_flush(struct proc* p);
+
+/**
+ * Throw away the registers this cpu holds for p, the saved state of p is
+ * used the next time p touches the floating point unit.
+ */
+void fpu_forget(struct proc* p);
+
+/**
+ * Give the process p a copy of the floating point state of the running
+ * process.
+ */
+void fpu_copy(struct proc* p);
+
 /**
  * Shutdown the system
  */
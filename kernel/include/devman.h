@@ -19,6 +19,8 @@ typedef uint32_t blk_t; /* A block number */
 typedef uint32_t sect_t; /* A sector number */
 typedef uint32_t fileoff_t; /* Offset into a file */
 
+struct poll_source;
+
 /* ioctl helper function */
 extern int ioctl_arg_ok(void* arg, size_t sz);
 
@@ -60,6 +62,12 @@ struct IODevice
 	int (*ready_read)(void* context);
 	int (*ready_write)(void* context);
 
+	/**
+	 * Optional source that tells event sets when the readiness of the
+	 * device changes. Devices without one get checked on every tick.
+	 */
+	struct poll_source* poll;
+
 	/**
 	 * Optional method for checking to see the values of different
 	 * configuration values (used in pathconf systemcall). Returns
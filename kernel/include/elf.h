@@ -106,11 +106,12 @@ int elf_check_binary_path(const char* path);
 /**
  * Load the binary into memory denoted by the given inode. The start of the 
  * code segment (low) will be placed into start if it is not NULL. The end of
- * the code segment (high) is returned in end if it is not null. Returns 0
- * on success, non zero otherwise.
+ * the code segment (high) is returned in end if it is not null. If areas is
+ * not NULL, segments are recorded in areas and paged in on demand. Returns
+ * 0 on success, non zero otherwise.
  */
 uintptr_t elf_load_binary_inode(inode ino, pgdir_t* pgdir, uintptr_t* start, 
-	uintptr_t* end, int user);
+	uintptr_t* end, int user, struct vm_area_table* areas);
 
 /**
  * Load the binary into memory denoted by the given path. The start of the 
@@ -119,6 +120,7 @@ uintptr_t elf_load_binary_inode(inode ino, pgdir_t* pgdir, uintptr_t* start,
  * on success, non zero otherwise. DEPRICATED USE load_binary_inode.
  */
 uintptr_t elf_load_binary_path(const char* path, pgdir_t* pgdir, 
-	uintptr_t* start, uintptr_t* end, int user);
+	uintptr_t* start, uintptr_t* end, int user,
+	struct vm_area_table* areas);
 
 #endif
@@ -41,6 +41,22 @@ struct devnode
         int type;
 };
 
+/* Maximum amount of buffers in a single vectored read or write */
+#ifndef IOV_MAX
+#define IOV_MAX 64
+#endif
+
+/**
+ * One buffer of a vectored read or write (readv, writev, preadv, pwritev).
+ */
+#ifndef _SYS_UIO_H
+struct iovec
+{
+	void* iov_base; /* Start of the buffer */
+	size_t iov_len; /* Length of the buffer in bytes */
+};
+#endif
+
 /* Linux Permission Macros */
 #ifndef __LINUX__
 
@@ -10,6 +10,7 @@
 
 #include "file.h"
 #include "stdlock.h"
+#include "kmutex.h"
 #include "cache.h"
 #include "devman.h"
 
@@ -28,12 +29,13 @@ struct inode_t
 {
 	int valid; /* Whether or not this inode is valid. */
 	int flags; /* The flags that were used to open this file */
-	slock_t lock; /* Lock needs to be held to access this inode */
+	kmutex_t lock; /* Lock needs to be held to access this inode */
 	int file_pos; /* Seek position in the file */
 	struct stat st; /* Stats on the file */
 	char name[FILE_MAX_NAME]; /* the name of the file */
 	struct FSDriver* fs; /* File system this inode belongs to.*/
 	void* inode_ptr; /* Pointer to the fs specific inode. */
+	slock_t ref_lock; /* Lock needed to change references */
 	int references; /* How many programs reference this file? */
 };
 
@@ -139,6 +141,30 @@ struct FSDriver
 	int (*write)(void* i, const void* src, fileoff_t start, 
 			size_t sz, void* context);
 
+	/**
+	 * Optional: read from the inode i into the iovcnt buffers in iov,
+	 * filling them in order starting at position start in the file.
+	 * Returns the amount of bytes read from the file.
+	 */
+	int (*readv)(void* i, const struct iovec* iov, int iovcnt,
+			fileoff_t start, void* context);
+
+	/**
+	 * Optional: write the iovcnt buffers in iov into the inode i, in
+	 * order, starting at position start in the file. Returns the amount
+	 * of bytes written to the file.
+	 */
+	int (*writev)(void* i, const struct iovec* iov, int iovcnt,
+			fileoff_t start, void* context);
+
+	/**
+	 * Optional: get a referenced pointer to the cache page that holds
+	 * the page of the file starting at start. The page must be page
+	 * aligned in the file and backed by a single cache page. Returns
+	 * NULL if the page can't be shared with the cache.
+	 */
+	void* (*getpage)(void* i, fileoff_t start, void* context);
+
 	/**
 	 * Move file from src to dst. This function can also move
 	 * directories.
@@ -151,18 +177,13 @@ struct FSDriver
 	 */
 	int (*unlink)(const char* file, void* context);
 
-	/**
-	 * Read the directory entry at index in the directory dir. Returns
-	 * 0 on success, -1 when the end of the directory has been reached.
-	 */
-	int (*readdir)(void* dir, int index, 
-			struct dirent* dst, void* context);
-
 	/**
 	 * Get directory entries from an inode. Pos is the offset to the
 	 * next available entry. Count is the amount of directory entries
-	 * to read. Returns the amount of bytes read. Returns -1 on failure
-	 * and returns 0 on end of directory.
+	 * to read. The d_off of every entry is the offset of the entry
+	 * after it, so reading can resume there without walking the
+	 * directory again. Returns the amount of entries read. Returns -1
+	 * on failure and returns 0 on end of directory.
 	 */
 	int (*getdents)(void* dir, struct dirent* dst_arr, int count,
 			fileoff_t pos, void* context);
@@ -248,7 +269,8 @@ extern char root_partition[];
 void fsman_init(void);
 
 /**
- * Add a reference to an inode.
+ * Add a reference to an inode the caller already holds a reference to.
+ * This doesn't sleep, so it can be used with the ptable lock held.
  */
 int fs_add_inode_reference(struct inode_t* i);
 
@@ -322,6 +344,32 @@ int fs_read(inode i, void* dst, size_t sz, fileoff_t start);
  */
 int fs_write(inode i, void* src, size_t sz, fileoff_t start);
 
+/**
+ * Read from inode i into the iovcnt buffers in iov, filling them in order
+ * starting at the seek position start. The inode is only locked once for
+ * the whole request. Returns the amount of bytes read, -1 on failure.
+ */
+int fs_readv(inode i, const struct iovec* iov, int iovcnt, fileoff_t start);
+
+/**
+ * Write the iovcnt buffers in iov into inode i, in order, starting at the
+ * seek position start. The inode is only locked and synced once for the
+ * whole request. Returns the amount of bytes written, -1 on failure.
+ */
+int fs_writev(inode i, const struct iovec* iov, int iovcnt, fileoff_t start);
+
+/**
+ * Get a pointer to the storage cache page that holds the page of the file
+ * that starts at start. The page stays in the cache until it is released
+ * with fs_putpage. Returns NULL if the page can't be mapped directly.
+ */
+void* fs_getpage(inode i, fileoff_t start);
+
+/**
+ * Release a page returned by fs_getpage.
+ */
+void fs_putpage(inode i, void* page);
+
 /**
  * Rename (or move) a file from src to dst. Returns 0 on success, 
  * returns -1 on failure.
@@ -335,10 +383,11 @@ int fs_rename(const char* src, const char* dst);
 int fs_unlink(const char* file);
 
 /**
- * Read the directory entry at the specified index. Returns 0 on success,
- * -1 otherwise.
+ * Read up to count directory entries starting at the offset pos, which is
+ * 0 or the d_off of an entry read before. Returns the amount of entries
+ * read, 0 at the end of the directory and -1 on failure.
  */
-int fs_readdir(inode i, int index, struct dirent* dst);
+int fs_getdents(inode i, struct dirent* dst, int count, fileoff_t pos);
 
 /**
  * Simplify the given path so that it doesn't contain any . or ..s
@@ -368,6 +417,12 @@ int fs_mknod(const char* path, dev_t dev, dev_t dev_type, mode_t perm);
  */
 int fs_truncate(inode i, int sz);
 
+/**
+ * Write the inode and the cached data of the file system it lives on back
+ * to the disk. Returns 0 on success, -1 on failure.
+ */
+int fs_fsync(inode i);
+
 /**
  * Sync all file system data to the underlying storage device. 
  * Return 0 on success.
@@ -0,0 +1,47 @@
+#ifndef _KMUTEX_H_
+#define _KMUTEX_H_
+
+#include "stdlock.h"
+#include "waitqueue.h"
+
+struct proc;
+
+/**
+ * A sleeping lock for things that stay locked for a long time, like a file
+ * descriptor during a disk transfer. A process that finds the mutex locked
+ * gives up the cpu until the mutex is unlocked instead of spinning. Never
+ * lock a mutex while holding a spin lock. A zeroed mutex is a valid,
+ * unlocked mutex.
+ */
+struct kmutex
+{
+	slock_t lock; /* Lock needed to change the mutex */
+	int locked; /* Whether or not the mutex is held */
+	struct proc* owner; /* The process holding the mutex */
+	waitqueue_t waiters; /* Processes waiting for the mutex */
+};
+typedef struct kmutex kmutex_t;
+
+/**
+ * Initilize an unlocked mutex.
+ */
+void kmutex_init(kmutex_t* m);
+
+/**
+ * Lock the mutex, blocking the running process until the mutex is free.
+ */
+void kmutex_lock(kmutex_t* m);
+
+/**
+ * Try to lock the mutex without blocking. Returns 0 if the mutex is now
+ * held, -1 if somebody else holds it.
+ */
+int kmutex_trylock(kmutex_t* m);
+
+/**
+ * Unlock the mutex and wake up the process that has been waiting for it
+ * the longest.
+ */
+void kmutex_unlock(kmutex_t* m);
+
+#endif
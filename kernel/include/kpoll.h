@@ -0,0 +1,135 @@
+#ifndef _KPOLL_H_
+#define _KPOLL_H_
+
+#include "stdlock.h"
+#include "waitqueue.h"
+#include "kmutex.h"
+#include "chronos.h"
+
+/* The most events that event_wait hands out at once */
+#define EVENT_WAIT_BATCH 0x40
+
+struct file_descriptor;
+struct poll_watch;
+struct event_set;
+
+/**
+ * Something that can become ready for reading or writing, like a tty or a
+ * pipe. Every event set that is interested in the source has a watch on
+ * its list, so a change in readiness only touches the sets that care.
+ */
+struct poll_source
+{
+	slock_t lock; /* Lock needed to touch the watch list */
+	struct poll_watch* watches; /* Everyone watching this source */
+};
+
+/**
+ * The interest of an event set in one file descriptor.
+ */
+struct poll_watch
+{
+	int used; /* Whether or not this watch is in use */
+	int fd; /* The watched file descriptor */
+	struct file_descriptor* file; /* What fd pointed to when added */
+	int events; /* The events that are interesting */
+	void* data; /* Given back to the user with the events */
+	struct event_set* set; /* The set this watch belongs to */
+
+	int polled; /* No source, the fd gets checked on every tick */
+	struct poll_source* source; /* The source this watch is on, if any */
+	struct poll_watch* src_next; /* Next watch on the same source */
+	struct poll_watch* src_prev; /* Previous watch on the same source */
+
+	int ready; /* Whether or not the watch is on the ready list */
+	struct poll_watch* ready_next; /* Next watch on the ready list */
+	struct poll_watch* check_next; /* Next watch a waiter has to check */
+};
+
+/**
+ * Watches are kept in pages that are chained to their set. Sources and the
+ * ready list point at the watches, so a set grows by adding pages instead
+ * of moving the watches it already has.
+ */
+struct poll_watch_page
+{
+	struct poll_watch_page* next; /* The next page of the same set */
+	struct poll_watch watches[]; /* As many watches as fit in the page */
+};
+
+/**
+ * A set of watched file descriptors. Sources put watches on the ready list
+ * of the set when they become ready, so a waiter only has to look at the
+ * file descriptors that had something happen to them.
+ */
+struct event_set
+{
+	slock_t lock; /* Lock needed to touch the ready list */
+	kmutex_t ctl; /* Held while the watches are changed or checked */
+	waitqueue_t waiters; /* Processes waiting for events */
+	struct poll_watch* ready; /* Watches that have been notified */
+	int unsourced; /* Watches that have to be checked on every tick */
+	struct poll_watch_page* pages; /* The watches of this set */
+};
+
+/**
+ * Initilize a source that nobody is watching yet.
+ */
+void poll_source_init(struct poll_source* src);
+
+/**
+ * Tell every set that is watching the source that the given events have
+ * happened. This may be called from an interrupt handler.
+ */
+void poll_notify(struct poll_source* src, int events);
+
+/**
+ * The source is going away, drop every watch that is on it.
+ */
+void poll_source_detach(struct poll_source* src);
+
+/**
+ * Get the events that the file descriptor is ready for right now. Returns
+ * a mask of POLL* events.
+ */
+int poll_fd(struct file_descriptor* fd);
+
+/**
+ * Allocate a new empty event set. Returns NULL if there is no memory left.
+ */
+struct event_set* event_set_alloc(void);
+
+/**
+ * Drop all of the watches in the set and free it.
+ */
+void event_set_free(struct event_set* set);
+
+/**
+ * Start watching fd of the running process for events. Unless dup is set,
+ * a file descriptor can only be watched once per set. The set grows as
+ * needed. Returns 0 on success, -1 on failure.
+ */
+int event_set_add(struct event_set* set, int fd, int events, void* data,
+		int dup);
+
+/**
+ * Change the events that are watched for on fd. Returns 0 on success, -1
+ * if fd isn't in the set.
+ */
+int event_set_mod(struct event_set* set, int fd, int events, void* data);
+
+/**
+ * Stop watching fd. Returns 0 on success, -1 if fd isn't in the set.
+ */
+int event_set_del(struct event_set* set, int fd);
+
+/**
+ * Wait until some of the watched file descriptors are ready and put at
+ * most max of them into dst. ticks is the longest the process waits, -1
+ * waits forever and 0 doesn't wait at all. Returns the amount of events
+ * that were put into dst, 0 on timeout, -1 if a signal arrived.
+ */
+int event_set_wait(struct event_set* set, struct event* dst, int max,
+		int ticks);
+
+#endif
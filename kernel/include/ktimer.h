@@ -0,0 +1,148 @@
+#ifndef _KTIMER_H_
+#define _KTIMER_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+
+/* The timer wheel turns KTIMER_HZ times per second */
+#define KTIMER_HZ 100
+#define KTIMER_TICK_NS (1000000000 / KTIMER_HZ)
+#define KTIMER_TICK_US (1000000 / KTIMER_HZ)
+
+/* The longest a timer can be set for */
+#define KTIMER_MAX_TICKS 0x7FFFFFFF
+
+struct proc;
+typedef void (*ktimer_func_t)(void* arg);
+
+/**
+ * A timer calls its function once the timer wheel has turned past its
+ * expiry tick. A timer is pending from the moment it is added until it
+ * fires or gets deleted. The function gets called without the timer lock
+ * and without the ptable lock. Once ktimer_del has returned, the function
+ * isn't running anymore, so the timer can live on the stack.
+ */
+struct ktimer
+{
+	uint expires; /* The tick this timer fires on */
+	ktimer_func_t func; /* The function to call when the timer fires */
+	void* arg; /* The argument for func */
+	struct ktimer* next; /* The next timer in the same wheel slot */
+	struct ktimer** pprev; /* The pointer to this timer, NULL if idle */
+};
+
+/**
+ * Initilize the timer wheel and the monotonic clock.
+ */
+void ktimer_init(void);
+
+/**
+ * Setup an idle timer that will call func with arg when it fires.
+ */
+void ktimer_setup(struct ktimer* t, ktimer_func_t func, void* arg);
+
+/**
+ * Start the timer. The timer will fire after at least ticks ticks and less
+ * than ticks + 1 ticks. If the timer was already pending, it is moved to
+ * its new expiry tick.
+ */
+void ktimer_add(struct ktimer* t, uint ticks);
+
+/**
+ * Stop the timer. If the function of the timer is running on another cpu,
+ * this waits for it to return, so no lock that the function takes may be
+ * held. Returns 1 if the timer was pending, 0 otherwise.
+ */
+int ktimer_del(struct ktimer* t);
+
+/**
+ * Returns the amount of ticks left before the timer fires. Returns 0 if the
+ * timer is not pending.
+ */
+uint ktimer_remaining(struct ktimer* t);
+
+/**
+ * Advance the monotonic clock by ns nanoseconds and fire every timer that
+ * has expired in the meantime. Returns the amount of ticks the timer wheel
+ * has turned.
+ */
+int ktimer_update(uint ns);
+
+/**
+ * Read the clock and update the timer wheel. Returns the amount of ticks
+ * the timer wheel has turned.
+ */
+int ktimer_poll(void);
+
+/**
+ * The clock interrupt has fired or the cpu has woken up from an interrupt
+ * that might have been the clock. Returns the amount of ticks the timer
+ * wheel has turned.
+ */
+int ktimer_clock_interrupt(void);
+
+/**
+ * Make sure the clock interrupts on the next tick that has timers to fire,
+ * or at the latest when the timer wheel has turned ticks times. This has to
+ * be called before the cpu goes back to a process or goes idle.
+ */
+void ktimer_arm(uint ticks);
+
+/**
+ * Returns the amount of ticks the timer wheel has turned since boot.
+ */
+uint ktimer_ticks(void);
+
+/**
+ * Returns the amount of nanoseconds that have passed since boot.
+ */
+uint64_t ktimer_ns(void);
+
+/**
+ * Get the time that has passed since boot.
+ */
+void ktimer_clock(struct timespec* dst);
+
+/**
+ * Convert a time span into ticks, rounding up. Spans that are too long
+ * for the timer wheel are clamped to KTIMER_MAX_TICKS.
+ */
+uint ktimer_timespec_ticks(const struct timespec* span);
+uint ktimer_timeval_ticks(const struct timeval* span);
+
+/**
+ * Convert ticks into a time span.
+ */
+void ktimer_ticks_timespec(uint ticks, struct timespec* dst);
+
+/**
+ * Block the running process for ticks ticks. Returns the amount of ticks
+ * that were left when the process got woken up early, 0 if it slept for
+ * the whole time. (lock not needed)
+ */
+uint ktimer_sleep(uint ticks);
+
+/**
+ * Wake up a process that is blocked in ktimer_sleep before its time is up.
+ * (lock not needed)
+ */
+void ktimer_interrupt(struct proc* p);
+
+/**
+ * Clock driver, implemented by the architecture.
+ */
+
+/**
+ * Returns the amount of nanoseconds that have passed since the last call.
+ */
+uint ktimer_clock_elapsed(void);
+
+/**
+ * Make the clock interrupt once after ns nanoseconds. If the clock can't
+ * wait that long, it interrupts earlier. Returns the amount of nanoseconds
+ * the clock was set for.
+ */
+uint ktimer_clock_oneshot(uint ns);
+
+#endif
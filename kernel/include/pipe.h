@@ -1,21 +1,30 @@
 #ifndef _PIPE_H_
 #define _PIPE_H_
 
-#define MAX_PIPES 32
-#define PIPE_DATA 0x1000 /* 4K */
+#include "waitqueue.h"
+#include "kpoll.h"
+
+#define PIPE_DEFAULT_PAGES 0x10 /* 64K */
+#define PIPE_MAX_PAGES 0x100 /* 1M */
+/* Writes of up to PIPE_BUF bytes never get mixed with other writes */
+#undef PIPE_BUF
+#define PIPE_BUF 0x1000
 
 struct pipe
 {
 	int faulted; /* 0 = no error, 1 = one end of the pipe is closed. */
 	int allocated; /* 0 = the pipe is not in use, 1 = the pipe is in use. */
-	char buffer[PIPE_DATA];
 	slock_t guard;
-	int read;
-	int write;
-	cond_t empty, fill; 
-	int full; 
+	char* pages[PIPE_MAX_PAGES]; /* Buffer pages, allocated on first use */
+	int page_count; /* The capacity of the pipe in pages */
+	size_t read; /* Offset of the oldest byte in the ring */
+	size_t count; /* Amount of bytes in the ring */
+	waitqueue_t readers; /* Processes waiting for data */
+	waitqueue_t writers; /* Processes waiting for space */
+	struct poll_source poll; /* Event sets watching this pipe */
 	int read_ref; /* How many readers are there? */
 	int write_ref; /* How many writers are there? */
+	struct pipe* next; /* Next pipe on the free list */
 };
 
 typedef struct pipe* pipe_t;
@@ -23,23 +32,52 @@ typedef struct pipe* pipe_t;
 void pipe_init(void);
 
 /**
- * Allocate a new pipe from the pipe table.
+ * Allocate a new pipe with the default capacity. Returns NULL if there is
+ * no memory left for another pipe.
  */
 pipe_t pipe_alloc(void);
 
 /**
- * Free a pipe that is no longer in use.
+ * Free a pipe that is no longer in use. The buffer pages are given back
+ * to the page allocator.
  */
 void pipe_free(pipe_t p);
 
 /**
- * Write to a pipe.
+ * One end of the pipe was closed, wake up everyone that is waiting on it.
+ */
+void pipe_fault(pipe_t t);
+
+/**
+ * Write to a pipe. Blocks until all sz bytes have been written or the
+ * pipe faults. A write of at most PIPE_BUF bytes is copied in one piece.
+ * Returns the amount of bytes written, -1 if the pipe has faulted.
  */
 int pipe_write(void *src, size_t sz, pipe_t pipe );
 
 /**
- * Read from a pipe.
+ * Read from a pipe. Blocks until there is data in the pipe, then reads
+ * whatever is available up to sz bytes. Returns the amount of bytes read,
+ * 0 if the pipe is empty and the writers are gone.
  */
 int pipe_read(void *dst, size_t sz, pipe_t pipe);
 
+/**
+ * Get the capacity of the pipe in bytes.
+ */
+int pipe_get_size(pipe_t pipe);
+
+/**
+ * Change the capacity of the pipe to at least sz bytes, rounded up to a
+ * whole amount of pages. The data in the pipe is kept. Returns the new
+ * capacity, -1 if the data in the pipe doesn't fit or sz is too big.
+ */
+int pipe_set_size(pipe_t pipe, size_t sz);
+
+/**
+ * Get the POLL* events that the read end (write = 0) or the write end
+ * (write = 1) of the pipe is ready for.
+ */
+int pipe_poll(pipe_t pipe, int write);
+
 #endif
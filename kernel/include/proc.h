@@ -8,15 +8,23 @@
 #include "ksignal.h"
 #include "vm.h"
 #include "trap.h"
+#include "waitqueue.h"
+#include "kmutex.h"
+#include "cpu.h"
+#include "ktimer.h"
 #include "pipe.h"
 #include "devman.h"
 #include "tty.h"
 #include "file.h"
+#include "kpoll.h"
 
-/* The amount of processes in the ptable */
-#define PTABLE_SIZE	0x40
-#define FDS_TABLE_SZ	0x1000
-#define MAX_PROC_NAME 	FILE_MAX_PATH
+/* The maximum amount of processes that can exist at the same time */
+#ifndef PROC_LIMIT
+#define PROC_LIMIT	0x100
+#endif
+#define PROC_HASH_SIZE	0x40 /* Buckets in the pid hash table (power of 2) */
+#define PROC_SLAB_SZ	0x10000 /* Bytes of kernel heap per slab of processes */
+#define MAX_PROC_NAME 	0x40
 #define MAX_PATH_LEN	0x60
 
 #define FD_TYPE_NULL 	0x00
@@ -28,6 +36,7 @@
 #define FD_TYPE_DEVICE 	0x05
 #define FD_TYPE_PIPE	0x06
 #define FD_TYPE_PATH	0x07
+#define FD_TYPE_EVENT	0x08 /* An event set (event_create) */
 
 #define FD_PIPE_MODE_NULL  0x00
 #define FD_PIPE_MODE_WRITE 0x01
@@ -36,7 +45,7 @@
 struct file_descriptor
 {
 	int type; /* The type of this file descriptor */
-	slock_t lock; /* The lock for this fd (read/write) */
+	kmutex_t lock; /* The lock for this fd (read/write) */
 	int refs; /* How many fdtabs reference this? */
 	int flags; /* Any flags needed by the descriptor */
 	int seek; /* What is the offset into the file? */
@@ -44,11 +53,34 @@ struct file_descriptor
 	struct IODevice* device; /* The device driver (if dev) */
 	pipe_t pipe; /* The pointer to the pipe (if pipe) */
 	int pipe_type; /* The type of pipe (if pipe) */
+	struct event_set* events; /* The event set (if event) */
 	char path[FILE_MAX_PATH]; /* Mount point on the file system */
+	struct file_descriptor* next; /* Next descriptor on the free list */
 };
 
-/* Maximum amount of file descriptors a process can have */
-#define PROC_MAX_FDS 0x20
+/**
+ * File descriptor tables start out with FD_TABLE_MIN slots that live inside
+ * of the table. Once a process needs more, the slots are moved into a page
+ * that holds FD_TABLE_MAX slots. The slots that are in use are tracked in
+ * a bitmap, with a summary word that tells which words of the bitmap are
+ * full, so finding the lowest free slot takes two bit scans.
+ */
+#define FD_TABLE_MIN	0x20
+#define FD_TABLE_MAX	(PGSIZE / sizeof(struct file_descriptor*))
+#define FD_TABLE_WORDS	(FD_TABLE_MAX / 32)
+
+/* Default soft limit on the amount of open file descriptors (RLIMIT_NOFILE) */
+#define FD_LIMIT_DEFAULT 0x100
+
+struct fd_table
+{
+	slock_t lock; /* Lock needed to change the table */
+	int size; /* The amount of slots in fds */
+	struct file_descriptor** fds; /* The slots, indexed by fd */
+	uint32_t used[FD_TABLE_WORDS]; /* Bit set: the slot is taken */
+	uint32_t full; /* Bit n set: word n of used has no free slots */
+	struct file_descriptor* slots[FD_TABLE_MIN]; /* The first slots */
+};
 
 /* States for processes */
 #define PROC_UNUSED 	0x00 /* This process is free */
@@ -62,15 +94,25 @@ struct file_descriptor
 #define PROC_STOPPED 	0x08 /* Process recieved stop signal. */
 #define PROC_SIGNAL 	0x09 /* Process is waiting to receive a signal */
 
+/* Scheduling priorities */
+#define SCHED_PRIO_COUNT	0x08 /* The amount of run queues */
+#define SCHED_PRIO_BOOST	0x00 /* Run queue for woken interactive processes */
+#define SCHED_PRIO_DEFAULT	0x03 /* The run queue new processes start in */
+#define SCHED_NICE_MIN		(-20) /* The most favorable nice value */
+#define SCHED_NICE_MAX		19 /* The least favorable nice value */
+#define SCHED_DEMOTE_VTIME	0x1000 /* Virtual runtime per demotion */
+#define SCHED_AGE_TICKS		0x80 /* Ticks between aging the runtimes */
+
 /* Blocked reasons */
 #define PROC_BLOCKED_NONE 0x00 /* The process is not blocked */
 #define PROC_BLOCKED_WAIT 0x01 /* The process is waiting on a child */
 #define PROC_BLOCKED_COND 0x02 /* The thread is waiting on a condition */
 #define PROC_BLOCKED_IO   0x03 /* The process is waiting on io to finish */
 #define PROC_BLOCKED_SLEEP 0x04 /* The process is waiting on sleep  */
+#define PROC_BLOCKED_MUTEX 0x05 /* The process is waiting on a mutex */
 
 /* File descriptor table */
-typedef struct file_descriptor** fdtab_t;
+typedef struct fd_table* fdtab_t;
 
 struct proc
 {
@@ -93,8 +135,11 @@ struct proc
 
 	/** Open files for this process */
 	fdtab_t fdtab;
-	slock_t* fdtab_lock;
+	int fd_limit; /* Soft limit on open file descriptors */
+	int fd_limit_max; /* Hard limit on open file descriptors */
 	mode_t umask; /* File creation mask */
+	struct iobatch_ctx* iobatch; /* Ring set up with iobatch_setup */
+	struct trace_ring* trace; /* System calls recorded by trace_ctl */
 
 	/** Process state parameters */
 	int state; /* The state of the process */
@@ -102,14 +147,30 @@ struct proc
 	cond_t* b_condition; /* The condition we might be waiting on */
 	int b_condition_signal; /* The condition ticket number. */
 	int b_pid; /* The pid we are waiting on. */
-	time_t sleep_time; /* The time when the sleep ends */
+	struct ktimer alarm_timer; /* Sends SIGALRM when it fires */
+	waitqueue_t* wq; /* The wait queue this process is blocked in */
+	struct proc* wq_next; /* The next process in the wait queue */
+	struct proc* wq_prev; /* The previous process in the wait queue */
+	waitqueue_t child_wait; /* Wait queue for waiting on children */
+
+	/** Scheduling parameters */
+	int priority; /* Run queue of this process (0 is the highest) */
+	int nice; /* The nice value of the process */
+	uint vruntime; /* Ticks spent running, weighted by nice */
+	uint vruntime_mark; /* vruntime that has been forgiven by aging */
+	int timeslice; /* Ticks left before the process gets preempted */
+	int sched_boost; /* Put the process in the boost queue next time */
+	int rq_queued; /* Whether or not this process is in a run queue */
+	int rq_cpu; /* The cpu whose run queue this process is in */
+	volatile int on_cpu; /* Set until the process has left its cpu */
+	struct proc* rq_next; /* The next process in the run queue */
+	struct proc* rq_prev; /* The previous process in the run queue */
 
 	/** IO parameters */
 	tty_t t; /* The tty this program is attached to. */
 	char* io_dst; /* Where the destination bytes will be placed. */
 	int io_request; /* Requested io size. Must be < PROC_IO_BUFFER */
 	int io_recieved; /* The actual amount of bytes recieved. */
-	struct proc* io_next; /* The next process waiting in the io queue*/
 	void* io_ticket; /* Optional parameter for some io operations */
 
 	/** SIGNAL stuff */
@@ -126,6 +187,9 @@ struct proc
 	int wait_options; /* Parent wait options (waitpid) */
 	int status_changed; /* Set by child, if set parent might wakeup */
 	struct proc* parent; /* The process that spawned this process */
+	struct proc* children; /* The first child of this process */
+	struct proc* sibling_next; /* The next child of our parent */
+	struct proc* sibling_prev; /* The previous child of our parent */
 	char name[MAX_PROC_NAME]; /* The name of the process */
 	char cwd[MAX_PATH_LEN]; /* Current working directory */
 
@@ -140,31 +204,79 @@ struct proc
 	uintptr_t code_start; /* Start of the code area */
 	uintptr_t code_end; /* end of the code area */
 	pgdir_t* pgdir; /* The page directory for the process */
+	struct vm_area_table vm_areas; /* Areas that are paged in on demand */
 	int* sys_esp; /* Pointer to the start of the syscall argv */
 	context_t k_stack; /* A pointer to the kernel stack for this process. */
 	struct task_segment* tss; /* The task segment for this process */
 	struct trap_frame* tf; /* A pointer to the trap frame from the int.*/
+	void* fpu_state; /* Saved floating point registers (16 byte aligned) */
+	int fpu_used; /* Whether or not fpu_state has been filled in */
 	uintptr_t entry_point; /* The address of the first instruction */
 	uintptr_t context; /* The address at the top of the saved stack */
 
 	/* Resource usage */
 	int user_ticks; /* The amount of ticks spent in user mode */
 	int kernel_ticks; /* The amount of ticks spent in kernel mode */
+
+	/** Process table links */
+	struct proc* all_next; /* The next process in the process list */
+	struct proc* all_prev; /* The previous process in the process list */
+	struct proc* hash_next; /* The next process in the pid hash bucket */
 };
 
-extern struct proc ptable[];
-extern struct proc* rproc;
-extern slock_t ptable_lock;
+extern struct proc* proc_list;
+/* The process running on this cpu */
+#define rproc (cpu_this()->proc)
+extern qlock_t ptable_lock;
 extern pid_t next_pid;
 
-extern context_t k_context;
+/* The scheduler context of this cpu */
+#define k_context (cpu_this()->context)
 extern pstack_t k_stack;
 
 /**
- * Allocate a new process
+ * Allocate a new process. The process isn't visible to the rest of the
+ * system until it is linked with proc_link. Returns NULL if the process
+ * limit has been reached or there is no memory left. (lock not needed)
  */
 struct proc* alloc_proc();
 
+/**
+ * Add the process to the process list, the pid hash and the children of
+ * parent. This must be done after the pid has been set. parent may be NULL
+ * or p itself if the process has no parent. (lock required)
+ */
+void proc_link(struct proc* p, struct proc* parent);
+
+/**
+ * Unlink the process from the process table and give the process
+ * structure back to the allocator. Children of the process become
+ * orphans. (lock required)
+ */
+void free_proc(struct proc* p);
+
+/**
+ * Take the process out of the pid hash and out of the children of its
+ * parent, so that waitpid and pid lookups can't find it anymore. free_proc
+ * does this as well. (ptable lock needed)
+ */
+void proc_unlink(struct proc* p);
+
+/**
+ * Timer function for the alarm timer of a process. Sends SIGALRM to the
+ * process arg. (lock not needed)
+ */
+void proc_alarm(void* arg);
+
+/**
+ * Create a process that never leaves the kernel and starts by calling
+ * entry(arg). entry must never return. The process only has the kernel
+ * mapped, so it can't touch the memory of user processes. Returns the new
+ * process or NULL if there are no free processes. (lock not needed)
+ */
+struct proc* kproc_spawn(const char* name, void (*entry)(void* arg),
+		void* arg);
+
 /**
  * Initilize all of the variables needed for scheduling. (lock not needed)
  */
@@ -177,10 +289,21 @@ void sched_init();
 struct proc* get_proc_pid(int pid);
 
 /**
- * Initilize a fdtab. This zeros all entries in the table.
+ * Initilize the file descriptor allocator.
+ */
+void fd_init(void);
+
+/**
+ * Initilize an empty fdtab with FD_TABLE_MIN slots.
  */
 void fdtab_init(fdtab_t tab);
 
+/**
+ * Give back the slots of a fdtab that has grown. The table has to be
+ * empty (see fd_tab_free).
+ */
+void fdtab_destroy(fdtab_t tab);
+
 /**
  * Free the given file descriptor for the given process. This will clear the
  * fd table entry.
@@ -194,9 +317,10 @@ void fd_free(struct proc* p, int fd);
 int fd_tab_free(struct proc* p);
 
 /**
- * Allocate a new file descriptor for a process. The result will be at pos
- * or after. If there is an error, -1 is returned. 0 is a valid file
- * descriptor.
+ * Allocate a new file descriptor for a process. The result is the lowest
+ * free fd at pos or after, the table grows if needed. If there is an
+ * error or the soft limit would be exceeded, -1 is returned. 0 is a valid
+ * file descriptor.
  */
 int fd_next_at(struct proc* p, int pos);
 
@@ -206,6 +330,19 @@ int fd_next_at(struct proc* p, int pos);
  */
 #define fd_next(process) fd_next_at(process, 0)
 
+/**
+ * Put the open file descriptor file into the table of p at index. There
+ * must not be a file descriptor at index yet. The reference count of file
+ * is not changed. Returns 0 on success, -1 if index is over the limit.
+ */
+int fd_install(struct proc* p, int index, struct file_descriptor* file);
+
+/**
+ * Get the lowest fd at pos or after that is in use. Returns -1 if there
+ * are no more file descriptors in use.
+ */
+int fd_next_used(struct proc* p, int pos);
+
 /**
  * Make dst and src share the same fdtab. Dst's fdtab will now point to
  * src's fd tab. Returns 0 on success, nonzero otherwise.
@@ -214,8 +351,9 @@ int fd_tab_map(struct proc* dst, struct proc* src);
 
 /**
  * Copy src's fdtab into dst's fdtab. All of the file descriptors in
- * dst's table are freed before they are overwritten. returns 0 on
- * success, nonzero otherwise.
+ * dst's table are freed before they are overwritten. The references of
+ * the inodes and pipes behind the descriptors are taken as well. returns
+ * 0 on success, nonzero otherwise.
  */
 int fd_tab_copy(struct proc* dst, struct proc* src);
 
@@ -239,6 +377,49 @@ void fd_print_table(void);
  */
 extern void wake_parent(struct proc* p);
 
+/**
+ * Put the process at the back of its run queue. The state of the process
+ * must already be PROC_RUNNABLE or PROC_READY. Does nothing if the process
+ * is already queued. (lock not needed)
+ */
+void sched_enqueue(struct proc* p);
+
+/**
+ * Take the process out of its run queue. This must be done before the
+ * process slot is reused. (lock not needed)
+ */
+void sched_dequeue(struct proc* p);
+
+/**
+ * The process is about to be woken up after waiting on an interactive
+ * device like a keyboard or a pipe. If the process hasn't been using much
+ * cpu time lately, it will run before the cpu bound processes the next time
+ * it is enqueued. (lock not needed)
+ */
+void sched_boost(struct proc* p);
+
+/**
+ * Change the nice value of a process. The value gets clamped to the range
+ * SCHED_NICE_MIN to SCHED_NICE_MAX. If the process is queued, it moves to
+ * the queue for its new priority. (lock required)
+ */
+void sched_set_nice(struct proc* p, int nice);
+
+/**
+ * Charge ticks timer ticks to the running process. Returns 1 if the running
+ * process has used up its time slice while other processes are waiting or
+ * if a process with a higher priority is waiting for the cpu, 0 otherwise.
+ * (lock not needed)
+ */
+int sched_tick(int ticks);
+
+/**
+ * Set the clock to interrupt the running process when its time slice is
+ * over. The clock is left alone as long as no other process is waiting for
+ * the cpu. (lock not needed)
+ */
+void sched_arm_clock(void);
+
 /**
  * Surrender a scheduling round.
  */
@@ -1,6 +1,25 @@
 #ifndef _STDLOCK_H_
 #define _STDLOCK_H_
 
+/* Collect statistics for the locks that have been given a name */
+// #define LOCK_STATS
+
+/* Keep the compiler from moving memory accesses across this point */
+#define lock_barrier() asm volatile("" ::: "memory")
+
+/**
+ * Statistics for a single named lock. Times are in cpu cycles.
+ */
+struct lock_stats
+{
+	const char* name; /* The name of the lock */
+	unsigned int acquisitions; /* How many times was the lock acquired? */
+	unsigned int contended; /* How many acquisitions had to wait? */
+	unsigned int spins; /* How many times did waiters check the lock? */
+	unsigned int hold_start; /* When the lock was acquired last */
+	unsigned int max_hold; /* The longest the lock has been held */
+};
+
 struct cond
 {
 	int next_signal;
@@ -10,17 +29,39 @@ typedef struct cond cond_t;
 
 struct slock
 {
-	int val;
+	volatile int val;
+	struct lock_stats* stats; /* Statistics if the lock has a name */
 };
 typedef struct slock slock_t;
 
 struct tlock
 {
-        int next_ticket;
-	int currently_serving;
+	volatile int next_ticket;
+	volatile int currently_serving;
+	struct lock_stats* stats; /* Statistics if the lock has a name */
 };
 typedef struct tlock tlock_t;
 
+/**
+ * Waiters on a queued lock each spin on their own node, the holder passes
+ * the lock on to the node that is next in line. This keeps busy locks fair
+ * and keeps waiters from fighting over the cache line of the lock.
+ */
+struct qlock_node
+{
+	volatile int locked; /* Set while the owner of this node waits */
+	struct qlock_node* volatile next; /* The node waiting behind us */
+	volatile int used; /* Is this node being used by a lock? */
+};
+
+struct qlock
+{
+	struct qlock_node* volatile tail; /* The last node in line */
+	struct qlock_node* owner; /* The node of the current holder */
+	struct lock_stats* stats; /* Statistics if the lock has a name */
+};
+typedef struct qlock qlock_t;
+
 /**
  * Initilize the spin lock.
  */
@@ -51,6 +92,58 @@ void tlock_acquire(tlock_t* lock);
  */
 void tlock_release(tlock_t* lock);
 
+/**
+ * Initilize the queued lock.
+ */
+void qlock_init(qlock_t* lock);
+
+/**
+ * Acquire the queued lock. Waiters get the lock in the order they arrived.
+ */
+void qlock_acquire(qlock_t* lock);
+
+/**
+ * Release the queued lock. This doesn't have to happen in the same context
+ * that acquired the lock.
+ */
+void qlock_release(qlock_t* lock);
+
+/**
+ * Returns 1 if the running cpu holds the queued lock, 0 otherwise.
+ */
+int qlock_held(qlock_t* lock);
+
+/**
+ * Give the lock a name so that statistics get collected for it. This must
+ * be called after the lock has been initilized. Does nothing if lock
+ * statistics are disabled.
+ */
+void slock_name(slock_t* lock, const char* name);
+void tlock_name(tlock_t* lock, const char* name);
+void qlock_name(qlock_t* lock, const char* name);
+
+/**
+ * Print the statistics of all named locks.
+ */
+void lock_stats_print(void);
+
+/**
+ * Returns a time stamp in cpu cycles for the lock statistics.
+ */
+unsigned int lock_timestamp(void);
+
+/**
+ * Update the statistics of a lock that has just been acquired after spins
+ * checks of the lock. stats may be NULL.
+ */
+void lock_stats_acquired(struct lock_stats* stats, int spins);
+
+/**
+ * Update the statistics of a lock that is about to be released. stats may
+ * be NULL.
+ */
+void lock_stats_released(struct lock_stats* stats);
+
 /**
  * Initilize a condition variable (non-broadcast).
  */    
@@ -4,8 +4,8 @@
 /* syscall utility functions */
 
 /**
- * Checks whether or not the pointer points to a valid byte in memory.
- * Returns 0 if the address is ok, 1 otherwise.
+ * Checks whether or not the pointer points to a valid byte in user memory,
+ * paging it in if needed. Returns 0 if the address is ok, 1 otherwise.
  */
 int syscall_addr_safe(void* address);
 
@@ -44,6 +44,26 @@ int syscall_get_str(char* dst, int sz_kern, int arg_num);
  */
 int syscall_get_buffer_ptr(void** ptr, int sz, int arg_num);
 
+/**
+ * Make sure every page of the user buffer can be read, paging it in if it
+ * isn't there yet. Returns 0 if the buffer is ok, 1 otherwise.
+ */
+int syscall_buffer_safe(const void* buff, size_t sz);
+
+/**
+ * Puts a pointer to a buffer the kernel is going to write into ptr. Like
+ * syscall_get_buffer_ptr, but every page must also be writable. Returns 0
+ * on sucess, 1 otherwise.
+ */
+int syscall_get_output_ptr(void** ptr, int sz, int arg_num);
+
+/**
+ * Make sure every page of the user buffer can be written, paging it in
+ * and breaking copy on write if needed. Returns 0 if the buffer is ok, 1
+ * otherwise.
+ */
+int syscall_buffer_writable(void* buff, size_t sz);
+
 /**
  * Get a pointer to a list of pointers. The pointer addresses are NOT
  * checked for validity. Returns 0 on success, 1 otherwise.
@@ -58,16 +78,42 @@ int syscall_get_buffer_ptrs(void*** ptr, int arg_num);
  */
 int syscall_get_str_ptr(const char** dst, int arg_num);
 
+struct iovec;
+
 /**
- * Probe an argument on the stack. If the pointer is reachable
- * and non zero, 0 is returned. Otherwise 1 is returned and
- * ptr is undefined.
+ * Copy an array of cnt iovecs from the user stack into dst and page in
+ * every buffer it describes. cnt must be between 0 and IOV_MAX. If write
+ * is set, the buffers must be writable. The total length of the buffers is
+ * put into total. Returns 0 on success, 1 otherwise.
+ */
+int syscall_get_iovec(struct iovec* dst, int cnt, size_t* total,
+		int arg_num, int write);
+
+/**
+ * Get a pointer argument that is allowed to be NULL. The memory it points
+ * to is NOT checked. Returns 0 on success, 1 if the argument couldn't be
+ * read.
  */
 int syscall_get_optional_ptr(void** ptr, int arg_num);
 
 /* Check to see if an fd is valid */
 int fd_ok(int fd);
 
+struct proc;
+
+/**
+ * Close the file descriptor fd of the process p, which doesn't have to be
+ * the running process. Returns 0 on success, -1 if fd isn't open.
+ */
+int fd_close(struct proc* p, int fd);
+
+/**
+ * Drop the I/O batch ring of the process p. Jobs that the worker hasn't
+ * finished yet are thrown away once they are done. (ptable lock must not
+ * be held)
+ */
+void iobatch_release(struct proc* p);
+
 /**
  * Find an available file descriptor that is > val
  */
@@ -168,10 +214,31 @@ int sys_sync(void);
 int sys_setreuid(void);
 int sys_setregid(void);
 int sys_reboot(void);
+int sys_nice(void);
+int sys_getpriority(void);
+int sys_setpriority(void);
+int sys_nanosleep(void);
+int sys_clock_gettime(void);
+int sys_readv(void);
+int sys_writev(void);
+int sys_preadv(void);
+int sys_pwritev(void);
+int sys_sendfile(void);
+int sys_splice(void);
+int sys_poll(void);
+int sys_event_create(void);
+int sys_event_ctl(void);
+int sys_event_wait(void);
+int sys_getrlimit(void);
+int sys_setrlimit(void);
+int sys_iobatch_setup(void);
+int sys_iobatch_enter(void);
+int sys_trace_ctl(void);
+int sys_trace_read(void);
 
 #include <chronos.h>
 
 #define SYS_MIN SYS_fork /* System call with the smallest value */
-#define SYS_MAX SYS_reboot /* System call with the greatest value*/
+#define SYS_MAX SYS_trace_read /* System call with the greatest value*/
 
 #endif
@@ -0,0 +1,39 @@
+#ifndef _SYSTRACE_H_
+#define _SYSTRACE_H_
+
+#include "chronos.h"
+
+struct proc;
+struct IODevice;
+
+/**
+ * Initilize the /dev/syscallstats device. Reading the device gives one
+ * struct syscall_stat per system call number, writing to it clears the
+ * statistics.
+ */
+int syscall_stats_init(struct IODevice* device);
+
+/**
+ * Account for a system call that took cycles cpu cycles and returned
+ * result.
+ */
+void syscall_stats_add(int num, unsigned int cycles, int result);
+
+/**
+ * Start a trace event for the system call num if the running process is
+ * being traced. The arguments are recorded now because the call might
+ * replace the user stack. Returns 1 if the call is traced, 0 otherwise.
+ */
+int trace_begin(struct trace_event* event, int num);
+
+/**
+ * Finish the event and put it into the trace ring of the running process.
+ */
+void trace_end(struct trace_event* event, unsigned int cycles, int result);
+
+/**
+ * Free the trace ring of the process, if it has one. (ptable lock needed)
+ */
+void trace_free(struct proc* p);
+
+#endif
@@ -75,6 +75,8 @@
 #include <sys/ioctl.h>
 #include <termios.h>
 #include "klog.h"
+#include "waitqueue.h"
+#include "kpoll.h"
 
 struct IODriver;
 struct proc;
@@ -133,8 +135,8 @@ struct tty
 	slock_t key_lock; /* The lock needed in order to read from keybaord */
 
 	struct IODevice* driver; /* driver for standard in/out */
-	slock_t io_queue_lock; /* Lock needed to touch the io queue */
-	struct proc* io_queue; /* Process currently waiting for io */
+	waitqueue_t io_wait; /* Processes waiting for keyboard input */
+	struct poll_source poll; /* Event sets watching for input */
 
 	/* Terminal operating settings */
 	struct termios term;
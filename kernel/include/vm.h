@@ -97,6 +97,7 @@
 #define VM_TBL_WRIT 0x0100 /* Mark the page as writable */
 #define VM_TBL_PRES 0x0200 /* Mark the page as present */
 #define VM_TBL_EXEC 0x0400 /* Mark the page as executable */
+#define VM_TBL_FILE 0x4000 /* The page belongs to the storage cache */
 
 #ifdef __ALLOW_VM_SHARE__
 #define VM_TBL_SHAR 0x1000 /* Mark the page as shared */
@@ -200,7 +201,8 @@ extern int vm_pgsreadonly(vmpage_t start, vmpage_t end, pgdir_t* dir);
 extern void freepgdir(pgdir_t* dir);
 
 /**
- * Copy the kernel portion of the page table
+ * Copy the kernel portion of the page table. Most of the kernel page
+ * tables are shared, only the stack mappings are copied.
  */
 extern int vm_copy_kvm(pgdir_t* dir);
 
@@ -248,12 +250,185 @@ extern size_t vm_memmove(void* dst, const void* src, size_t sz,
                 pgdir_t* dst_pgdir, pgdir_t* src_pgdir,
                 vmflags_t dir_flags, vmflags_t tbl_flags);
 
+/**
+ * Copy sz bytes from the user address src in the running process into
+ * dst. Pages that aren't there yet get paged in. Returns 0 on success, -1
+ * if any part of src isn't accessible user memory.
+ */
+extern int copy_from_user(void* dst, const void* src, size_t sz);
+
+/**
+ * Copy sz bytes from src into the user address dst in the running process.
+ * Returns 0 on success, -1 if any part of dst isn't writable user memory.
+ */
+extern int copy_to_user(void* dst, const void* src, size_t sz);
+
+/**
+ * Copy the string at the user address src into dst, copying at most sz
+ * bytes including the terminator. Returns the length of the string, sz if
+ * it didn't fit or -1 if the string isn't accessible user memory.
+ */
+extern int strncpy_from_user(char* dst, const char* src, size_t sz);
+
+/**
+ * Returns the length of the string at the user address str, looking at
+ * most at sz bytes. Returns sz if there is no terminator in the first sz
+ * bytes or -1 if the string isn't accessible user memory.
+ */
+extern int strnlen_user(const char* str, size_t sz);
+
 /**
  * Free the directory and page table struct  but none of the pages pointed to 
  * by the tables.
  */
 extern void vm_freepgdir_struct(pgdir_t* dir);
 
+/** Virtual memory areas */
+
+/* Types of virtual memory areas */
+#define VM_AREA_ANON	0x01 /* Pages are zero filled on first touch */
+#define VM_AREA_FILE	0x02 /* Pages are read from an inode on first touch */
+
+/* Area flags */
+#define VM_AREA_SHARED	0x01 /* Changes are written back to the file */
+
+#define VM_AREA_MAX	0x40 /* Maximum amount of areas in an area table */
+#define VM_AREA_PIN_MAX	0x0C /* Maximum amount of pinned cache pages */
+
+struct inode_t;
+
+/**
+ * A range of user memory that isn't populated until it is touched. File
+ * backed areas copy [data_start, data_end) from the inode starting at
+ * offset, everything else in the area is zero filled. Shared file areas
+ * map storage cache pages directly when they can.
+ */
+struct vm_area
+{
+	int type; /* The type of area (see above) */
+	int flags; /* Area flags (see above) */
+	uintptr_t start; /* The first page of the area */
+	uintptr_t end; /* The page after the last page in the area */
+	vmflags_t dir_flags; /* Directory flags to use when populating */
+	vmflags_t tbl_flags; /* Table flags to use when populating */
+	struct inode_t* ino; /* The inode backing this area (file only) */
+	uintptr_t data_start; /* Where the file contents start in memory */
+	uintptr_t data_end; /* Where the file contents end in memory */
+	uint32_t offset; /* The offset in the file of data_start */
+};
+
+/**
+ * The areas in a table are kept sorted by address and never overlap.
+ */
+struct vm_area_table
+{
+	int count; /* The amount of areas in the table */
+	struct vm_area areas[VM_AREA_MAX];
+};
+
+/**
+ * Clear the area table. This does not release any references.
+ */
+extern void vm_area_init(struct vm_area_table* table);
+
+/**
+ * Add a copy of the area to the table. If the area continues an area
+ * right next to it, that area grows instead. Otherwise, if the area is
+ * file backed, a reference to the inode is taken. Returns 0 on success, -1
+ * if the table is full or if the area overlaps with another area.
+ */
+extern int vm_area_add(struct vm_area_table* table, struct vm_area* area);
+
+/**
+ * Find the area that contains the given address. Returns NULL if the
+ * address is not in any area.
+ */
+extern struct vm_area* vm_area_find(struct vm_area_table* table,
+		uintptr_t address);
+
+/**
+ * Make sure that no area crosses the page boundary at address. Returns 0
+ * on success, -1 if the table is full.
+ */
+extern int vm_area_split(struct vm_area_table* table, uintptr_t address);
+
+/**
+ * Remove every area (or part of an area) from start to end. This does not
+ * unmap any pages. Returns 0 on success, -1 if the table is full.
+ */
+extern int vm_area_remove(struct vm_area_table* table, uintptr_t start,
+		uintptr_t end);
+
+/**
+ * Move the areas (or parts of areas) from start to end out of the table
+ * into dst, at most max of them. The inode references move with the
+ * areas, nothing is written back or unmapped. This doesn't sleep so it
+ * can be done with the memory lock held. Returns the amount of areas
+ * moved, -1 if the table is full.
+ */
+extern int vm_area_detach(struct vm_area_table* table, uintptr_t start,
+		uintptr_t end, struct vm_area* dst, int max);
+
+/**
+ * Change the table flags of every area from start to end. This does not
+ * change the flags of pages that are already mapped. Returns 0 on success,
+ * -1 if the table is full.
+ */
+extern int vm_area_protect(struct vm_area_table* table, uintptr_t start,
+		uintptr_t end, vmflags_t tbl_flags);
+
+/**
+ * Find the highest range of sz bytes between low and high that isn't used
+ * by any area. Returns the start of the range, 0 if there isn't enough space.
+ */
+extern uintptr_t vm_area_find_space(struct vm_area_table* table,
+		uintptr_t low, uintptr_t high, size_t sz);
+
+/**
+ * Populate the page that contains address. dir must be the page directory
+ * that is currently in use. Returns 0 if the page was populated, 1 if
+ * the address isn't in an area or the page could not be populated.
+ */
+extern int vm_area_fault(struct vm_area_table* table, uintptr_t address,
+		pgdir_t* dir);
+
+/**
+ * Populate every page from start to start + sz that hasn't been touched
+ * yet. dir must be the page directory that is currently in use. Returns
+ * 0 on success, 1 on failure.
+ */
+extern int vm_area_prefault(struct vm_area_table* table, uintptr_t start,
+		size_t sz, pgdir_t* dir);
+
+/**
+ * Take another reference to every inode in the table. This should be
+ * called after the table has been copied into a new process.
+ */
+extern void vm_area_dup(struct vm_area_table* table);
+
+/**
+ * Detach every page from start to end in dir from the file that backs it.
+ * Dirty pages in shared areas are written back to the file and storage
+ * cache pages are unmapped and released. Private pages stay mapped.
+ */
+extern void vm_area_release(struct vm_area_table* table, uintptr_t start,
+		uintptr_t end, pgdir_t* dir);
+
+/**
+ * Release an area that was detached from its table. If dir is not NULL,
+ * the pages of the area are released from dir first (see vm_area_release).
+ * The inode reference is dropped. This can sleep, so no spin locks may be
+ * held.
+ */
+extern void vm_area_put(struct vm_area* area, pgdir_t* dir);
+
+/**
+ * Release all areas in the table. If dir is not NULL, the pages of the
+ * areas are released from dir first (see vm_area_release). This does not
+ * free any private pages.
+ */
+extern void vm_area_free(struct vm_area_table* table, pgdir_t* dir);
+
 /** Memory debugging functions */
 
 /**
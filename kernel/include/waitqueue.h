@@ -0,0 +1,105 @@
+#ifndef _WAITQUEUE_H_
+#define _WAITQUEUE_H_
+
+#include "stdlock.h"
+
+/* Wait queue flags */
+#define WAITQUEUE_INTERACTIVE 0x01 /* Boost the priority of woken processes */
+
+struct proc;
+
+/**
+ * A list of processes that are blocked on the same event. The list is
+ * threaded through the processes themselves so a process can only wait in
+ * one queue at a time. A zeroed wait queue is a valid, empty wait queue.
+ */
+struct waitqueue
+{
+	slock_t lock; /* Lock needed to touch the queue */
+	int flags; /* Wait queue flags (see above) */
+	struct proc* head; /* The process that has been waiting the longest */
+	struct proc* tail; /* The process that started waiting last */
+};
+typedef struct waitqueue waitqueue_t;
+
+/**
+ * Initilize an empty wait queue with the given flags.
+ */
+void waitqueue_init(waitqueue_t* q, int flags);
+
+/**
+ * Put the process at the back of the wait queue. This does not change the
+ * state of the process.
+ */
+void waitqueue_add(waitqueue_t* q, struct proc* p);
+
+/**
+ * Take the process out of the wait queue it is in. Does nothing if the
+ * process isn't waiting in a queue.
+ */
+void waitqueue_remove(struct proc* p);
+
+/**
+ * Returns the process that has been waiting in the queue the longest
+ * without removing it. Returns NULL if the queue is empty.
+ */
+struct proc* waitqueue_first(waitqueue_t* q);
+
+/**
+ * Take the process out of its wait queue and make it runnable if it is
+ * still blocked.
+ */
+void waitqueue_wake_proc(struct proc* p);
+
+/**
+ * Wake up the process that has been waiting the longest. Returns the
+ * amount of processes that were woken up.
+ */
+int waitqueue_wake_one(waitqueue_t* q);
+
+/**
+ * Wake up every process in the queue. Returns the amount of processes that
+ * were woken up.
+ */
+int waitqueue_wake_all(waitqueue_t* q);
+
+/**
+ * Wake up the processes in the queue for which match returns nonzero, in
+ * the order they started waiting. At most max processes are woken up, or
+ * all of them if max is 0. Returns the amount of processes that were woken
+ * up. match must not touch the queue.
+ */
+int waitqueue_wake_if(waitqueue_t* q, int (*match)(struct proc* p, void* arg),
+		void* arg, int max);
+
+/**
+ * Block the running process in the wait queue until it gets woken up. If
+ * lock is not NULL, it is released while the process is blocked and is
+ * held again when this returns. The process is never in the queue anymore
+ * when this returns, even if a signal woke it up. (ptable lock not needed)
+ */
+void waitqueue_sleep(waitqueue_t* q, int block_type, slock_t* lock);
+
+/**
+ * The first half of waitqueue_sleep: mark the running process as blocked
+ * and put it into the wait queue, but don't give up the cpu yet. Anything
+ * that can wake the process, like a timer, has to be set up after this or
+ * the wakeup can get lost. (ptable lock not needed)
+ */
+void waitqueue_prepare(waitqueue_t* q, int block_type);
+
+/**
+ * The second half of waitqueue_sleep: release lock if it is not NULL and
+ * give up the cpu until the process is woken up. The process is never in
+ * a queue anymore when this returns and lock is held again.
+ * (ptable lock not needed)
+ */
+void waitqueue_block(slock_t* lock);
+
+/**
+ * Same as waitqueue_sleep, but for a caller that holds the ptable lock. The
+ * ptable lock is held again when this returns. (ptable lock required)
+ */
+void waitqueue_sleep_ptable(waitqueue_t* q, int block_type);
+
+#endif
@@ -0,0 +1,528 @@
+/**
+ * Readiness notifications for poll and event sets. Instead of asking every
+ * file descriptor whether or not it is ready on every tick, the things
+ * that can become ready (ttys, pipes) keep a list of the event sets that
+ * are watching them. When a source changes, it puts the watch onto the
+ * ready list of its set and wakes up the set's waiters. A waiter only has
+ * to check the watches on the ready list, so waking up costs as much as
+ * the amount of file descriptors that had something happen to them.
+ *
+ * The ready list is level triggered: a watch that is still ready after it
+ * was reported stays on the list until a check finds it not ready anymore.
+ * Descriptors without a source (files, devices that don't notify) are put
+ * on the ready list on every tick.
+ *
+ * Lock order: source lock (and anything held by the notifier, like a pipe
+ * guard) -> set lock -> wait queue lock. Readiness is never checked with
+ * the set lock held.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "kstdlib.h"
+#include "stdlock.h"
+#include "kpoll.h"
+#include "proc.h"
+#include "pipe.h"
+#include "devman.h"
+#include "vm.h"
+#include "ktimer.h"
+
+// #define DEBUG
+
+/* Events that are always reported, even if they weren't asked for */
+#define POLL_ALWAYS (POLLERR | POLLHUP)
+
+/* How many watches fit into one watch page */
+#define EVENT_PAGE_WATCHES \
+	((PGSIZE - sizeof(struct poll_watch_page)) / sizeof(struct poll_watch))
+
+void poll_source_init(struct poll_source* src)
+{
+	slock_init(&src->lock);
+	src->watches = NULL;
+}
+
+/**
+ * Put the watch on the ready list of its set. (set lock required)
+ */
+static void event_set_ready(struct event_set* set, struct poll_watch* w)
+{
+	if(w->ready) return;
+	w->ready = 1;
+	w->ready_next = set->ready;
+	set->ready = w;
+}
+
+/**
+ * Take the watch off of the ready list of its set. (set lock required)
+ */
+static void event_set_unready(struct event_set* set, struct poll_watch* w)
+{
+	if(!w->ready) return;
+
+	struct poll_watch** pp = &set->ready;
+	while(*pp && *pp != w) pp = &(*pp)->ready_next;
+	if(*pp) *pp = w->ready_next;
+
+	w->ready = 0;
+	w->ready_next = NULL;
+}
+
+void poll_notify(struct poll_source* src, int events)
+{
+	slock_acquire(&src->lock);
+	struct poll_watch* w;
+	for(w = src->watches;w;w = w->src_next)
+	{
+		if(!(events & (w->events | POLL_ALWAYS)))
+			continue;
+
+		struct event_set* set = w->set;
+		slock_acquire(&set->lock);
+		event_set_ready(set, w);
+		slock_release(&set->lock);
+		waitqueue_wake_all(&set->waiters);
+	}
+	slock_release(&src->lock);
+}
+
+void poll_source_detach(struct poll_source* src)
+{
+	slock_acquire(&src->lock);
+	while(src->watches)
+	{
+		struct poll_watch* w = src->watches;
+		src->watches = w->src_next;
+		w->source = NULL;
+		w->src_next = NULL;
+		w->src_prev = NULL;
+
+		/* The waiter will find out that the fd is gone */
+		struct event_set* set = w->set;
+		slock_acquire(&set->lock);
+		event_set_ready(set, w);
+		slock_release(&set->lock);
+		waitqueue_wake_all(&set->waiters);
+	}
+	slock_release(&src->lock);
+}
+
+/**
+ * Put the watch on the watch list of the source.
+ */
+static void poll_watch_attach(struct poll_watch* w, struct poll_source* src)
+{
+	slock_acquire(&src->lock);
+	w->source = src;
+	w->src_prev = NULL;
+	w->src_next = src->watches;
+	if(src->watches) src->watches->src_prev = w;
+	src->watches = w;
+	slock_release(&src->lock);
+}
+
+/**
+ * Take the watch off of the watch list of its source, if it still has one.
+ */
+static void poll_watch_detach(struct poll_watch* w)
+{
+	struct poll_source* src = w->source;
+	if(!src) return;
+
+	slock_acquire(&src->lock);
+	/* The source might have been detached while we weren't looking */
+	if(w->source == src)
+	{
+		if(w->src_prev) w->src_prev->src_next = w->src_next;
+		else src->watches = w->src_next;
+		if(w->src_next) w->src_next->src_prev = w->src_prev;
+		w->source = NULL;
+		w->src_next = NULL;
+		w->src_prev = NULL;
+	}
+	slock_release(&src->lock);
+}
+
+/**
+ * Get the source that notifies about changes to the file descriptor.
+ * Returns NULL if the descriptor has to be checked on every tick.
+ */
+static struct poll_source* poll_fd_source(struct file_descriptor* fd)
+{
+	switch(fd->type)
+	{
+		case FD_TYPE_DEVICE:
+			return fd->device->poll;
+		case FD_TYPE_PIPE:
+			return &fd->pipe->poll;
+		default:
+			return NULL;
+	}
+}
+
+int poll_fd(struct file_descriptor* fd)
+{
+	int events = 0;
+	switch(fd->type)
+	{
+		case FD_TYPE_FILE:
+			/* Files never block */
+			events = POLLIN | POLLOUT;
+			break;
+		case FD_TYPE_DEVICE:
+			/* Devices that can't tell never block */
+			if(!fd->device->ready_read
+				|| fd->device->ready_read(fd->device->context))
+				events |= POLLIN;
+			if(!fd->device->ready_write
+				|| fd->device->ready_write(fd->device->context))
+				events |= POLLOUT;
+			break;
+		case FD_TYPE_PIPE:
+			events = pipe_poll(fd->pipe,
+				fd->pipe_type == FD_PIPE_MODE_WRITE);
+			break;
+		default:
+			events = POLLNVAL;
+			break;
+	}
+
+	return events;
+}
+
+/**
+ * Check to see if the fd of the watch still points to the descriptor it
+ * had when it was added. Returns 1 if the watch is stale.
+ */
+static int poll_watch_stale(struct poll_watch* w)
+{
+	if(w->fd < 0 || w->fd >= rproc->fdtab->size) return 1;
+	if(rproc->fdtab->fds[w->fd] != w->file) return 1;
+	if(!w->file->type) return 1;
+	return 0;
+}
+
+struct event_set* event_set_alloc(void)
+{
+	struct event_set* set = (struct event_set*)palloc();
+	if(!set) return NULL;
+	memset(set, 0, sizeof(struct event_set));
+
+	slock_init(&set->lock);
+	kmutex_init(&set->ctl);
+	waitqueue_init(&set->waiters, WAITQUEUE_INTERACTIVE);
+
+	return set;
+}
+
+/**
+ * Stop watching, the watch slot can be used again. (ctl required)
+ */
+static void event_set_drop(struct event_set* set, struct poll_watch* w)
+{
+	poll_watch_detach(w);
+	if(w->polled) set->unsourced--;
+
+	slock_acquire(&set->lock);
+	event_set_unready(set, w);
+	w->used = 0;
+	slock_release(&set->lock);
+}
+
+void event_set_free(struct event_set* set)
+{
+	kmutex_lock(&set->ctl);
+	while(set->pages)
+	{
+		struct poll_watch_page* page = set->pages;
+		int x;
+		for(x = 0;x < EVENT_PAGE_WATCHES;x++)
+		{
+			if(page->watches[x].used)
+				event_set_drop(set, page->watches + x);
+		}
+
+		set->pages = page->next;
+		pfree((pypage_t)page);
+	}
+	kmutex_unlock(&set->ctl);
+
+	pfree((pypage_t)set);
+}
+
+/**
+ * Find the watch for fd in the set. Returns NULL if fd isn't watched.
+ * (ctl required)
+ */
+static struct poll_watch* event_set_find(struct event_set* set, int fd)
+{
+	struct poll_watch_page* page;
+	for(page = set->pages;page;page = page->next)
+	{
+		int x;
+		for(x = 0;x < EVENT_PAGE_WATCHES;x++)
+		{
+			if(page->watches[x].used && page->watches[x].fd == fd)
+				return page->watches + x;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Find a watch that isn't in use, adding a page of watches to the set if
+ * they are all taken. Returns NULL if there is no memory left.
+ * (ctl required)
+ */
+static struct poll_watch* event_set_free_watch(struct event_set* set)
+{
+	struct poll_watch_page* page;
+	for(page = set->pages;page;page = page->next)
+	{
+		int x;
+		for(x = 0;x < EVENT_PAGE_WATCHES;x++)
+		{
+			if(!page->watches[x].used)
+				return page->watches + x;
+		}
+	}
+
+	page = (struct poll_watch_page*)palloc();
+	if(!page) return NULL;
+	memset(page, 0, PGSIZE);
+	page->next = set->pages;
+	set->pages = page;
+
+	return page->watches;
+}
+
+/**
+ * The file descriptor might already be ready, check it now because the
+ * source only tells us about changes. (ctl required)
+ */
+static void event_set_check(struct event_set* set, struct poll_watch* w)
+{
+	if(!(poll_fd(w->file) & (w->events | POLL_ALWAYS)))
+		return;
+
+	slock_acquire(&set->lock);
+	event_set_ready(set, w);
+	slock_release(&set->lock);
+	waitqueue_wake_all(&set->waiters);
+}
+
+int event_set_add(struct event_set* set, int fd, int events, void* data,
+		int dup)
+{
+	if(fd < 0 || fd >= rproc->fdtab->size) return -1;
+	struct file_descriptor* file = rproc->fdtab->fds[fd];
+	if(!file || !file->type) return -1;
+
+	/* Event sets can't watch each other */
+	if(file->type == FD_TYPE_EVENT) return -1;
+
+	kmutex_lock(&set->ctl);
+	if(!dup && event_set_find(set, fd))
+	{
+		kmutex_unlock(&set->ctl);
+		return -1;
+	}
+
+	struct poll_watch* w = event_set_free_watch(set);
+	if(!w)
+	{
+		kmutex_unlock(&set->ctl);
+		return -1;
+	}
+
+	memset(w, 0, sizeof(struct poll_watch));
+	w->used = 1;
+	w->fd = fd;
+	w->file = file;
+	w->events = events;
+	w->data = data;
+	w->set = set;
+
+	struct poll_source* src = poll_fd_source(file);
+	if(src) poll_watch_attach(w, src);
+	else {
+		w->polled = 1;
+		set->unsourced++;
+	}
+
+	event_set_check(set, w);
+	kmutex_unlock(&set->ctl);
+
+#ifdef DEBUG
+	cprintf("%s:%d: watching fd %d for 0x%x (%s)\n",
+		rproc->name, rproc->pid, fd, events,
+		src ? "notified" : "polled");
+#endif
+
+	return 0;
+}
+
+int event_set_mod(struct event_set* set, int fd, int events, void* data)
+{
+	kmutex_lock(&set->ctl);
+	struct poll_watch* w = event_set_find(set, fd);
+	if(!w)
+	{
+		kmutex_unlock(&set->ctl);
+		return -1;
+	}
+
+	w->events = events;
+	w->data = data;
+	if(!poll_watch_stale(w))
+		event_set_check(set, w);
+	kmutex_unlock(&set->ctl);
+
+	return 0;
+}
+
+int event_set_del(struct event_set* set, int fd)
+{
+	kmutex_lock(&set->ctl);
+	struct poll_watch* w = event_set_find(set, fd);
+	if(w) event_set_drop(set, w);
+	kmutex_unlock(&set->ctl);
+
+	if(!w) return -1;
+	return 0;
+}
+
+/**
+ * Check the watches on the ready list and report the ones that are still
+ * ready. Returns the amount of events put into dst. (ctl required)
+ */
+static int event_set_collect(struct event_set* set, struct event* dst,
+		int max)
+{
+	/* Descriptors without a source have to be checked every time */
+	slock_acquire(&set->lock);
+	if(set->unsourced)
+	{
+		struct poll_watch_page* page;
+		for(page = set->pages;page;page = page->next)
+		{
+			int x;
+			for(x = 0;x < EVENT_PAGE_WATCHES;x++)
+			{
+				struct poll_watch* w = page->watches + x;
+				if(w->used && w->polled)
+					event_set_ready(set, w);
+			}
+		}
+	}
+
+	/**
+	 * Take the whole ready list, sources may add to it again. The
+	 * watches stay where they are, only ctl holders use check_next.
+	 */
+	struct poll_watch* check = NULL;
+	while(set->ready)
+	{
+		struct poll_watch* w = set->ready;
+		set->ready = w->ready_next;
+		w->ready = 0;
+		w->ready_next = NULL;
+		w->check_next = check;
+		check = w;
+	}
+	slock_release(&set->lock);
+
+	int found = 0;
+	while(check)
+	{
+		struct poll_watch* w = check;
+		check = w->check_next;
+		w->check_next = NULL;
+
+		/* The fd was closed or replaced */
+		if(poll_watch_stale(w))
+		{
+			event_set_drop(set, w);
+			continue;
+		}
+
+		int events = poll_fd(w->file) & (w->events | POLL_ALWAYS);
+		if(!events) continue;
+
+		if(found < max)
+		{
+			dst[found].events = events;
+			dst[found].data = w->data;
+			found++;
+		}
+
+		/* Still ready, check it again next time */
+		slock_acquire(&set->lock);
+		event_set_ready(set, w);
+		slock_release(&set->lock);
+	}
+
+	return found;
+}
+
+/**
+ * A timed out event set waiter has to be woken up.
+ */
+static void event_set_timeout(void* arg)
+{
+	waitqueue_wake_proc((struct proc*)arg);
+}
+
+int event_set_wait(struct event_set* set, struct event* dst, int max,
+		int ticks)
+{
+	uint end = ktimer_ticks() + ticks;
+	for(;;)
+	{
+		kmutex_lock(&set->ctl);
+		int found = event_set_collect(set, dst, max);
+		int polled = set->unsourced;
+		kmutex_unlock(&set->ctl);
+
+		if(found || !ticks) return found;
+
+		/* A signal interrupts the wait */
+		if(rproc->sig_queue) return -1;
+
+		int left = -1;
+		if(ticks > 0)
+		{
+			left = end - ktimer_ticks();
+			if(left <= 0) return 0;
+		}
+
+		/* Descriptors without a source are checked on the next tick */
+		if(polled && (left < 0 || left > 1))
+			left = 1;
+
+		slock_acquire(&set->lock);
+		if(set->ready)
+		{
+			/* Something happened while we were checking */
+			slock_release(&set->lock);
+			continue;
+		}
+
+		/* Be in the queue before the timer can fire */
+		struct ktimer t;
+		waitqueue_prepare(&set->waiters, PROC_BLOCKED_COND);
+		if(left > 0)
+		{
+			ktimer_setup(&t, event_set_timeout, rproc);
+			ktimer_add(&t, left);
+		}
+
+		waitqueue_block(&set->lock);
+		slock_release(&set->lock);
+
+		if(left > 0) ktimer_del(&t);
+	}
+}
@@ -0,0 +1,421 @@
+/**
+ * Timer wheel. Timers are hashed into the slots of a hierarchical wheel by
+ * their expiry tick so adding, deleting and firing a timer doesn't depend
+ * on the amount of timers that are pending. The root wheel holds the timers
+ * that fire within the next KTIMER_ROOT_SIZE ticks. Every level above it
+ * covers a span that is KTIMER_LEVEL_SIZE times longer. Whenever the root
+ * wheel has made a full turn, the next slot of the level above it is
+ * cascaded down into the lower levels.
+ *
+ * The clock doesn't interrupt on every tick. Before the cpu goes back to a
+ * process or goes idle, the clock gets set to interrupt once on the next
+ * tick that has work to do. The wheel belongs to the boot cpu, the other
+ * cpus only add and delete timers. Timer functions therefore run on the
+ * boot cpu while their owners run on other cpus, which is why ktimer_del
+ * waits for a function that is still running.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stdlock.h"
+#include "ktimer.h"
+#include "proc.h"
+#include "cpu.h"
+#include "panic.h"
+
+// #define DEBUG
+
+#define KTIMER_ROOT_BITS 8
+#define KTIMER_ROOT_SIZE (1 << KTIMER_ROOT_BITS)
+#define KTIMER_ROOT_MASK (KTIMER_ROOT_SIZE - 1)
+#define KTIMER_LEVEL_BITS 6
+#define KTIMER_LEVEL_SIZE (1 << KTIMER_LEVEL_BITS)
+#define KTIMER_LEVEL_MASK (KTIMER_LEVEL_SIZE - 1)
+#define KTIMER_LEVELS 4 /* Levels above the root, enough for 32 bits */
+
+#define NSEC_PER_SEC 1000000000
+
+static slock_t ktimer_lock;
+static struct ktimer* ktimer_root[KTIMER_ROOT_SIZE];
+static struct ktimer* ktimer_levels[KTIMER_LEVELS][KTIMER_LEVEL_SIZE];
+static uint ktimer_jiffies; /* The next tick the wheel will process */
+static struct ktimer* ktimer_running; /* The timer whose function is called */
+static int ktimer_running_cpu; /* The cpu that is calling it */
+
+/* The monotonic clock */
+static uint ktimer_sec; /* Seconds since boot */
+static uint ktimer_nsec; /* Nanoseconds into the current second */
+static uint ktimer_tick_ns; /* Nanoseconds into the current tick */
+
+/* The clock interrupt */
+static int ktimer_armed; /* Is the clock interrupt set? */
+static uint ktimer_armed_tick; /* The clock interrupts before this tick */
+
+/* Processes that are blocked in ktimer_sleep */
+static waitqueue_t ktimer_sleepers;
+
+void ktimer_init(void)
+{
+	slock_init(&ktimer_lock);
+	slock_name(&ktimer_lock, "ktimer");
+	memset(ktimer_root, 0, sizeof(ktimer_root));
+	memset(ktimer_levels, 0, sizeof(ktimer_levels));
+	ktimer_jiffies = 0;
+	ktimer_running = NULL;
+	ktimer_sec = 0;
+	ktimer_nsec = 0;
+	ktimer_tick_ns = 0;
+	ktimer_armed = 0;
+	waitqueue_init(&ktimer_sleepers, WAITQUEUE_INTERACTIVE);
+}
+
+void ktimer_setup(struct ktimer* t, ktimer_func_t func, void* arg)
+{
+	memset(t, 0, sizeof(struct ktimer));
+	t->func = func;
+	t->arg = arg;
+}
+
+/**
+ * Put the timer into the slot for its expiry tick. (timer lock required)
+ */
+static void ktimer_queue(struct ktimer* t)
+{
+	uint delta = t->expires - ktimer_jiffies;
+	struct ktimer** slot;
+
+	if((int)delta < 0)
+	{
+		/* Already expired, fire on the next tick */
+		t->expires = ktimer_jiffies;
+		slot = ktimer_root + (t->expires & KTIMER_ROOT_MASK);
+	} else if(delta < KTIMER_ROOT_SIZE)
+	{
+		slot = ktimer_root + (t->expires & KTIMER_ROOT_MASK);
+	} else {
+		int level;
+		int shift = KTIMER_ROOT_BITS;
+		for(level = 0;level < KTIMER_LEVELS - 1;level++)
+		{
+			if(delta < (1U << (shift + KTIMER_LEVEL_BITS)))
+				break;
+			shift += KTIMER_LEVEL_BITS;
+		}
+
+		slot = ktimer_levels[level]
+			+ ((t->expires >> shift) & KTIMER_LEVEL_MASK);
+	}
+
+	t->pprev = slot;
+	t->next = *slot;
+	if(t->next) t->next->pprev = &t->next;
+	*slot = t;
+}
+
+/**
+ * Take the timer out of its slot. (timer lock required)
+ */
+static void ktimer_unqueue(struct ktimer* t)
+{
+	*t->pprev = t->next;
+	if(t->next) t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+void ktimer_add(struct ktimer* t, uint ticks)
+{
+	if(ticks > KTIMER_MAX_TICKS)
+		ticks = KTIMER_MAX_TICKS;
+
+	slock_acquire(&ktimer_lock);
+	if(t->pprev) ktimer_unqueue(t);
+	t->expires = ktimer_jiffies + ticks;
+	ktimer_queue(t);
+
+	/**
+	 * Only the boot cpu sets the clock, let it know if the clock has to
+	 * interrupt earlier now.
+	 */
+	int kick = cpu_current()->id && (!ktimer_armed
+		|| (int)(t->expires - ktimer_armed_tick) < 0);
+	slock_release(&ktimer_lock);
+
+	if(kick) cpu_reschedule(cpus);
+}
+
+int ktimer_del(struct ktimer* t)
+{
+	int pending = 0;
+	slock_acquire(&ktimer_lock);
+
+	/**
+	 * If another cpu is calling the function right now, wait for it to
+	 * return. The function might add the timer again, so check again
+	 * afterwards. If this cpu is calling it, we are inside of it.
+	 */
+	while(ktimer_running == t && ktimer_running_cpu != cpu_current()->id)
+	{
+		slock_release(&ktimer_lock);
+		slock_acquire(&ktimer_lock);
+	}
+
+	if(t->pprev)
+	{
+		ktimer_unqueue(t);
+		pending = 1;
+	}
+	slock_release(&ktimer_lock);
+
+	return pending;
+}
+
+uint ktimer_remaining(struct ktimer* t)
+{
+	uint left = 0;
+	slock_acquire(&ktimer_lock);
+	if(t->pprev) left = t->expires - ktimer_jiffies + 1;
+	slock_release(&ktimer_lock);
+
+	return left;
+}
+
+/**
+ * Move all of the timers in the slot down into the lower levels.
+ * (timer lock required)
+ */
+static void ktimer_cascade(struct ktimer** slot)
+{
+	struct ktimer* t = *slot;
+	*slot = NULL;
+
+	while(t)
+	{
+		struct ktimer* next = t->next;
+		ktimer_queue(t);
+		t = next;
+	}
+}
+
+/**
+ * Turn the wheel by one tick and fire the timers that expire on it.
+ */
+static void ktimer_run(void)
+{
+	slock_acquire(&ktimer_lock);
+	int index = ktimer_jiffies & KTIMER_ROOT_MASK;
+
+	/* Did the root wheel make a full turn? */
+	if(!index)
+	{
+		int level;
+		int shift = KTIMER_ROOT_BITS;
+		for(level = 0;level < KTIMER_LEVELS;level++)
+		{
+			int slot = (ktimer_jiffies >> shift) & KTIMER_LEVEL_MASK;
+			ktimer_cascade(ktimer_levels[level] + slot);
+			if(slot) break;
+			shift += KTIMER_LEVEL_BITS;
+		}
+	}
+
+	/**
+	 * Fire the timers one at a time, a timer function might add or delete
+	 * other timers.
+	 */
+	struct ktimer* t;
+	while((t = ktimer_root[index]))
+	{
+		ktimer_unqueue(t);
+		ktimer_running = t;
+		ktimer_running_cpu = cpu_current()->id;
+		slock_release(&ktimer_lock);
+
+#ifdef DEBUG
+		cprintf("ktimer: timer fired on tick %d\n", ktimer_jiffies);
+#endif
+		t->func(t->arg);
+
+		slock_acquire(&ktimer_lock);
+		ktimer_running = NULL;
+	}
+
+	ktimer_jiffies++;
+	slock_release(&ktimer_lock);
+}
+
+int ktimer_update(uint ns)
+{
+	slock_acquire(&ktimer_lock);
+	ktimer_nsec += ns;
+	while(ktimer_nsec >= NSEC_PER_SEC)
+	{
+		ktimer_nsec -= NSEC_PER_SEC;
+		ktimer_sec++;
+	}
+
+	int ticks = 0;
+	ktimer_tick_ns += ns;
+	while(ktimer_tick_ns >= KTIMER_TICK_NS)
+	{
+		ktimer_tick_ns -= KTIMER_TICK_NS;
+		ticks++;
+	}
+	slock_release(&ktimer_lock);
+
+	int x;
+	for(x = 0;x < ticks;x++)
+		ktimer_run();
+
+	return ticks;
+}
+
+int ktimer_poll(void)
+{
+	/* Only the boot cpu reads the clock */
+	if(cpu_current()->id) return 0;
+	return ktimer_update(ktimer_clock_elapsed());
+}
+
+int ktimer_clock_interrupt(void)
+{
+	ktimer_armed = 0;
+	return ktimer_poll();
+}
+
+/**
+ * Returns the first tick within max ticks that has timers to fire or has
+ * to cascade. Returns the tick max ticks from now if there is none.
+ * (timer lock required)
+ */
+static uint ktimer_next_tick(uint max)
+{
+	if(max > KTIMER_ROOT_SIZE)
+		max = KTIMER_ROOT_SIZE;
+
+	uint tick;
+	for(tick = ktimer_jiffies;tick - ktimer_jiffies < max;tick++)
+	{
+		int index = tick & KTIMER_ROOT_MASK;
+		if(!index || ktimer_root[index])
+			break;
+	}
+
+	return tick;
+}
+
+void ktimer_arm(uint ticks)
+{
+	slock_acquire(&ktimer_lock);
+	if(ktimer_armed)
+	{
+		/* Is the clock going to interrupt early enough already? */
+		int armed = ktimer_armed_tick - ktimer_jiffies;
+		if(armed <= 0 || (ticks >= (uint)armed
+				&& ktimer_next_tick(armed) == ktimer_armed_tick))
+		{
+			slock_release(&ktimer_lock);
+			return;
+		}
+	}
+	slock_release(&ktimer_lock);
+
+	/* Bring the clock up to date before setting the interrupt */
+	ktimer_poll();
+
+	slock_acquire(&ktimer_lock);
+	uint tick = ktimer_next_tick(ticks);
+	uint ns = (tick - ktimer_jiffies) * KTIMER_TICK_NS
+		+ KTIMER_TICK_NS - ktimer_tick_ns;
+	uint set = ktimer_clock_oneshot(ns);
+
+	/* The clock might not be able to wait that long */
+	ktimer_armed = 1;
+	ktimer_armed_tick = ktimer_jiffies - 1
+		+ (ktimer_tick_ns + set + KTIMER_TICK_NS - 1) / KTIMER_TICK_NS;
+	slock_release(&ktimer_lock);
+
+#ifdef DEBUG
+	cprintf("ktimer: clock set for %d ns\n", set);
+#endif
+}
+
+uint ktimer_ticks(void)
+{
+	return ktimer_jiffies;
+}
+
+uint64_t ktimer_ns(void)
+{
+	slock_acquire(&ktimer_lock);
+	uint64_t ns = (uint64_t)ktimer_sec * NSEC_PER_SEC + ktimer_nsec;
+	slock_release(&ktimer_lock);
+
+	return ns;
+}
+
+void ktimer_clock(struct timespec* dst)
+{
+	slock_acquire(&ktimer_lock);
+	dst->tv_sec = ktimer_sec;
+	dst->tv_nsec = ktimer_nsec;
+	slock_release(&ktimer_lock);
+}
+
+uint ktimer_timespec_ticks(const struct timespec* span)
+{
+	if(span->tv_sec < 0 || span->tv_nsec < 0) return 0;
+	if(span->tv_sec >= KTIMER_MAX_TICKS / KTIMER_HZ)
+		return KTIMER_MAX_TICKS;
+
+	return span->tv_sec * KTIMER_HZ
+		+ (span->tv_nsec + KTIMER_TICK_NS - 1) / KTIMER_TICK_NS;
+}
+
+uint ktimer_timeval_ticks(const struct timeval* span)
+{
+	if(span->tv_sec < 0 || span->tv_usec < 0) return 0;
+	if(span->tv_sec >= KTIMER_MAX_TICKS / KTIMER_HZ)
+		return KTIMER_MAX_TICKS;
+
+	return span->tv_sec * KTIMER_HZ
+		+ (span->tv_usec + KTIMER_TICK_US - 1) / KTIMER_TICK_US;
+}
+
+void ktimer_ticks_timespec(uint ticks, struct timespec* dst)
+{
+	dst->tv_sec = ticks / KTIMER_HZ;
+	dst->tv_nsec = (ticks % KTIMER_HZ) * KTIMER_TICK_NS;
+}
+
+/**
+ * The sleep of the process is over.
+ */
+static void ktimer_wakeup(void* arg)
+{
+	waitqueue_wake_proc((struct proc*)arg);
+}
+
+uint ktimer_sleep(uint ticks)
+{
+	/* Be in the queue before the timer can fire or the wakeup is lost */
+	struct ktimer t;
+	ktimer_setup(&t, ktimer_wakeup, rproc);
+	waitqueue_prepare(&ktimer_sleepers, PROC_BLOCKED_SLEEP);
+	ktimer_add(&t, ticks);
+
+	waitqueue_block(NULL);
+
+	/* If the timer is still pending we got woken up early */
+	uint left = ktimer_remaining(&t);
+	ktimer_del(&t);
+
+	return left;
+}
+
+void ktimer_interrupt(struct proc* p)
+{
+	if(p->wq == &ktimer_sleepers)
+		waitqueue_wake_proc(p);
+}
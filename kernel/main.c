@@ -15,6 +15,7 @@
 #include "panic.h"
 #include "cpu.h"
 #include "ktime.h"
+#include "ktimer.h"
 #include "trap.h"
 #include "signal.h"
 #include "cacheman.h"
@@ -51,6 +52,7 @@ void main_stack(void)
 	/* Initilize kernel time */
 	cprintf("Initilizing kernel time...\t\t\t\t\t\t");
 	ktime_init();
+	ktimer_init();
 	cprintf("[ OK ]\n");
 
 	/* Initilize caches */
@@ -67,6 +69,11 @@ void main_stack(void)
 	pipe_init();
 	cprintf("[ OK ]\n");
 
+	/* Initilize file descriptors */
+	cprintf("Initilizing file descriptors...\t\t\t\t\t\t");
+	fd_init();
+	cprintf("[ OK ]\n");
+
 	/* Start file system manager */
 	cprintf("Starting file system manager...\t\t\t\t\t\t");
 	fsman_init();
@@ -86,6 +93,12 @@ void main_stack(void)
 	sched_init();
 	cprintf("[ OK ]\n");
 
+	cprintf("Starting the other cpus...\t\t\t\t\t\t");
+	int cpus_running = smp_init();
+	cprintf("[ OK ]\n");
+	if(cpus_running > 1)
+		cprintf("%d cpus are running.\n", cpus_running);
+
 	cprintf("Starting all logs...\t\t\t\t\t\t\t");
 	if(tty_code_log_init())
 		cprintf("[FAIL]\n");
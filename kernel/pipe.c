@@ -18,135 +18,295 @@
 #include "fsman.h"
 #include "tty.h"
 #include "proc.h"
+#include "vm.h"
 
-/* Pipe table */
-struct pipe pipe_table[MAX_PIPES];
+/**
+ * Pipe structures are carved out of slabs of kernel heap and are recycled
+ * through a free list. The buffer of a pipe is a ring of pages that only
+ * get allocated once data is written into them.
+ */
+static pipe_t pipe_free_list;
 slock_t pipe_table_lock;
 
 void pipe_init(void)
 {
 	slock_init(&pipe_table_lock);
-	memset(pipe_table, 0, sizeof(struct pipe) * MAX_PIPES);
+	slock_name(&pipe_table_lock, "pipe_table");
+	pipe_free_list = NULL;
+}
+
+/**
+ * Get a new page of pipes and put them on the free list. Returns 0 on
+ * success. (lock required)
+ */
+static int pipe_grow(void)
+{
+	struct pipe* slab = (struct pipe*)palloc();
+	if(!slab) return -1;
+	memset(slab, 0, PGSIZE);
+
+	int x;
+	for(x = 0;x < PGSIZE / sizeof(struct pipe);x++)
+	{
+		slab[x].next = pipe_free_list;
+		pipe_free_list = slab + x;
+	}
+
+	return 0;
 }
 
 pipe_t pipe_alloc(void)
 {
 	slock_acquire(&pipe_table_lock);
-	pipe_t p = NULL;
-	int x;
-	for(x = 0;x < MAX_PIPES;x++)
+	if(!pipe_free_list && pipe_grow())
 	{
-		if(!pipe_table[x].allocated)
-		{
-			p = pipe_table + x;
-			p->allocated = 1;
-			p->faulted = 0;
-			break;
-		}
+		slock_release(&pipe_table_lock);
+		return NULL;
 	}
 
+	pipe_t p = pipe_free_list;
+	pipe_free_list = p->next;
 	slock_release(&pipe_table_lock);
 
+	memset(p, 0, sizeof(struct pipe));
+	slock_init(&p->guard);
+	p->allocated = 1;
+	p->page_count = PIPE_DEFAULT_PAGES;
+	waitqueue_init(&p->readers, WAITQUEUE_INTERACTIVE);
+	waitqueue_init(&p->writers, WAITQUEUE_INTERACTIVE);
+	poll_source_init(&p->poll);
+
 	return p;
 }
 
 void pipe_fault(pipe_t t)
 {
-	slock_acquire(&ptable_lock);
-	int x;
-	for(x = 0;x < PTABLE_SIZE;x++)
-	{
-		if(ptable[x].state == PROC_BLOCKED 
-			&& ptable[x].block_type == PROC_BLOCKED_COND
-			&& (ptable[x].b_condition == &t->empty
-			|| ptable[x].b_condition == &t->fill))
-		{
-			ptable[x].b_condition = NULL;
-			ptable[x].block_type = 0;
-			ptable[x].state = PROC_RUNNABLE;
-		}
-	}
-	slock_release(&ptable_lock);
+	waitqueue_wake_all(&t->readers);
+	waitqueue_wake_all(&t->writers);
+	poll_notify(&t->poll, POLLHUP | POLLERR);
 }
 
 void pipe_free(pipe_t p)
 {
+	/* Nobody can watch this pipe anymore */
+	poll_source_detach(&p->poll);
+
+	int x;
+	for(x = 0;x < PIPE_MAX_PAGES;x++)
+	{
+		if(p->pages[x]) pfree((pypage_t)p->pages[x]);
+		p->pages[x] = NULL;
+	}
+
 	slock_acquire(&pipe_table_lock);
 	p->allocated = 0;
 	p->faulted = 0;
+	p->next = pipe_free_list;
+	pipe_free_list = p;
 	slock_release(&pipe_table_lock);
 }
 
-int pipe_write(void *src, size_t sz, pipe_t pipe ){
-	if(pipe->faulted) return -1;
+/**
+ * Copy sz bytes into the ring starting at the offset pos, allocating the
+ * pages that are touched for the first time. Returns 0 on success.
+ * (guard required)
+ */
+static int pipe_copy_in(pipe_t pipe, const char* src, size_t pos, size_t sz)
+{
+	size_t cap = pipe->page_count * PGSIZE;
+	while(sz)
+	{
+		char** page = pipe->pages + pos / PGSIZE;
+		if(!*page && !(*page = (char*)palloc()))
+			return -1;
+
+		size_t off = pos & (PGSIZE - 1);
+		size_t len = PGSIZE - off;
+		if(len > sz) len = sz;
+		memmove(*page + off, src, len);
+
+		src += len;
+		sz -= len;
+		pos = (pos + len) % cap;
+	}
+
+	return 0;
+}
+
+/**
+ * Copy sz bytes out of the ring starting at the offset pos. (guard
+ * required)
+ */
+static void pipe_copy_out(pipe_t pipe, char* dst, size_t pos, size_t sz)
+{
+	size_t cap = pipe->page_count * PGSIZE;
+	while(sz)
+	{
+		size_t off = pos & (PGSIZE - 1);
+		size_t len = PGSIZE - off;
+		if(len > sz) len = sz;
+		memmove(dst, pipe->pages[pos / PGSIZE] + off, len);
+
+		dst += len;
+		sz -= len;
+		pos = (pos + len) % cap;
+	}
+}
+
+int pipe_write(void *src, size_t sz, pipe_t pipe)
+{
+	const char* src_c = src;
+	size_t written = 0;
 	slock_acquire(&pipe->guard);
-	int byteswritten = 0;
-	while(byteswritten!=sz){
-		/* Check for full buffer and pipe fault */
-		if(pipe->full && pipe->faulted) break;
+	while(written < sz)
+	{
 		/* Never wait on a faulted pipe */
-		while(pipe->full == 1 && !pipe->faulted){
-			cond_wait_spin(&(pipe->empty), &(pipe->guard));
-		}
 		if(pipe->faulted) break;
-		int bytes_avail = 0;
-		int bytes_left = sz - byteswritten; 
-		if(pipe->write >= pipe->read){
-			bytes_avail = PIPE_DATA - pipe->write;
-		}
-		else{
-			bytes_avail = pipe->read - pipe->write;
-		}
-		if(bytes_avail>bytes_left){
-			bytes_avail = bytes_left;
-		}
-		memmove(pipe->buffer+pipe->write, src+byteswritten, bytes_avail);
-		pipe->write = (pipe->write + bytes_avail) % PIPE_DATA; 
-		if(pipe->write == pipe->read){
-			pipe->full = 1;
-			cond_signal(&pipe->fill);
-			
+
+		/* Small writes have to fit into the pipe all at once */
+		size_t cap = pipe->page_count * PGSIZE;
+		size_t space = cap - pipe->count;
+		size_t needed = sz - written;
+		if(needed > PIPE_BUF) needed = 1;
+		if(space < needed)
+		{
+			waitqueue_sleep(&pipe->writers, PROC_BLOCKED_COND,
+				&pipe->guard);
+			continue;
 		}
-		byteswritten += bytes_avail;
+
+		size_t len = sz - written;
+		if(len > space) len = space;
+		if(pipe_copy_in(pipe, src_c + written,
+					(pipe->read + pipe->count) % cap, len))
+			break;
+		pipe->count += len;
+		written += len;
+
+		/* There is data for the readers now */
+		waitqueue_wake_all(&pipe->readers);
+		poll_notify(&pipe->poll, POLLIN);
 	}
 	slock_release(&pipe->guard);
-	return byteswritten;
-	
+
+	/* Nothing could be written, the readers are gone */
+	if(!written && sz) return -1;
+	return written;
 }
 
-int pipe_read(void *dst, size_t sz, pipe_t pipe){
-	if(pipe->faulted) return -1;
+int pipe_read(void *dst, size_t sz, pipe_t pipe)
+{
 	slock_acquire(&pipe->guard);
-	int bytesread = 0;
-	while(bytesread!=sz){
-		/* If the pipe has faulted, and its empty, break */
-		if(pipe->faulted && !pipe->full && pipe->write == pipe->read)
-			break;
-		/* Never wait on a faulted pipe! */
-		while(pipe->full == 0 && pipe->write == pipe->read
-				 && !pipe->faulted){
-			cond_wait_spin(&(pipe->fill), &(pipe->guard));
-		}
-		int bytes_avail = 0;
-		int bytes_left = sz - bytesread; 
-		if(pipe->write >= pipe->read){
-			bytes_avail = PIPE_DATA - pipe->write;
-		}
-		else{
-			bytes_avail = pipe->read - pipe->write;
-		}
-		if(bytes_avail>bytes_left){
-			bytes_avail = bytes_left;
-		}
-		memmove(dst+bytesread, pipe->buffer+pipe->read,  bytes_avail);
-		pipe->read = (pipe->read + bytes_avail) % PIPE_DATA; 
-		pipe->full = 0;
-		if(pipe->write == pipe->read){
-			cond_signal(&pipe->empty);
-			
+
+	/* Wait for data unless all of the writers are gone */
+	while(!pipe->count && !pipe->faulted)
+	{
+		waitqueue_sleep(&pipe->readers, PROC_BLOCKED_COND,
+			&pipe->guard);
+	}
+
+	/* Take whatever is there instead of waiting for all sz bytes */
+	size_t len = pipe->count;
+	if(len > sz) len = sz;
+	if(len)
+	{
+		pipe_copy_out(pipe, dst, pipe->read, len);
+		pipe->read = (pipe->read + len)
+			% (pipe->page_count * PGSIZE);
+		pipe->count -= len;
+
+		/* There is space for the writers now */
+		waitqueue_wake_all(&pipe->writers);
+		poll_notify(&pipe->poll, POLLOUT);
+	}
+
+	slock_release(&pipe->guard);
+	return len;
+}
+
+int pipe_get_size(pipe_t pipe)
+{
+	return pipe->page_count * PGSIZE;
+}
+
+int pipe_set_size(pipe_t pipe, size_t sz)
+{
+	int count = (sz + PGSIZE - 1) / PGSIZE;
+	if(count < 1) count = 1;
+	if(count > PIPE_MAX_PAGES) return -1;
+
+	slock_acquire(&pipe->guard);
+	int old_count = pipe->page_count;
+	size_t old_cap = old_count * PGSIZE;
+	size_t off = pipe->read & (PGSIZE - 1);
+
+	/* The data in the pipe has to fit after the pages are rotated */
+	if(off + pipe->count > count * PGSIZE)
+	{
+		slock_release(&pipe->guard);
+		return -1;
+	}
+
+	/* Rotate the pages so that the data starts in the first page */
+	char* old[PIPE_MAX_PAGES];
+	memmove(old, pipe->pages, sizeof(char*) * old_count);
+	int first = pipe->read / PGSIZE;
+	int x;
+	for(x = 0;x < old_count;x++)
+		pipe->pages[x] = old[(first + x) % old_count];
+
+	if(off + pipe->count > old_cap)
+	{
+		/**
+		 * The end of the data wrapped around into the front of the
+		 * first page, move it behind the old end of the ring. This
+		 * only happens when growing.
+		 */
+		size_t wrapped = off + pipe->count - old_cap;
+		char** page = pipe->pages + old_count;
+		if(!*page && !(*page = (char*)palloc()))
+		{
+			/* Undo the rotation */
+			memmove(pipe->pages, old, sizeof(char*) * old_count);
+			slock_release(&pipe->guard);
+			return -1;
 		}
-		bytesread+= bytes_avail;
+		memmove(*page, pipe->pages[0], wrapped);
+	}
+
+	/* Give back pages that are past the new end of the ring */
+	for(x = count;x < old_count;x++)
+	{
+		if(pipe->pages[x]) pfree((pypage_t)pipe->pages[x]);
+		pipe->pages[x] = NULL;
+	}
+
+	pipe->read = off;
+	pipe->page_count = count;
+
+	/* There might be more space for the writers */
+	waitqueue_wake_all(&pipe->writers);
+	poll_notify(&pipe->poll, POLLOUT);
+	slock_release(&pipe->guard);
+
+	return count * PGSIZE;
+}
+
+int pipe_poll(pipe_t pipe, int write)
+{
+	int events = 0;
+	slock_acquire(&pipe->guard);
+	if(write)
+	{
+		/* A write of PIPE_BUF bytes wouldn't block */
+		size_t cap = pipe->page_count * PGSIZE;
+		if(cap - pipe->count >= PIPE_BUF) events |= POLLOUT;
+		if(pipe->faulted) events |= POLLERR;
+	} else {
+		if(pipe->count) events |= POLLIN;
+		if(pipe->faulted) events |= POLLHUP;
 	}
 	slock_release(&pipe->guard);
-	return bytesread;
+
+	return events;
 }
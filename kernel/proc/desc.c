@@ -42,53 +42,174 @@
 
 // #define DEBUG
 
-/* Table for all of the file descriptors */
-struct file_descriptor fds[FDS_TABLE_SZ];
-
-/* Table of file descriptor tables */
-struct file_descriptor* fd_tables[PTABLE_SIZE][PROC_MAX_FDS];
-slock_t fd_tables_locks[PTABLE_SIZE];
+/**
+ * The main fd table is made out of slabs of kernel heap. Descriptors that
+ * are no longer referenced go onto a free list.
+ */
+static struct file_descriptor* fds_free_list;
+static int fds_count; /* The amount of descriptors in use */
 
-/* Lock needed to touch fds */
+/* Lock needed to touch the free list */
 slock_t fds_lock;
 
+extern struct proc* proc_list;
+
 void fd_init(void)
 {
 	slock_init(&fds_lock);
-	memset(fds, 0, sizeof(struct file_descriptor) * FDS_TABLE_SZ);
-	memset(fd_tables, 0, sizeof(struct file_descriptor*) * PTABLE_SIZE);
+	slock_name(&fds_lock, "fds");
+	fds_free_list = NULL;
+	fds_count = 0;
+}
+
+/**
+ * Get a new page of file descriptors and put them on the free list.
+ * Returns 0 on success. (lock required)
+ */
+static int fd_grow(void)
+{
+	struct file_descriptor* slab = (struct file_descriptor*)palloc();
+	if(!slab) return -1;
+	memset(slab, 0, PGSIZE);
 
-	/* Initilize all locks */
 	int x;
-	for(x = 0;x < PTABLE_SIZE;x++)
-		slock_init(fd_tables_locks + x);
+	for(x = 0;x < PGSIZE / sizeof(struct file_descriptor);x++)
+	{
+		slab[x].next = fds_free_list;
+		fds_free_list = slab + x;
+	}
+
+#ifdef DEBUG
+	cprintf("desc: new slab of %d descriptors\n", x);
+#endif
+
+	return 0;
 }
 
 void fdtab_init(fdtab_t tab)
 {
 	if(!tab) return;
-	memset(tab, 0, sizeof(struct file_descriptor*) * PROC_MAX_FDS);
+	memset(tab, 0, sizeof(struct fd_table));
+	slock_init(&tab->lock);
+	tab->fds = tab->slots;
+	tab->size = FD_TABLE_MIN;
+}
+
+void fdtab_destroy(fdtab_t tab)
+{
+	if(!tab) return;
+	if(tab->fds != tab->slots)
+		pfree((pypage_t)tab->fds);
+	tab->fds = tab->slots;
+	tab->size = FD_TABLE_MIN;
+}
+
+/**
+ * Move the slots of the table into a page with room for FD_TABLE_MAX
+ * slots. Returns 0 on success. (table lock required)
+ */
+static int fd_tab_grow(fdtab_t tab)
+{
+	if(tab->size >= FD_TABLE_MAX) return -1;
+
+	struct file_descriptor** fds = (struct file_descriptor**)palloc();
+	if(!fds) return -1;
+	memset(fds, 0, PGSIZE);
+	memmove(fds, tab->fds, sizeof(struct file_descriptor*) * tab->size);
+	tab->fds = fds;
+	tab->size = FD_TABLE_MAX;
+
+#ifdef DEBUG
+	cprintf("desc: fd table grew to %d slots\n", tab->size);
+#endif
+
+	return 0;
+}
+
+/**
+ * Mark the slot as taken. (table lock required)
+ */
+static void fd_tab_set(fdtab_t tab, int fd)
+{
+	int word = fd / 32;
+	tab->used[word] |= 1u << (fd & 31);
+	if(tab->used[word] == 0xFFFFFFFF)
+		tab->full |= 1u << word;
+}
+
+/**
+ * Mark the slot as free. (table lock required)
+ */
+static void fd_tab_clear(fdtab_t tab, int fd)
+{
+	int word = fd / 32;
+	tab->used[word] &= ~(1u << (fd & 31));
+	tab->full &= ~(1u << word);
+}
+
+/**
+ * Find the lowest free slot at pos or after. Slots past the size of the
+ * table count as free. Returns -1 if every slot is taken. (table lock
+ * required)
+ */
+static int fd_tab_lowest_free(fdtab_t tab, int pos)
+{
+	if(pos < 0 || pos >= FD_TABLE_MAX) return -1;
+
+	/* Look in the word that pos is in first */
+	int word = pos / 32;
+	uint32_t bits = ~tab->used[word] & (0xFFFFFFFF << (pos & 31));
+	if(bits) return word * 32 + __builtin_ctz(bits);
+
+	/* Skip over all of the full words */
+	if(word + 1 >= FD_TABLE_WORDS) return -1;
+	uint32_t words = ~tab->full & (0xFFFFFFFF << (word + 1));
+	if(!words) return -1;
+	word = __builtin_ctz(words);
+	return word * 32 + __builtin_ctz(~tab->used[word]);
+}
+
+/**
+ * Find the lowest slot that is in use at pos or after. Returns -1 if there
+ * are no more slots in use. (table lock required)
+ */
+static int fd_tab_lowest_used(fdtab_t tab, int pos)
+{
+	if(pos < 0) return -1;
+
+	int word = pos / 32;
+	uint32_t bits = 0;
+	if(word < FD_TABLE_WORDS)
+		bits = tab->used[word] & (0xFFFFFFFF << (pos & 31));
+	while(!bits)
+	{
+		if(++word >= FD_TABLE_WORDS) return -1;
+		bits = tab->used[word];
+	}
+
+	return word * 32 + __builtin_ctz(bits);
 }
 
 static struct file_descriptor* fd_alloc(void)
 {
-        struct file_descriptor* result = NULL;
-        slock_acquire(&fds_lock);
-
-        int x;
-        for(x = 0;x < FDS_TABLE_SZ;x++)
-        {
-                if(fds[x].type) continue;
-                result = fds + x;
-		result->type = FD_TYPE_INUSE;
-		result->refs = 1;
-		slock_init(&result->lock);
-                break;
-        }
-
-        slock_release(&fds_lock);
-
-        return result;
+	slock_acquire(&fds_lock);
+	if(!fds_free_list && fd_grow())
+	{
+		slock_release(&fds_lock);
+		return NULL;
+	}
+
+	struct file_descriptor* result = fds_free_list;
+	fds_free_list = result->next;
+	fds_count++;
+	slock_release(&fds_lock);
+
+	memset(result, 0, sizeof(struct file_descriptor));
+	result->type = FD_TYPE_INUSE;
+	result->refs = 1;
+	kmutex_init(&result->lock);
+
+	return result;
 }
 
 static void fd_free_native(struct file_descriptor * fd)
@@ -100,47 +221,58 @@ static void fd_free_native(struct file_descriptor * fd)
 		fd->refs, fd->refs - 1);
 #endif
 	fd->refs--;
-        if(fd->refs <= 0)
-                memset(fd, 0, sizeof(struct file_descriptor));
+	if(fd->refs > 0) return;
+
+	memset(fd, 0, sizeof(struct file_descriptor));
+	slock_acquire(&fds_lock);
+	fd->next = fds_free_list;
+	fds_free_list = fd;
+	fds_count--;
+	slock_release(&fds_lock);
 }
 
 void fd_free(struct proc* p, int fd)
 {
-        if(!p) return;
-	
-	slock_acquire(p->fdtab_lock);
-	struct file_descriptor* file = p->fdtab[fd];
-	if(file)
+	if(!p) return;
+
+	fdtab_t tab = p->fdtab;
+	slock_acquire(&tab->lock);
+	if(fd >= 0 && fd < tab->size && tab->fds[fd])
 	{
-		fd_free_native(p->fdtab[fd]);
-		p->fdtab[fd] = NULL;
+		fd_free_native(tab->fds[fd]);
+		tab->fds[fd] = NULL;
+		fd_tab_clear(tab, fd);
 	}
-	slock_release(p->fdtab_lock);
+	slock_release(&tab->lock);
 }
 
 int fd_tab_free_native(struct proc* p)
 {
 	if(!p || !p->fdtab) return -1;
 #ifdef DEBUG
-        cprintf("desc: freeing table for proc %s\n", p->name);
+	cprintf("desc: freeing table for proc %s\n", p->name);
 #endif
 
+	fdtab_t tab = p->fdtab;
 	int x;
-        for(x = 0;x < PROC_MAX_FDS;x++)
-        {
-                if(!p->fdtab[x]) continue;
-                fd_free_native(p->fdtab[x]);
-                p->fdtab[x] = NULL;
-        }
+	for(x = fd_tab_lowest_used(tab, 0);x >= 0;
+			x = fd_tab_lowest_used(tab, x + 1))
+	{
+		fd_free_native(tab->fds[x]);
+		tab->fds[x] = NULL;
+	}
+
+	memset(tab->used, 0, sizeof(tab->used));
+	tab->full = 0;
 	return 0;
 }
 
 int fd_tab_free(struct proc* p)
 {
 	if(!p || !p->fdtab) return -1;
-	slock_acquire(p->fdtab_lock);
+	slock_acquire(&p->fdtab->lock);
 	int result = fd_tab_free_native(p);
-	slock_release(p->fdtab_lock);
+	slock_release(&p->fdtab->lock);
 	return result;
 }
 
@@ -149,26 +281,29 @@ int fd_next_at(struct proc* p, int pos)
 #ifdef DEBUG
 	cprintf("desc: %s is looking for a new fd\n", p->name);
 #endif
-	int result = -1;
 	/* Acquire the fd table lock */
-	slock_acquire(p->fdtab_lock);
+	fdtab_t tab = p->fdtab;
+	slock_acquire(&tab->lock);
 
-        int x;
-        for(x = pos;x < PROC_MAX_FDS;x++)
-        {
-		if(p->fdtab[x]) continue;
+	int result = fd_tab_lowest_free(tab, pos);
+	if(result >= p->fd_limit) result = -1;
+
+	/* Make room for the new fd */
+	if(result >= tab->size && fd_tab_grow(tab))
+		result = -1;
+
+	if(result >= 0)
+	{
 		/* attempt to get a free fd */
 		struct file_descriptor* fd = fd_alloc();
-		if(!fd) break;
+		if(fd)
+		{
+			tab->fds[result] = fd;
+			fd_tab_set(tab, result);
+		} else result = -1;
+	}
 
-		/* Set the table entry */
-		p->fdtab[x] = fd;
-		/* Return this index */
-		result = x;
-		break;
-        }
-	
-	slock_release(p->fdtab_lock);
+	slock_release(&tab->lock);
 
 #ifdef DEBUG
 	cprintf("desc: %s got fd at index %d\n", p->name, result);
@@ -176,6 +311,45 @@ int fd_next_at(struct proc* p, int pos)
 	return result;
 }
 
+/**
+ * Make sure the table has a slot at index. Returns 0 on success.
+ * (table lock required)
+ */
+static int fd_tab_reserve(struct proc* p, int index)
+{
+	if(index < 0 || index >= p->fd_limit || index >= FD_TABLE_MAX)
+		return -1;
+	if(index >= p->fdtab->size && fd_tab_grow(p->fdtab))
+		return -1;
+	return 0;
+}
+
+int fd_install(struct proc* p, int index, struct file_descriptor* file)
+{
+	fdtab_t tab = p->fdtab;
+	slock_acquire(&tab->lock);
+	if(fd_tab_reserve(p, index) || tab->fds[index])
+	{
+		slock_release(&tab->lock);
+		return -1;
+	}
+
+	tab->fds[index] = file;
+	fd_tab_set(tab, index);
+	slock_release(&tab->lock);
+
+	return 0;
+}
+
+int fd_next_used(struct proc* p, int pos)
+{
+	slock_acquire(&p->fdtab->lock);
+	int result = fd_tab_lowest_used(p->fdtab, pos);
+	slock_release(&p->fdtab->lock);
+
+	return result;
+}
+
 int fd_tab_map(struct proc* dst, struct proc* src)
 {
 #ifdef DEBUG
@@ -186,7 +360,6 @@ int fd_tab_map(struct proc* dst, struct proc* src)
 	if(dst->fdtab)
 		fd_tab_free(dst);
 	dst->fdtab = src->fdtab;
-	dst->fdtab_lock = src->fdtab_lock;
 	return 0;
 }
 
@@ -198,33 +371,68 @@ int fd_tab_copy(struct proc* dst, struct proc* src)
 		panic("kernel: invalid fd table! 0x%x 0x%x\n", 
 				dst->fdtab, src->fdtab);
 
+	fdtab_t dtab = dst->fdtab;
+	fdtab_t stab = src->fdtab;
+
 	/* Lock both tables */
 	/* This hack below is just to prevent possible deadlocks */
-	if(dst->fdtab > src->fdtab)
+	if(dtab > stab)
 	{
-		slock_acquire(src->fdtab_lock);
-		slock_acquire(dst->fdtab_lock);
+		slock_acquire(&stab->lock);
+		slock_acquire(&dtab->lock);
 	} else {
-		slock_acquire(dst->fdtab_lock);
-		slock_acquire(src->fdtab_lock);
+		slock_acquire(&dtab->lock);
+		slock_acquire(&stab->lock);
 	}
 
 	/* Free the dst table */
 	fd_tab_free_native(dst);
 
-	/* Copy all valid descriptors */
-	int x;
-        for(x = 0;x < PROC_MAX_FDS;x++)
+	int result = 0;
+	if(stab->size > dtab->size && fd_tab_grow(dtab))
 	{
-		if(!src->fdtab[x]) continue;
-		/* We created another ref to this fd */
-		src->fdtab[x]->refs++;
-		dst->fdtab[x] = src->fdtab[x];
+		result = -1;
+	} else {
+		/* Copy the whole table at once */
+		memmove(dtab->fds, stab->fds,
+			sizeof(struct file_descriptor*) * stab->size);
+		memmove(dtab->used, stab->used, sizeof(dtab->used));
+		dtab->full = stab->full;
 	}
 
 	/* Free both locks */
-	slock_release(src->fdtab_lock);
-	slock_release(dst->fdtab_lock);
+	slock_release(&stab->lock);
+	slock_release(&dtab->lock);
+
+	if(result) return result;
+
+	/**
+	 * We created another ref to every descriptor. Nobody else can see
+	 * dst's table yet, so this is done without the table locks. Taking
+	 * inode and pipe references only takes spin locks, fork and clone
+	 * call this with the ptable lock held.
+	 */
+	int x;
+	for(x = fd_tab_lowest_used(dtab, 0);x >= 0;
+			x = fd_tab_lowest_used(dtab, x + 1))
+	{
+		struct file_descriptor* file = dtab->fds[x];
+		file->refs++;
+		switch(file->type)
+		{
+			case FD_TYPE_FILE:
+				fs_add_inode_reference(file->i);
+				break;
+			case FD_TYPE_PIPE:
+				slock_acquire(&file->pipe->guard);
+				if(file->pipe_type == FD_PIPE_MODE_WRITE)
+					file->pipe->write_ref++;
+				if(file->pipe_type == FD_PIPE_MODE_READ)
+					file->pipe->read_ref++;
+				slock_release(&file->pipe->guard);
+				break;
+		}
+	}
 
 	return 0;
 }
@@ -232,17 +440,22 @@ int fd_tab_copy(struct proc* dst, struct proc* src)
 int fd_new(struct proc* p, int index, int free)
 {
 	int result = 0;
-	slock_acquire(p->fdtab_lock);
-	if(p->fdtab[index]) 
+	fdtab_t tab = p->fdtab;
+	slock_acquire(&tab->lock);
+	if(fd_tab_reserve(p, index))
+	{
+		result = -1;
+	} else if(tab->fds[index]) 
 	{
 		result = 1;
-		
 	} else {
-		p->fdtab[index] = fd_alloc();
-		result = 0;
+		tab->fds[index] = fd_alloc();
+		if(tab->fds[index])
+			fd_tab_set(tab, index);
+		else result = -1;
 	}
 
-	slock_release(p->fdtab_lock);
+	slock_release(&tab->lock);
 	return result;
 }
 
@@ -251,15 +464,22 @@ void fd_print_table(void)
 	cprintf("+------------------------------+\n");
 	cprintf("|---------- FD TABLE ----------|\n");
 	cprintf("+------------------------------+\n\n");
+	cprintf("descriptors in use: %d\n", fds_count);
 
-	int x;
-	for(x = 0;x < FDS_TABLE_SZ;x++)
+	struct proc* p;
+	for(p = proc_list;p;p = p->all_next)
 	{
-		if(fds[x].type)
+		if(!p->state || !p->fdtab) continue;
+		cprintf("%s %d (%d slots)\n", p->name, p->pid,
+				p->fdtab->size);
+
+		int x;
+		for(x = fd_next_used(p, 0);x >= 0;x = fd_next_used(p, x + 1))
 		{
-			cprintf("%d: %s\n", x, fds[x].path);
+			struct file_descriptor* fd = p->fdtab->fds[x];
+			cprintf("%d: %s\n", x, fd->path);
 			cprintf("\ttype:   ");
-			switch(fds[x].type)
+			switch(fd->type)
 			{
 				case FD_TYPE_INUSE:
 					cprintf("LEAKED\n");
@@ -276,13 +496,15 @@ void fd_print_table(void)
 				case FD_TYPE_PATH:
 					cprintf("PATH\n");
 					break;
+				case FD_TYPE_EVENT:
+					cprintf("EVENT\n");
+					break;
 			}
-			cprintf("\trefs:   %d\n", fds[x].refs);
-			cprintf("\tflags:  %d\n", fds[x].flags);
-			cprintf("\tseek:   %d\n", fds[x].seek);
-			cprintf("\ti:      0x%x\n", fds[x].i);
-			cprintf("\tdevice: 0x%x\n", fds[x].device);
-			cprintf("\tpath:   %s\n", fds[x].path);
+			cprintf("\trefs:   %d\n", fd->refs);
+			cprintf("\tflags:  %d\n", fd->flags);
+			cprintf("\tseek:   %d\n", fd->seek);
+			cprintf("\ti:      0x%x\n", fd->i);
+			cprintf("\tdevice: 0x%x\n", fd->device);
 		}
 	}
 }
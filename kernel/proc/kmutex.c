@@ -0,0 +1,74 @@
+/**
+ * Sleeping mutexes. The mutex itself is only protected by a spin lock for
+ * the few instructions it takes to check or change it, waiters sleep in the
+ * wait queue of the mutex.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stdlock.h"
+#include "kmutex.h"
+#include "proc.h"
+#include "panic.h"
+
+// #define DEBUG
+
+void kmutex_init(kmutex_t* m)
+{
+	slock_init(&m->lock);
+	m->locked = 0;
+	m->owner = NULL;
+	waitqueue_init(&m->waiters, 0);
+}
+
+void kmutex_lock(kmutex_t* m)
+{
+	slock_acquire(&m->lock);
+	while(m->locked)
+	{
+		/* Nobody would ever unlock the mutex for the scheduler */
+		if(!rproc) panic("kmutex: scheduler blocked on a mutex.\n");
+
+		/* Sleeping takes the ptable lock, which isn't recursive */
+		if(qlock_held(&ptable_lock))
+			panic("kmutex: blocked with the ptable lock held.\n");
+
+#ifdef DEBUG
+		cprintf("kmutex: %s:%d waiting for %s:%d\n",
+				rproc->name, rproc->pid,
+				m->owner ? m->owner->name : "kernel",
+				m->owner ? m->owner->pid : 0);
+#endif
+
+		waitqueue_sleep(&m->waiters, PROC_BLOCKED_MUTEX, &m->lock);
+	}
+
+	m->locked = 1;
+	m->owner = rproc;
+	slock_release(&m->lock);
+}
+
+int kmutex_trylock(kmutex_t* m)
+{
+	int result = -1;
+	slock_acquire(&m->lock);
+	if(!m->locked)
+	{
+		m->locked = 1;
+		m->owner = rproc;
+		result = 0;
+	}
+	slock_release(&m->lock);
+
+	return result;
+}
+
+void kmutex_unlock(kmutex_t* m)
+{
+	slock_acquire(&m->lock);
+	m->locked = 0;
+	m->owner = NULL;
+	waitqueue_wake_one(&m->waiters);
+	slock_release(&m->lock);
+}
@@ -25,54 +25,203 @@
 #include "syscall.h"
 #include "chronos.h"
 #include "iosched.h"
+#include "systrace.h"
 #include "time.h"
 #include "context.h"
+#include "cacheman.h"
 
 extern struct vsfs_context context;
 
+// #define DEBUG
+
 /* The process table lock must be acquired before accessing the ptable. */
-slock_t ptable_lock;
-/* The process table */
-struct proc ptable[PTABLE_SIZE];
-/* A pointer into the ptable of the running process */
-struct proc* rproc;
+qlock_t ptable_lock;
+/* Every process that has been linked into the process table */
+struct proc* proc_list;
 /* The next available pid */
 pid_t next_pid;
-/* How many ticks have there been since boot? */
-int k_ticks;
 
-extern struct file_descriptor* fd_tables[PTABLE_SIZE][PROC_MAX_FDS];
-extern slock_t fd_tables_locks[];
+/**
+ * Process structures are carved out of slabs of kernel heap and are
+ * recycled through a free list. Each process gets its own file descriptor
+ * table right next to it.
+ */
+struct proc_slab_entry
+{
+	struct proc p; /* Must be first */
+	struct fd_table fdtab;
+	char fpu_area[FPU_STATE_SZ + FPU_STATE_ALIGN];
+};
 
-struct proc* alloc_proc()
+static struct proc* proc_free_list; /* Linked through all_next */
+static int proc_count; /* The amount of processes that are allocated */
+static struct proc* proc_hash[PROC_HASH_SIZE]; /* Processes by pid */
+
+#define PROC_HASH(pid) (proc_hash + ((pid) & (PROC_HASH_SIZE - 1)))
+
+/**
+ * Get a new slab of processes from the kernel heap and put them on the
+ * free list. Returns 0 on success. (lock required)
+ */
+static int proc_grow(void)
 {
-	slock_acquire(&ptable_lock);
+	struct proc_slab_entry* slab = cman_alloc(PROC_SLAB_SZ);
+	if(!slab) return -1;
+	memset(slab, 0, PROC_SLAB_SZ);
+
 	int x;
-	for(x = 0;x < PTABLE_SIZE;x++)
+	for(x = 0;x < PROC_SLAB_SZ / sizeof(struct proc_slab_entry);x++)
+	{
+		slab[x].p.all_next = proc_free_list;
+		proc_free_list = &slab[x].p;
+	}
+
+#ifdef DEBUG
+	cprintf("proc: new slab of %d processes\n", x);
+#endif
+
+	return 0;
+}
+
+struct proc* alloc_proc()
+{
+	qlock_acquire(&ptable_lock);
+	if(proc_count >= PROC_LIMIT || (!proc_free_list && proc_grow()))
 	{
-		if(ptable[x].state == PROC_UNUSED)
+		qlock_release(&ptable_lock);
+		return NULL;
+	}
+
+	struct proc* p = proc_free_list;
+	proc_free_list = p->all_next;
+	proc_count++;
+
+	struct proc_slab_entry* entry = (struct proc_slab_entry*)p;
+	memset(entry, 0, sizeof(struct proc_slab_entry));
+	fdtab_init(&entry->fdtab);
+	p->state = PROC_EMBRYO;
+	p->priority = SCHED_PRIO_DEFAULT;
+	p->fdtab = &entry->fdtab;
+	p->fd_limit = FD_LIMIT_DEFAULT;
+	p->fd_limit_max = FD_TABLE_MAX;
+	p->fpu_state = (void*)(((uintptr_t)entry->fpu_area
+		+ FPU_STATE_ALIGN - 1) & ~(FPU_STATE_ALIGN - 1));
+	ktimer_setup(&p->alarm_timer, proc_alarm, p);
+
+	qlock_release(&ptable_lock);
+
+	return p;
+}
+
+void proc_link(struct proc* p, struct proc* parent)
+{
+	/* Add to the list of all processes */
+	p->all_prev = NULL;
+	p->all_next = proc_list;
+	if(proc_list) proc_list->all_prev = p;
+	proc_list = p;
+
+	/* Add to the pid hash */
+	struct proc** bucket = PROC_HASH(p->pid);
+	p->hash_next = *bucket;
+	*bucket = p;
+
+	/* We don't have any children yet */
+	p->children = NULL;
+	p->sibling_prev = NULL;
+	p->sibling_next = NULL;
+	if(parent && parent != p)
+	{
+		p->sibling_next = parent->children;
+		if(parent->children) parent->children->sibling_prev = p;
+		parent->children = p;
+	}
+}
+
+void proc_unlink(struct proc* p)
+{
+	/* Take the process out of the pid hash */
+	struct proc** bucket = PROC_HASH(p->pid);
+	for(;*bucket;bucket = &(*bucket)->hash_next)
+	{
+		if(*bucket == p)
 		{
-			memset(ptable + x, 0, sizeof(struct proc));
-			ptable[x].state = PROC_EMBRYO;
-			ptable[x].fdtab = fd_tables[x];
-			ptable[x].fdtab_lock = &fd_tables_locks[x];
+			*bucket = p->hash_next;
 			break;
 		}
 	}
+	p->hash_next = NULL;
+
+	/* Take the process out of the children of its parent */
+	if(p->sibling_prev) p->sibling_prev->sibling_next = p->sibling_next;
+	else if(p->parent && p->parent->children == p)
+		p->parent->children = p->sibling_next;
+	if(p->sibling_next) p->sibling_next->sibling_prev = p->sibling_prev;
+	p->sibling_next = p->sibling_prev = NULL;
+}
+
+void free_proc(struct proc* p)
+{
+	/**
+	 * Make sure the alarm doesn't go off anymore. waitpid stops it
+	 * without the ptable lock first, so this never has to wait for
+	 * proc_alarm, which takes the ptable lock.
+	 */
+	ktimer_del(&p->alarm_timer);
+
+	/* This cpu might still hold the floating point registers of p */
+	fpu_forget(p);
 
-	slock_release(&ptable_lock);
+	/* The table of p might have grown out of the slab entry */
+	fdtab_destroy(&((struct proc_slab_entry*)p)->fdtab);
 
-	if(x >= PTABLE_SIZE) return NULL;
-	return ptable + x;
+	/* Nobody can read what is left in the trace ring anymore */
+	trace_free(p);
+
+	/* The process might not have been unlinked yet */
+	proc_unlink(p);
+
+	/* Take the process out of the list of all processes */
+	if(p->all_prev) p->all_prev->all_next = p->all_next;
+	else if(proc_list == p) proc_list = p->all_next;
+	if(p->all_next) p->all_next->all_prev = p->all_prev;
+
+	/* Our children don't have a parent anymore */
+	struct proc* child;
+	for(child = p->children;child;)
+	{
+		struct proc* next = child->sibling_next;
+		child->orphan = 1;
+		child->parent = NULL;
+		child->sibling_next = child->sibling_prev = NULL;
+		child = next;
+	}
+
+	memset(p, 0, sizeof(struct proc));
+	p->state = PROC_UNUSED;
+	p->all_next = proc_free_list;
+	proc_free_list = p;
+	proc_count--;
+}
+
+void proc_alarm(void* arg)
+{
+	struct proc* p = arg;
+	qlock_acquire(&ptable_lock);
+	sig_proc(p, SIGALRM);
+	qlock_release(&ptable_lock);
+
+	/* Don't let the process sleep through the signal */
+	ktimer_interrupt(p);
 }
 
 struct proc* get_proc_pid(int pid)
 {
-	int x;
-	for(x = 0;x < PTABLE_SIZE;x++)
+	struct proc* p;
+	for(p = *PROC_HASH(pid);p;p = p->hash_next)
 	{
-		if(ptable[x].pid == pid)
-			return ptable + x;
+		if(p->pid == pid)
+			return p;
 	}
 
 	/* There is no process with that pid. */
@@ -81,25 +230,23 @@ struct proc* get_proc_pid(int pid)
 
 void proc_print_table(void)
 {
-	int x;
-	for(x = 0;x < PTABLE_SIZE;x++)
+	struct proc* p;
+	for(p = proc_list;p;p = p->all_next)
 	{
-		if(!ptable[x].state) continue;
+		if(!p->state) continue;
 
-		cprintf("%s %d\n", ptable[x].name, 
-				ptable[x].pid);
+		cprintf("%s %d\n", p->name, p->pid);
 		cprintf("Open Files\n");
 		int fd;
-		for(fd = 0;fd < PROC_MAX_FDS;fd++)
+		for(fd = fd_next_used(p, 0);fd >= 0;
+				fd = fd_next_used(p, fd + 1))
 		{
-			if(!ptable[x].fdtab[fd]) continue;
-			if(!ptable[x].fdtab[fd]->type)
+			if(!p->fdtab->fds[fd]->type)
 				continue;
 			cprintf("\t%d: name: %s refs: %d\n", 
-				fd, ptable[x].fdtab[fd]->path,
-				ptable[x].fdtab[fd]->refs);
+				fd, p->fdtab->fds[fd]->path,
+				p->fdtab->fds[fd]->refs);
 		}
-		cprintf("Working directory: %s\n", 
-				ptable[x].cwd);
+		cprintf("Working directory: %s\n", p->cwd);
 	}
 }
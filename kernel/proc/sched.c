@@ -5,27 +5,468 @@
 #include "proc.h"
 #include "devman.h"
 #include "context.h"
+#include "cpu.h"
+#include "ktimer.h"
 #include "panic.h"
 
+// #define DEBUG
+
+/**
+ * Processes that are ready to run are kept in one run queue per priority.
+ * The scheduler always takes the process at the front of the highest
+ * priority queue that isn't empty and processes go to the back of their
+ * queue when they give up the cpu.
+ *
+ * The queue a process goes into depends on its nice value and on how much
+ * virtual runtime it has used lately. Every tick a process runs adds to its
+ * virtual runtime, weighted by its nice value. Cpu bound processes sink
+ * into the lower queues, which get longer time slices. Every
+ * SCHED_AGE_TICKS half of the recent virtual runtime of each process is
+ * forgiven so processes that stop using the cpu rise again.
+ *
+ * The clock only interrupts the running process when its time slice is
+ * over and other processes are waiting, so a process that has the cpu to
+ * itself runs undisturbed. When there is nothing to run, the cpu halts
+ * until the next interrupt.
+ *
+ * Every cpu runs this scheduler loop with its own run queues. A woken up
+ * process goes back to the cpu it ran on last unless another cpu is idle,
+ * and a cpu that runs out of work takes processes from the busiest cpu.
+ */
+struct run_queue
+{
+	struct proc* head; /* The next process to run */
+	struct proc* tail; /* The last process to run */
+};
+
+/**
+ * Every cpu has its own set of run queues, so cpus only touch each other's
+ * queues when they hand processes over. A process is in the queues of the
+ * cpu in its rq_cpu field. rq_cpu and rq_queued only change while the lock
+ * of those queues is held.
+ */
+struct cpu_queues
+{
+	slock_t lock;
+	struct run_queue queues[SCHED_PRIO_COUNT];
+	int map; /* Bit n is set if run queue n isn't empty */
+	int count; /* The amount of processes in all queues */
+};
+
+static struct cpu_queues cpu_queues[CPU_MAX];
+static int sched_aged; /* The last tick the runtimes were aged */
+
+/**
+ * The weight of each nice value, starting at SCHED_NICE_MIN. Every step is
+ * about 25% more cpu time than the step below it.
+ */
+static const int sched_nice_weight[] = {
+	88761, 71755, 56483, 46273, 36291,
+	29154, 23254, 18705, 14949, 11916,
+	9548, 7620, 6100, 4904, 3906,
+	3121, 2501, 1991, 1586, 1277,
+	1024, 820, 655, 526, 423,
+	335, 272, 215, 172, 137,
+	110, 87, 70, 56, 45,
+	36, 29, 23, 18, 15
+};
+#define SCHED_NICE_0_WEIGHT 1024
+
+/**
+ * Returns the run queue a process should go into next.
+ */
+static int sched_prio(struct proc* p)
+{
+	if(p->sched_boost)
+	{
+		p->sched_boost = 0;
+		return SCHED_PRIO_BOOST;
+	}
+
+	/* The nice value picks one of the queues below the boost queue */
+	int prio = SCHED_PRIO_BOOST + 1 + (p->nice - SCHED_NICE_MIN) / 8;
+	prio += (p->vruntime - p->vruntime_mark) / SCHED_DEMOTE_VTIME;
+	if(prio >= SCHED_PRIO_COUNT)
+		prio = SCHED_PRIO_COUNT - 1;
+
+	return prio;
+}
+
+/**
+ * Returns the amount of ticks a process in the given queue gets before
+ * it is preempted.
+ */
+static int sched_slice(int prio)
+{
+	return 1 << (prio / 2);
+}
+
 void sched_init()
 {
-	/* Zero all of the processes (unused) */
-	int x;
-	for(x = 0;x < PTABLE_SIZE;x++)
-		memset(ptable + x, 0, sizeof(struct proc));
 	/* No process is running right now. */
 	rproc = NULL;
 	/* Initilize our process table lock */
-	slock_init(&ptable_lock);
+	qlock_init(&ptable_lock);
+	qlock_name(&ptable_lock, "ptable");
+
+	/* All run queues are empty */
+	memset(cpu_queues, 0, sizeof(cpu_queues));
+	int x;
+	for(x = 0;x < CPU_MAX;x++)
+		slock_init(&cpu_queues[x].lock);
+	slock_name(&cpu_queues[0].lock, "run_queue");
+	sched_aged = 0;
+}
+
+/**
+ * Lock the queues the process belongs to and return them.
+ */
+static struct cpu_queues* sched_lock_proc(struct proc* p)
+{
+	while(1)
+	{
+		int cpu = p->rq_cpu;
+		slock_acquire(&cpu_queues[cpu].lock);
+		/* The process might have moved in the meantime */
+		if(p->rq_cpu == cpu) return cpu_queues + cpu;
+		slock_release(&cpu_queues[cpu].lock);
+	}
+}
+
+/**
+ * Put the process at the back of its queue. (queue lock required)
+ */
+static void sched_link(struct cpu_queues* rq, struct proc* p)
+{
+	p->priority = sched_prio(p);
+	struct run_queue* q = rq->queues + p->priority;
+
+	p->rq_next = NULL;
+	p->rq_prev = q->tail;
+	if(q->tail) q->tail->rq_next = p;
+	else q->head = p;
+	q->tail = p;
+
+	p->rq_queued = 1;
+	rq->map |= 1 << p->priority;
+	rq->count++;
+}
+
+/**
+ * Take the process out of its queue. (queue lock required)
+ */
+static void sched_unlink(struct cpu_queues* rq, struct proc* p)
+{
+	struct run_queue* q = rq->queues + p->priority;
+	if(p->rq_prev) p->rq_prev->rq_next = p->rq_next;
+	else q->head = p->rq_next;
+	if(p->rq_next) p->rq_next->rq_prev = p->rq_prev;
+	else q->tail = p->rq_prev;
+
+	p->rq_next = p->rq_prev = NULL;
+	p->rq_queued = 0;
+	if(!q->head) rq->map &= ~(1 << p->priority);
+	rq->count--;
+}
+
+/**
+ * Choose the cpu the process should run on next. The process stays on the
+ * cpu it ran on last unless another cpu is idle or less busy.
+ */
+static int sched_pick_cpu(struct proc* p)
+{
+	int best = p->rq_cpu;
+	if(!cpus[best].started) best = 0;
+	if(cpu_count < 2) return best;
+
+	/* Nothing beats an idle cpu that still has the process cached */
+	if(!cpus[best].proc && !cpu_queues[best].count)
+		return best;
+
+	int x;
+	for(x = 0;x < cpu_count;x++)
+	{
+		if(!cpus[x].started) continue;
+		if(!cpus[x].proc && !cpu_queues[x].count)
+			return x;
+		if(cpu_queues[x].count < cpu_queues[best].count)
+			best = x;
+	}
+
+	return best;
+}
+
+/**
+ * Interrupt the cpu if it should run the process it just got instead of
+ * what it is doing right now.
+ */
+static void sched_kick(int cpu, struct proc* p)
+{
+	struct cpu* c = cpus + cpu;
+	struct proc* running = c->proc;
+	if(!running || p->priority < running->priority)
+		cpu_reschedule(c);
+}
+
+void sched_enqueue(struct proc* p)
+{
+	int cpu;
+	while(1)
+	{
+		struct cpu_queues* home = sched_lock_proc(p);
+		if(p->rq_queued)
+		{
+			slock_release(&home->lock);
+			return;
+		}
+
+		cpu = sched_pick_cpu(p);
+		struct cpu_queues* rq = cpu_queues + cpu;
+		if(rq == home)
+		{
+			sched_link(rq, p);
+			slock_release(&rq->lock);
+			break;
+		}
+
+		/* Take both locks in order so two cpus can't deadlock */
+		slock_release(&home->lock);
+		struct cpu_queues* first = home < rq ? home : rq;
+		struct cpu_queues* second = home < rq ? rq : home;
+		slock_acquire(&first->lock);
+		slock_acquire(&second->lock);
+
+		int moved = 0;
+		if(cpu_queues + p->rq_cpu == home && !p->rq_queued)
+		{
+			p->rq_cpu = cpu;
+			sched_link(rq, p);
+			moved = 1;
+		}
+
+		slock_release(&second->lock);
+		slock_release(&first->lock);
+		if(moved) break;
+	}
+
+	sched_kick(cpu, p);
+}
+
+void sched_dequeue(struct proc* p)
+{
+	struct cpu_queues* rq = sched_lock_proc(p);
+	if(p->rq_queued) sched_unlink(rq, p);
+	slock_release(&rq->lock);
+}
+
+void sched_boost(struct proc* p)
+{
+	/* Only processes that are mostly waiting get the boost */
+	uint recent = p->vruntime - p->vruntime_mark;
+	p->vruntime_mark += recent / 2;
+	if(recent < SCHED_DEMOTE_VTIME)
+		p->sched_boost = 1;
+}
+
+void sched_set_nice(struct proc* p, int nice)
+{
+	if(nice < SCHED_NICE_MIN) nice = SCHED_NICE_MIN;
+	if(nice > SCHED_NICE_MAX) nice = SCHED_NICE_MAX;
+	p->nice = nice;
+
+	/* Move the process to its new queue */
+	if(p->rq_queued)
+	{
+		sched_dequeue(p);
+		sched_enqueue(p);
+	}
+}
+
+int sched_tick(int ticks)
+{
+	struct proc* p = rproc;
+	if(!p) return 0;
+	struct cpu_queues* rq = cpu_queues + cpu_this()->id;
+
+	int nice = p->nice;
+	if(nice < SCHED_NICE_MIN) nice = SCHED_NICE_MIN;
+	if(nice > SCHED_NICE_MAX) nice = SCHED_NICE_MAX;
+	p->vruntime += ticks * (SCHED_NICE_0_WEIGHT * SCHED_NICE_0_WEIGHT
+		/ sched_nice_weight[nice - SCHED_NICE_MIN]);
+
+	p->timeslice -= ticks;
+	if(p->timeslice <= 0)
+	{
+		/* Keep going if nobody else wants the cpu */
+		if(!rq->count)
+		{
+			p->timeslice = sched_slice(p->priority);
+			return 0;
+		}
+
+		return 1;
+	}
+
+	/* Is there something more important waiting? */
+	if(rq->map & ((1 << p->priority) - 1))
+		return 1;
+
+	return 0;
+}
+
+void sched_arm_clock(void)
+{
+	struct cpu* c = cpu_this();
+	struct cpu_queues* rq = cpu_queues + c->id;
+	uint ticks = KTIMER_MAX_TICKS;
+	if(rproc && rq->count)
+	{
+		if(rq->map & ((1 << rproc->priority) - 1))
+			ticks = 0; /* Something more important is waiting */
+		else if(rproc->timeslice > 0)
+			ticks = rproc->timeslice - 1;
+		else ticks = 0;
+	}
+
+	/* The boot cpu drives the timer wheel, the others use their own */
+	if(!c->id) ktimer_arm(ticks);
+	else if(ticks != KTIMER_MAX_TICKS || !c->timer_ticks)
+		cpu_timer_arm(ticks);
+}
+
+/**
+ * Forgive half of the recent virtual runtime of every process. Queued
+ * processes move to the queue for their new priority. (lock required)
+ */
+static void sched_age(void)
+{
+	struct proc* p;
+	for(p = proc_list;p;p = p->all_next)
+	{
+		p->vruntime_mark += (p->vruntime - p->vruntime_mark) / 2;
+		if(p->rq_queued)
+		{
+			sched_dequeue(p);
+			sched_enqueue(p);
+		}
+	}
+
+	sched_aged = ktimer_ticks();
+}
+
+/**
+ * Take the first process out of the queues that isn't still running on
+ * another cpu. Returns NULL if there is none. (queue lock required)
+ */
+static struct proc* sched_take(struct cpu_queues* rq)
+{
+	int map = rq->map;
+	while(map)
+	{
+		/* The lowest bit is the highest priority */
+		int prio = __builtin_ctz(map);
+		struct proc* p;
+		for(p = rq->queues[prio].head;p;p = p->rq_next)
+		{
+			/* It got woken up before it could leave its cpu */
+			if(p->on_cpu) continue;
+
+			sched_unlink(rq, p);
+			return p;
+		}
+
+		map &= ~(1 << prio);
+	}
+
+	return NULL;
+}
+
+/**
+ * Take a process from the cpu with the most waiting processes and move it
+ * to this cpu. Returns NULL if there is nothing to take. (lock required)
+ */
+static struct proc* sched_steal(struct cpu* c)
+{
+	int busiest = -1;
+	int most = 0;
+	int x;
+	for(x = 0;x < cpu_count;x++)
+	{
+		if(x == c->id) continue;
+		if(cpu_queues[x].count > most)
+		{
+			most = cpu_queues[x].count;
+			busiest = x;
+		}
+	}
+
+	if(busiest < 0) return NULL;
+
+	struct cpu_queues* rq = cpu_queues + busiest;
+	slock_acquire(&rq->lock);
+	struct proc* p = sched_take(rq);
+	if(p) p->rq_cpu = c->id;
+	slock_release(&rq->lock);
+
+#ifdef DEBUG
+	if(p) cprintf("sched: cpu %d took %s:%d from cpu %d\n",
+			c->id, p->name, p->pid, busiest);
+#endif
+
+	return p;
+}
+
+/**
+ * Take the next process to run on this cpu out of the run queues. If this
+ * cpu has nothing to run, a process is taken from the busiest cpu.
+ * Processes that stopped being runnable while they were queued are
+ * dropped. Returns NULL if there are no runnable processes. (lock required)
+ */
+static struct proc* sched_next(struct cpu* c)
+{
+	struct cpu_queues* rq = cpu_queues + c->id;
+	while(1)
+	{
+		slock_acquire(&rq->lock);
+		struct proc* p = sched_take(rq);
+		slock_release(&rq->lock);
+
+		if(!p) p = sched_steal(c);
+		if(!p) return NULL;
+
+		if(p->state == PROC_RUNNABLE || p->state == PROC_READY)
+			return p;
+#ifdef DEBUG
+		cprintf("sched: dropped %s:%d from the run queue of cpu %d\n",
+				p->name, p->pid, c->id);
+#endif
+	}
+}
+
+/**
+ * Returns the amount of processes this cpu could run in the next round.
+ */
+static int sched_waiting(struct cpu* c)
+{
+	int waiting = cpu_queues[c->id].count;
+	if(waiting) return waiting;
+
+	/* Is there something to take from the other cpus? */
+	int x;
+	for(x = 0;x < cpu_count;x++)
+		if(cpu_queues[x].count) return 1;
+
+	return 0;
 }
 
 void yield(void)
 {
 	/* We are about to enter the scheduler again, reacquire lock. */
-	slock_acquire(&ptable_lock);
+	qlock_acquire(&ptable_lock);
 
 	/* Set state to runnable. */
 	rproc->state = PROC_RUNNABLE;
+	sched_enqueue(rproc);
 
 	/* Give up cpu for a scheduling round */
 	context_restore((uintptr_t*)&rproc->context, k_context);
@@ -37,6 +478,8 @@ void yield_withlock(void)
 {
 	/* We have the lock, just enter the scheduler. */
 	/* We are also not changing the state of the process here. */
+	if(rproc->state == PROC_RUNNABLE || rproc->state == PROC_READY)
+		sched_enqueue(rproc);
 
 	/* Give up cpu for a scheduling round */
 	context_restore((uintptr_t*)&rproc->context, k_context);
@@ -47,45 +490,82 @@ void yield_withlock(void)
 void sched(void)
 {
 	/* Acquire ptable lock */
-	slock_acquire(&ptable_lock);
-	scheduler();	
+	qlock_acquire(&ptable_lock);
+	scheduler();
 }
 
 void scheduler(void)
 {
 	/* WARNING: ptable lock must be held here.*/
+	struct cpu* c = cpu_this();
+
+	/**
+	 * The boot cpu also drives the timer wheel and the io scheduler.
+	 * The io scheduler gets checked once every round, a round is over
+	 * when every process that was queued at the start of the round
+	 * has been given the cpu.
+	 */
+	int boot = !c->id;
+	int round = 0;
 
 	while(1)
 	{
-		int x;
-		for(x = 0;x < PTABLE_SIZE;x++)
+		if(boot && ktimer_ticks() - sched_aged >= SCHED_AGE_TICKS)
+			sched_age();
+
+		struct proc* p = NULL;
+		if(round > 0)
 		{
-			if(ptable[x].state == PROC_RUNNABLE
-					|| ptable[x].state == PROC_READY)
-			{
-				/* Found a process! */
-				rproc = ptable + x;
+			p = sched_next(c);
+			round--;
+		}
 
-				/* release lock */
-				slock_release(&ptable_lock);
+		if(p)
+		{
+			/* Found a process! */
+			rproc = p;
+			p->on_cpu = 1;
+			rproc->timeslice = sched_slice(rproc->priority);
 
-				/* Make the context switch */
-				context_switch(rproc);
-				//cprintf("Process is done for now.\n");
+			/* release lock */
+			qlock_release(&ptable_lock);
 
-				// The new process is now scheduled.
-				/* The process is done for now. */
-				rproc = NULL;
+			/* Interrupt the process when its time is up */
+			sched_arm_clock();
 
-				/* The process has reacquired the lock. */
-			}
+			/* Make the context switch */
+			context_switch(rproc);
+
+			/* The process is done for now. */
+			rproc = NULL;
+
+			/* The process has reacquired the lock. */
+			p->on_cpu = 0;
+			continue;
 		}
 
 		/* We still have the process table lock */
-		slock_release(&ptable_lock);
+		qlock_release(&ptable_lock);
 		/* run io scheduler */
-		iosched_check();
+		if(boot) iosched_check();
+
+		/* Nothing to run, sleep until the next interrupt */
+		if(!sched_waiting(c))
+		{
+			if(boot) ktimer_arm(KTIMER_MAX_TICKS);
+			if(!sched_waiting(c))
+			{
+				c->idle = 1;
+				cpu_idle();
+				c->idle = 0;
+				/* The interrupt might have been the clock */
+				if(boot) ktimer_clock_interrupt();
+			}
+		}
+
 		/* Reacquire the lock */
-		slock_acquire(&ptable_lock);
+		qlock_acquire(&ptable_lock);
+
+		round = sched_waiting(c);
 	}
 }
@@ -0,0 +1,190 @@
+/**
+ * Wait queues. A process that blocks on an event puts itself into the wait
+ * queue for that event so that waking up the waiters only touches the
+ * processes that are actually waiting, without a scan of the ptable.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stdlock.h"
+#include "waitqueue.h"
+#include "proc.h"
+#include "panic.h"
+
+// #define DEBUG
+
+void waitqueue_init(waitqueue_t* q, int flags)
+{
+	memset(q, 0, sizeof(waitqueue_t));
+	slock_init(&q->lock);
+	q->flags = flags;
+}
+
+/**
+ * Unlink the process from the queue. (queue lock required)
+ */
+static void waitqueue_unlink(waitqueue_t* q, struct proc* p)
+{
+	if(p->wq_prev) p->wq_prev->wq_next = p->wq_next;
+	else q->head = p->wq_next;
+	if(p->wq_next) p->wq_next->wq_prev = p->wq_prev;
+	else q->tail = p->wq_prev;
+
+	p->wq_next = p->wq_prev = NULL;
+	p->wq = NULL;
+}
+
+/**
+ * Unlink the process from the queue and make it runnable. Returns 1 if the
+ * process was woken up, 0 if it wasn't blocked anymore. (queue lock
+ * required)
+ */
+static int waitqueue_wakeup(waitqueue_t* q, struct proc* p)
+{
+	waitqueue_unlink(q, p);
+
+	/* A signal might have woken the process already */
+	if(p->state != PROC_BLOCKED)
+		return 0;
+
+#ifdef DEBUG
+	cprintf("waitqueue: waking up %s:%d\n", p->name, p->pid);
+#endif
+
+	p->state = PROC_RUNNABLE;
+	p->block_type = PROC_BLOCKED_NONE;
+	if(q->flags & WAITQUEUE_INTERACTIVE)
+		sched_boost(p);
+	sched_enqueue(p);
+
+	return 1;
+}
+
+void waitqueue_add(waitqueue_t* q, struct proc* p)
+{
+	if(p->wq) waitqueue_remove(p);
+
+	slock_acquire(&q->lock);
+	p->wq = q;
+	p->wq_next = NULL;
+	p->wq_prev = q->tail;
+	if(q->tail) q->tail->wq_next = p;
+	else q->head = p;
+	q->tail = p;
+	slock_release(&q->lock);
+}
+
+void waitqueue_remove(struct proc* p)
+{
+	waitqueue_t* q = p->wq;
+	if(!q) return;
+
+	slock_acquire(&q->lock);
+	/* Another cpu might have taken the process out in the meantime */
+	if(p->wq == q)
+		waitqueue_unlink(q, p);
+	slock_release(&q->lock);
+}
+
+struct proc* waitqueue_first(waitqueue_t* q)
+{
+	slock_acquire(&q->lock);
+	struct proc* p = q->head;
+	slock_release(&q->lock);
+
+	return p;
+}
+
+void waitqueue_wake_proc(struct proc* p)
+{
+	waitqueue_t* q = p->wq;
+	if(!q) return;
+
+	/**
+	 * Timers fire on the boot cpu while the process runs somewhere else,
+	 * it might have left the queue before we got the lock.
+	 */
+	slock_acquire(&q->lock);
+	if(p->wq == q)
+		waitqueue_wakeup(q, p);
+	slock_release(&q->lock);
+}
+
+int waitqueue_wake_one(waitqueue_t* q)
+{
+	int woken = 0;
+	slock_acquire(&q->lock);
+	while(q->head && !woken)
+		woken = waitqueue_wakeup(q, q->head);
+	slock_release(&q->lock);
+
+	return woken;
+}
+
+int waitqueue_wake_all(waitqueue_t* q)
+{
+	int woken = 0;
+	slock_acquire(&q->lock);
+	while(q->head)
+		woken += waitqueue_wakeup(q, q->head);
+	slock_release(&q->lock);
+
+	return woken;
+}
+
+int waitqueue_wake_if(waitqueue_t* q, int (*match)(struct proc* p, void* arg),
+		void* arg, int max)
+{
+	int woken = 0;
+	slock_acquire(&q->lock);
+	struct proc* p = q->head;
+	while(p && (!max || woken < max))
+	{
+		struct proc* next = p->wq_next;
+		if(match(p, arg))
+			woken += waitqueue_wakeup(q, p);
+		p = next;
+	}
+	slock_release(&q->lock);
+
+	return woken;
+}
+
+void waitqueue_prepare(waitqueue_t* q, int block_type)
+{
+	/* Wakers only look at processes in the queue that are blocked */
+	rproc->block_type = block_type;
+	rproc->state = PROC_BLOCKED;
+	waitqueue_add(q, rproc);
+}
+
+void waitqueue_sleep(waitqueue_t* q, int block_type, slock_t* lock)
+{
+	waitqueue_prepare(q, block_type);
+	waitqueue_block(lock);
+}
+
+void waitqueue_block(slock_t* lock)
+{
+	if(lock) slock_release(lock);
+
+	/* Give up the cpu until somebody wakes us up */
+	qlock_acquire(&ptable_lock);
+	yield_withlock();
+
+	/* We might have been woken up by something else */
+	waitqueue_remove(rproc);
+	if(lock) slock_acquire(lock);
+}
+
+void waitqueue_sleep_ptable(waitqueue_t* q, int block_type)
+{
+	waitqueue_prepare(q, block_type);
+
+	/* The scheduler releases the ptable lock for us */
+	yield_withlock();
+
+	waitqueue_remove(rproc);
+	qlock_acquire(&ptable_lock);
+}
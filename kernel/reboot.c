@@ -7,14 +7,14 @@
 #if 0
 static int still_up()
 {
-	int x;
-	for(x = 0;x < PTABLE_SIZE;x++)
+	struct proc* p;
+	for(p = proc_list;p;p = p->all_next)
 	{
-		if(ptable + 1 == rproc) continue;
+		if(p == rproc) continue;
 
-		if(ptable[x].state != PROC_UNUSED)
+		if(p->state != PROC_UNUSED)
 		{
-			cprintf("Still alive: %s\n", ptable[x].name);
+			cprintf("Still alive: %s\n", p->name);
 			return 1;
 		}
 	}
@@ -26,21 +26,20 @@ static int still_up()
 void pre_shutdown()
 {
 	/* Prevent creation of new processes */
-	slock_acquire(&ptable_lock);
+	qlock_acquire(&ptable_lock);
 
 	cprintf("kernel: sending SIGKILL to all processes...\n");
 #if 0
 	/* Kill all processes */
-	int i;
-	for(i = 0;i < PTABLE_SIZE;i++)
+	struct proc* p;
+	for(p = proc_list;p;p = p->all_next)
 	{
-		if(ptable[i].state == PROC_UNUSED
-				|| ptable + i == rproc)
+		if(p->state == PROC_UNUSED || p == rproc)
 			continue;
 
-		if(sig_proc(ptable + i, SIGKILL))
+		if(sig_proc(p, SIGKILL))
 			ic("Couldn't kill process!\n");
-		cprintf("killed %s\n", ptable[i].name);
+		cprintf("killed %s\n", p->name);
 	}
 
 	/* Make sure all processes have exited */
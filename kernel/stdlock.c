@@ -5,15 +5,30 @@
  * A standard lock library implementation.
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "stdlock.h"
+#include "panic.h"
+
+#ifdef LOCK_STATS
+#define LOCK_STATS_MAX 0x40
+static struct lock_stats lock_stats_table[LOCK_STATS_MAX];
+static int lock_stats_count;
+#endif
 
 void slock_init(slock_t* lock)
 {
 	lock->val = 0;
+	lock->stats = NULL;
 }
 
 void slock_release(slock_t* lock)
 {
+#ifdef LOCK_STATS
+	lock_stats_released(lock->stats);
+#endif
+	lock_barrier();
 	lock->val = 0;
 }
 
@@ -21,9 +36,97 @@ void tlock_init(tlock_t* lock)
 {
 	lock->next_ticket = 0;
 	lock->currently_serving = 0;
+	lock->stats = NULL;
 }
 
 void tlock_release(tlock_t* lock)
 {
-	lock->currently_serving++;
+#ifdef LOCK_STATS
+	lock_stats_released(lock->stats);
+#endif
+	/* Only the holder writes this, no need for an atomic add */
+	lock_barrier();
+	lock->currently_serving = lock->currently_serving + 1;
+}
+
+void qlock_init(qlock_t* lock)
+{
+	lock->tail = NULL;
+	lock->owner = NULL;
+	lock->stats = NULL;
+}
+
+/**
+ * Get a statistics entry for a lock with the given name. Returns NULL if
+ * lock statistics are disabled or if there are no entries left.
+ */
+static struct lock_stats* lock_stats_alloc(const char* name)
+{
+#ifdef LOCK_STATS
+	if(lock_stats_count >= LOCK_STATS_MAX)
+		return NULL;
+
+	struct lock_stats* stats = lock_stats_table + lock_stats_count;
+	lock_stats_count++;
+	memset(stats, 0, sizeof(struct lock_stats));
+	stats->name = name;
+	return stats;
+#else
+	return NULL;
+#endif
+}
+
+void slock_name(slock_t* lock, const char* name)
+{
+	lock->stats = lock_stats_alloc(name);
+}
+
+void tlock_name(tlock_t* lock, const char* name)
+{
+	lock->stats = lock_stats_alloc(name);
+}
+
+void qlock_name(qlock_t* lock, const char* name)
+{
+	lock->stats = lock_stats_alloc(name);
+}
+
+void lock_stats_acquired(struct lock_stats* stats, int spins)
+{
+	if(!stats) return;
+
+	stats->acquisitions++;
+	if(spins)
+	{
+		stats->contended++;
+		stats->spins += spins;
+	}
+
+	stats->hold_start = lock_timestamp();
+}
+
+void lock_stats_released(struct lock_stats* stats)
+{
+	if(!stats) return;
+
+	unsigned int held = lock_timestamp() - stats->hold_start;
+	if(held > stats->max_hold)
+		stats->max_hold = held;
+}
+
+void lock_stats_print(void)
+{
+#ifdef LOCK_STATS
+	cprintf("lock: acquisitions contended spins max_hold\n");
+	int x;
+	for(x = 0;x < lock_stats_count;x++)
+	{
+		struct lock_stats* stats = lock_stats_table + x;
+		cprintf("%s: %d %d %d %d\n", stats->name,
+				stats->acquisitions, stats->contended,
+				stats->spins, stats->max_hold);
+	}
+#else
+	cprintf("Lock statistics are disabled.\n");
+#endif
 }
@@ -16,6 +16,7 @@
 #include "elf.h"
 #include "stdarg.h"
 #include "syscall.h"
+#include "systrace.h"
 #include "panic.h"
 #include "reboot.h"
 
@@ -122,7 +123,28 @@ int (*syscall_table[])(void) = {
 	sys_sync,
 	sys_setreuid,
 	sys_setregid,
-	sys_reboot
+	sys_reboot,
+	sys_nice,
+	sys_getpriority,
+	sys_setpriority,
+	sys_nanosleep,
+	sys_clock_gettime,
+	sys_readv,
+	sys_writev,
+	sys_preadv,
+	sys_pwritev,
+	sys_sendfile,
+	sys_splice,
+	sys_poll,
+	sys_event_create,
+	sys_event_ctl,
+	sys_event_wait,
+	sys_getrlimit,
+	sys_setrlimit,
+	sys_iobatch_setup,
+	sys_iobatch_enter,
+	sys_trace_ctl,
+	sys_trace_read
 };
 
 char* syscall_table_names[] = {
@@ -219,7 +241,28 @@ char* syscall_table_names[] = {
     "sync",
 	"setreuid",
 	"setregid",
-	"reboot"
+	"reboot",
+	"nice",
+	"getpriority",
+	"setpriority",
+	"nanosleep",
+	"clock_gettime",
+	"readv",
+	"writev",
+	"preadv",
+	"pwritev",
+	"sendfile",
+	"splice",
+	"poll",
+	"event_create",
+	"event_ctl",
+	"event_wait",
+	"getrlimit",
+	"setrlimit",
+	"iobatch_setup",
+	"iobatch_enter",
+	"trace_ctl",
+	"trace_read"
 };
 
 
@@ -257,8 +300,16 @@ int syscall_handler(int* esp)
 	fs_sync();
 #endif
 
+	struct trace_event event;
+	int traced = trace_begin(&event, syscall_number);
+	unsigned int start = lock_timestamp();
+
 	return_value = syscall_table[syscall_number]();
 
+	unsigned int cycles = lock_timestamp() - start;
+	syscall_stats_add(syscall_number, cycles, return_value);
+	if(traced) trace_end(&event, cycles, return_value);
+
 #ifdef DEBUG
 	cprintf("%s:%d: syscall: return value: %d\n", rproc->name,
 		rproc->pid, return_value);
@@ -279,36 +330,53 @@ int sys_isatty(void)
 	for(x = 0;x < MAX_TTYS;x++)
 	{
 		tty_t t = tty_find(x);
-		if(t->driver == rproc->fdtab[fd]->device)
+		if(t->driver == rproc->fdtab->fds[fd]->device)
 			return 1;
 	}
 
 	return 0;
 }
 
+/**
+ * Processes waiting on a condition variable wait in one of these queues,
+ * picked by the address of the condition variable.
+ */
+#define COND_QUEUES 0x10
+static waitqueue_t cond_queues[COND_QUEUES];
+#define COND_QUEUE(c) (cond_queues + (((uintptr_t)(c) >> 3) % COND_QUEUES))
+
+/**
+ * Block until signal_cv hands the signal for our ticket to us. Other
+ * wakeups don't count, we just go back to sleep. We are only ever in the
+ * queue while we sleep, so the signal can't arrive between the check and
+ * going to sleep.
+ */
+static void cond_sleep(struct cond* c)
+{
+	while(rproc->b_condition)
+		waitqueue_sleep(COND_QUEUE(c), PROC_BLOCKED_COND, NULL);
+}
+
 /* int wait_s(struct cond* c, struct slock* lock) */
 int sys_wait_s(void)
 {	
 	struct cond* c;
 	struct slock* lock;
 
-	if(syscall_get_buffer_ptr((void**)&c, sizeof(struct cond), 0))
+	if(syscall_get_output_ptr((void**)&c, sizeof(struct cond), 0))
 		return -1;
-	if(syscall_get_buffer_ptr((void**)&lock, sizeof(struct slock), 1))
+	if(syscall_get_output_ptr((void**)&lock, sizeof(struct slock), 1))
 		return -1;
 
-	slock_acquire(&ptable_lock);
 	if(c->next_signal > c->current_signal){
 		c->next_signal = 0;
 		c->current_signal = 0;
 	}
 
-	rproc->block_type = PROC_BLOCKED_COND;
 	rproc->b_condition = c;
-	rproc->state = PROC_BLOCKED;
 	rproc->b_condition_signal = c->current_signal++;
 	slock_release(lock);
-	slock_release(&ptable_lock);
+	cond_sleep(c);
 	return 0;
 }
 
@@ -318,50 +386,62 @@ int sys_wait_t(void)
 	struct cond* c;
 	struct tlock* lock;
 
-	if(syscall_get_buffer_ptr((void**)&c, sizeof(struct cond), 0))
+	if(syscall_get_output_ptr((void**)&c, sizeof(struct cond), 0))
 		return -1;
-	if(syscall_get_buffer_ptr((void**)&lock, sizeof(struct tlock), 1))
+	if(syscall_get_output_ptr((void**)&lock, sizeof(struct tlock), 1))
 		return -1;
 
-	slock_acquire(&ptable_lock);
 	if(c->next_signal>c->current_signal){
 		c->next_signal = 0;
 		c->current_signal = 0;
 	}
-	rproc->block_type = PROC_BLOCKED_COND;
+
 	rproc->b_condition = c;
-	rproc->state = PROC_BLOCKED;
 	rproc->b_condition_signal = c->current_signal++;
 	tlock_release(lock);
-	slock_release(&ptable_lock);
+	cond_sleep(c);
 	return 0;
 }
 
+/* A signal on a condition variable for the waiter with the ticket */
+struct cond_signal
+{
+	struct cond* c; /* The condition variable that got signaled */
+	int ticket; /* The ticket of the waiter that gets the signal */
+	int delivered; /* Did the waiter get the signal? */
+};
 
+/**
+ * Hand the signal arg to p if p is waiting for it. The signal counts even
+ * if something else woke p up already, p is still in the queue and goes
+ * back to sleep until it gets the signal.
+ */
+static int cond_match(struct proc* p, void* arg)
+{
+	struct cond_signal* s = arg;
+	if(p->b_condition != s->c || p->b_condition_signal != s->ticket)
+		return 0;
+
+	p->b_condition = NULL;
+	s->delivered = 1;
+	return 1;
+}
 
 /* int signal_cv(struct cond* c) */
 int sys_signal_cv(void)
 {
 	struct cond* c;
-	if(syscall_get_buffer_ptr((void**)&c, sizeof(struct cond), 0))
+	if(syscall_get_output_ptr((void**)&c, sizeof(struct cond), 0))
 		return -1;
 
-	slock_acquire(&ptable_lock);
-	int i;
-	for(i = 0; i< PTABLE_SIZE; i++){
-		if(ptable[i].state != PROC_BLOCKED) continue;
-		if(ptable[i].block_type != PROC_BLOCKED_COND) continue;
-		if(ptable[i].b_condition != c) continue;
-		if(c->next_signal != ptable[i].b_condition_signal) continue;
-
-		ptable[i].state = PROC_RUNNABLE;
-		ptable[i].block_type = PROC_BLOCKED_NONE;
-		ptable[i].b_condition_signal = 0;
+	struct cond_signal s;
+	s.c = c;
+	s.ticket = c->next_signal;
+	s.delivered = 0;
+	waitqueue_wake_if(COND_QUEUE(c), cond_match, &s, 1);
+	if(s.delivered)
 		c->next_signal++;
-		break;
-	}
 
-	slock_release(&ptable_lock);
 	return 0;
 }
 
@@ -436,17 +516,40 @@ int sys_mprotect(void)
 	/* Start must be in the user address space */
 	if(start >= UVM_KVM_S) return -1;
 
-	size_t end = (int)(start + len);
+	size_t end = PGROUNDUP(start + len);
+	if(end > UVM_KVM_S || end < start) return -1;
+
+	vmflags_t flags = VM_TBL_USRP | VM_TBL_READ;
+	if(prot & PROT_WRITE) flags |= VM_TBL_WRIT;
+	if(prot & PROT_EXEC) flags |= VM_TBL_EXEC;
 
-	unsigned char flags = 0;
-	if(prot & PROT_READ) flags |= 0;
-	if(prot & PROT_WRITE) flags |= VM_TBL_WRIT | VM_TBL_READ;
-	if(prot & PROT_READ) flags |= 0;
+	slock_acquire(&rproc->mem_lock);
 
+	/* Pages that haven't been touched yet get the new flags on fault */
+	if(vm_area_protect(&rproc->vm_areas, start, end, flags))
+	{
+		slock_release(&rproc->mem_lock);
+		return -1;
+	}
 
 	size_t x;
 	for(x = start;x < end;x += PGSIZE)
-		vm_setpgflags(x, rproc->pgdir, flags);
+	{
+		if(!vm_findpg(x, 0, rproc->pgdir, 0, 0))
+			continue;
+
+		vmflags_t pg_flags = vm_findpgflags(x, rproc->pgdir);
+		pg_flags &= ~(VM_TBL_WRIT | VM_TBL_EXEC);
+		pg_flags |= flags;
+#ifdef __ALLOW_VM_SHARE__
+		/* Copy on write pages must stay read only */
+		if(pg_flags & VM_TBL_COWR)
+			pg_flags &= ~VM_TBL_WRIT;
+#endif
+		vm_setpgflags(x, rproc->pgdir, pg_flags);
+	}
+
+	slock_release(&rproc->mem_lock);
 
 	return 0;
 }
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/fcntl.h>
@@ -13,6 +14,7 @@
 #include "fsman.h"
 #include "tty.h"
 #include "pipe.h"
+#include "kpoll.h"
 #include "syscall.h"
 #include "chronos.h"
 #include "proc.h"
@@ -49,7 +51,7 @@ int sys_stat(void)
 	const char* path;
 	struct stat* st;
 	if(syscall_get_str_ptr(&path, 0)) return -1;
-	if(syscall_get_buffer_ptr((void**) &st, sizeof(struct stat), 1)) return -1;
+	if(syscall_get_output_ptr((void**) &st, sizeof(struct stat), 1)) return -1;
 #ifdef DEBUG
 	if(path) cprintf("%s: statting file: %s\n", rproc->name, path);
 #endif
@@ -67,15 +69,13 @@ int sys_stat(void)
 
 }
 
-/* int open(const char* path, int flags, ...); */
-int sys_open(void)
+/**
+ * Open the file at path with the given flags in a new file descriptor of
+ * the running process. mode is only used if the file gets created.
+ * Returns the new file descriptor, -1 on failure.
+ */
+static int fd_open(const char* path, int flags, mode_t mode)
 {
-	const char* path;
-	int flags;
-	mode_t mode = 0x0;
-
-	if(syscall_get_str_ptr(&path, 0)) return -1; 
-	if(syscall_get_int(&flags, 1)) return -1;
 	int fd = fd_next(rproc);
 	if(fd == -1) return -1;
 
@@ -84,86 +84,95 @@ int sys_open(void)
 #endif
 
 	/* Lock this file descriptor */
-	slock_acquire(&rproc->fdtab[fd]->lock);
+	kmutex_lock(&rproc->fdtab->fds[fd]->lock);
 
 #ifdef O_PATH
 	if(flags & O_PATH)
 	{
-		strncpy(rproc->fdtab[fd].path, path, FILE_MAX_PATH);
-		rproc->fdtab[fd].type = FD_TYPE_PATH;
-		slock_release(&rproc->fdtab[fd]->lock);
+		strncpy(rproc->fdtab->fds[fd].path, path, FILE_MAX_PATH);
+		rproc->fdtab->fds[fd].type = FD_TYPE_PATH;
+		kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 		return fd;
 	}
 #endif
 
 	int created = 0;
 	if(flags & O_CREAT)
-	{
-		if(syscall_get_int((int*)&mode, 2)) 
-		{
-			slock_release(&rproc->fdtab[fd]->lock);
-			fd_free(rproc, fd);
-			return -1;
-		}
-
 		created = fs_create(path, flags, mode, 
 				rproc->uid, rproc->gid);
-	}
 
 	/* Check for O_EXCL */
 	if((flags & O_CREAT) && (flags & O_EXCL) && created)
 	{
-		slock_release(&rproc->fdtab[fd]->lock);
+		kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 		fd_free(rproc, fd);
 		return -1;
 	}
 
-	rproc->fdtab[fd]->type = FD_TYPE_FILE;
-	strncpy(rproc->fdtab[fd]->path, path, FILE_MAX_PATH);
-	rproc->fdtab[fd]->flags = flags;
-	rproc->fdtab[fd]->i = fs_open((char*) path, flags,
+	rproc->fdtab->fds[fd]->type = FD_TYPE_FILE;
+	strncpy(rproc->fdtab->fds[fd]->path, path, FILE_MAX_PATH);
+	rproc->fdtab->fds[fd]->flags = flags;
+	rproc->fdtab->fds[fd]->i = fs_open((char*) path, flags,
 			mode, rproc->uid, rproc->uid);
 
-	if(rproc->fdtab[fd]->i == NULL)
+	if(rproc->fdtab->fds[fd]->i == NULL)
 	{
-		slock_release(&rproc->fdtab[fd]->lock);
+		kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 		fd_free(rproc, fd);
 		return -1;
 	}
 
 	struct stat st;
-	fs_stat(rproc->fdtab[fd]->i, &st);
+	fs_stat(rproc->fdtab->fds[fd]->i, &st);
 
 	if(S_ISDEV(st.st_mode))
 	{
 		/* Get the driver open */
-		rproc->fdtab[fd]->type = FD_TYPE_DEVICE;
+		rproc->fdtab->fds[fd]->type = FD_TYPE_DEVICE;
 		struct devnode node;
-		fs_read(rproc->fdtab[fd]->i, &node, 
+		fs_read(rproc->fdtab->fds[fd]->i, &node, 
 				sizeof(struct devnode), 0);
-		rproc->fdtab[fd]->device = dev_lookup(node.dev);
+		rproc->fdtab->fds[fd]->device = dev_lookup(node.dev);
 	}
 
 	if(flags & O_DIRECTORY && !S_ISDIR(st.st_mode))
 	{
-		slock_release(&rproc->fdtab[fd]->lock);
+		kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 		fd_free(rproc, fd);
 		return -1;
 	}
 
 	if(flags & O_TRUNC && S_ISREG(st.st_mode))
-		fs_truncate(rproc->fdtab[fd]->i, 0);
+		fs_truncate(rproc->fdtab->fds[fd]->i, 0);
 
-	rproc->fdtab[fd]->seek = 0;
+	rproc->fdtab->fds[fd]->seek = 0;
 #ifdef DEBUG
 	cprintf("%s: opened file %s with fd %d\n", rproc->name, path, fd);
 #endif
 
-	slock_release(&rproc->fdtab[fd]->lock);
+	kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 
 	return fd;
 }
 
+/* int open(const char* path, int flags, ...); */
+int sys_open(void)
+{
+	const char* path;
+	int flags;
+	mode_t mode = 0x0;
+
+	if(syscall_get_str_ptr(&path, 0)) return -1; 
+	if(syscall_get_int(&flags, 1)) return -1;
+	if(flags & O_CREAT)
+	{
+		if(syscall_get_int((int*)&mode, 2)) 
+			return -1;
+	}
+
+	return fd_open(path, flags, mode);
+}
+
 /* int close(int fd) */
 int sys_close(void)
 {
@@ -177,32 +186,52 @@ int sys_close(void)
 	return close(fd);
 }
 
-int close(int fd)
+int fd_close(struct proc* p, int fd)
 {
-	if(!fd_ok(fd)) return -1;
+	if(fd < 0 || fd >= p->fdtab->size || !p->fdtab->fds[fd])
+		return -1;
+	if(!p->fdtab->fds[fd]->type) return -1;
 
-	slock_acquire(&rproc->fdtab[fd]->lock);
-	if(rproc->fdtab[fd]->type == FD_TYPE_FILE)
+	kmutex_lock(&p->fdtab->fds[fd]->lock);
+	if(p->fdtab->fds[fd]->type == FD_TYPE_FILE)
 	{
-		fs_close(rproc->fdtab[fd]->i);
-	}else if(rproc->fdtab[fd]->type == FD_TYPE_PIPE)
+		fs_close(p->fdtab->fds[fd]->i);
+	}else if(p->fdtab->fds[fd]->type == FD_TYPE_PIPE)
 	{
 		/* Do we need to free the pipe? */
-		if(rproc->fdtab[fd]->pipe_type == FD_PIPE_MODE_WRITE)
-			rproc->fdtab[fd]->pipe->write_ref--;
-		if(rproc->fdtab[fd]->pipe_type == FD_PIPE_MODE_READ)
-			rproc->fdtab[fd]->pipe->read_ref--;
-
-		if(!rproc->fdtab[fd]->pipe->write_ref ||
-				!rproc->fdtab[fd]->pipe->read_ref)
-			rproc->fdtab[fd]->pipe->faulted = 1;
+		if(p->fdtab->fds[fd]->pipe_type == FD_PIPE_MODE_WRITE)
+			p->fdtab->fds[fd]->pipe->write_ref--;
+		if(p->fdtab->fds[fd]->pipe_type == FD_PIPE_MODE_READ)
+			p->fdtab->fds[fd]->pipe->read_ref--;
+
+		if(!p->fdtab->fds[fd]->pipe->write_ref ||
+				!p->fdtab->fds[fd]->pipe->read_ref)
+		{
+			p->fdtab->fds[fd]->pipe->faulted = 1;
+			pipe_fault(p->fdtab->fds[fd]->pipe);
+		}
+
+		/* Nobody can reach the pipe anymore */
+		if(!p->fdtab->fds[fd]->pipe->write_ref &&
+				!p->fdtab->fds[fd]->pipe->read_ref)
+			pipe_free(p->fdtab->fds[fd]->pipe);
+	}else if(p->fdtab->fds[fd]->type == FD_TYPE_EVENT)
+	{
+		/* Free the set once the last reference is gone */
+		if(p->fdtab->fds[fd]->refs == 1)
+			event_set_free(p->fdtab->fds[fd]->events);
 	}
 
-	slock_release(&rproc->fdtab[fd]->lock);
-	fd_free(rproc, fd);
+	kmutex_unlock(&p->fdtab->fds[fd]->lock);
+	fd_free(p, fd);
 	return 0;
 }
 
+int close(int fd)
+{
+	return fd_close(rproc, fd);
+}
+
 /* int read(int fd, char* dst, size_t sz) */
 int sys_read(void)
 {
@@ -211,23 +240,23 @@ int sys_read(void)
 	int sz;
 	if(syscall_get_int(&fd, 0)) return -1;
 	if(syscall_get_int(&sz, 2)) return -1;
-	if(syscall_get_buffer_ptr((void**)&dst, sz, 1)) return -1;
+	if(syscall_get_output_ptr((void**)&dst, sz, 1)) return -1;
 
 	/* Make sure this fd is valid */
 	if(!fd_ok(fd)) return -1;
 
 	/* Acquire the lock */
-	slock_acquire(&rproc->fdtab[fd]->lock);
+	kmutex_lock(&rproc->fdtab->fds[fd]->lock);
 
 #ifdef DEBUG
 	cprintf("%s:%d: doing read  for %d bytes.\n",
 			rproc->name, rproc->pid, sz);
 	cprintf("%s:%d: reading {%d} from file %s\n",
 		rproc->name, rproc->pid,
-		fd, rproc->fdtab[fd]->path);
+		fd, rproc->fdtab->fds[fd]->path);
 #endif
 
-	switch(rproc->fdtab[fd]->type)
+	switch(rproc->fdtab->fds[fd]->type)
 	{
 		default:
 #ifdef DEBUG
@@ -236,8 +265,8 @@ int sys_read(void)
 			sz = -1;
 			break;
 		case FD_TYPE_FILE:
-			if((sz = fs_read(rproc->fdtab[fd]->i, dst, sz,
-							rproc->fdtab[fd]->seek)) < 0) 
+			if((sz = fs_read(rproc->fdtab->fds[fd]->i, dst, sz,
+							rproc->fdtab->fds[fd]->seek)) < 0) 
 			{
 #ifdef DEBUG
 				cprintf("READ FAILURE!\n");
@@ -252,31 +281,31 @@ int sys_read(void)
 			break;
 		case FD_TYPE_DEVICE:
 			/* Check for read support */
-			if(rproc->fdtab[fd]->device->read)
+			if(rproc->fdtab->fds[fd]->device->read)
 			{
 				/* read is supported */
-				sz = rproc->fdtab[fd]->device->read(dst,
-						rproc->fdtab[fd]->seek, sz,
-						rproc->fdtab[fd]->device->context);
+				sz = rproc->fdtab->fds[fd]->device->read(dst,
+						rproc->fdtab->fds[fd]->seek, sz,
+						rproc->fdtab->fds[fd]->device->context);
 			} else sz = -1;
 			break;
 		case FD_TYPE_PIPE:
-			if(rproc->fdtab[fd]->pipe_type == FD_PIPE_MODE_READ)
-				pipe_read(dst, sz, rproc->fdtab[fd]->pipe);
+			if(rproc->fdtab->fds[fd]->pipe_type == FD_PIPE_MODE_READ)
+				sz = pipe_read(dst, sz, rproc->fdtab->fds[fd]->pipe);
 			else sz = -1;
 			break;
 	}
 
 	if(sz > 0)
-		rproc->fdtab[fd]->seek += sz;
+		rproc->fdtab->fds[fd]->seek += sz;
 
 #ifdef DEBUG_CONTENT
 	cprintf("%s: CONTENTS |%s|\n", rproc->name, dst);
 	cprintf("%s: new position in file: %d\n", 
-			rproc->name, rproc->fdtab[fd]->seek);
+			rproc->name, rproc->fdtab->fds[fd]->seek);
 #endif
 
-	slock_release(&rproc->fdtab[fd]->lock);
+	kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 
 	return sz;
 }
@@ -292,17 +321,17 @@ int sys_write(void)
 	if(syscall_get_buffer_ptr((void**)&src, sz, 1)) return -1;
 
 	if(!fd_ok(fd)) return -1;
-	slock_acquire(&rproc->fdtab[fd]->lock);
+	kmutex_lock(&rproc->fdtab->fds[fd]->lock);
 
 #ifdef DEBUG
 	cprintf("%s:%d: doing write for %d bytes.\n",
 			rproc->name, rproc->pid, sz);
 	cprintf("%s:%d: Writing {%d} file: %s\n",
 		rproc->name, rproc->pid,
-		fd, rproc->fdtab[fd]->path);
+		fd, rproc->fdtab->fds[fd]->path);
 #endif
 
-	switch(rproc->fdtab[fd]->type)
+	switch(rproc->fdtab->fds[fd]->type)
 	{
 		default:
 #ifdef DEBUG
@@ -311,43 +340,1125 @@ int sys_write(void)
 			sz = -1;
 			break;
 		case FD_TYPE_FILE:
-			if((sz = fs_write(rproc->fdtab[fd]->i, src, sz,
-						rproc->fdtab[fd]->seek)) < 0)
+			if((sz = fs_write(rproc->fdtab->fds[fd]->i, src, sz,
+						rproc->fdtab->fds[fd]->seek)) < 0)
 			{
 #ifdef DEBUG
 				cprintf("%s: write to file %s failed!\n",
 						rproc->name, 
-						rproc->fdtab[fd]->path);
+						rproc->fdtab->fds[fd]->path);
 #endif
 				sz = -1;
 			}
 			break;
 		case FD_TYPE_PIPE:
-			if(rproc->fdtab[fd]->pipe_type == FD_PIPE_MODE_WRITE)
-				pipe_write(src, sz, rproc->fdtab[fd]->pipe);
+			if(rproc->fdtab->fds[fd]->pipe_type == FD_PIPE_MODE_WRITE)
+				sz = pipe_write(src, sz, rproc->fdtab->fds[fd]->pipe);
 			else sz = -1;
 			break;
 		case FD_TYPE_DEVICE:
-			if(rproc->fdtab[fd]->device->write)
-				sz = rproc->fdtab[fd]->device->write(src,
-						rproc->fdtab[fd]->seek, sz, 
-						rproc->fdtab[fd]->device->context);
+			if(rproc->fdtab->fds[fd]->device->write)
+				sz = rproc->fdtab->fds[fd]->device->write(src,
+						rproc->fdtab->fds[fd]->seek, sz, 
+						rproc->fdtab->fds[fd]->device->context);
 			else sz = -1;
 			break;
 	}
 
 	if(sz > 0)
-		rproc->fdtab[fd]->seek += sz;
+		rproc->fdtab->fds[fd]->seek += sz;
 
 #ifdef DEBUG
 	cprintf("%s:%d: New position in file: %d\n", 
 			rproc->name, rproc->pid,
-			rproc->fdtab[fd]->seek);
+			rproc->fdtab->fds[fd]->seek);
 #endif
-	slock_release(&rproc->fdtab[fd]->lock);
+	kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
+	return sz;
+}
+
+/**
+ * Read sz bytes from the file descriptor at position pos into the kernel
+ * or user buffer dst. Pipes ignore the position. Returns the amount of
+ * bytes read, -1 on failure. (fd lock required for devices and pipes)
+ */
+static int fd_read_at(struct file_descriptor* fd, void* dst, size_t sz,
+		fileoff_t pos)
+{
+	switch(fd->type)
+	{
+		case FD_TYPE_FILE:
+			return fs_read(fd->i, dst, sz, pos);
+		case FD_TYPE_DEVICE:
+			if(!fd->device->read) break;
+			return fd->device->read(dst, pos, sz,
+					fd->device->context);
+		case FD_TYPE_PIPE:
+			if(fd->pipe_type != FD_PIPE_MODE_READ) break;
+			return pipe_read(dst, sz, fd->pipe);
+	}
+
+	return -1;
+}
+
+/**
+ * Write sz bytes from the buffer src into the file descriptor at position
+ * pos. Pipes ignore the position. Returns the amount of bytes written, -1
+ * on failure. (fd lock required for devices and pipes)
+ */
+static int fd_write_at(struct file_descriptor* fd, const void* src,
+		size_t sz, fileoff_t pos)
+{
+	switch(fd->type)
+	{
+		case FD_TYPE_FILE:
+			return fs_write(fd->i, (void*)src, sz, pos);
+		case FD_TYPE_DEVICE:
+			if(!fd->device->write) break;
+			return fd->device->write((void*)src, pos, sz,
+					fd->device->context);
+		case FD_TYPE_PIPE:
+			if(fd->pipe_type != FD_PIPE_MODE_WRITE) break;
+			return pipe_write((void*)src, sz, fd->pipe);
+	}
+
+	return -1;
+}
+
+/**
+ * Move data between the buffers in iov and the file descriptor starting at
+ * the offset start. Files get the whole vector in one call, devices and
+ * pipes get one call per buffer. Returns the amount of bytes moved, -1 on
+ * failure.
+ */
+static int rwv_fd(struct file_descriptor* fd, const struct iovec* iov,
+		int iovcnt, fileoff_t start, int write)
+{
+	if(fd->type == FD_TYPE_FILE)
+	{
+		if(write) return fs_writev(fd->i, iov, iovcnt, start);
+		return fs_readv(fd->i, iov, iovcnt, start);
+	}
+
+	int bytes = 0;
+	int x;
+	for(x = 0;x < iovcnt;x++)
+	{
+		int result;
+		if(write) result = fd_write_at(fd, iov[x].iov_base,
+				iov[x].iov_len, start + bytes);
+		else result = fd_read_at(fd, iov[x].iov_base,
+				iov[x].iov_len, start + bytes);
+
+		/* Report what was moved before the error */
+		if(result < 0) return bytes ? bytes : -1;
+		bytes += result;
+		if(result != iov[x].iov_len) break;
+	}
+
+	return bytes;
+}
+
+/**
+ * readv and writev: the fd lock is only taken once for the whole vector
+ * and the seek is moved past everything that was transferred.
+ */
+static int rwv_seek(int write)
+{
+	int fd;
+	int iovcnt;
+	size_t total;
+	struct iovec iov[IOV_MAX];
+	if(syscall_get_int(&fd, 0)) return -1;
+	if(syscall_get_int(&iovcnt, 2)) return -1;
+	if(syscall_get_iovec(iov, iovcnt, &total, 1, !write)) return -1;
+	if(!fd_ok(fd)) return -1;
+
+	struct file_descriptor* file = rproc->fdtab->fds[fd];
+	kmutex_lock(&file->lock);
+	int sz = rwv_fd(file, iov, iovcnt, file->seek, write);
+	if(sz > 0)
+		file->seek += sz;
+	kmutex_unlock(&file->lock);
+
+	return sz;
+}
+
+/**
+ * preadv and pwritev: the seek is left alone. Files are only locked at
+ * the inode so that processes sharing an fd don't wait on each other.
+ */
+static int rwv_pos(int write)
+{
+	int fd;
+	int iovcnt;
+	int offset;
+	size_t total;
+	struct iovec iov[IOV_MAX];
+	if(syscall_get_int(&fd, 0)) return -1;
+	if(syscall_get_int(&iovcnt, 2)) return -1;
+	if(syscall_get_int(&offset, 3)) return -1;
+	if(syscall_get_iovec(iov, iovcnt, &total, 1, !write)) return -1;
+	if(offset < 0 || !fd_ok(fd)) return -1;
+
+	struct file_descriptor* file = rproc->fdtab->fds[fd];
+
+	/* Pipes don't have a position */
+	if(file->type == FD_TYPE_PIPE) return -1;
+	if(file->type == FD_TYPE_FILE)
+		return rwv_fd(file, iov, iovcnt, offset, write);
+
+	kmutex_lock(&file->lock);
+	int sz = rwv_fd(file, iov, iovcnt, offset, write);
+	kmutex_unlock(&file->lock);
+
+	return sz;
+}
+
+/* int readv(int fd, const struct iovec* iov, int iovcnt) */
+int sys_readv(void)
+{
+	return rwv_seek(0);
+}
+
+/* int writev(int fd, const struct iovec* iov, int iovcnt) */
+int sys_writev(void)
+{
+	return rwv_seek(1);
+}
+
+/* int preadv(int fd, const struct iovec* iov, int iovcnt, off_t offset) */
+int sys_preadv(void)
+{
+	return rwv_pos(0);
+}
+
+/* int pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset) */
+int sys_pwritev(void)
+{
+	return rwv_pos(1);
+}
+
+/**
+ * Lock two file descriptors in address order so that two processes moving
+ * data between the same descriptors in opposite directions can't deadlock.
+ */
+static void fd_lock_pair(struct file_descriptor* a, struct file_descriptor* b)
+{
+	if(a > b)
+	{
+		struct file_descriptor* tmp = a;
+		a = b;
+		b = tmp;
+	}
+
+	kmutex_lock(&a->lock);
+	if(a != b) kmutex_lock(&b->lock);
+}
+
+static void fd_unlock_pair(struct file_descriptor* a,
+		struct file_descriptor* b)
+{
+	if(a != b) kmutex_unlock(&b->lock);
+	kmutex_unlock(&a->lock);
+}
+
+/**
+ * Move up to count bytes from in to out without going through user memory.
+ * Whole pages of a file that are in the storage cache are handed to the
+ * output straight from the cache, everything else goes through one bounce
+ * page. in_pos and out_pos are moved past the data that was transferred.
+ * Returns the amount of bytes moved, -1 on failure. (fd locks required)
+ */
+static int fd_splice(struct file_descriptor* in, fileoff_t* in_pos,
+		struct file_descriptor* out, fileoff_t* out_pos, size_t count)
+{
+	char* bounce = NULL;
+	size_t bytes = 0;
+	int failed = 0;
+
+	while(bytes < count)
+	{
+		size_t chunk = PGSIZE - (*in_pos & (PGSIZE - 1));
+		if(chunk > count - bytes) chunk = count - bytes;
+
+		char* page = NULL;
+		const char* src;
+		int avail = chunk;
+		if(in->type == FD_TYPE_FILE)
+			page = fs_getpage(in->i, PGROUNDDOWN(*in_pos));
+
+		if(page)
+		{
+			src = page + (*in_pos & (PGSIZE - 1));
+		} else {
+			if(!bounce && !(bounce = (char*)palloc()))
+			{
+				failed = 1;
+				break;
+			}
+
+			avail = fd_read_at(in, bounce, chunk, *in_pos);
+			src = bounce;
+
+			/* End of file or a closed pipe */
+			if(avail <= 0)
+			{
+				failed = avail < 0;
+				break;
+			}
+		}
+
+		int written = fd_write_at(out, src, avail, *out_pos);
+		if(page) fs_putpage(in->i, page);
+		if(written < 0)
+		{
+			failed = 1;
+			break;
+		}
+
+		bytes += written;
+		*in_pos += written;
+		*out_pos += written;
+		if(written != avail) break;
+	}
+
+	if(bounce) pfree((pypage_t)bounce);
+	if(!bytes && failed) return -1;
+	return bytes;
+}
+
+/* int sendfile(int out_fd, int in_fd, off_t* offset, size_t count) */
+int sys_sendfile(void)
+{
+	int out_fd;
+	int in_fd;
+	off_t* offset;
+	int count;
+	if(syscall_get_int(&out_fd, 0)) return -1;
+	if(syscall_get_int(&in_fd, 1)) return -1;
+	if(syscall_get_optional_ptr((void**)&offset, 2)) return -1;
+	if(syscall_get_int(&count, 3)) return -1;
+	if(count < 0 || !fd_ok(out_fd) || !fd_ok(in_fd)) return -1;
+
+	struct file_descriptor* in = rproc->fdtab->fds[in_fd];
+	struct file_descriptor* out = rproc->fdtab->fds[out_fd];
+
+	/* The data has to come from a file */
+	if(in->type != FD_TYPE_FILE) return -1;
+
+	off_t pos = 0;
+	if(offset && copy_from_user(&pos, offset, sizeof(off_t)))
+		return -1;
+	if(pos < 0) return -1;
+
+	fd_lock_pair(in, out);
+	fileoff_t in_pos = offset ? pos : in->seek;
+	fileoff_t out_pos = out->seek;
+	int sz = fd_splice(in, &in_pos, out, &out_pos, count);
+	if(sz > 0)
+	{
+		/* With an offset the seek of the input stays where it is */
+		if(!offset) in->seek = in_pos;
+		out->seek = out_pos;
+	}
+	fd_unlock_pair(in, out);
+
+	pos = in_pos;
+	if(offset && copy_to_user(offset, &pos, sizeof(off_t)))
+		return -1;
+
 	return sz;
 }
 
+/**
+ * int splice(int fd_in, off_t* off_in, int fd_out, off_t* off_out,
+ *		size_t len, unsigned int flags)
+ */
+int sys_splice(void)
+{
+	int fd_in;
+	int fd_out;
+	off_t* off_in;
+	off_t* off_out;
+	int len;
+	if(syscall_get_int(&fd_in, 0)) return -1;
+	if(syscall_get_optional_ptr((void**)&off_in, 1)) return -1;
+	if(syscall_get_int(&fd_out, 2)) return -1;
+	if(syscall_get_optional_ptr((void**)&off_out, 3)) return -1;
+	if(syscall_get_int(&len, 4)) return -1;
+	if(len < 0 || !fd_ok(fd_in) || !fd_ok(fd_out)) return -1;
+
+	struct file_descriptor* in = rproc->fdtab->fds[fd_in];
+	struct file_descriptor* out = rproc->fdtab->fds[fd_out];
+
+	/* Pipes don't have a position */
+	if(off_in && in->type == FD_TYPE_PIPE) return -1;
+	if(off_out && out->type == FD_TYPE_PIPE) return -1;
+
+	off_t pos_in = 0;
+	off_t pos_out = 0;
+	if(off_in && copy_from_user(&pos_in, off_in, sizeof(off_t)))
+		return -1;
+	if(off_out && copy_from_user(&pos_out, off_out, sizeof(off_t)))
+		return -1;
+	if(pos_in < 0 || pos_out < 0) return -1;
+
+	fd_lock_pair(in, out);
+	fileoff_t in_pos = off_in ? pos_in : in->seek;
+	fileoff_t out_pos = off_out ? pos_out : out->seek;
+	int sz = fd_splice(in, &in_pos, out, &out_pos, len);
+	if(sz > 0)
+	{
+		if(!off_in) in->seek = in_pos;
+		if(!off_out) out->seek = out_pos;
+	}
+	fd_unlock_pair(in, out);
+
+	pos_in = in_pos;
+	pos_out = out_pos;
+	if(off_in && copy_to_user(off_in, &pos_in, sizeof(off_t)))
+		return -1;
+	if(off_out && copy_to_user(off_out, &pos_out, sizeof(off_t)))
+		return -1;
+
+	return sz;
+}
+
+/**
+ * Convert a poll timeout in milliseconds into ticks. A negative timeout
+ * waits forever.
+ */
+static int poll_timeout_ticks(int ms)
+{
+	if(ms < 0) return -1;
+	return (ms / 1000) * KTIMER_HZ
+		+ ((ms % 1000) * KTIMER_HZ + 999) / 1000;
+}
+
+/**
+ * Fill in revents for every entry of a poll array. Returns the amount of
+ * entries that have events.
+ */
+static int poll_check(struct pollfd* fds, int nfds)
+{
+	int ready = 0;
+	int x;
+	for(x = 0;x < nfds;x++)
+	{
+		fds[x].revents = 0;
+		if(fds[x].fd < 0) continue;
+		if(!fd_ok(fds[x].fd)) fds[x].revents = POLLNVAL;
+		else fds[x].revents = poll_fd(rproc->fdtab->fds[fds[x].fd])
+			& (fds[x].events | POLLERR | POLLHUP | POLLNVAL);
+		if(fds[x].revents) ready++;
+	}
+
+	return ready;
+}
+
+/* int poll(struct pollfd* fds, nfds_t nfds, int timeout) */
+int sys_poll(void)
+{
+	struct pollfd* fds;
+	int nfds;
+	int timeout;
+	if(syscall_get_int(&nfds, 1)) return -1;
+	if(syscall_get_int(&timeout, 2)) return -1;
+	if(nfds < 0 || nfds > rproc->fd_limit) return -1;
+
+	/* Without any fds poll just sleeps */
+	fds = NULL;
+	if(nfds && syscall_get_output_ptr((void**)&fds,
+			sizeof(struct pollfd) * nfds, 0))
+		return -1;
+
+	/* Most of the time something is ready already */
+	int ready = poll_check(fds, nfds);
+	int ticks = poll_timeout_ticks(timeout);
+	if(ready || !ticks) return ready;
+
+	/* Wait for the sources to tell us that something changed */
+	struct event_set* set = event_set_alloc();
+	if(!set) return -1;
+
+	int x;
+	for(x = 0;x < nfds;x++)
+	{
+		if(fds[x].fd < 0) continue;
+		if(event_set_add(set, fds[x].fd, fds[x].events,
+					(void*)x, 1))
+		{
+			event_set_free(set);
+			return -1;
+		}
+	}
+
+	/**
+	 * The set only wakes us up, the whole array is checked again
+	 * afterwards so that every entry that is ready gets reported.
+	 */
+	uint end = ktimer_ticks() + ticks;
+	for(;;)
+	{
+		struct event event;
+		ready = event_set_wait(set, &event, 1, ticks);
+		if(ready <= 0) break;
+
+		ready = poll_check(fds, nfds);
+		if(ready) break;
+
+		/* It wasn't ready anymore, wait for the time that is left */
+		if(ticks > 0)
+		{
+			ticks = end - ktimer_ticks();
+			if(ticks <= 0) break;
+		}
+	}
+	event_set_free(set);
+
+	return ready;
+}
+
+/* int event_create(int flags) */
+int sys_event_create(void)
+{
+	int flags;
+	if(syscall_get_int(&flags, 0)) return -1;
+
+	struct event_set* set = event_set_alloc();
+	if(!set) return -1;
+
+	int fd = fd_next(rproc);
+	if(!fd_ok(fd))
+	{
+		event_set_free(set);
+		return -1;
+	}
+
+	kmutex_lock(&rproc->fdtab->fds[fd]->lock);
+	rproc->fdtab->fds[fd]->type = FD_TYPE_EVENT;
+	rproc->fdtab->fds[fd]->events = set;
+	kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
+
+	return fd;
+}
+
+/* int event_ctl(int efd, int op, int fd, struct event* event) */
+int sys_event_ctl(void)
+{
+	int efd;
+	int op;
+	int fd;
+	struct event* uevent;
+	if(syscall_get_int(&efd, 0)) return -1;
+	if(syscall_get_int(&op, 1)) return -1;
+	if(syscall_get_int(&fd, 2)) return -1;
+	if(syscall_get_optional_ptr((void**)&uevent, 3)) return -1;
+	if(!fd_ok(efd) || rproc->fdtab->fds[efd]->type != FD_TYPE_EVENT)
+		return -1;
+
+	struct event_set* set = rproc->fdtab->fds[efd]->events;
+	struct event ev;
+	switch(op)
+	{
+		case EVENT_CTL_ADD:
+		case EVENT_CTL_MOD:
+			if(!uevent || copy_from_user(&ev, uevent,
+						sizeof(struct event)))
+				return -1;
+			if(op == EVENT_CTL_ADD)
+				return event_set_add(set, fd, ev.events,
+						ev.data, 0);
+			return event_set_mod(set, fd, ev.events, ev.data);
+		case EVENT_CTL_DEL:
+			return event_set_del(set, fd);
+		default:
+			return -1;
+	}
+}
+
+/* int event_wait(int efd, struct event* events, int max, int timeout) */
+int sys_event_wait(void)
+{
+	int efd;
+	struct event* uevents;
+	int max;
+	int timeout;
+	if(syscall_get_int(&efd, 0)) return -1;
+	if(syscall_get_int(&max, 2)) return -1;
+	if(syscall_get_int(&timeout, 3)) return -1;
+	if(max <= 0) return -1;
+	if(max > EVENT_WAIT_BATCH) max = EVENT_WAIT_BATCH;
+	if(syscall_get_output_ptr((void**)&uevents,
+			sizeof(struct event) * max, 1))
+		return -1;
+	if(!fd_ok(efd) || rproc->fdtab->fds[efd]->type != FD_TYPE_EVENT)
+		return -1;
+
+	struct event events[EVENT_WAIT_BATCH];
+	int ready = event_set_wait(rproc->fdtab->fds[efd]->events, events, max,
+			poll_timeout_ticks(timeout));
+	if(ready > 0 && copy_to_user(uevents, events,
+				sizeof(struct event) * ready))
+		return -1;
+
+	return ready;
+}
+
+/**
+ * Batched I/O: the process queues operations in a ring in its own memory
+ * and hands a whole batch to the kernel with one iobatch_enter. Reads,
+ * writes and fsyncs of files at a given position are run by a kernel
+ * worker process, so the process can go on while the disk is busy. The
+ * worker only has the kernel mapped: the data moves through kernel pages
+ * that iobatch_enter fills and empties, and finished jobs are posted to
+ * the completion ring by the next iobatch_enter. Everything else needs the
+ * file table of the process (openat, the current position) or could block
+ * the worker for good (pipes, devices), so it runs during iobatch_enter.
+ */
+
+#define IOBATCH_JOBS		0x100 /* Jobs that can be in flight at once */
+#define IOBATCH_JOB_PAGES	(IOBATCH_MAX_IO / PGSIZE)
+
+/**
+ * A read, write or fsync that was handed to the worker.
+ */
+struct iobatch_job
+{
+	int used; /* Whether or not the job is in use */
+	int opcode; /* What to do (IOBATCH_OP_*) */
+	inode i; /* The file, holds an inode reference */
+	fileoff_t off; /* Where in the file */
+	size_t len; /* Bytes to move */
+	void* addr; /* The user buffer of a read */
+	void* user_data; /* Copied into the completion */
+	int result; /* What the system call would have returned */
+	char* pages[IOBATCH_JOB_PAGES]; /* Kernel copy of the data */
+	struct iobatch_ctx* ctx; /* The ring the job came from */
+	struct iobatch_job* next; /* The next job in the same list */
+};
+
+/**
+ * The kernel side of an I/O batch ring. It stays around until the process
+ * is done with the ring and the worker is done with its jobs.
+ */
+struct iobatch_ctx
+{
+	struct iobatch_ring* ring; /* The ring in user memory */
+	int unposted; /* Queued jobs not in the ring yet (process only) */
+
+	slock_t lock; /* Protects everything below */
+	int pending; /* Jobs the worker hasn't finished */
+	int detached; /* The process doesn't want the results anymore */
+	struct iobatch_job* done; /* Finished jobs, oldest first */
+	struct iobatch_job* done_tail; /* The job that finished last */
+	waitqueue_t done_wait; /* iobatch_enter waits here for the worker */
+};
+
+static slock_t iobatch_lock; /* Protects the jobs, queue and worker */
+static struct iobatch_job iobatch_jobs[IOBATCH_JOBS];
+static struct iobatch_job* iobatch_queue; /* Jobs for the worker */
+static struct iobatch_job* iobatch_queue_tail; /* The newest queued job */
+static waitqueue_t iobatch_work_wait; /* The worker waits here for jobs */
+static struct proc* iobatch_worker; /* Started with the first ring */
+
+/* Get an unused job, NULL if all of them are in flight. */
+static struct iobatch_job* iobatch_job_alloc(void)
+{
+	struct iobatch_job* job = NULL;
+	slock_acquire(&iobatch_lock);
+	int x;
+	for(x = 0;x < IOBATCH_JOBS;x++)
+	{
+		if(iobatch_jobs[x].used) continue;
+		job = iobatch_jobs + x;
+		memset(job, 0, sizeof(struct iobatch_job));
+		job->used = 1;
+		break;
+	}
+	slock_release(&iobatch_lock);
+
+	return job;
+}
+
+/* Drop the inode reference and the pages of the job and free it. */
+static void iobatch_job_free(struct iobatch_job* job)
+{
+	if(job->i) fs_close(job->i);
+
+	int x;
+	for(x = 0;x < IOBATCH_JOB_PAGES;x++)
+		if(job->pages[x]) pfree((pypage_t)job->pages[x]);
+
+	slock_acquire(&iobatch_lock);
+	job->used = 0;
+	slock_release(&iobatch_lock);
+}
+
+/* Run a job in the worker. Returns what the system call would have. */
+static int iobatch_job_run(struct iobatch_job* job)
+{
+	if(job->opcode == IOBATCH_OP_FSYNC)
+		return fs_fsync(job->i);
+
+	size_t done = 0;
+	int x;
+	for(x = 0;done < job->len;x++)
+	{
+		size_t sz = job->len - done;
+		if(sz > PGSIZE) sz = PGSIZE;
+
+		int moved;
+		if(job->opcode == IOBATCH_OP_WRITE)
+			moved = fs_write(job->i, job->pages[x], sz,
+					job->off + done);
+		else moved = fs_read(job->i, job->pages[x], sz,
+				job->off + done);
+
+		/* Failing after some of the data moved is a short transfer */
+		if(moved < 0) return done ? (int)done : -1;
+		done += moved;
+		if((size_t)moved < sz) break;
+	}
+
+	return done;
+}
+
+/**
+ * The worker process: runs the queued jobs in order and hands each one
+ * back to the ring it came from. Never returns.
+ */
+static void iobatch_work(void* arg)
+{
+	while(1)
+	{
+		slock_acquire(&iobatch_lock);
+		while(!iobatch_queue)
+			waitqueue_sleep(&iobatch_work_wait, PROC_BLOCKED_IO,
+					&iobatch_lock);
+		struct iobatch_job* job = iobatch_queue;
+		iobatch_queue = job->next;
+		if(!iobatch_queue) iobatch_queue_tail = NULL;
+		slock_release(&iobatch_lock);
+
+		job->result = iobatch_job_run(job);
+		job->next = NULL;
+
+		struct iobatch_ctx* ctx = job->ctx;
+		slock_acquire(&ctx->lock);
+		ctx->pending--;
+		if(ctx->detached)
+		{
+			/* Nobody reaps it, the last job frees the context */
+			int last = !ctx->pending;
+			slock_release(&ctx->lock);
+			iobatch_job_free(job);
+			if(last) pfree((pypage_t)ctx);
+		} else {
+			if(ctx->done_tail) ctx->done_tail->next = job;
+			else ctx->done = job;
+			ctx->done_tail = job;
+			waitqueue_wake_all(&ctx->done_wait);
+			slock_release(&ctx->lock);
+		}
+
+		/* The kernel isn't preempted, let the submitters run */
+		yield();
+	}
+}
+
+/**
+ * Should the submission go to the worker? Only files can be read at a
+ * position without the file table of the process.
+ */
+static int iobatch_async(struct iobatch_sqe* sqe)
+{
+	switch(sqe->opcode)
+	{
+		case IOBATCH_OP_READ:
+		case IOBATCH_OP_WRITE:
+			if(sqe->off == IOBATCH_POS_CURRENT) return 0;
+			break;
+		case IOBATCH_OP_FSYNC:
+			break;
+		default:
+			return 0;
+	}
+
+	if(!fd_ok(sqe->fd)) return 0;
+	return rproc->fdtab->fds[sqe->fd]->type == FD_TYPE_FILE;
+}
+
+/**
+ * Fill in the job for the submission and queue it for the worker. Write
+ * data is copied into the pages of the job now. Returns 0 if the job was
+ * queued, -1 if the submission failed and the job has to be freed.
+ */
+static int iobatch_submit(struct iobatch_ctx* ctx, struct iobatch_sqe* sqe,
+		struct iobatch_job* job)
+{
+	job->opcode = sqe->opcode;
+	job->off = sqe->off;
+	job->addr = sqe->addr;
+	job->user_data = sqe->user_data;
+	job->ctx = ctx;
+
+	if(sqe->opcode != IOBATCH_OP_FSYNC)
+	{
+		if(sqe->len > INT_MAX || sqe->off > INT_MAX) return -1;
+		int write = sqe->opcode == IOBATCH_OP_WRITE;
+		/* Reads store into the buffer, so it has to be writable */
+		size_t len = sqe->len ? sqe->len : 1;
+		if(write ? syscall_buffer_safe(sqe->addr, len)
+				: syscall_buffer_writable(sqe->addr, len))
+			return -1;
+
+		/* Longer transfers are cut short like a read or write can be */
+		job->len = sqe->len;
+		if(job->len > IOBATCH_MAX_IO) job->len = IOBATCH_MAX_IO;
+
+		size_t pos;
+		int x;
+		for(x = 0, pos = 0;pos < job->len;x++, pos += PGSIZE)
+		{
+			job->pages[x] = (char*)palloc();
+			if(!job->pages[x]) return -1;
+
+			size_t sz = job->len - pos;
+			if(sz > PGSIZE) sz = PGSIZE;
+			if(write && copy_from_user(job->pages[x],
+						(char*)sqe->addr + pos, sz))
+				return -1;
+		}
+	}
+
+	/* The file can be closed before the worker gets to the job */
+	if(!fd_ok(sqe->fd)) return -1;
+	struct file_descriptor* file = rproc->fdtab->fds[sqe->fd];
+	kmutex_lock(&file->lock);
+	if(file->type == FD_TYPE_FILE && !fs_add_inode_reference(file->i))
+		job->i = file->i;
+	kmutex_unlock(&file->lock);
+	if(!job->i) return -1;
+
+	slock_acquire(&ctx->lock);
+	ctx->pending++;
+	slock_release(&ctx->lock);
+
+	slock_acquire(&iobatch_lock);
+	if(iobatch_queue_tail) iobatch_queue_tail->next = job;
+	else iobatch_queue = job;
+	iobatch_queue_tail = job;
+	waitqueue_wake_one(&iobatch_work_wait);
+	slock_release(&iobatch_lock);
+
+	return 0;
+}
+
+/**
+ * Post the jobs the worker finished to the completion ring while there is
+ * room in it. The data of a read is copied to the process first.
+ */
+static void iobatch_reap(struct iobatch_ctx* ctx, unsigned int cq_head,
+		unsigned int* cq_tail)
+{
+	while(*cq_tail - cq_head < IOBATCH_RING_ENTRIES)
+	{
+		slock_acquire(&ctx->lock);
+		struct iobatch_job* job = ctx->done;
+		if(job) ctx->done = job->next;
+		if(!ctx->done) ctx->done_tail = NULL;
+		slock_release(&ctx->lock);
+		if(!job) break;
+
+		struct iobatch_cqe cqe;
+		cqe.user_data = job->user_data;
+		cqe.result = job->result;
+
+		size_t pos;
+		int x;
+		for(x = 0, pos = 0;job->opcode == IOBATCH_OP_READ
+				&& cqe.result > 0 && pos < (size_t)job->result;
+				x++, pos += PGSIZE)
+		{
+			size_t sz = job->result - pos;
+			if(sz > PGSIZE) sz = PGSIZE;
+			if(copy_to_user((char*)job->addr + pos,
+						job->pages[x], sz))
+				cqe.result = -1;
+		}
+
+		iobatch_job_free(job);
+		ctx->unposted--;
+
+		/* The ring was checked when it was set up */
+		copy_to_user(ctx->ring->cq
+				+ (*cq_tail & (IOBATCH_RING_ENTRIES - 1)),
+				&cqe, sizeof(struct iobatch_cqe));
+		(*cq_tail)++;
+	}
+}
+
+void iobatch_release(struct proc* p)
+{
+	struct iobatch_ctx* ctx = p->iobatch;
+	if(!ctx) return;
+	p->iobatch = NULL;
+
+	slock_acquire(&ctx->lock);
+	struct iobatch_job* job = ctx->done;
+	ctx->done = ctx->done_tail = NULL;
+	ctx->detached = 1;
+	int last = !ctx->pending;
+	slock_release(&ctx->lock);
+
+	while(job)
+	{
+		struct iobatch_job* next = job->next;
+		iobatch_job_free(job);
+		job = next;
+	}
+
+	/* Otherwise the worker frees it with the last job */
+	if(last) pfree((pypage_t)ctx);
+}
+
+/* Run an openat submission. */
+static int iobatch_openat(struct iobatch_sqe* sqe)
+{
+	char path[FILE_MAX_PATH];
+	char rel[FILE_MAX_PATH];
+	int len = strncpy_from_user(rel, sqe->addr, FILE_MAX_PATH);
+	if(len <= 0 || len >= FILE_MAX_PATH) return -1;
+
+	if(rel[0] == '/' || sqe->fd == AT_FDCWD)
+		return fd_open(rel, sqe->len, sqe->mode);
+
+	/* The path is relative to the directory open at fd */
+	if(!fd_ok(sqe->fd)) return -1;
+	struct file_descriptor* dir = rproc->fdtab->fds[sqe->fd];
+	kmutex_lock(&dir->lock);
+	if(dir->type != FD_TYPE_FILE)
+	{
+		kmutex_unlock(&dir->lock);
+		return -1;
+	}
+	strncpy(path, dir->path, FILE_MAX_PATH);
+	kmutex_unlock(&dir->lock);
+
+	if(file_path_dir(path, FILE_MAX_PATH)) return -1;
+	if(strlen(path) + len >= FILE_MAX_PATH) return -1;
+	strncat(path, rel, FILE_MAX_PATH - strlen(path) - 1);
+
+	return fd_open(path, sqe->len, sqe->mode);
+}
+
+/**
+ * Run a read or write submission. Like read and write if the position is
+ * IOBATCH_POS_CURRENT, like pread and pwrite otherwise.
+ */
+static int iobatch_rw(struct iobatch_sqe* sqe, int write)
+{
+	if(sqe->len > INT_MAX || !fd_ok(sqe->fd)) return -1;
+	/* Reads store into the buffer, so it has to be writable */
+	size_t len = sqe->len ? sqe->len : 1;
+	if(write ? syscall_buffer_safe(sqe->addr, len)
+			: syscall_buffer_writable(sqe->addr, len))
+		return -1;
+
+	struct file_descriptor* file = rproc->fdtab->fds[sqe->fd];
+	int sz;
+	if(sqe->off == IOBATCH_POS_CURRENT)
+	{
+		kmutex_lock(&file->lock);
+		if(write) sz = fd_write_at(file, sqe->addr, sqe->len,
+				file->seek);
+		else sz = fd_read_at(file, sqe->addr, sqe->len, file->seek);
+		if(sz > 0)
+			file->seek += sz;
+		kmutex_unlock(&file->lock);
+		return sz;
+	}
+
+	/* Pipes don't have a position */
+	if(sqe->off > INT_MAX || file->type == FD_TYPE_PIPE) return -1;
+	if(file->type == FD_TYPE_FILE)
+	{
+		if(write) return fd_write_at(file, sqe->addr, sqe->len,
+				sqe->off);
+		return fd_read_at(file, sqe->addr, sqe->len, sqe->off);
+	}
+
+	kmutex_lock(&file->lock);
+	if(write) sz = fd_write_at(file, sqe->addr, sqe->len, sqe->off);
+	else sz = fd_read_at(file, sqe->addr, sqe->len, sqe->off);
+	kmutex_unlock(&file->lock);
+
+	return sz;
+}
+
+/* Run an fsync submission. */
+static int iobatch_fsync(struct iobatch_sqe* sqe)
+{
+	if(!fd_ok(sqe->fd)) return -1;
+	struct file_descriptor* file = rproc->fdtab->fds[sqe->fd];
+	if(file->type != FD_TYPE_FILE) return -1;
+	return fs_fsync(file->i);
+}
+
+/* Run one submission and return what its system call would have. */
+static int iobatch_run(struct iobatch_sqe* sqe)
+{
+	switch(sqe->opcode)
+	{
+		case IOBATCH_OP_NOP:
+			return 0;
+		case IOBATCH_OP_READ:
+			return iobatch_rw(sqe, 0);
+		case IOBATCH_OP_WRITE:
+			return iobatch_rw(sqe, 1);
+		case IOBATCH_OP_FSYNC:
+			return iobatch_fsync(sqe);
+		case IOBATCH_OP_OPENAT:
+			return iobatch_openat(sqe);
+	}
+
+#ifdef DEBUG
+	cprintf("%s: bad iobatch opcode: %d\n", rproc->name, sqe->opcode);
+#endif
+	return -1;
+}
+
+/* int iobatch_setup(struct iobatch_ring* ring) */
+int sys_iobatch_setup(void)
+{
+	struct iobatch_ring* ring;
+	if(syscall_get_optional_ptr((void**)&ring, 0)) return -1;
+
+	/* NULL tears the ring down */
+	if(ring && syscall_buffer_writable(ring, sizeof(struct iobatch_ring)))
+		return -1;
+
+	/* Results that weren't posted to the old ring are dropped */
+	iobatch_release(rproc);
+	if(!ring) return 0;
+
+	slock_acquire(&iobatch_lock);
+	if(!iobatch_worker)
+		iobatch_worker = kproc_spawn("iobatch", iobatch_work, NULL);
+	int worker = iobatch_worker != NULL;
+	slock_release(&iobatch_lock);
+	if(!worker) return -1;
+
+	struct iobatch_ctx* ctx = (struct iobatch_ctx*)palloc();
+	if(!ctx) return -1;
+	memset(ctx, 0, sizeof(struct iobatch_ctx));
+	slock_init(&ctx->lock);
+	waitqueue_init(&ctx->done_wait, 0);
+	ctx->ring = ring;
+
+	rproc->iobatch = ctx;
+	return 0;
+}
+
+/* int iobatch_enter(unsigned int to_submit, unsigned int min_complete) */
+int sys_iobatch_enter(void)
+{
+	unsigned int to_submit;
+	unsigned int min_complete;
+	if(syscall_get_int((int*)&to_submit, 0)) return -1;
+	if(syscall_get_int((int*)&min_complete, 1)) return -1;
+
+	struct iobatch_ctx* ctx = rproc->iobatch;
+	if(!ctx) return -1;
+	struct iobatch_ring* ring = ctx->ring;
+
+	unsigned int sq_head;
+	unsigned int sq_tail;
+	unsigned int cq_head;
+	unsigned int cq_tail;
+	if(copy_from_user(&sq_head, &ring->sq_head, sizeof(int))) return -1;
+	if(copy_from_user(&sq_tail, &ring->sq_tail, sizeof(int))) return -1;
+	if(copy_from_user(&cq_head, &ring->cq_head, sizeof(int))) return -1;
+	if(copy_from_user(&cq_tail, &ring->cq_tail, sizeof(int))) return -1;
+
+	/* The process can't queue more than the ring holds */
+	if(sq_tail - sq_head > IOBATCH_RING_ENTRIES) return -1;
+	if(cq_tail - cq_head > IOBATCH_RING_ENTRIES) return -1;
+
+	/* Post what the worker finished since the last call first */
+	iobatch_reap(ctx, cq_head, &cq_tail);
+
+	int done = 0;
+	while(done < to_submit && sq_head != sq_tail)
+	{
+		/* Leave the rest queued until there is room for the results */
+		if(cq_tail - cq_head + ctx->unposted >= IOBATCH_RING_ENTRIES)
+			break;
+
+		struct iobatch_sqe sqe;
+		if(copy_from_user(&sqe, ring->sq
+				+ (sq_head & (IOBATCH_RING_ENTRIES - 1)),
+				sizeof(struct iobatch_sqe)))
+			break;
+
+		struct iobatch_cqe cqe;
+		cqe.user_data = sqe.user_data;
+		if(iobatch_async(&sqe))
+		{
+			/* Try again once other jobs are done */
+			struct iobatch_job* job = iobatch_job_alloc();
+			if(!job) break;
+
+			if(!iobatch_submit(ctx, &sqe, job))
+			{
+				ctx->unposted++;
+				sq_head++;
+				done++;
+				continue;
+			}
+
+			iobatch_job_free(job);
+			cqe.result = -1;
+		} else cqe.result = iobatch_run(&sqe);
+
+		if(copy_to_user(ring->cq
+				+ (cq_tail & (IOBATCH_RING_ENTRIES - 1)),
+				&cqe, sizeof(struct iobatch_cqe)))
+			break;
+
+		sq_head++;
+		cq_tail++;
+		done++;
+	}
+
+	/* Wait for the worker until enough results are in the ring */
+	iobatch_reap(ctx, cq_head, &cq_tail);
+	while(cq_tail - cq_head < min_complete && ctx->unposted
+			&& cq_tail - cq_head < IOBATCH_RING_ENTRIES)
+	{
+		slock_acquire(&ctx->lock);
+		if(!ctx->done)
+			waitqueue_sleep(&ctx->done_wait, PROC_BLOCKED_IO,
+					&ctx->lock);
+		slock_release(&ctx->lock);
+
+		iobatch_reap(ctx, cq_head, &cq_tail);
+	}
+
+	/* Publish the new positions once for the whole batch */
+	if(copy_to_user(&ring->sq_head, &sq_head, sizeof(int))) return -1;
+	if(copy_to_user(&ring->cq_tail, &cq_tail, sizeof(int))) return -1;
+
+#ifdef DEBUG
+	cprintf("%s: iobatch_enter submitted %d operations\n",
+			rproc->name, done);
+#endif
+
+	return done;
+}
+
 /* int lseek(int fd, int offset, int whence) */
 int sys_lseek(void)
 {
@@ -358,11 +1469,11 @@ int sys_lseek(void)
 	if(syscall_get_int((int*)&offset, 1)) return -1;
 	if(syscall_get_int(&whence, 2)) return -1;
 	if(!fd_ok(fd)) return -1;
-	slock_acquire(&rproc->fdtab[fd]->lock);
+	kmutex_lock(&rproc->fdtab->fds[fd]->lock);
 #ifdef DEBUG
 	cprintf("%s:%d: Seeking in file\n", rproc->name, rproc->pid);
 	cprintf("%s:%d: File {%d}  %s\n", rproc->name, rproc->pid,
-		fd, rproc->fdtab[fd]->path);
+		fd, rproc->fdtab->fds[fd]->path);
 	cprintf("%s:%d: whence: %d  offset: %d\n",
 		rproc->name, rproc->pid,
 		whence, offset);
@@ -373,9 +1484,9 @@ int sys_lseek(void)
 #ifdef DEBUG
 		cprintf("%s:%d: Setting seek to: %d\n", 
 			rproc->name, rproc->pid, 
-			offset + rproc->fdtab[fd]->seek);
+			offset + rproc->fdtab->fds[fd]->seek);
 #endif
-		seek_pos = rproc->fdtab[fd]->seek + offset;
+		seek_pos = rproc->fdtab->fds[fd]->seek + offset;
 	}
 	else if(whence == SEEK_SET){
 #ifdef DEBUG
@@ -387,7 +1498,7 @@ int sys_lseek(void)
 	}
 	else if(whence == SEEK_END){
 		struct stat stat;
-		fs_stat(rproc->fdtab[fd]->i, &stat);
+		fs_stat(rproc->fdtab->fds[fd]->i, &stat);
 		seek_pos = stat.st_size + offset;
 #ifdef DEBUG
 		cprintf("%s:%d: Setting seek from end to: %d\n", 
@@ -402,7 +1513,7 @@ int sys_lseek(void)
 	}
 
 	if(seek_pos >= 0)
-		rproc->fdtab[fd]->seek = seek_pos;
+		rproc->fdtab->fds[fd]->seek = seek_pos;
 	else {
 #ifdef DEBUG
 		cprintf("%s:%d: TRIED TO SET NEGATIVE SEEK!\n",
@@ -410,7 +1521,7 @@ int sys_lseek(void)
 #endif
 	}
 
-	slock_release(&rproc->fdtab[fd]->lock);
+	kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 	return seek_pos;
 }
 
@@ -502,39 +1613,39 @@ int sys_fstat(void)
 	int fd;
 	struct stat* dst;
 
-	if(syscall_get_buffer_ptr((void**)&dst, sizeof(struct stat), 1)) 
+	if(syscall_get_output_ptr((void**)&dst, sizeof(struct stat), 1)) 
 		return -1;
 	if(syscall_get_int(&fd, 0)) return -1;
 	if(!fd_ok(fd)) return -1;
 
 #ifdef DEBUG
 	cprintf("%s:%d: fstat on file fd: %d  path: %s\n", rproc->name, rproc->pid, 
-		fd, rproc->fdtab[fd]->path);
+		fd, rproc->fdtab->fds[fd]->path);
 #endif
 
-	slock_acquire(&rproc->fdtab[fd]->lock);
+	kmutex_lock(&rproc->fdtab->fds[fd]->lock);
 
 	int close_on_exit = 0;
 	inode i = NULL;
 	/* Check file descriptor type */
-	switch(rproc->fdtab[fd]->type)
+	switch(rproc->fdtab->fds[fd]->type)
 	{
 		case FD_TYPE_FILE:
-			i = rproc->fdtab[fd]->i;
+			i = rproc->fdtab->fds[fd]->i;
 			break;
 		case FD_TYPE_DEVICE:
 		case FD_TYPE_PIPE:
 #ifdef DEBUG
 			cprintf("%s:%d: File is device.\n", rproc->name, rproc->pid);
 #endif
-			i = fs_open(rproc->fdtab[fd]->device->node, 
+			i = fs_open(rproc->fdtab->fds[fd]->device->node, 
 					O_RDONLY, 0x0, 0x0, 0x0);
 
 			close_on_exit = 1;
 			break;
 		default:
 #ifdef DEBUG
-			cprintf("Fstat called on: %d\n", rproc->fdtab[fd]->type); 
+			cprintf("Fstat called on: %d\n", rproc->fdtab->fds[fd]->type); 
 #endif
 			break;
 	}
@@ -547,7 +1658,7 @@ int sys_fstat(void)
 			fs_close(i);
 	}
 
-	slock_release(&rproc->fdtab[fd]->lock);
+	kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 
 	return result;
 }
@@ -566,33 +1677,35 @@ int sys_readdir(void)
 	struct old_linux_dirent* dirp;
 
 	if(syscall_get_int(&fd, 0)) return -1;
-	if(syscall_get_buffer_ptr((void**)&dirp, 
+	if(syscall_get_output_ptr((void**)&dirp, 
 				sizeof(struct old_linux_dirent), 1))
 		return -1;
 	if(!fd_ok(fd)) return -1;
-	if(rproc->fdtab[fd]->type != FD_TYPE_FILE)
+	if(rproc->fdtab->fds[fd]->type != FD_TYPE_FILE)
 		return -1;
 
 	/* Acquire lock */
-	slock_acquire(&rproc->fdtab[fd]->lock);
+	kmutex_lock(&rproc->fdtab->fds[fd]->lock);
 
+	/* readdir is a getdents of a single entry */
 	struct dirent dir;
-	int result = fs_readdir(rproc->fdtab[fd]->i, rproc->fdtab[fd]->seek, 
-			&dir);
-	if(result < 0) 
+	int result = fs_getdents(rproc->fdtab->fds[fd]->i, &dir, 1,
+			rproc->fdtab->fds[fd]->seek);
+	if(result <= 0) 
 	{
-		slock_release(&rproc->fdtab[fd]->lock);
-		return -1;
+		kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
+		return result;
 	}
 
 	/* Convert to old structure */
 	dirp->d_ino = dir.d_ino;
-	dirp->d_off = rproc->fdtab[fd]->seek;
+	dirp->d_off = dir.d_off;
 	dirp->d_reclen = FILE_MAX_NAME;
 	strncpy(dirp->d_name, dir.d_name, FILE_MAX_NAME);
 
-	rproc->fdtab[fd]->seek++; /* Increment seek */
-	slock_release(&rproc->fdtab[fd]->lock);
+	/* The seek of a directory is the offset of the next entry */
+	rproc->fdtab->fds[fd]->seek = dir.d_off;
+	kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 	return 1;
 }
 
@@ -606,33 +1719,34 @@ int sys_getdents(void)
 	if(syscall_get_int(&fd, 0)) return -1;
 	if(syscall_get_int((int*)&count, 2)) return -1;
 	if(count < sizeof(struct dirent)) return -1;
-	if(syscall_get_buffer_ptr((void**)&dirp, count, 1))
+	if(syscall_get_output_ptr((void**)&dirp, count, 1))
 		return -1;
 	if(!fd_ok(fd)) return -1;
-	if(rproc->fdtab[fd]->type != FD_TYPE_FILE)
+	if(rproc->fdtab->fds[fd]->type != FD_TYPE_FILE)
 		return -1;
 
 #ifdef DEBUG
 	cprintf("%s:%d: getdents on fd {%d} file: %s\n", 
-		rproc->name, rproc->pid, fd, rproc->fdtab[fd]->path);
+		rproc->name, rproc->pid, fd, rproc->fdtab->fds[fd]->path);
 #endif
 
-	slock_acquire(&rproc->fdtab[fd]->lock);
-	int result = fs_readdir(rproc->fdtab[fd]->i, 
-		rproc->fdtab[fd]->seek, dirp);
+	/* Fill as much of the buffer as possible in one pass */
+	kmutex_lock(&rproc->fdtab->fds[fd]->lock);
+	int result = fs_getdents(rproc->fdtab->fds[fd]->i, dirp,
+		count / sizeof(struct dirent), rproc->fdtab->fds[fd]->seek);
 	if(result < 0) 
 	{
 #ifdef DEBUG
 		cprintf("%s:%d: ERROR READING DIRECTORY ENTRY\n",
 				rproc->name, rproc->pid);
 #endif
-		slock_release(&rproc->fdtab[fd]->lock);
+		kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 		return -1;
 	}
 
-	if(result > 0)
+	if(result == 0)
 	{
-		slock_release(&rproc->fdtab[fd]->lock);
+		kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 #ifdef DEBUG
 		cprintf("%s:%d: END OF DIRECTORY\n",
 			rproc->name, rproc->pid);
@@ -640,20 +1754,22 @@ int sys_getdents(void)
 		return 0;
 	}
 
-	/* Update the record length */
-	dirp->d_reclen = sizeof(struct dirent);
+	/* Update the record lengths */
+	int x;
+	for(x = 0;x < result;x++)
+		dirp[x].d_reclen = sizeof(struct dirent);
 
-	/* Convert to old structure */
-	rproc->fdtab[fd]->seek++; /* Increment seek */
-	slock_release(&rproc->fdtab[fd]->lock);
-	return sizeof(struct dirent);
+	/* The next call picks up right after the last entry */
+	rproc->fdtab->fds[fd]->seek = dirp[result - 1].d_off;
+	kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
+	return result * sizeof(struct dirent);
 }
 
 /* int pipe(int fd[2]) */
 int sys_pipe(void)
 {
 	int* pipefd;
-	if(syscall_get_buffer_ptr((void**)&pipefd, sizeof(int) * 2, 0))
+	if(syscall_get_output_ptr((void**)&pipefd, sizeof(int) * 2, 0))
 		return -1;
 
 	/* Try to get a pipe */
@@ -667,22 +1783,22 @@ int sys_pipe(void)
 	int write = fd_next(rproc);
 	if(!fd_ok(write))
 		return -1;
-	slock_acquire(&rproc->fdtab[read]->lock);
-	slock_acquire(&rproc->fdtab[write]->lock);
+	kmutex_lock(&rproc->fdtab->fds[read]->lock);
+	kmutex_lock(&rproc->fdtab->fds[write]->lock);
 
 	if(read >= 0)
 	{
-		rproc->fdtab[read]->type = FD_TYPE_PIPE;
-		rproc->fdtab[read]->pipe_type = FD_PIPE_MODE_READ;
-		rproc->fdtab[read]->pipe = t;
+		rproc->fdtab->fds[read]->type = FD_TYPE_PIPE;
+		rproc->fdtab->fds[read]->pipe_type = FD_PIPE_MODE_READ;
+		rproc->fdtab->fds[read]->pipe = t;
 	}
 
 	/* Get a write fd */
 	if(write >= 0)
 	{
-		rproc->fdtab[write]->type = FD_TYPE_PIPE;
-		rproc->fdtab[write]->pipe_type = FD_PIPE_MODE_WRITE;
-		rproc->fdtab[write]->pipe = t;
+		rproc->fdtab->fds[write]->type = FD_TYPE_PIPE;
+		rproc->fdtab->fds[write]->pipe_type = FD_PIPE_MODE_WRITE;
+		rproc->fdtab->fds[write]->pipe = t;
 	}
 
 	t->write_ref = 1;
@@ -690,8 +1806,8 @@ int sys_pipe(void)
 	pipefd[0] = read;
 	pipefd[1] = write;
 	
-	slock_release(&rproc->fdtab[read]->lock);
-	slock_release(&rproc->fdtab[write]->lock);
+	kmutex_unlock(&rproc->fdtab->fds[read]->lock);
+	kmutex_unlock(&rproc->fdtab->fds[write]->lock);
 	
 	return 0;
 }
@@ -721,37 +1837,43 @@ int dup2(int new_fd, int old_fd)
 {
 	if(!fd_ok(old_fd))
 		return -1;
+	/* Nothing to do if they are the same */
+	if(new_fd == old_fd) return 0;
 	/* Make sure new_fd is closed */
 	close(new_fd);
 	/* Lock the old fd */
-	slock_acquire(&rproc->fdtab[old_fd]->lock);
+	kmutex_lock(&rproc->fdtab->fds[old_fd]->lock);
+	/* Create the mapping, the table might have to grow */
+	if(fd_install(rproc, new_fd, rproc->fdtab->fds[old_fd]))
+	{
+		kmutex_unlock(&rproc->fdtab->fds[old_fd]->lock);
+		return -1;
+	}
 	/* Added a reference for this fd */
-	rproc->fdtab[old_fd]->refs++;
-	/* Create the mapping */
-	rproc->fdtab[new_fd] = rproc->fdtab[old_fd];
+	rproc->fdtab->fds[old_fd]->refs++;
 
 	/* Modify references for other mechanisms */
-	switch(rproc->fdtab[old_fd]->type)
+	switch(rproc->fdtab->fds[old_fd]->type)
 	{
 		default: break;
 		case FD_TYPE_FILE:
 			/* Increment inode references */
-			rproc->fdtab[old_fd]->i->references++;
+			fs_add_inode_reference(rproc->fdtab->fds[old_fd]->i);
 			break;
 		case FD_TYPE_DEVICE:
 			break;
 		case FD_TYPE_PIPE:
-			slock_acquire(&rproc->fdtab[old_fd]->pipe->guard);
-			if(rproc->fdtab[old_fd]->pipe_type == FD_PIPE_MODE_WRITE)
-				rproc->fdtab[old_fd]->pipe->write_ref++;
-			if(rproc->fdtab[old_fd]->pipe_type == FD_PIPE_MODE_READ)
-				rproc->fdtab[old_fd]->pipe->read_ref++;
-			slock_release(&rproc->fdtab[old_fd]->pipe->guard);
+			slock_acquire(&rproc->fdtab->fds[old_fd]->pipe->guard);
+			if(rproc->fdtab->fds[old_fd]->pipe_type == FD_PIPE_MODE_WRITE)
+				rproc->fdtab->fds[old_fd]->pipe->write_ref++;
+			if(rproc->fdtab->fds[old_fd]->pipe_type == FD_PIPE_MODE_READ)
+				rproc->fdtab->fds[old_fd]->pipe->read_ref++;
+			slock_release(&rproc->fdtab->fds[old_fd]->pipe->guard);
 			break;
 	}
 
 	/* Release the fd lock */
-	slock_release(&rproc->fdtab[old_fd]->lock);
+	kmutex_unlock(&rproc->fdtab->fds[old_fd]->lock);
 	return 0;
 }
 
@@ -760,7 +1882,7 @@ int sys_fchdir(void)
 	int fd;
 	if(syscall_get_int(&fd, 0)) return -1;
 	if(!fd_ok(fd)) return -1;
-	slock_acquire(&rproc->fdtab[fd]->lock);
+	kmutex_lock(&rproc->fdtab->fds[fd]->lock);
 	switch(fd)
 	{
 		case FD_TYPE_FILE:
@@ -768,12 +1890,12 @@ int sys_fchdir(void)
 		case FD_TYPE_PATH:
 			break;
 		default:
-			slock_release(&rproc->fdtab[fd]->lock);
+			kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 			return -1;
 	}
 
-	strncpy(rproc->cwd, rproc->fdtab[fd]->path, FILE_MAX_PATH);
-	slock_release(&rproc->fdtab[fd]->lock);
+	strncpy(rproc->cwd, rproc->fdtab->fds[fd]->path, FILE_MAX_PATH);
+	kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 	return 0;
 }
 
@@ -785,7 +1907,7 @@ int sys_fchmod(void)
 	if(syscall_get_int(&fd, 0)) return -1;
 	if(syscall_get_int((int*)&mode, 1)) return -1;
 	if(!fd_ok(fd));
-	slock_acquire(&rproc->fdtab[fd]->lock);
+	kmutex_lock(&rproc->fdtab->fds[fd]->lock);
 
 	switch(fd)
 	{
@@ -794,12 +1916,12 @@ int sys_fchmod(void)
 		case FD_TYPE_PATH:
 			break;
 		default:
-			slock_release(&rproc->fdtab[fd]->lock);
+			kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 			return -1;
 	}
 			
-	int result = fs_chmod(rproc->fdtab[fd]->path, mode);
-	slock_release(&rproc->fdtab[fd]->lock);
+	int result = fs_chmod(rproc->fdtab->fds[fd]->path, mode);
+	kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 
 	return result;
 }
@@ -814,7 +1936,7 @@ int sys_fchown(void)
 	if(syscall_get_short((short*)&owner, 1)) return -1;
 	if(syscall_get_short((short*)&group, 2)) return -1;
 	if(!fd_ok(fd)) return -1;
-	slock_acquire(&rproc->fdtab[fd]->lock);
+	kmutex_lock(&rproc->fdtab->fds[fd]->lock);
 
 	switch(fd)
 	{
@@ -823,12 +1945,12 @@ int sys_fchown(void)
 		case FD_TYPE_PATH:
 			break;
 		default:
-			slock_release(&rproc->fdtab[fd]->lock);
+			kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 			return -1;
 	}
 
-	int result = fs_chown(rproc->fdtab[fd]->path, owner, group);
-	slock_release(&rproc->fdtab[fd]->lock);
+	int result = fs_chown(rproc->fdtab->fds[fd]->path, owner, group);
+	kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 	return result;
 }
 
@@ -853,25 +1975,25 @@ int sys_ioctl(void)
 
 	if(!fd_ok(fd)) return -1;
 
-	slock_acquire(&rproc->fdtab[fd]->lock);
+	kmutex_lock(&rproc->fdtab->fds[fd]->lock);
 	/* Is this a device? */
-	if(rproc->fdtab[fd]->type != FD_TYPE_DEVICE)
+	if(rproc->fdtab->fds[fd]->type != FD_TYPE_DEVICE)
 	{
-		slock_release(&rproc->fdtab[fd]->lock);
+		kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 		return -1;
 	}
 
 	/* Does this device support ioctl? */
-	if(!rproc->fdtab[fd]->device->ioctl)
+	if(!rproc->fdtab->fds[fd]->device->ioctl)
 	{
-		slock_release(&rproc->fdtab[fd]->lock);
+		kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 		return -1;
 	}
 
-	int result = rproc->fdtab[fd]->device->ioctl(request, 
-			arg, rproc->fdtab[fd]->device->context);
+	int result = rproc->fdtab->fds[fd]->device->ioctl(request, 
+			arg, rproc->fdtab->fds[fd]->device->context);
 
-	slock_release(&rproc->fdtab[fd]->lock);
+	kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 	return result;
 }
 
@@ -914,21 +2036,21 @@ int sys_ttyname(void)
 	if(!fd_ok(fd)) return -1;
 
 	/* Lock this fd */
-	slock_acquire(&rproc->fdtab[fd]->lock);
+	kmutex_lock(&rproc->fdtab->fds[fd]->lock);
 	/* Check to make sure the file descriptor is actually a device */
-	if(rproc->fdtab[fd]->type != FD_TYPE_DEVICE
-		|| !tty_check(rproc->fdtab[fd]->device)) 
+	if(rproc->fdtab->fds[fd]->type != FD_TYPE_DEVICE
+		|| !tty_check(rproc->fdtab->fds[fd]->device)) 
 	{
-		slock_release(&rproc->fdtab[fd]->lock);
+		kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 		return -1;
 	}
 
 	/* Move the mount point into buf */
 	if(sz > FILE_MAX_PATH)
 		sz = FILE_MAX_PATH;
-	strncpy(buf, rproc->fdtab[fd]->device->node, sz);
+	strncpy(buf, rproc->fdtab->fds[fd]->device->node, sz);
 
-	slock_release(&rproc->fdtab[fd]->lock);
+	kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 	return 0;
 }
 
@@ -941,7 +2063,7 @@ int sys_fpathconf(void)
 	if(syscall_get_int(&name, 1)) return -1;
 	if(!fd_ok(fd)) return -1;
 
-	struct file_descriptor* filed = rproc->fdtab[fd];
+	struct file_descriptor* filed = rproc->fdtab->fds[fd];
 	const char* path = filed->path;
 
 	return fs_pathconf(name, path);
@@ -965,7 +2087,7 @@ int sys_lstat(void)
 	struct stat* st;
 	if(syscall_get_str_ptr(&path, 0)) 
 		return -1;
-	if(syscall_get_buffer_ptr((void**) &st, sizeof(struct stat), 1)) 
+	if(syscall_get_output_ptr((void**) &st, sizeof(struct stat), 1)) 
 		return -1;
 
 #ifdef DEBUG
@@ -1017,7 +2139,7 @@ int sys_fcntl(void)
 	cprintf("%s: fcntl on fd %d, action %d, iarg: %d\n", 
 			rproc->name, fd, action, i_arg);
 #endif
-	slock_acquire(&rproc->fdtab[fd]->lock);
+	kmutex_lock(&rproc->fdtab->fds[fd]->lock);
 
 	int result = 0;
 	switch(action)
@@ -1040,19 +2162,35 @@ int sys_fcntl(void)
 			}
 			result = dup2(i_arg, fd);
 			/* Also set the close on exec flag */
-			rproc->fdtab[i_arg]->flags |= O_CLOEXEC;
+			rproc->fdtab->fds[i_arg]->flags |= O_CLOEXEC;
 			break;
 		case F_GETFD:
-			result = rproc->fdtab[fd]->flags;
+			result = rproc->fdtab->fds[fd]->flags;
 			break;
 		case F_SETFD:
-			rproc->fdtab[fd]->flags = i_arg;
+			rproc->fdtab->fds[fd]->flags = i_arg;
 			break;
 		case F_GETFL:
-			result = rproc->fdtab[fd]->flags;
+			result = rproc->fdtab->fds[fd]->flags;
 			break;
 		case F_SETFL:
-			rproc->fdtab[fd]->flags = i_arg;
+			rproc->fdtab->fds[fd]->flags = i_arg;
+			break;
+		case F_GETPIPE_SZ:
+			if(rproc->fdtab->fds[fd]->type != FD_TYPE_PIPE)
+			{
+				result = -1;
+				break;
+			}
+			result = pipe_get_size(rproc->fdtab->fds[fd]->pipe);
+			break;
+		case F_SETPIPE_SZ:
+			if(rproc->fdtab->fds[fd]->type != FD_TYPE_PIPE || i_arg < 0)
+			{
+				result = -1;
+				break;
+			}
+			result = pipe_set_size(rproc->fdtab->fds[fd]->pipe, i_arg);
 			break;
 		default:
 			cprintf("UNIMPLEMENTED FCNTL: %d\n", action);
@@ -1060,7 +2198,7 @@ int sys_fcntl(void)
 			break;
 	}
 
-	slock_release(&rproc->fdtab[fd]->lock);
+	kmutex_unlock(&rproc->fdtab->fds[fd]->lock);
 	return result;
 }
 
@@ -1076,6 +2214,10 @@ int sys_sysconf(void)
 			return PGSIZE;
 		case _SC_PHYS_PAGES:
 			return (int)(1 << 22);
+		case _SC_CHILD_MAX:
+			return PROC_LIMIT;
+		case _SC_OPEN_MAX:
+			return rproc->fd_limit;
 		default:
 #ifdef DEBUG
 			cprintf("kernel: no such limit: %d\n", name);
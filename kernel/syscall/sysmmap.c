@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "stdlock.h"
 #include "file.h"
 #include "syscall.h"
@@ -13,46 +15,39 @@
 
 void* mmap(void* hint, size_t sz, int protection,
         int flags, int fd, off_t offset);
+int munmap(void* addr, size_t length);
+
+/* Areas munmap takes out of the area table at once */
+#define MUNMAP_BATCH 0x08
 
+/**
+ * Find sz bytes of free space in the mmap area. New mappings are normally
+ * placed right below the lowest mapping, otherwise the gaps between the
+ * existing mappings are searched from the top down.
+ */
 static void* mmap_find_space(size_t sz)
 {
-	/* Lets start searching from the start */
-	int pages_needed = PGROUNDUP(sz) / PGSIZE;
-	int page = PGROUNDDOWN(rproc->mmap_start) - PGSIZE;
-	int pages = 0;
-	void* address = NULL;
-	for(;page > rproc->heap_end;page -= PGSIZE)
-	{
-		if(vm_findpg(page, 0, rproc->pgdir, 0, 0))
-			pages = 0;
-		else {
-			pages++;
+	uintptr_t low = PGROUNDUP(rproc->heap_end) + PGSIZE;
+	uintptr_t high = PGROUNDDOWN(rproc->mmap_start);
+	uintptr_t address = 0;
 
-			if(pages == pages_needed)
-			{
-				address = (void*)page;
-				break;
-			}
-		}
-	}	
+	if(rproc->mmap_end > low && rproc->mmap_end <= high)
+		address = vm_area_find_space(&rproc->vm_areas, 
+				low, rproc->mmap_end, sz);
+	if(!address)
+		address = vm_area_find_space(&rproc->vm_areas, low, high, sz);
 
-	return address;	
+	return (void*)address;
 }
 
-/* int munmap(void* addr, size_t length) */
-int sys_munmap(void)
+int munmap(void* addr, size_t length)
 {
-	void* addr;
-	size_t length;
-
-	if(syscall_get_int((int*)&addr, 0)) return -1;
-        if(syscall_get_int((int*)&length, 1)) return -1;
-
 	/* Is the address okay? */
 	uintptr_t address = (uintptr_t)addr;
 	if(length == 0) return -1;
 	/* Address must be page aligned */
 	if(address != PGROUNDDOWN(address)) return -1;
+	length = PGROUNDUP(length);
 
 	/* Address must be in the proper range */
 	if(address < PGROUNDUP(rproc->heap_end) + PGSIZE ||
@@ -60,13 +55,52 @@ int sys_munmap(void)
 			address + length > PGROUNDDOWN(rproc->mmap_start))
 		return -1;
 
-	uintptr_t x;
-	for(x = 0;x < length;x += PGSIZE)
-		vm_unmappage(x + address, rproc->pgdir);
+	/**
+	 * Writing back shared file pages and closing the file can sleep, so
+	 * the areas are taken out of the table with the memory lock held and
+	 * released after the lock is dropped.
+	 */
+	uintptr_t end = address + length;
+	struct vm_area areas[MUNMAP_BATCH];
+	int count;
+	int x;
+	do
+	{
+		slock_acquire(&rproc->mem_lock);
+		count = vm_area_detach(&rproc->vm_areas, address, end,
+				areas, MUNMAP_BATCH);
+		slock_release(&rproc->mem_lock);
+		if(count < 0) return -1;
+
+		for(x = 0;x < count;x++)
+			vm_area_put(areas + x, rproc->pgdir);
+	} while(count == MUNMAP_BATCH);
+
+	/* Free the private pages that are left */
+	slock_acquire(&rproc->mem_lock);
+	uintptr_t page;
+	for(page = address;page < end;page += PGSIZE)
+	{
+		pypage_t pg = vm_unmappage(page, rproc->pgdir);
+		if(pg) pfree(pg);
+	}
+	slock_release(&rproc->mem_lock);
 
 	return 0;
 }
 
+/* int munmap(void* addr, size_t length) */
+int sys_munmap(void)
+{
+	void* addr;
+	size_t length;
+
+	if(syscall_get_int((int*)&addr, 0)) return -1;
+        if(syscall_get_int((int*)&length, 1)) return -1;
+
+	return munmap(addr, length);
+}
+
 
 
 /* void* mmap(void* hint, size_t sz, int protection,
@@ -87,14 +121,32 @@ int sys_mmap(void)
         if(syscall_get_int(&fd, 4)) return -1;
         if(syscall_get_int((int*) &offset, 5)) return -1;
 
-	slock_acquire(&ptable_lock);
+	/* Unmapping can sleep, so the old mappings go before the lock */
+	if(flags & MAP_FIXED)
+		munmap(hint, sz);
+
+	qlock_acquire(&ptable_lock);
 	void* ret = mmap(hint, sz, protection, flags, fd, offset);
-	slock_release(&ptable_lock);
+	qlock_release(&ptable_lock);
+
+	/**
+	 * Populating a file mapping reads the file, which can sleep. Do it
+	 * without any locks, just like a page fault would.
+	 */
+	int file = !(flags & MAP_ANONYMOUS) && fd >= 0;
+	if(ret && file && (flags & MAP_POPULATE))
+		vm_area_prefault(&rproc->vm_areas, (uintptr_t)ret,
+				sz, rproc->pgdir);
 
 	return (int)ret;
 }
 
-/** MUST HAVE PTABLE LOCK! */
+/**
+ * MUST HAVE PTABLE LOCK! A fixed mapping fails if anything is still mapped
+ * in its range, the caller has to munmap the range first. Only anonymous
+ * mappings are populated here, the caller has to populate file mappings
+ * after dropping the lock.
+ */
 void* mmap(void* hint, size_t sz, int protection, 
 	int flags, int fd, off_t offset)
 {
@@ -108,6 +160,24 @@ void* mmap(void* hint, size_t sz, int protection,
 	if(hint && !hint_okay)
 		return NULL;
 
+	if(!sz || !protection)
+		return NULL;
+
+	/* Is this mapping backed by a file? */
+	inode ino = NULL;
+	if(!(flags & MAP_ANONYMOUS) && fd >= 0)
+	{
+		if(!fd_ok(fd) || rproc->fdtab->fds[fd]->type != FD_TYPE_FILE)
+			return NULL;
+		/* The offset must be page aligned */
+		if(offset < 0 || offset != PGROUNDDOWN(offset))
+			return NULL;
+		ino = rproc->fdtab->fds[fd]->i;
+	}
+
+	size_t data_sz = sz;
+	sz = PGROUNDUP(sz);
+
 	/* acquire the memory lock */	
 	slock_acquire(&rproc->mem_lock);
 
@@ -117,7 +187,7 @@ void* mmap(void* hint, size_t sz, int protection,
 		/* Is the address appropriate? */
 		if(addr >= PGROUNDUP(rproc->heap_end) + PGSIZE && 
 				addr < rproc->mmap_start && 
-				addr + sz < rproc->mmap_start)
+				addr + sz <= rproc->mmap_start)
 			pagestart = addr;
 		else {
 			slock_release(&rproc->mem_lock);
@@ -133,9 +203,6 @@ void* mmap(void* hint, size_t sz, int protection,
 		return NULL;
 	}
 
-	if(pagestart < rproc->mmap_end)
-		rproc->mmap_end = pagestart;
-
 	vmflags_t dir_flags = VM_DIR_USRP | VM_DIR_READ | VM_DIR_WRIT;
 	vmflags_t tbl_flags = 0;
 	if(protection & PROT_WRITE)
@@ -144,21 +211,64 @@ void* mmap(void* hint, size_t sz, int protection,
 		tbl_flags |= VM_TBL_EXEC;
 	if(protection & PROT_READ)
 		tbl_flags |= VM_TBL_READ;
-	
-	if(!protection)
+
+	/* Enable default flags */
+	tbl_flags |= VM_TBL_USRP | VM_TBL_READ;
+
+	/* The pages get filled when they are first touched */
+	struct vm_area area;
+	memset(&area, 0, sizeof(struct vm_area));
+	area.type = VM_AREA_ANON;
+	area.start = pagestart;
+	area.end = pagestart + sz;
+	area.dir_flags = dir_flags;
+	area.tbl_flags = tbl_flags;
+	if(ino)
+	{
+		/* Anything past the end of the file is zero filled */
+		size_t file_sz = 0;
+		if(ino->st.st_size > offset)
+			file_sz = ino->st.st_size - offset;
+		if(data_sz > file_sz)
+			data_sz = file_sz;
+
+		area.type = VM_AREA_FILE;
+		area.ino = ino;
+		area.data_start = pagestart;
+		area.data_end = pagestart + data_sz;
+		area.offset = offset;
+		if(flags & MAP_SHARED)
+			area.flags |= VM_AREA_SHARED;
+	}
+
+	if(vm_area_add(&rproc->vm_areas, &area))
 	{
 		slock_release(&rproc->mem_lock);
 		return NULL;
 	}
 
-	/* Enable default flags */
-	tbl_flags |= VM_TBL_USRP | VM_TBL_READ;
+	if(pagestart < rproc->mmap_end)
+		rproc->mmap_end = pagestart;
 
-        vm_mappages(pagestart, sz, rproc->pgdir, dir_flags, tbl_flags);
+#ifdef  __ALLOW_VM_SHARE__
+	/* Shared pages have to exist before they can be shared */
+	if((flags & MAP_SHARED) && !ino)
+		flags |= MAP_POPULATE;
+#endif
+
+	if((flags & MAP_POPULATE) && !ino)
+	{
+		/**
+		 * Populating is only a hint, whatever is missing gets
+		 * populated when it is touched.
+		 */
+		vm_area_prefault(&rproc->vm_areas, pagestart, 
+					sz, rproc->pgdir);
+	}
 
 #ifdef  __ALLOW_VM_SHARE__
-	/* Is this mapping shared? */
-	if(flags & MAP_SHARED)
+	/* Is this mapping shared? File mappings share through the cache. */
+	if((flags & MAP_SHARED) && !ino)
 	{
 		if(vm_pgsshare(pagestart, sz, rproc->pgdir))
 		{
@@ -21,7 +21,7 @@ int sys_gethostname(void)
 	size_t size;
 	
 	if(syscall_get_int((int*)&size, 1)) return 0;
-	if(syscall_get_buffer_ptr((void**)&buffer, size, 0)) return 0;
+	if(syscall_get_output_ptr((void**)&buffer, size, 0)) return 0;
 
 	strncpy(buffer, hostname, size);
 	
@@ -30,11 +30,28 @@
 # undef DEBUG
 #endif
 
-extern int k_ticks;
-
 int waitpid_nolock(int pid, int* status, int options);
 int waitpid_nolock_noharvest(int pid);
 
+/**
+ * Returns the first process that waitpid has to look at for the given
+ * pid. A single pid is found in the pid hash, -1 walks our children.
+ */
+static struct proc* waitpid_first(int pid)
+{
+	if(pid == -1) return rproc->children;
+	return get_proc_pid(pid);
+}
+
+/**
+ * Returns the process that waitpid has to look at after child.
+ */
+static struct proc* waitpid_next(int pid, struct proc* child)
+{
+	if(pid == -1) return child->sibling_next;
+	return NULL;
+}
+
 /* int waitpid(int pid, int* status, int options) */
 int sys_waitpid(void)
 {
@@ -43,7 +60,7 @@ int sys_waitpid(void)
 	int options = 0;
 	if(syscall_get_int(&pid, 0)) return -1;
 	if(syscall_get_int((int*)&status, 1)) return -1;
-	if(status != NULL && syscall_get_buffer_ptr(
+	if(status != NULL && syscall_get_output_ptr(
 				(void**)&status, sizeof(int), 1))
 		return -1;
 	if(syscall_get_int(&options, 2)) return -1;
@@ -53,11 +70,11 @@ int sys_waitpid(void)
 
 int waitpid(int pid, int* status, int options)
 {
-	slock_acquire(&ptable_lock);
+	qlock_acquire(&ptable_lock);
 
 	int result = waitpid_nolock(pid, status, options);
 	/* Release the ptable lock */
-	slock_release(&ptable_lock);
+	qlock_release(&ptable_lock);
 
 	return result;
 }
@@ -74,24 +91,24 @@ int waitpid_nolock(int pid, int* status, int options)
 	while(1)
 	{
 		int found = 0; /* Is there an elligible process? */
-		int process;
-		for(process = 0;process < PTABLE_SIZE;process++)
+		struct proc* child = waitpid_first(pid);
+		for(;child;child = waitpid_next(pid, child))
 		{
 			/* Did we find the process? */
-			if((pid == ptable[process].pid || pid == -1)
-				&& ptable[process].parent == rproc)
+			if((pid == child->pid || pid == -1)
+				&& child->parent == rproc)
 				found = 1;
 			else continue;
 
-			int status_change = ptable[process].status_changed;
+			int status_change = child->status_changed;
 #ifdef DEBUG
 			cprintf("%s:%d: Child changed status? %d\n",
 					rproc->name, rproc->pid, status_change);
 #endif
 
 			/* Are we listening to continue events? */
-			if((ptable[process].state == PROC_RUNNABLE 
-					|| ptable[process].state == PROC_RUNNING)
+			if((child->state == PROC_RUNNABLE 
+					|| child->state == PROC_RUNNING)
 					&& ((options & WCONTINUED) == 0x0))
 				status_change = 0;
 
@@ -101,7 +118,7 @@ int waitpid_nolock(int pid, int* status, int options)
 #endif
 
 			/* Are we listening to stops? */
-			if(ptable[process].state == PROC_STOPPED
+			if(child->state == PROC_STOPPED
 					&& (options & WUNTRACED) == 0x0)
 				status_change = 0;
 
@@ -110,14 +127,10 @@ int waitpid_nolock(int pid, int* status, int options)
 					rproc->name, rproc->pid, status_change);
 #endif
 
-			if((ptable[process].state == PROC_ZOMBIE || status_change)
-					&& ptable[process].parent == rproc)
+			if(child->state == PROC_ZOMBIE || status_change)
 			{
-				if(pid == -1 || ptable[process].pid == pid)
-				{
-					p = ptable + process;
-					break;
-				}
+				p = child;
+				break;
 			}
 		}
 
@@ -140,26 +153,33 @@ int waitpid_nolock(int pid, int* status, int options)
 				if(status)
 					*status = p->return_code;
 
-				/* Free used memory */
-				freepgdir(p->pgdir);
-
-				/* pushcli here */
-
 				/**
-				 * Change rproc to the child process so that we 
-				 * can close its files. 
+				 * Writing back mappings and closing files can
+				 * sleep, which needs the ptable lock. Hide the
+				 * child so that nobody else harvests it and
+				 * tear it down without the lock.
 				 */
-				struct proc* current = rproc;
-				rproc = p;
+				waitqueue_remove(p);
+				sched_dequeue(p);
+				proc_unlink(p);
+				qlock_release(&ptable_lock);
+
+				/* A signal might have killed it with an alarm set */
+				ktimer_del(&p->alarm_timer);
+
+				/* Write back file mappings, free used memory */
+				vm_area_free(&p->vm_areas, p->pgdir);
+				freepgdir(p->pgdir);
 
 				/* Close open files */
 				int file;
-				for(file = 0;file < PROC_MAX_FDS;file++)
-					close(file);
-				rproc = current;
+				for(file = fd_next_used(p, 0);file >= 0;
+						file = fd_next_used(p, file + 1))
+					fd_close(p, file);
+				iobatch_release(p);
 
-				memset(p, 0, sizeof(struct proc));
-				p->state = PROC_UNUSED;
+				qlock_acquire(&ptable_lock);
+				free_proc(p);
 			} else { /* The process wasn't ended */
 				p->status_changed = 0;
 
@@ -186,15 +206,10 @@ int waitpid_nolock(int pid, int* status, int options)
 			/* Set the wait options */
 			rproc->wait_options = options;
 
-			/* Lets block ourself */
-			rproc->block_type = PROC_BLOCKED_WAIT;
+			/* Wait for one of our children to exit */
 			rproc->b_pid = pid;
-			rproc->state = PROC_BLOCKED;
-
-			/* Wait for a signal. */
-			yield_withlock();
-			/* Reacquire ptable lock */
-			slock_acquire(&ptable_lock);
+			waitqueue_sleep_ptable(&rproc->child_wait,
+					PROC_BLOCKED_WAIT);
 		}
 	}
 
@@ -212,17 +227,14 @@ int waitpid_nolock_noharvest(int pid)
 	struct proc* p = NULL;
 	while(1)
 	{
-		int process;
-		for(process = 0;process < PTABLE_SIZE;process++)
+		struct proc* child = waitpid_first(pid);
+		for(;child;child = waitpid_next(pid, child))
 		{
-			if(ptable[process].state == PROC_ZOMBIE
-					&& ptable[process].parent == rproc)
-			{               
-				if(pid == -1 || ptable[process].pid == pid)
-				{
-					p = ptable + process;
-					break;
-				}
+			if(child->state == PROC_ZOMBIE
+					&& child->parent == rproc)
+			{
+				p = child;
+				break;
 			}
 		}
 
@@ -231,14 +243,10 @@ int waitpid_nolock_noharvest(int pid)
 			ret_pid = p->pid;
 			break;
 		} else {
-			/* Lets block ourself */
-			rproc->block_type = PROC_BLOCKED_WAIT;
+			/* Wait for one of our children to exit */
 			rproc->b_pid = pid; 
-			rproc->state = PROC_BLOCKED;
-			/* Wait for a signal. */
-			yield_withlock();
-			/* Reacquire ptable lock */
-			slock_acquire(&ptable_lock);
+			waitqueue_sleep_ptable(&rproc->child_wait,
+					PROC_BLOCKED_WAIT);
 		}
 	}
 
@@ -250,7 +258,7 @@ int sys_wait(void)
 {
 	int* status;
 	if(syscall_get_int((int*)&status, 0)) return -1;
-	if(status != NULL && syscall_get_buffer_ptr(
+	if(status != NULL && syscall_get_output_ptr(
 				(void**)&status, sizeof(int), 0))
 		return -1;
 	return waitpid(-1, status, 0);
@@ -314,8 +322,11 @@ int sys_exit(void)
 			rproc->name, rproc->pid, return_code);
 #endif
 
+	/* The alarm takes the ptable lock, stop it before taking it */
+	ktimer_del(&rproc->alarm_timer);
+
 	/* Acquire the ptable lock */
-	slock_acquire(&ptable_lock);
+	qlock_acquire(&ptable_lock);
 
 	/* The process exited */
 	rproc->return_code = (return_code & 0xFF) << 8;
@@ -324,41 +335,28 @@ int sys_exit(void)
 	rproc->state = PROC_ZOMBIE;
 
 	/* Attempt to wakeup our parent */
-	if(rproc->orphan == 0)
-	{
-		if(rproc->parent->block_type == PROC_BLOCKED_WAIT)
-		{
-			if(rproc->parent->b_pid == -1 || rproc->parent->b_pid == rproc->pid)
-			{
-				/* Our parent is waiting on us, release the block. */
-				rproc->parent->block_type = PROC_BLOCKED_NONE;
-				rproc->parent->state = PROC_RUNNABLE;
-				rproc->parent->b_pid = 0;
-			}
-		}
-	}
+	wake_parent(rproc);
 
 	/* Release ourself to the scheduler, never to return. */
 	yield_withlock();
 	return 0;
 }
 
+/**
+ * Is the parent p waiting for the child arg?
+ */
+static int wake_parent_match(struct proc* p, void* arg)
+{
+	struct proc* child = arg;
+	return p->b_pid == -1 || p->b_pid == child->pid;
+}
+
 void wake_parent(struct proc* p)
 {
 	/* Attempt to wakeup our parent */
 	if(p->orphan == 0)
-	{
-		if(p->parent->block_type == PROC_BLOCKED_WAIT)
-		{
-			if(p->parent->b_pid == -1 || p->parent->b_pid == p->pid)
-			{
-				/* Our parent is waiting on us, release the block. */
-				p->parent->block_type = PROC_BLOCKED_NONE;
-				p->parent->state = PROC_RUNNABLE;
-				p->parent->b_pid = 0;
-			}
-		}
-	}
+		waitqueue_wake_if(&p->parent->child_wait, wake_parent_match,
+				p, 0);
 }
 
 
@@ -371,7 +369,7 @@ void _exit(int return_code)
 
 int sys__exit(void)
 {
-	slock_acquire(&ptable_lock);
+	qlock_acquire(&ptable_lock);
 	/* Set state to killed */
 	int return_code;
 	if(syscall_get_int(&return_code, 0)) return -1;
@@ -383,7 +381,7 @@ int sys__exit(void)
 	//	rproc->file_descriptors[x].type = 0x0;
 
 	/* release the lock */
-	slock_release(&ptable_lock);
+	qlock_release(&ptable_lock);
 
 	/* Finish up with a call to exit() */
 	sys_exit();
@@ -398,13 +396,13 @@ int sys_brk(void)
 	void* addr;
 	if(syscall_get_int((int*)&addr, 0), 0) return -1;
 
-	slock_acquire(&ptable_lock);
+	qlock_acquire(&ptable_lock);
 	/* see if the address makes sense */
 	uintptr_t check_addr = (uintptr_t)addr;
 	if(PGROUNDUP(check_addr) >= rproc->stack_end
 			|| check_addr < rproc->heap_start)
 	{
-		slock_release(&ptable_lock);
+		qlock_release(&ptable_lock);
 		return -1;
 	}
 
@@ -420,7 +418,7 @@ int sys_brk(void)
 				rproc->name, rproc->pid, addr);
 #endif
 
-		slock_release(&ptable_lock);
+		qlock_release(&ptable_lock);
 		return old;
 	}
 
@@ -450,7 +448,7 @@ int sys_brk(void)
 #endif
 
 	/* Release lock */
-	slock_release(&ptable_lock);
+	qlock_release(&ptable_lock);
 	return (int)addr;
 }
 
@@ -470,7 +468,7 @@ int sys_sbrk(void)
 		return rproc->heap_end;
 	}
 
-	slock_acquire(&ptable_lock);
+	qlock_acquire(&ptable_lock);
 	uintptr_t old_end = rproc->heap_end;
 
 	if(increment < 0)
@@ -494,7 +492,7 @@ int sys_sbrk(void)
 					PGROUNDUP(old_end + increment) 
 					>= rproc->mmap_end))
 		{
-			slock_release(&ptable_lock);
+			qlock_release(&ptable_lock);
 			return (int)NULL;
 		}
 
@@ -523,7 +521,7 @@ int sys_sbrk(void)
 	/* Change heap end */
 	rproc->heap_end = old_end + increment;
 	/* release lock */
-	slock_release(&ptable_lock);
+	qlock_release(&ptable_lock);
 
 	/* return old end */
 	return (int)old_end;
@@ -578,7 +576,7 @@ int sys_getcwd(void)
 	size_t sz;	
 
 	if(syscall_get_int((int*)&sz, 1)) return -1;
-	if(syscall_get_buffer_ptr((void**)&dst, sz, 0)) return -1;
+	if(syscall_get_output_ptr((void**)&dst, sz, 0)) return -1;
 	strncpy(dst, rproc->cwd, sz);
 	return (int)dst;
 }
@@ -589,7 +587,7 @@ int sys_times(void)
 	struct tms* buf;
 	/* buf is allowed to be null */
 	if(syscall_get_int((int*)&buf, 0)) return -1;
-	if(buf && syscall_get_buffer_ptr((void**)&buf, sizeof(struct tms), 0))
+	if(buf && syscall_get_output_ptr((void**)&buf, sizeof(struct tms), 0))
 		return -1;
 
 	if(buf)
@@ -601,7 +599,7 @@ int sys_times(void)
 		buf->tms_cstime = 0;
 	}
 
-	return k_ticks;
+	return ktimer_ticks();
 }
 
 /* uid_t getuid(void) */
@@ -667,9 +665,9 @@ int sys_getresuid(void){
 	uid_t *ruid;
 	uid_t *euid;
 	uid_t *suid;
-	if(syscall_get_buffer_ptr((void**)&ruid, sizeof(int*), 0)) return -1;
-	if(syscall_get_buffer_ptr((void**)&euid, sizeof(int*), 1)) return -1;
-	if(syscall_get_buffer_ptr((void**)&suid, sizeof(int*), 2)) return -1;	
+	if(syscall_get_output_ptr((void**)&ruid, sizeof(int*), 0)) return -1;
+	if(syscall_get_output_ptr((void**)&euid, sizeof(int*), 1)) return -1;
+	if(syscall_get_output_ptr((void**)&suid, sizeof(int*), 2)) return -1;	
 	*ruid = rproc->ruid;
 	*euid = rproc->euid;
 	*suid = rproc->suid;
@@ -682,9 +680,9 @@ int sys_getresgid(void){
 	gid_t *rgid;
 	gid_t *egid;
 	gid_t *sgid;
-	if(syscall_get_buffer_ptr((void**)&rgid, sizeof(int*), 0))return -1;
-	if(syscall_get_buffer_ptr((void**)&egid, sizeof(int*), 1))return -1;
-	if(syscall_get_buffer_ptr((void**)&sgid, sizeof(int*), 2)) return -1;
+	if(syscall_get_output_ptr((void**)&rgid, sizeof(int*), 0))return -1;
+	if(syscall_get_output_ptr((void**)&egid, sizeof(int*), 1))return -1;
+	if(syscall_get_output_ptr((void**)&sgid, sizeof(int*), 2)) return -1;
 	*rgid = rproc->rgid;
 	*egid = rproc->egid;
 	*sgid = rproc->sgid;
@@ -932,10 +930,196 @@ int getumask(void){
 	return rproc->umask;
 }
 
+/**
+ * Check whether or not the running process may give p the given nice
+ * value. Only root may make a process more favorable and only the owner
+ * of a process or root may change it at all.
+ */
+static int sched_nice_allowed(struct proc* p, int nice)
+{
+	if(rproc->euid == 0) return 1;
+	if(p->uid != rproc->euid && p->uid != rproc->uid)
+		return 0;
+	if(nice < p->nice) return 0;
+	return 1;
+}
+
+/**
+ * Check whether or not p is one of the processes selected by which and
+ * who. who may be 0 to select the running process, its group or its user.
+ */
+static int sched_prio_match(struct proc* p, int which, int who)
+{
+	if(p->state == PROC_UNUSED || p->state == PROC_EMBRYO
+			|| p->state == PROC_ZOMBIE)
+		return 0;
+
+	switch(which)
+	{
+		case PRIO_PROCESS:
+			if(!who) who = rproc->pid;
+			return p->pid == who;
+		case PRIO_PGRP:
+			if(!who) who = rproc->pgid;
+			return p->pgid == who;
+		case PRIO_USER:
+			if(!who) who = rproc->uid;
+			return p->uid == who;
+	}
+
+	return 0;
+}
+
+/* int nice(int inc) */
+int sys_nice(void)
+{
+	int inc;
+	if(syscall_get_int(&inc, 0)) return -1;
+
+	qlock_acquire(&ptable_lock);
+	int nice = rproc->nice + inc;
+	if(!sched_nice_allowed(rproc, nice))
+	{
+		qlock_release(&ptable_lock);
+		return -1;
+	}
+	sched_set_nice(rproc, nice);
+	nice = rproc->nice;
+	qlock_release(&ptable_lock);
+
+	return nice;
+}
+
+/**
+ * int getpriority(int which, int who)
+ * Returns 20 - nice of the most favorable matching process so that the
+ * result is never negative. Returns -1 if no process matched.
+ */
+int sys_getpriority(void)
+{
+	int which;
+	int who;
+	if(syscall_get_int(&which, 0)) return -1;
+	if(syscall_get_int(&who, 1)) return -1;
+
+	int best = -1;
+	qlock_acquire(&ptable_lock);
+	struct proc* p;
+	for(p = proc_list;p;p = p->all_next)
+	{
+		if(!sched_prio_match(p, which, who))
+			continue;
+		if(20 - p->nice > best)
+			best = 20 - p->nice;
+	}
+	qlock_release(&ptable_lock);
+
+	return best;
+}
+
+/* int setpriority(int which, int who, int prio) */
+int sys_setpriority(void)
+{
+	int which;
+	int who;
+	int prio;
+	if(syscall_get_int(&which, 0)) return -1;
+	if(syscall_get_int(&who, 1)) return -1;
+	if(syscall_get_int(&prio, 2)) return -1;
+
+	if(prio < SCHED_NICE_MIN) prio = SCHED_NICE_MIN;
+	if(prio > SCHED_NICE_MAX) prio = SCHED_NICE_MAX;
+
+	int found = 0;
+	int result = 0;
+	qlock_acquire(&ptable_lock);
+	struct proc* p;
+	for(p = proc_list;p;p = p->all_next)
+	{
+		if(!sched_prio_match(p, which, who))
+			continue;
+
+		found = 1;
+		if(!sched_nice_allowed(p, prio))
+		{
+			result = -1;
+			continue;
+		}
+		sched_set_nice(p, prio);
+	}
+	qlock_release(&ptable_lock);
+
+	if(!found) return -1;
+	return result;
+}
+
+/* int getrlimit(int resource, struct rlimit* rlim) */
+int sys_getrlimit(void)
+{
+	int resource;
+	struct rlimit* rlim;
+	if(syscall_get_int(&resource, 0)) return -1;
+	if(syscall_get_output_ptr((void**)&rlim, sizeof(struct rlimit), 1))
+		return -1;
+
+	/* Only the amount of open files is limited */
+	if(resource != RLIMIT_NOFILE) return -1;
+
+	struct rlimit limit;
+	limit.rlim_cur = rproc->fd_limit;
+	limit.rlim_max = rproc->fd_limit_max;
+	if(copy_to_user(rlim, &limit, sizeof(struct rlimit)))
+		return -1;
+
+	return 0;
+}
+
+/* int setrlimit(int resource, const struct rlimit* rlim) */
+int sys_setrlimit(void)
+{
+	int resource;
+	struct rlimit* rlim;
+	if(syscall_get_int(&resource, 0)) return -1;
+	if(syscall_get_buffer_ptr((void**)&rlim, sizeof(struct rlimit), 1))
+		return -1;
+	if(resource != RLIMIT_NOFILE) return -1;
+
+	struct rlimit limit;
+	if(copy_from_user(&limit, rlim, sizeof(struct rlimit)))
+		return -1;
+
+	/* A table can't grow any further than FD_TABLE_MAX */
+	if(limit.rlim_cur > FD_TABLE_MAX) limit.rlim_cur = FD_TABLE_MAX;
+	if(limit.rlim_max > FD_TABLE_MAX) limit.rlim_max = FD_TABLE_MAX;
+	if(limit.rlim_cur > limit.rlim_max) return -1;
+
+	/* Only root can raise the hard limit */
+	if(limit.rlim_max > rproc->fd_limit_max && rproc->euid)
+		return -1;
+
+	rproc->fd_limit = limit.rlim_cur;
+	rproc->fd_limit_max = limit.rlim_max;
+
+	return 0;
+}
+
+/* uint alarm(uint seconds) */
 int sys_alarm(void)
 {
-	panic("WARNING: alarm system call unimplemented.\n");
-	return -1;
+	uint seconds;
+	if(syscall_get_int((int*)&seconds, 0)) return -1;
+	if(seconds > KTIMER_MAX_TICKS / KTIMER_HZ)
+		seconds = KTIMER_MAX_TICKS / KTIMER_HZ;
+
+	/* Cancel the alarm that is already set */
+	uint left = ktimer_remaining(&rproc->alarm_timer);
+	ktimer_del(&rproc->alarm_timer);
+
+	if(seconds)
+		ktimer_add(&rproc->alarm_timer, seconds * KTIMER_HZ);
+
+	/* Return the seconds that were left on the old alarm */
+	return (left + KTIMER_HZ - 1) / KTIMER_HZ;
 }
 
 int sys_vfork(void)
@@ -948,16 +1132,16 @@ int sys_vfork(void)
 
 	if(p > 0)
 	{
-		slock_acquire(&ptable_lock);
+		qlock_acquire(&ptable_lock);
 		if(waitpid_nolock_noharvest(p) != p)
 		{
 #ifdef DEBUG
 			cprintf("chronos: vfork failed! 2\n");	
-			slock_release(&ptable_lock);
+			qlock_release(&ptable_lock);
 			return -1;
 #endif
 		}
-		slock_release(&ptable_lock);
+		qlock_release(&ptable_lock);
 	} else {
 #ifdef DEBUG
 		cprintf("chronos: vfork failed!\n");
@@ -41,7 +41,7 @@ int sys_sigaction(void)
 		rproc->name, rproc->pid, signum);
 #endif
 
-	slock_acquire(&ptable_lock);
+	qlock_acquire(&ptable_lock);
 	if(old)
 	{
 		memmove(old, &rproc->sigactions[signum],
@@ -50,7 +50,7 @@ int sys_sigaction(void)
 	memmove(&rproc->sigactions[signum],
 		act, sizeof(struct sigaction));
 	
-	slock_release(&ptable_lock);
+	qlock_release(&ptable_lock);
 
 	return 0;
 }
@@ -101,7 +101,7 @@ int sys_signal(void)
 		rproc->name, rproc->pid, signum);
 #endif
 
-	slock_acquire(&ptable_lock);
+	qlock_acquire(&ptable_lock);
 	if(act == (struct sigaction*)SIG_IGN 
                 || act == (struct sigaction*)SIG_DFL 
                 || act == (struct sigaction*)SIG_ERR)
@@ -111,7 +111,7 @@ int sys_signal(void)
 		memmove(&rproc->sigactions[signum],
 				act, sizeof(struct sigaction));
 	}
-	slock_release(&ptable_lock);
+	qlock_release(&ptable_lock);
 
 	return (int)act;
 }
@@ -128,13 +128,13 @@ int sys_sigsuspend(void)
 		rproc->name, rproc->pid);
 #endif
 
-	slock_acquire(&ptable_lock);
+	qlock_acquire(&ptable_lock);
 
 	rproc->sig_suspend_mask = set;
 	rproc->state = PROC_SIGNAL;
 	yield_withlock();
 
-	slock_release(&ptable_lock);
+	qlock_release(&ptable_lock);
 
 	return 0;
 }
@@ -153,7 +153,7 @@ int sys_kill(void)
 		sig, pid);
 #endif
 
-	slock_acquire(&ptable_lock);
+	qlock_acquire(&ptable_lock);
 
 	if(pid > 0)
 	{
@@ -163,12 +163,12 @@ int sys_kill(void)
 			goto bad;
 	} else if(pid == 0)
 	{
-		int x;
-		for(x = 0;x < PTABLE_SIZE;x++)
+		struct proc* p;
+		for(p = proc_list;p;p = p->all_next)
 		{
 			/* Send the signal to the group */
-			if(ptable[x].state && ptable[x].pgid == rproc->pgid)
-				sig_proc(ptable + x, sig);
+			if(p->state && p->pgid == rproc->pgid)
+				sig_proc(p, sig);
 		}
 	} else if(pid == -1)
 	{
@@ -183,9 +183,9 @@ int sys_kill(void)
 			goto bad;
 	}
 
-	slock_release(&ptable_lock);
+	qlock_release(&ptable_lock);
 	return 0;
 bad:
-	slock_release(&ptable_lock);
+	qlock_release(&ptable_lock);
 	return -1;
 }
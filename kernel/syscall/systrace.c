@@ -0,0 +1,264 @@
+#include <string.h>
+#include <limits.h>
+
+#include "stdlock.h"
+#include "file.h"
+#include "syscall.h"
+#include "devman.h"
+#include "fsman.h"
+#include "proc.h"
+#include "vm.h"
+#include "chronos.h"
+#include "systrace.h"
+#include "panic.h"
+
+// #define DEBUG
+
+#ifdef RELEASE
+# undef DEBUG
+#endif
+
+/* How many events fit into the page of a trace ring */
+#define TRACE_RING_ENTRIES \
+	((PGSIZE - sizeof(struct trace_ring)) / sizeof(struct trace_event))
+
+/* Events trace_read moves out of the ring at once */
+#define TRACE_READ_BATCH 0x10
+
+/**
+ * The system calls a traced process has made that nobody has read yet.
+ * The ring lives in one page and is only freed with the process, so the
+ * traced process never has to check if it went away.
+ */
+struct trace_ring
+{
+	slock_t lock; /* Lock needed to touch the ring */
+	int enabled; /* Whether or not new calls are recorded */
+	unsigned int head; /* Next event to read */
+	unsigned int tail; /* Next free event */
+	unsigned int lost; /* Events dropped since the last read */
+	struct trace_event events[];
+};
+
+/**
+ * Counters for every system call. They are updated without a lock, so
+ * cpus that make the same call at the same time can lose an update.
+ */
+static struct syscall_stat syscall_stats[SYS_MAX + 1];
+
+void syscall_stats_add(int num, unsigned int cycles, int result)
+{
+	struct syscall_stat* stat = syscall_stats + num;
+	stat->calls++;
+	if(result < 0)
+		stat->errors++;
+	stat->cycles += cycles;
+	if(cycles > stat->max_cycles)
+		stat->max_cycles = cycles;
+
+	int bucket = 0;
+	if(cycles) bucket = 31 - __builtin_clz(cycles);
+	stat->hist[bucket]++;
+}
+
+static int syscall_stats_read(void* dst, fileoff_t start, size_t sz,
+		void* context)
+{
+	if(start >= sizeof(syscall_stats)) return 0;
+	if(sz > sizeof(syscall_stats) - start)
+		sz = sizeof(syscall_stats) - start;
+	memmove(dst, (char*)syscall_stats + start, sz);
+	return sz;
+}
+
+static int syscall_stats_write(void* src, fileoff_t start, size_t sz,
+		void* context)
+{
+	/* Any write starts the statistics over */
+	memset(syscall_stats, 0, sizeof(syscall_stats));
+	return sz;
+}
+
+int syscall_stats_init(struct IODevice* device)
+{
+	device->init = syscall_stats_init;
+	device->read = syscall_stats_read;
+	device->write = syscall_stats_write;
+	device->ioctl = NULL;
+	return 0;
+}
+
+int trace_begin(struct trace_event* event, int num)
+{
+	struct trace_ring* ring = rproc->trace;
+	if(!ring || !ring->enabled) return 0;
+
+	event->num = num;
+	if(copy_from_user(event->args, rproc->sys_esp, sizeof(event->args)))
+		memset(event->args, 0, sizeof(event->args));
+	return 1;
+}
+
+void trace_end(struct trace_event* event, unsigned int cycles, int result)
+{
+	struct trace_ring* ring = rproc->trace;
+	event->result = result;
+	event->cycles = cycles;
+
+	slock_acquire(&ring->lock);
+	/* Drop the oldest event if nobody has been reading */
+	if(ring->tail - ring->head == TRACE_RING_ENTRIES)
+	{
+		ring->head++;
+		ring->lost++;
+	}
+	ring->events[ring->tail % TRACE_RING_ENTRIES] = *event;
+	ring->tail++;
+	slock_release(&ring->lock);
+}
+
+void trace_free(struct proc* p)
+{
+	if(!p->trace) return;
+	pfree((pypage_t)p->trace);
+	p->trace = NULL;
+}
+
+/**
+ * Look up the process with the given pid that the running process is
+ * allowed to trace. 0 is the running process. (ptable lock needed)
+ */
+static struct proc* trace_proc(pid_t pid)
+{
+	if(!pid) return rproc;
+
+	struct proc* p = get_proc_pid(pid);
+	if(!p) return NULL;
+	if(rproc->euid && rproc->euid != p->uid) return NULL;
+	return p;
+}
+
+/* int trace_ctl(pid_t pid, int enable) */
+int sys_trace_ctl(void)
+{
+	pid_t pid;
+	int enable;
+	if(syscall_get_int(&pid, 0)) return -1;
+	if(syscall_get_int(&enable, 1)) return -1;
+
+	/* Get a ring ready in case the process doesn't have one */
+	struct trace_ring* ring = NULL;
+	if(enable)
+	{
+		ring = (struct trace_ring*)palloc();
+		if(!ring) return -1;
+		memset(ring, 0, sizeof(struct trace_ring));
+		slock_init(&ring->lock);
+	}
+
+	qlock_acquire(&ptable_lock);
+	struct proc* p = trace_proc(pid);
+	if(!p)
+	{
+		qlock_release(&ptable_lock);
+		if(ring) pfree((pypage_t)ring);
+		return -1;
+	}
+
+	if(enable && !p->trace)
+	{
+		p->trace = ring;
+		ring = NULL;
+	}
+
+	/* The ring stays around until the process is freed */
+	if(p->trace)
+		p->trace->enabled = enable != 0;
+	qlock_release(&ptable_lock);
+
+	if(ring) pfree((pypage_t)ring);
+
+#ifdef DEBUG
+	cprintf("%s: tracing %s for %d\n", rproc->name,
+			enable ? "enabled" : "disabled", pid);
+#endif
+
+	return 0;
+}
+
+/**
+ * Move up to max events out of the trace ring of the process with the
+ * given pid into the kernel buffer dst. Returns the amount of events
+ * moved, -1 if the process is gone or has exited and has nothing left to
+ * read.
+ */
+static int trace_take(pid_t pid, struct trace_event* dst, int max)
+{
+	qlock_acquire(&ptable_lock);
+	struct proc* p = trace_proc(pid);
+	if(!p || !p->trace)
+	{
+		qlock_release(&ptable_lock);
+		return -1;
+	}
+
+	struct trace_ring* ring = p->trace;
+	int count = 0;
+	slock_acquire(&ring->lock);
+	if(ring->lost && max)
+	{
+		memset(dst, 0, sizeof(struct trace_event));
+		dst->num = TRACE_LOST;
+		dst->result = ring->lost;
+		ring->lost = 0;
+		count++;
+	}
+
+	for(;count < max && ring->head != ring->tail;count++)
+	{
+		dst[count] = ring->events[ring->head % TRACE_RING_ENTRIES];
+		ring->head++;
+	}
+	slock_release(&ring->lock);
+
+	if(!count && p->state == PROC_ZOMBIE)
+		count = -1;
+	qlock_release(&ptable_lock);
+
+	return count;
+}
+
+/* int trace_read(pid_t pid, struct trace_event* events, int max) */
+int sys_trace_read(void)
+{
+	pid_t pid;
+	int max;
+	struct trace_event* events;
+	if(syscall_get_int(&pid, 0)) return -1;
+	if(syscall_get_int(&max, 2)) return -1;
+	if(max < 0 || max > INT_MAX / sizeof(struct trace_event)) return -1;
+	if(syscall_get_output_ptr((void**)&events,
+			max * sizeof(struct trace_event), 1))
+		return -1;
+
+	/* The user buffer can't be touched while the ring is locked */
+	struct trace_event batch[TRACE_READ_BATCH];
+	int total = 0;
+	while(total < max)
+	{
+		int want = max - total;
+		if(want > TRACE_READ_BATCH) want = TRACE_READ_BATCH;
+
+		int count = trace_take(pid, batch, want);
+		if(count < 0) return total ? total : -1;
+		if(!count) break;
+
+		if(copy_to_user(events + total, batch,
+				count * sizeof(struct trace_event)))
+			return -1;
+		total += count;
+		if(count < want) break;
+	}
+
+	return total;
+}
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include "kstdlib.h"
 #include "file.h"
@@ -14,45 +15,61 @@
 /** Check to see if an fd is valid */
 int fd_ok(int fd)
 {
-        if(fd < 0 || fd >= PROC_MAX_FDS)
+        if(fd < 0 || fd >= rproc->fdtab->size)
                 return 0;
-	if(!rproc->fdtab[fd])
+	if(!rproc->fdtab->fds[fd])
 		return 0;
-        if(!rproc->fdtab[fd]->type)
+        if(!rproc->fdtab->fds[fd]->type)
                 return 0;
         return 1;
 }
 
+/**
+ * Touch one byte in every page of the buffer. If write is set, the byte is
+ * stored back so that read only pages fail here and copy on write pages
+ * get copied now. Returns 0 if the buffer is ok, 1 otherwise.
+ */
+static int syscall_buffer_probe(const void* buff, size_t sz, int write)
+{
+	uintptr_t start = (uintptr_t)buff;
+	if(!buff || start + sz < start || start + sz > UVM_KVM_S)
+		return 1;
+	if(!sz) return 0;
+
+	/* Touching one byte per page lets the MMU do the checking */
+	char probe;
+	uintptr_t addr = start;
+	while(addr < start + sz)
+	{
+		if(copy_from_user(&probe, (void*)addr, 1))
+			return 1;
+		if(write && copy_to_user((void*)addr, &probe, 1))
+			return 1;
+		addr = PGROUNDDOWN(addr) + PGSIZE;
+	}
+
+	return 0;
+}
+
+int syscall_buffer_safe(const void* buff, size_t sz)
+{
+	return syscall_buffer_probe(buff, sz, 0);
+}
+
+int syscall_buffer_writable(void* buff, size_t sz)
+{
+	return syscall_buffer_probe(buff, sz, 1);
+}
+
 /* Is the given address safe to access? */
 int syscall_addr_safe(void* address)
 {
-	if(!address) return 1;
-		/* Stack grows down towards heap*/
-        if((rproc->stack_end <= (uint)address
-                && (uint)address < rproc->stack_start) ||
-		/* Code never changes, but end > start */
-        	   (rproc->code_end > (uint)address
-                && (uint)address >= rproc->code_start) ||
-		/* MMAP grows down towards heap */
-        	   (rproc->mmap_end <= (uint)address
-                && (uint)address < rproc->mmap_start) ||
-		/* HEAP grows upwards */
-                   (rproc->heap_end > (uint)address
-                && (uint)address >= rproc->heap_start))
-        {
-                /* Valid memory access */
-                return 0;
-        }
-        /* Invalid memory access */
-        return 1;
+	return syscall_buffer_safe(address, 1);
 }
 
 int syscall_ptr_safe(void* address)
 {
-        if(syscall_addr_safe(address)
-                || syscall_addr_safe(address + 3))
-                        return 1;
-        return 0;
+	return syscall_buffer_safe(address, sizeof(void*));
 }
 
 /**
@@ -60,90 +77,59 @@ int syscall_ptr_safe(void* address)
  */
 int syscall_get_int(int* dst, int arg_num)
 {
-	uintptr_t* esp = (uintptr_t*)rproc->sys_esp;
-        esp += arg_num;
-        char* num_start = (char*)esp;
-        char* num_end = (char*)esp + sizeof(int) - 1;
-
-        if(syscall_addr_safe(num_start) || syscall_addr_safe(num_end))
-                return 1;
-
-        *dst = *esp;
-        return 0;
+	int* arg = (int*)rproc->sys_esp + arg_num;
+	if(copy_from_user(dst, arg, sizeof(int)))
+		return 1;
+	return 0;
 }
 
 /**
- * Get an integer argument. The arg_num determines the offset to the argument.
+ * Get a long argument. The arg_num determines the offset to the argument.
  */
 int syscall_get_long(long* dst, int arg_num)
 {
-        uintptr_t* esp = (uintptr_t*)rproc->sys_esp;
-        esp += arg_num;
-        char* num_start = (char*)esp;
-        char* num_end = (char*)esp + sizeof(long) - 1;
-
-        if(syscall_addr_safe(num_start) || syscall_addr_safe(num_end))
-                return 1;
-
-        *dst = *esp;
-        return 0;
+	int* arg = (int*)rproc->sys_esp + arg_num;
+	if(copy_from_user(dst, arg, sizeof(long)))
+		return 1;
+	return 0;
 }
 
 /**
- * Get an integer argument. The arg_num determines the offset to the argument.
+ * Get a short argument. The arg_num determines the offset to the argument.
  */
 int syscall_get_short(short* dst, int arg_num)
 {
-        uintptr_t* esp = (uintptr_t*)rproc->sys_esp;
-        esp += arg_num;
-        char* num_start = (char*)esp;
-        char* num_end = (char*)esp + sizeof(short) - 1;
-
-        if(syscall_addr_safe(num_start) || syscall_addr_safe(num_end))
-                return 1;
-
-        *dst = *esp;
-        return 0;
+	int* arg = (int*)rproc->sys_esp + arg_num;
+	if(copy_from_user(dst, arg, sizeof(short)))
+		return 1;
+	return 0;
 }
 
-char syscall_get_str(char* dst, int sz_kern, int arg_num)
+int syscall_get_str(char* dst, int sz_kern, int arg_num)
 {
-	uintptr_t* esp = (uintptr_t*)rproc->sys_esp;
-        memset(dst, 0, sz_kern);
-        esp += arg_num; /* This is a pointer to the string we need */
-        char* str_addr = (char*)esp;
-        if(syscall_ptr_safe(str_addr))
-                return 1;
-        char* str = *(char**)str_addr;
-
-        int x;
-        for(x = 0;x < sz_kern;x++)
-        {
-                if(syscall_ptr_safe(str + x))
-			return 1;
-		dst[x] = str[x];
-		if(str[x] == 0) break;
-	}
+	char* str;
+	memset(dst, 0, sz_kern);
+	if(syscall_get_int((int*)&str, arg_num))
+		return 1;
+	if(!str || strncpy_from_user(dst, str, sz_kern) < 0)
+		return 1;
 
 	return 0;
 }
 
 int syscall_get_str_ptr(const char** dst, int arg_num)
 {
-	uintptr_t* esp = (uintptr_t*)rproc->sys_esp;
-	esp += arg_num; /* This is a pointer to the string we need */
-	const char* str_addr = (const char*)esp;
-	if(syscall_ptr_safe((void*)str_addr))
+	const char* str;
+	if(syscall_get_int((int*)&str, arg_num))
 		return 1;
-	const char* str = *(const char**)str_addr;
 
-	int x;
-	for(x = 0;;x++)
-	{
-		if(syscall_addr_safe((void*)(str + x)))
-			return 1;
-		if(!str[x]) break;
-	}
+	/* The whole string has to be in user memory */
+	if(!str || (uintptr_t)str >= UVM_KVM_S)
+		return 1;
+	size_t max = UVM_KVM_S - (uintptr_t)str;
+	int len = strnlen_user(str, max);
+	if(len < 0 || len == max)
+		return 1;
 
 	*dst = str;
 	return 0;
@@ -151,37 +137,50 @@ int syscall_get_str_ptr(const char** dst, int arg_num)
 
 int syscall_get_buffer_ptr(char** ptr, int sz, int arg_num)
 {
-	uintptr_t* esp = (uintptr_t*)rproc->sys_esp;
-	esp += arg_num; /* This is a pointer to the string we need */
-	char* buff_addr = (char*)esp;
-	if(syscall_addr_safe(buff_addr))
+	char* buff;
+	if(syscall_get_int((int*)&buff, arg_num))
 		return 1;
-	char* buff = *(char**)buff_addr;
-	if(syscall_addr_safe(buff) || syscall_addr_safe(buff + sz - 1))
+
+	/**
+	 * Page in the buffer now so that the kernel doesn't fault on it
+	 * while it is holding locks.
+	 */
+	if(sz < 0 || syscall_buffer_safe(buff, sz ? sz : 1))
 		return 1;
 
-	*ptr = (char*)buff;
+	*ptr = buff;
+
+	return 0;
+}
+
+int syscall_get_output_ptr(void** ptr, int sz, int arg_num)
+{
+	char* buff;
+	if(syscall_get_int((int*)&buff, arg_num))
+		return 1;
+
+	/* The kernel is going to write here, so probe for writing */
+	if(sz < 0 || syscall_buffer_writable(buff, sz ? sz : 1))
+		return 1;
+
+	*ptr = buff;
 
 	return 0;
 }
 
 int syscall_get_buffer_ptrs(void*** ptr, int arg_num)
 {
-	uintptr_t* esp = (uintptr_t*)rproc->sys_esp;
-	esp += arg_num;
-	/* Get the address of the buffer */
-	char*** buff_buff_addr = (char***)esp;
-	/* Is the user stack okay? */
-	if(syscall_ptr_safe((char*) buff_buff_addr))
+	char** buff_addr;
+	if(syscall_get_int((int*)&buff_addr, arg_num))
 		return 1;
-	char** buff_addr = *buff_buff_addr;
+
 	/* Check until we hit a null. */
 	int x;
 	for(x = 0;x < MAX_ARG;x++)
 	{
-		if(syscall_ptr_safe((char*)(buff_addr + x)))
+		char* val;
+		if(copy_from_user(&val, buff_addr + x, sizeof(char*)))
 			return 1;
-		char* val = *(buff_addr + x);
 		if(val == 0) break;
 	}
 
@@ -196,18 +195,43 @@ int syscall_get_buffer_ptrs(void*** ptr, int arg_num)
 	return 0;
 }
 
-
 int syscall_get_optional_ptr(void** ptr, int arg_num)
 {
-	uintptr_t* esp = (uintptr_t*)rproc->sys_esp;
-	esp += arg_num;
+	/* The pointer itself is allowed to be NULL */
+	if(syscall_get_int((int*)ptr, arg_num))
+		return 1;
+
+	return 0;
+}
 
-	if(syscall_ptr_safe(esp))
+int syscall_get_iovec(struct iovec* dst, int cnt, size_t* total,
+		int arg_num, int write)
+{
+	struct iovec* iov;
+	if(cnt < 0 || cnt > IOV_MAX)
+		return 1;
+	if(syscall_get_int((int*)&iov, arg_num))
+		return 1;
+	if(cnt && copy_from_user(dst, iov, sizeof(struct iovec) * cnt))
 		return 1;
-	/* Get the pointer */
-	*ptr = *(void**)esp;
 
-	if(!ptr) return 1;
+	/**
+	 * Page in every buffer now so that the file system doesn't fault
+	 * on them while it is holding locks.
+	 */
+	size_t sz = 0;
+	int x;
+	for(x = 0;x < cnt;x++)
+	{
+		/* The total length has to fit into the return value */
+		if(dst[x].iov_len > INT_MAX - sz)
+			return 1;
+		if(dst[x].iov_len && syscall_buffer_probe(dst[x].iov_base,
+					dst[x].iov_len, write))
+			return 1;
+		sz += dst[x].iov_len;
+	}
 
+	*total = sz;
 	return 0;
 }
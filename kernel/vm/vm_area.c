@@ -0,0 +1,538 @@
+/**
+ * Virtual memory areas. An area describes a range of user memory that
+ * doesn't get populated until the process touches it. Shared file areas
+ * map pages of the storage cache directly when the file allows it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "kstdlib.h"
+#include "file.h"
+#include "stdlock.h"
+#include "fsman.h"
+#include "vm.h"
+#include "panic.h"
+
+// #define DEBUG
+
+/**
+ * Storage cache pages that are mapped into a process can't be evicted, so
+ * only a few of them may be mapped at a time.
+ */
+static slock_t vm_area_pin_lock;
+static int vm_area_pinned;
+
+void vm_area_init(struct vm_area_table* table)
+{
+	memset(table, 0, sizeof(struct vm_area_table));
+}
+
+/**
+ * Find the index of the first area in the table that ends after the given
+ * address. The areas are kept sorted by address so this is a binary search.
+ * Returns table->count if every area ends at or before the address.
+ */
+static int vm_area_index(struct vm_area_table* table, uintptr_t address)
+{
+	int low = 0;
+	int high = table->count;
+	while(low < high)
+	{
+		int mid = (low + high) / 2;
+		if(table->areas[mid].end <= address)
+			low = mid + 1;
+		else high = mid;
+	}
+
+	return low;
+}
+
+/**
+ * Remove the area at the given index. The inode reference is dropped.
+ */
+static void vm_area_delete(struct vm_area_table* table, int index)
+{
+	struct vm_area* area = table->areas + index;
+	if(area->type == VM_AREA_FILE)
+		fs_close(area->ino);
+
+	memmove(area, area + 1,
+		(table->count - index - 1) * sizeof(struct vm_area));
+	table->count--;
+	memset(table->areas + table->count, 0, sizeof(struct vm_area));
+}
+
+/**
+ * Check to see if the area b, which starts where the area a ends, can be
+ * turned into one area with a. File areas have to read the same file
+ * without a gap at the boundary. Returns 1 if they can be merged.
+ */
+static int vm_area_mergeable(struct vm_area* a, struct vm_area* b)
+{
+	if(a->end != b->start || a->type != b->type || a->flags != b->flags
+			|| a->dir_flags != b->dir_flags
+			|| a->tbl_flags != b->tbl_flags)
+		return 0;
+	if(a->type != VM_AREA_FILE)
+		return 1;
+
+	/* Every address has to map to the same file position */
+	if(a->ino != b->ino || a->offset - a->data_start
+			!= b->offset - b->data_start)
+		return 0;
+
+	/* Halves of the same mapping */
+	if(a->data_start == b->data_start && a->data_end == b->data_end)
+		return 1;
+
+	/* The file contents have to go across the boundary */
+	return a->data_start <= a->end && a->end <= a->data_end
+		&& b->data_start <= b->start && b->start <= b->data_end;
+}
+
+/**
+ * Grow a over the area b that comes right after it. vm_area_mergeable has
+ * to be true. This doesn't touch any inode references.
+ */
+static void vm_area_merge(struct vm_area* a, struct vm_area* b)
+{
+	a->end = b->end;
+	a->data_end = b->data_end;
+}
+
+int vm_area_add(struct vm_area_table* table, struct vm_area* area)
+{
+	if(area->start >= area->end)
+		return -1;
+
+	/* Make sure this area doesn't overlap any other areas */
+	int index = vm_area_index(table, area->start);
+	if(index < table->count && table->areas[index].start < area->end)
+		return -1;
+
+	/**
+	 * Grow a neighbour instead of taking another slot, so that mapping
+	 * memory piece by piece doesn't fill up the table. The neighbour
+	 * already holds a reference to the inode.
+	 */
+	struct vm_area* prev = index ? table->areas + index - 1 : NULL;
+	struct vm_area* next = index < table->count 
+		? table->areas + index : NULL;
+	if(prev && vm_area_mergeable(prev, area))
+	{
+		vm_area_merge(prev, area);
+
+		/* Dropping the inode reference of next could sleep */
+		if(next && prev->type != VM_AREA_FILE
+				&& vm_area_mergeable(prev, next))
+		{
+			vm_area_merge(prev, next);
+			vm_area_delete(table, index);
+		}
+
+		return 0;
+	}
+
+	if(next && vm_area_mergeable(area, next))
+	{
+		struct vm_area merged = *area;
+		vm_area_merge(&merged, next);
+		*next = merged;
+		return 0;
+	}
+
+	if(table->count >= VM_AREA_MAX)
+		return -1;
+
+	/* Keep the table sorted */
+	struct vm_area* dst = table->areas + index;
+	memmove(dst + 1, dst, 
+		(table->count - index) * sizeof(struct vm_area));
+	memmove(dst, area, sizeof(struct vm_area));
+	if(dst->type == VM_AREA_FILE)
+		fs_add_inode_reference(dst->ino);
+	table->count++;
+
+#ifdef DEBUG
+	cprintf("vm_area: new area 0x%x -> 0x%x\n", dst->start, dst->end);
+#endif
+
+	return 0;
+}
+
+struct vm_area* vm_area_find(struct vm_area_table* table, uintptr_t address)
+{
+	int index = vm_area_index(table, address);
+	if(index < table->count && table->areas[index].start <= address)
+		return table->areas + index;
+
+	return NULL;
+}
+
+int vm_area_split(struct vm_area_table* table, uintptr_t address)
+{
+	address = PGROUNDDOWN(address);
+	struct vm_area* area = vm_area_find(table, address);
+
+	/* Is there already a boundary here? */
+	if(!area || area->start == address)
+		return 0;
+
+	if(table->count >= VM_AREA_MAX)
+		return -1;
+
+	/* Both halves keep the same file position for data_start */
+	memmove(area + 1, area, (table->count - (area - table->areas))
+			* sizeof(struct vm_area));
+	area->end = address;
+	(area + 1)->start = address;
+	if(area->type == VM_AREA_FILE)
+		fs_add_inode_reference(area->ino);
+	table->count++;
+
+	return 0;
+}
+
+int vm_area_remove(struct vm_area_table* table, uintptr_t start,
+		uintptr_t end)
+{
+	start = PGROUNDDOWN(start);
+	end = PGROUNDUP(end);
+
+	if(vm_area_split(table, start) || vm_area_split(table, end))
+		return -1;
+
+	int index = vm_area_index(table, start);
+	while(index < table->count && table->areas[index].start < end)
+		vm_area_delete(table, index);
+
+	return 0;
+}
+
+int vm_area_detach(struct vm_area_table* table, uintptr_t start,
+		uintptr_t end, struct vm_area* dst, int max)
+{
+	start = PGROUNDDOWN(start);
+	end = PGROUNDUP(end);
+
+	if(vm_area_split(table, start) || vm_area_split(table, end))
+		return -1;
+
+	int index = vm_area_index(table, start);
+	int count = 0;
+	while(count < max && index + count < table->count
+			&& table->areas[index + count].start < end)
+		count++;
+
+	/* The inode references move over with the areas */
+	memmove(dst, table->areas + index, count * sizeof(struct vm_area));
+	memmove(table->areas + index, table->areas + index + count,
+		(table->count - index - count) * sizeof(struct vm_area));
+	table->count -= count;
+	memset(table->areas + table->count, 0, 
+		count * sizeof(struct vm_area));
+
+	return count;
+}
+
+int vm_area_protect(struct vm_area_table* table, uintptr_t start,
+		uintptr_t end, vmflags_t tbl_flags)
+{
+	start = PGROUNDDOWN(start);
+	end = PGROUNDUP(end);
+
+	if(vm_area_split(table, start) || vm_area_split(table, end))
+		return -1;
+
+	int index;
+	for(index = vm_area_index(table, start);index < table->count
+			&& table->areas[index].start < end;index++)
+		table->areas[index].tbl_flags = tbl_flags;
+
+	return 0;
+}
+
+uintptr_t vm_area_find_space(struct vm_area_table* table, uintptr_t low,
+		uintptr_t high, size_t sz)
+{
+	sz = PGROUNDUP(sz);
+	low = PGROUNDUP(low);
+	high = PGROUNDDOWN(high);
+	if(!sz || high < low || high - low < sz)
+		return 0;
+
+	/* Walk the gaps between areas from the top down */
+	int index = vm_area_index(table, high);
+	uintptr_t gap_end = high;
+	if(index < table->count && table->areas[index].start < high)
+		gap_end = table->areas[index].start;
+
+	for(index--;;index--)
+	{
+		uintptr_t gap_start = low;
+		if(index >= 0 && table->areas[index].end > low)
+			gap_start = table->areas[index].end;
+
+		if(gap_end >= gap_start && gap_end - gap_start >= sz)
+			return gap_end - sz;
+
+		if(index < 0 || table->areas[index].start <= low)
+			break;
+		gap_end = table->areas[index].start;
+	}
+
+	return 0;
+}
+
+/**
+ * Map the storage cache page that backs page directly into dir. Returns 0
+ * on success, -1 if the page has to be copied instead.
+ */
+static int vm_area_map_cache(struct vm_area* area, vmpage_t page,
+		pgdir_t* dir)
+{
+	/* The whole page has to come from the file */
+	if(page < area->data_start || page + PGSIZE > area->data_end)
+		return -1;
+
+	slock_acquire(&vm_area_pin_lock);
+	if(vm_area_pinned >= VM_AREA_PIN_MAX)
+	{
+		slock_release(&vm_area_pin_lock);
+		return -1;
+	}
+	vm_area_pinned++;
+	slock_release(&vm_area_pin_lock);
+
+	fileoff_t off = area->offset + (page - area->data_start);
+	void* cache_page = fs_getpage(area->ino, off);
+	if(cache_page)
+	{
+		pypage_t phy = vm_findpg((uintptr_t)cache_page, 0, dir, 0, 0);
+		if(phy && !vm_mappage(phy, page, dir, area->dir_flags,
+					area->tbl_flags | VM_TBL_FILE))
+		{
+#ifdef DEBUG
+			cprintf("vm_area: mapped cache page 0x%x -> 0x%x\n",
+					cache_page, page);
+#endif
+			return 0;
+		}
+
+		fs_putpage(area->ino, cache_page);
+	}
+
+	slock_acquire(&vm_area_pin_lock);
+	vm_area_pinned--;
+	slock_release(&vm_area_pin_lock);
+
+	return -1;
+}
+
+int vm_area_fault(struct vm_area_table* table, uintptr_t address,
+		pgdir_t* dir)
+{
+	struct vm_area* area = vm_area_find(table, address);
+	if(!area) return 1;
+
+	vmpage_t page = PGROUNDDOWN(address);
+
+	/* If the page is already here, this isn't our fault */
+	if(vm_findpg(page, 0, dir, 0, 0))
+		return 1;
+
+#ifdef DEBUG
+	cprintf("vm_area: populating page 0x%x\n", page);
+#endif
+
+	/* Shared file pages come straight from the storage cache */
+	if(area->type == VM_AREA_FILE && (area->flags & VM_AREA_SHARED))
+	{
+		if(!vm_area_map_cache(area, page, dir))
+			return 0;
+	}
+
+	/* palloc gives us a zeroed page */
+	pypage_t phy = palloc();
+	if(!phy) return 1;
+
+	/* Map the page writable until it has been filled */
+	if(vm_mappage(phy, page, dir, area->dir_flags,
+				area->tbl_flags | VM_TBL_WRIT))
+	{
+		pfree(phy);
+		return 1;
+	}
+
+	if(area->type == VM_AREA_FILE)
+	{
+		uintptr_t copy_start = page;
+		uintptr_t copy_end = page + PGSIZE;
+		if(copy_start < area->data_start)
+			copy_start = area->data_start;
+		if(copy_end > area->data_end)
+			copy_end = area->data_end;
+
+		if(copy_start < copy_end)
+		{
+			size_t sz = copy_end - copy_start;
+			fileoff_t off = area->offset
+				+ (copy_start - area->data_start);
+			if(fs_read(area->ino, (void*)copy_start, sz, off) != sz)
+			{
+#ifdef DEBUG
+				cprintf("vm_area: couldn't read page 0x%x\n",
+						page);
+#endif
+				vm_unmappage(page, dir);
+				pfree(phy);
+				return 1;
+			}
+		}
+	}
+
+	/* Set the real flags, this also makes the page clean again */
+	vm_setpgflags(page, dir, area->tbl_flags);
+
+	return 0;
+}
+
+int vm_area_prefault(struct vm_area_table* table, uintptr_t start,
+		size_t sz, pgdir_t* dir)
+{
+	if(!sz) return 0;
+
+	vmpage_t page = PGROUNDDOWN(start);
+	vmpage_t end = PGROUNDUP(start + sz);
+	for(;page < end;page += PGSIZE)
+	{
+		if(vm_findpg(page, 0, dir, 0, 0))
+			continue;
+		if(!vm_area_find(table, page))
+			continue;
+		if(vm_area_fault(table, page, dir))
+			return 1;
+	}
+
+	return 0;
+}
+
+void vm_area_dup(struct vm_area_table* table)
+{
+	int x;
+	for(x = 0;x < table->count;x++)
+	{
+		if(table->areas[x].type == VM_AREA_FILE)
+			fs_add_inode_reference(table->areas[x].ino);
+	}
+}
+
+/**
+ * Detach a single page from the file that backs the area. See
+ * vm_area_release.
+ */
+static void vm_area_release_page(struct vm_area* area, vmpage_t page,
+		pgdir_t* dir)
+{
+	pypage_t phy = vm_findpg(page, 0, dir, 0, 0);
+	if(!phy) return;
+
+	vmflags_t flags = vm_findpgflags(page, dir);
+	fileoff_t off = area->offset + (page - area->data_start);
+	if(flags & VM_TBL_FILE)
+	{
+		vm_unmappage(page, dir);
+
+		/* Look up the cache page again to get the pointer back */
+		void* cache_page = fs_getpage(area->ino, off);
+		if(cache_page)
+		{
+			if(vm_findpg((uintptr_t)cache_page, 0, dir, 0, 0) 
+					== PGROUNDDOWN(phy))
+				fs_putpage(area->ino, cache_page);
+			fs_putpage(area->ino, cache_page);
+		}
+
+		slock_acquire(&vm_area_pin_lock);
+		vm_area_pinned--;
+		slock_release(&vm_area_pin_lock);
+		return;
+	}
+
+	/* Private copy, is there anything to write back? */
+	if(!(flags & VM_TBL_DRTY))
+		return;
+
+	uintptr_t copy_start = page;
+	uintptr_t copy_end = page + PGSIZE;
+	if(copy_start < area->data_start)
+		copy_start = area->data_start;
+	if(copy_end > area->data_end)
+		copy_end = area->data_end;
+
+	if(copy_start < copy_end)
+	{
+#ifdef DEBUG
+		cprintf("vm_area: writing back page 0x%x\n", page);
+#endif
+		off = area->offset + (copy_start - area->data_start);
+
+		/* dir might not be in use, go through the physical page */
+		pgdir_t* save = vm_push_pgdir();
+		fs_write(area->ino, (void*)(PGROUNDDOWN(phy) 
+					+ (copy_start - page)),
+				copy_end - copy_start, off);
+		vm_pop_pgdir(save);
+	}
+
+	vm_setpgflags(page, dir, flags & ~VM_TBL_DRTY);
+}
+
+void vm_area_release(struct vm_area_table* table, uintptr_t start,
+		uintptr_t end, pgdir_t* dir)
+{
+	start = PGROUNDDOWN(start);
+	end = PGROUNDUP(end);
+
+	int index;
+	for(index = vm_area_index(table, start);index < table->count
+			&& table->areas[index].start < end;index++)
+	{
+		struct vm_area* area = table->areas + index;
+		if(area->type != VM_AREA_FILE 
+				|| !(area->flags & VM_AREA_SHARED))
+			continue;
+
+		vmpage_t page = area->start;
+		vmpage_t page_end = area->end;
+		if(page < start) page = start;
+		if(page_end > end) page_end = end;
+		for(;page < page_end;page += PGSIZE)
+			vm_area_release_page(area, page, dir);
+	}
+}
+
+void vm_area_put(struct vm_area* area, pgdir_t* dir)
+{
+	if(area->type != VM_AREA_FILE)
+		return;
+
+	if(dir && (area->flags & VM_AREA_SHARED))
+	{
+		vmpage_t page;
+		for(page = area->start;page < area->end;page += PGSIZE)
+			vm_area_release_page(area, page, dir);
+	}
+
+	fs_close(area->ino);
+}
+
+void vm_area_free(struct vm_area_table* table, pgdir_t* dir)
+{
+	int x;
+	for(x = 0;x < table->count;x++)
+		vm_area_put(table->areas + x, dir);
+
+	vm_area_init(table);
+}
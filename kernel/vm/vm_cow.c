@@ -24,6 +24,8 @@ int vm_uvm_cow(pgdir_t* dir)
 		pypage_t phy = vm_findpg(p, 0, dir, 0, 0);
 		/* Does the page exist? */
 		if(!phy) continue;
+		/* Storage cache pages are never copied */
+		if(vm_findpgflags(p, dir) & VM_TBL_FILE) continue;
 		vmflags_t flags = vm_findtblflags(p, dir);
 		/* Is this page already cow? */
 		if(flags & VM_TBL_COWR)
@@ -102,9 +104,11 @@ int vm_uncow(pgdir_t* dir, vmpage_t page)
 		if(vm_setpgflags(page, dir, flags & (~VM_TBL_COWR)))
                         return -1;
 
-		/* Unmap the old page */
-		pypage_t unmap = vm_unmappage(page, dir);
-		if(unmap)pfree(unmap);
+		/**
+		 * Unmap the old page. Our reference was already dropped
+		 * above so the page must not be freed here.
+		 */
+		vm_unmappage(page, dir);
 
 		/* Map in the new page */
 		vm_mappage(newpg, page, dir, dirflags, flags);
@@ -9,190 +9,60 @@
 
 #define PARANOID
 // #define DEBUG
-#define MAX_SHARE 16384
-#define SHARE_HASHMAP 128
 
-struct vm_share
-{
-	int valid; /* Whether or not this entry is in use. */
-	pypage_t page; /* Physical address of the shared page */
-	int refs; /* How many people point to this page? */
-	struct vm_share* next; /* Next vm_share in the list */
-};
-
-typedef struct vm_share vm_share_t;
-
-static slock_t share_table_lock;
-static vm_share_t share_table[MAX_SHARE];
-static int table_clock;
-
-static vm_share_t* share_hashmap[SHARE_HASHMAP];
-
-void vm_share_print(void)
-{
-	cprintf("vV VM_SHARE_PRINTOUT Vv (TAB)\n");
-	int x;
-	for(x = 0;x < MAX_SHARE;x++)
-	{
-		if(share_table[x].valid)
-		{
-			pypage_t a = share_table[x].page;
-			int b = share_table[x].refs;
-			cprintf("|0x%x|%d|\n", a, b);
-		}
-	}
-	
-	cprintf("vV VM_SHARE_HASHMAP Vv (HASHMAP)\n");
-	for(x = 0;x < SHARE_HASHMAP;x++)
-	{
-		if(!share_hashmap[x]) continue;
-		
-		cprintf("Hash %d\n", x);
-		vm_share_t* curr = share_hashmap[x];
-		while(curr)
-		{
-			cprintf("|0x%x|%d|\n",
-				curr->page, curr->refs);
-			curr = curr->next;
-		}
-	}
-	
-}
-
-int vm_share_init(void)
-{
-        slock_init(&share_table_lock);
-        memset(share_table, 0, sizeof(vm_share_t) * MAX_SHARE);
-	memset(share_hashmap, 0, sizeof(vm_share_t*) * SHARE_HASHMAP);
-        table_clock = 0;
-
-        return 0;
-}
-
-static int vm_share_hash(vmpage_t page)
-{
-	if(!page) return 0;
-	return (page >> PGSHIFT) & (SHARE_HASHMAP - 1);
-}
-
-/**
- * Insert this share object into the hashmap.
- */
-static void vm_share_insert(vm_share_t* sh)
-{
-	vmpage_t page = sh->page;
-	page = PGROUNDDOWN(page);
-	int index = vm_share_hash(page);
-
-	if(!share_hashmap[index])
-	{
-		share_hashmap[index] = sh;
-		return;
-	}
-
-	/* Get the head */
-	vm_share_t* pos = share_hashmap[index];
-
-	/* Find the end */
-	while(pos->next) pos = pos->next;
+/* One descriptor for every physical page in the page pool. */
+#define VM_PAGE_COUNT (VM_POOL_E >> PGSHIFT)
+#define VM_PAGE_MAXREFS 0xFFFF
 
-	/* Append this struct */
-	pos->next = sh;
-
-	/* Safety: zero the next pointer */
-	sh->next = NULL;
-}
+/* Flags for the vm_page structure */
+#define VM_PAGE_SHARED	0x0001 /* This page has a share reference count */
 
 /**
- * Remove this share object from the hashmap.
+ * Physical page descriptor. The descriptor for a page is found by
+ * indexing the page table with the physical frame number of the page.
  */
-static void vm_share_remove(vm_share_t* sh)
+struct vm_page
 {
-	pypage_t page = PGROUNDDOWN(sh->page);
-	int index = vm_share_hash(page);
-
-	vm_share_t* head = share_hashmap[index];
-
-	if(head == sh)
-	{
-		/* we're removing the head */
-		share_hashmap[index] = sh->next;
-		return;
-	}
-
-	/* Find the element before sh in the list */
-	while(head && head->next != sh) 
-		head = head->next;
-
-	/* Did we find it? */
-	if(!head) 
-		return;
+	uint16_t refs; /* How many people point to this page? */
+	uint16_t flags; /* Flags for this page (see above) */
+};
 
-	/* Set this next equal to sh's next */
-	head->next = sh->next;
-}
+static slock_t share_table_lock;
+static struct vm_page page_table[VM_PAGE_COUNT];
 
 /**
- * Lookup the page in the hashmap.
+ * Get the descriptor for the given physical page. Returns NULL if the
+ * physical page is outside of the page pool.
  */
-static vm_share_t* vm_share_lookup(pypage_t page)
+static struct vm_page* vm_page_lookup(pypage_t py)
 {
-	page = PGROUNDDOWN(page);
-	int index = vm_share_hash(page);
-	vm_share_t* pos = share_hashmap[index];
-
-	while(pos && pos->page != page)
-		pos = pos->next;
-
-	return pos;
+	uintptr_t pfn = py >> PGSHIFT;
+	if(pfn >= VM_PAGE_COUNT)
+		return NULL;
+	return page_table + pfn;
 }
 
-static vm_share_t* vm_share_alloc(void)
+void vm_share_print(void)
 {
-	vm_share_t* result = NULL;
-
-	if(table_clock >= MAX_SHARE || table_clock < 0)
-		table_clock = 0;
-
-	int start = table_clock;
-	do
-	{
-		/* Does this work? */
-		if(!share_table[table_clock].valid)
-			break;
-
-		/* Increment clock */
-		table_clock++;
-		/* Do we need to wrap? */
-		if(table_clock >= MAX_SHARE || table_clock < 0)
-			table_clock = 0;
-	} while(start != table_clock);
-
-	if(!share_table[table_clock].valid)
+	cprintf("vV VM_SHARE_PRINTOUT Vv (PFN)\n");
+	uintptr_t x;
+	for(x = 0;x < VM_PAGE_COUNT;x++)
 	{
-		/* Intilize this share struct */
-		share_table[table_clock].valid = 1;
-		share_table[table_clock].page = 0;
-		share_table[table_clock].refs = 0;
-		share_table[table_clock].next = NULL;
-		result = share_table + table_clock;
+		if(page_table[x].flags & VM_PAGE_SHARED)
+		{
+			pypage_t a = x << PGSHIFT;
+			int b = page_table[x].refs;
+			cprintf("|0x%x|%d|\n", a, b);
+		}
 	}
-
-	return result;
 }
 
-static void vm_share_free(vm_share_t* s)
+int vm_share_init(void)
 {
-	/* sanity check */
-	if(!s || s < share_table || s >= share_table + MAX_SHARE) 
-	{
-#ifdef DEBUG
-		cprintf("vm_share: ERROR: tried to free invalid share.\n");
-#endif
-		return;
-	}
+	slock_init(&share_table_lock);
+	memset(page_table, 0, sizeof(struct vm_page) * VM_PAGE_COUNT);
 
-	memset(s, 0, sizeof(vm_share_t));
+	return 0;
 }
 
 int vm_pgshare(vmpage_t page, pgdir_t* pgdir)
@@ -203,22 +73,32 @@ int vm_pgshare(vmpage_t page, pgdir_t* pgdir)
 
 	slock_acquire(&share_table_lock);
 	pypage_t py = vm_findpg(page, 0, pgdir, 0, 0);
-	if(!py) 
+	py = PGROUNDDOWN(py);
+	struct vm_page* st = NULL;
+	if(!py || !(st = vm_page_lookup(py)))
 	{
 #ifdef DEBUG
 		cprintf("vm_share: ERROR: page doesn't exist\n");
 #endif
-		/* This page doesn't exist. */
+		/* This page doesn't exist or isn't in the page pool. */
 		slock_release(&share_table_lock);
 		return -1;
 	}
 
-	vm_share_t* st = NULL;
-	if((st = vm_share_lookup(py)) != NULL)
+	if(st->flags & VM_PAGE_SHARED)
 	{
 #ifdef DEBUG
 		cprintf("vm_share: Share already existed.\n");
 #endif
+		if(st->refs == VM_PAGE_MAXREFS)
+		{
+#ifdef DEBUG
+			cprintf("vm_share: ERROR: too many references.\n");
+#endif
+			slock_release(&share_table_lock);
+			return -1;
+		}
+
 		/* Just increment the ref count */
 		st->refs++;
 
@@ -229,16 +109,8 @@ int vm_pgshare(vmpage_t page, pgdir_t* pgdir)
 #ifdef DEBUG
 		cprintf("vm_share: Creating new share.\n");
 #endif
-		/* Allocate a new share struct */
-		st = vm_share_alloc();
-
-		/* Setup this struct */
-		st->page = py;
+		st->flags |= VM_PAGE_SHARED;
 		st->refs = 1;
-		st->next = NULL;
-
-		/* Add this st to the hash map */
-		vm_share_insert(st);
 	}
 
 #ifdef DEBUG
@@ -261,13 +133,15 @@ int vm_pgshare(vmpage_t page, pgdir_t* pgdir)
 #ifdef DEBUG
 		cprintf("vm_share: ERROR: couldn't set flags!\n");
 #endif
-		slock_release(&share_table_lock);
-		
 		/* Because of the failure, decrement refs */
 		st->refs--;
+		if(!st->refs)
+			st->flags &= ~VM_PAGE_SHARED;
+
+		slock_release(&share_table_lock);
 		return -1;
 	}
-	
+
 #ifdef DEBUG
 	cprintf("vm_share: share completed successfully.\n");
 #endif
@@ -304,8 +178,8 @@ int vm_isshared(vmpage_t page, pgdir_t* pgdir)
 #ifdef DEBUG
 		cprintf("vm_share: starting paranoid check...\n");
 #endif
-		vm_share_t* st = vm_share_lookup(py);
-		if(!st) 
+		struct vm_page* st = vm_page_lookup(py);
+		if(!st || !(st->flags & VM_PAGE_SHARED))
 		{
 #ifdef DEBUG
 			cprintf("vm_share: paranoid check passed.\n");
@@ -337,9 +211,9 @@ int vm_pgunshare(pypage_t py)
 #endif
 	slock_acquire(&share_table_lock);
 
-	/* Get the entry from the hash table */
-	vm_share_t* st = vm_share_lookup(py);
-	if(!st)
+	/* Get the descriptor for this page */
+	struct vm_page* st = vm_page_lookup(py);
+	if(!st || !(st->flags & VM_PAGE_SHARED))
 	{
 		/* Page isn't shared */
 		slock_release(&share_table_lock);
@@ -348,16 +222,15 @@ int vm_pgunshare(pypage_t py)
 
 	/* decrement references */
 	st->refs--;
+	int refs = st->refs;
 
 #ifdef DEBUG
-	cprintf("vm_share: new ref count: %d\n", st->refs);
+	cprintf("vm_share: new ref count: %d\n", refs);
 #endif
-	if(st->refs <= 0)
+	if(!refs)
 	{
-		/* Remove this from the hash table */
-		vm_share_remove(st);
-		/* Free this st */
-		vm_share_free(st);
+		/* Nobody else has this page mapped */
+		st->flags &= ~VM_PAGE_SHARED;
 
 #ifdef DEBUG
 		cprintf("vm_share: share has been unallocated.\n");
@@ -369,7 +242,7 @@ int vm_pgunshare(pypage_t py)
 #endif
 
 	slock_release(&share_table_lock);
-	return st->refs;
+	return refs;
 }
 
 int vm_pgsshare(vmpage_t base, size_t sz, pgdir_t* pgdir)
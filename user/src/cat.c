@@ -3,6 +3,7 @@
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <chronos.h>
 
 int main(int argc, char** argv)
 {
@@ -39,11 +40,21 @@ int main(int argc, char** argv)
 	if(fstat(fileDescript, &st)) return -1;
 	int fileLength = st.st_size;
 
-	/* reset seek */
-	lseek(fileDescript, 0, SEEK_SET);
+	/* Let the kernel move the file to stdout without copying it here */
+	int sent = 0;
+	while(sent < fileLength)
+	{
+		int result = __chronos_syscall(SYS_sendfile, 1, fileDescript,
+				NULL, fileLength - sent);
+		if(result <= 0) break;
+		sent += result;
+	}
+
+	/* Copy whatever sendfile couldn't move */
+	lseek(fileDescript, sent, SEEK_SET);
 	char buffer[BUFF_SIZE];
 	int i;
-	for(i=0; i<fileLength;)
+	for(i=sent; i<fileLength;)
 	{
 		int left = fileLength - i;
 		if(left > BUFF_SIZE - 1) left = BUFF_SIZE - 1;
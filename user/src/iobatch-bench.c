@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <chronos.h>
+
+/**
+ * Batched I/O ring benchmark. Writes and then reads back a file one block
+ * at a time, once with a read or write call per block and once by queueing
+ * the blocks in an I/O batch ring for the kernel worker, and prints how
+ * long each took.
+ *
+ * usage: iobatch-bench [file] [blocks]
+ */
+
+#define BLOCK_SZ 0x1000
+
+static struct iobatch_ring ring;
+static char buffer[IOBATCH_RING_ENTRIES][BLOCK_SZ];
+
+static long usecs_since(struct timeval* start)
+{
+	struct timeval end;
+	gettimeofday(&end, NULL);
+	return (end.tv_sec - start->tv_sec) * 1000000
+		+ (end.tv_usec - start->tv_usec);
+}
+
+static void report(const char* name, int blocks, long usecs)
+{
+	if(!usecs) usecs = 1;
+	printf("%-12s %6d blocks %8ld us %6ld KB/s\n", name, blocks, usecs,
+			(long)((long long)blocks * BLOCK_SZ * 1000000
+				/ 1024 / usecs));
+}
+
+static int open_file(const char* path, int write)
+{
+	int fd;
+	if(write) fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	else fd = open(path, O_RDONLY);
+	if(fd < 0)
+	{
+		printf("iobatch-bench: couldn't open %s\n", path);
+		exit(1);
+	}
+
+	return fd;
+}
+
+static void run_blocking(const char* path, int blocks, int write)
+{
+	int fd = open_file(path, write);
+	struct timeval start;
+	gettimeofday(&start, NULL);
+
+	int x;
+	for(x = 0;x < blocks;x++)
+	{
+		int result;
+		if(write) result = __chronos_syscall(SYS_write, fd,
+				buffer[0], BLOCK_SZ);
+		else result = __chronos_syscall(SYS_read, fd,
+				buffer[0], BLOCK_SZ);
+		if(result != BLOCK_SZ)
+		{
+			printf("iobatch-bench: I/O failed at block %d\n", x);
+			exit(1);
+		}
+	}
+
+	report(write ? "write" : "read", blocks, usecs_since(&start));
+	close(fd);
+}
+
+static void run_ring(const char* path, int blocks, int write)
+{
+	int fd = open_file(path, write);
+	struct timeval start;
+	gettimeofday(&start, NULL);
+
+	int queued = 0;
+	int done = 0;
+	while(done < blocks)
+	{
+		/* Fill the ring, a buffer is busy until its block is done */
+		int batch = 0;
+		while(queued < blocks
+				&& queued - done < IOBATCH_RING_ENTRIES)
+		{
+			struct iobatch_sqe* sqe = ring.sq
+				+ (ring.sq_tail & (IOBATCH_RING_ENTRIES - 1));
+			sqe->opcode = write ? IOBATCH_OP_WRITE
+				: IOBATCH_OP_READ;
+			sqe->fd = fd;
+			sqe->off = queued * BLOCK_SZ;
+			sqe->addr = buffer[queued & (IOBATCH_RING_ENTRIES - 1)];
+			sqe->len = BLOCK_SZ;
+			sqe->user_data = (void*)queued;
+			ring.sq_tail++;
+			queued++;
+			batch++;
+		}
+
+		/* Submit the batch and wait for at least one block */
+		if(__chronos_syscall(SYS_iobatch_enter, batch, 1) < 0)
+		{
+			printf("iobatch-bench: iobatch_enter failed.\n");
+			exit(1);
+		}
+
+		/* Reap everything that finished */
+		while(ring.cq_head != ring.cq_tail)
+		{
+			struct iobatch_cqe* cqe = ring.cq
+				+ (ring.cq_head & (IOBATCH_RING_ENTRIES - 1));
+			if(cqe->result != BLOCK_SZ)
+			{
+				printf("iobatch-bench: ring I/O failed at "
+						"block %d\n",
+						(int)cqe->user_data);
+				exit(1);
+			}
+			ring.cq_head++;
+			done++;
+		}
+	}
+
+	report(write ? "ring write" : "ring read", blocks,
+			usecs_since(&start));
+	close(fd);
+}
+
+int main(int argc, char** argv)
+{
+	const char* path = "/tmp/iobatch-bench";
+	int blocks = 256;
+	if(argc > 1) path = argv[1];
+	if(argc > 2) blocks = atoi(argv[2]);
+
+	if(blocks < 1)
+	{
+		printf("usage: iobatch-bench [file] [blocks]\n");
+		return 1;
+	}
+
+	memset(buffer, 'A', sizeof(buffer));
+	if(__chronos_syscall(SYS_iobatch_setup, &ring))
+	{
+		printf("iobatch-bench: iobatch_setup failed.\n");
+		return 1;
+	}
+
+	run_blocking(path, blocks, 1);
+	run_blocking(path, blocks, 0);
+	run_ring(path, blocks, 1);
+	run_ring(path, blocks, 0);
+
+	__chronos_syscall(SYS_iobatch_setup, NULL);
+	unlink(path);
+
+	return 0;
+}
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/times.h>
+#include <sys/wait.h>
+
+/**
+ * Scheduling latency benchmark. A number of cpu bound processes spin while
+ * a number of interactive processes answer requests from the parent over a
+ * pipe. The time it takes for an interactive process to answer is the
+ * scheduling latency. The amount of work each cpu bound process got done
+ * shows how fair the scheduler is.
+ *
+ * usage: sched-bench [cpu bound] [interactive] [rounds]
+ */
+
+#define MAX_CHILDREN 32
+
+static clock_t ticks(void)
+{
+	struct tms t;
+	return times(&t);
+}
+
+static void spin(int duration, int result_fd)
+{
+	clock_t end = ticks() + duration;
+	int loops = 0;
+	volatile int work = 0;
+
+	while(ticks() < end)
+	{
+		int x;
+		for(x = 0;x < 0x1000;x++)
+			work++;
+		loops++;
+	}
+
+	write(result_fd, &loops, sizeof(int));
+	exit(0);
+}
+
+static void interactive(int request_fd, int reply_fd)
+{
+	char c;
+	while(read(request_fd, &c, 1) == 1)
+		write(reply_fd, &c, 1);
+	exit(0);
+}
+
+int main(int argc, char** argv)
+{
+	int cpu_count = 4;
+	int inter_count = 2;
+	int rounds = 100;
+
+	if(argc > 1) cpu_count = atoi(argv[1]);
+	if(argc > 2) inter_count = atoi(argv[2]);
+	if(argc > 3) rounds = atoi(argv[3]);
+
+	if(cpu_count < 0 || cpu_count > MAX_CHILDREN
+			|| inter_count < 1 || inter_count > MAX_CHILDREN
+			|| rounds < 1)
+	{
+		printf("usage: sched-bench [cpu bound] [interactive] [rounds]\n");
+		return 1;
+	}
+
+	printf("sched-bench: %d cpu bound, %d interactive, %d rounds\n",
+			cpu_count, inter_count, rounds);
+	fflush(stdout);
+
+	int results[2];
+	if(pipe(results))
+	{
+		printf("sched-bench: pipe failed.\n");
+		return 1;
+	}
+
+	/* Start the cpu bound processes */
+	int x;
+	for(x = 0;x < cpu_count;x++)
+	{
+		int pid = fork();
+		if(pid == 0) spin(rounds * 10, results[1]);
+		if(pid < 0)
+		{
+			printf("sched-bench: fork failed.\n");
+			return 1;
+		}
+	}
+
+	/* Start the interactive processes */
+	int request_fds[MAX_CHILDREN];
+	int reply_fds[MAX_CHILDREN];
+	for(x = 0;x < inter_count;x++)
+	{
+		int request[2];
+		int reply[2];
+		if(pipe(request) || pipe(reply))
+		{
+			printf("sched-bench: pipe failed.\n");
+			return 1;
+		}
+
+		int pid = fork();
+		if(pid == 0)
+		{
+			close(request[1]);
+			close(reply[0]);
+			interactive(request[0], reply[1]);
+		}
+
+		if(pid < 0)
+		{
+			printf("sched-bench: fork failed.\n");
+			return 1;
+		}
+
+		close(request[0]);
+		close(reply[1]);
+		request_fds[x] = request[1];
+		reply_fds[x] = reply[0];
+	}
+
+	/* Measure how long it takes for the interactive processes to run */
+	clock_t total = 0;
+	clock_t worst = 0;
+	int samples = 0;
+	int round;
+	for(round = 0;round < rounds;round++)
+	{
+		for(x = 0;x < inter_count;x++)
+		{
+			char c = 'x';
+			clock_t start = ticks();
+			if(write(request_fds[x], &c, 1) != 1) continue;
+			if(read(reply_fds[x], &c, 1) != 1) continue;
+			clock_t latency = ticks() - start;
+
+			total += latency;
+			if(latency > worst) worst = latency;
+			samples++;
+		}
+	}
+
+	/* Let the interactive processes exit */
+	for(x = 0;x < inter_count;x++)
+	{
+		close(request_fds[x]);
+		close(reply_fds[x]);
+	}
+
+	/* Collect the work done by the cpu bound processes */
+	int least = -1;
+	int most = 0;
+	for(x = 0;x < cpu_count;x++)
+	{
+		int loops;
+		if(read(results[0], &loops, sizeof(int)) != sizeof(int))
+			break;
+		if(least < 0 || loops < least) least = loops;
+		if(loops > most) most = loops;
+	}
+
+	while(wait(NULL) > 0);
+
+	printf("latency: %d samples, average %d.%02d ticks, worst %d ticks\n",
+			samples,
+			samples ? (int)(total / samples) : 0,
+			samples ? (int)((total * 100 / samples) % 100) : 0,
+			(int)worst);
+	if(cpu_count)
+		printf("cpu bound work: least %d, most %d\n", least, most);
+
+	return 0;
+}
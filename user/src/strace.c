@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <chronos.h>
+
+/**
+ * Run a command and print every system call it makes with its first
+ * arguments, its return value and how many cycles it took. With -c, the
+ * system wide statistics from /dev/syscallstats are cleared before the
+ * command runs and printed once it is done.
+ *
+ * usage: strace [-c] command [args]
+ */
+
+#define EVENT_BATCH 0x20
+
+static void print_stats(void)
+{
+	int fd = open("/dev/syscallstats", O_RDONLY);
+	if(fd < 0)
+	{
+		printf("strace: couldn't open /dev/syscallstats\n");
+		return;
+	}
+
+	printf("%-6s %8s %8s %10s %10s  histogram (log2 cycles:calls)\n",
+			"call", "calls", "errors", "avg", "max");
+
+	struct syscall_stat stat;
+	int num;
+	for(num = 0;read(fd, &stat, sizeof(stat)) == sizeof(stat);num++)
+	{
+		if(!stat.calls) continue;
+		printf("0x%-4x %8u %8u %10u %10u ", num, stat.calls,
+				stat.errors,
+				(unsigned int)(stat.cycles / stat.calls),
+				stat.max_cycles);
+
+		int x;
+		for(x = 0;x < SYSCALL_HIST_BUCKETS;x++)
+			if(stat.hist[x])
+				printf(" %d:%u", x, stat.hist[x]);
+		printf("\n");
+	}
+
+	close(fd);
+}
+
+static void print_event(int pid, struct trace_event* event)
+{
+	if(event->num == TRACE_LOST)
+	{
+		fprintf(stderr, "[%d] ... %d calls lost ...\n", pid,
+				event->result);
+		return;
+	}
+
+	fprintf(stderr, "[%d] 0x%02x(0x%x, 0x%x, 0x%x, 0x%x) = %d <%u>\n",
+			pid, event->num, event->args[0], event->args[1],
+			event->args[2], event->args[3], event->result,
+			event->cycles);
+}
+
+int main(int argc, char** argv)
+{
+	int stats = 0;
+	int arg = 1;
+	if(arg < argc && !strcmp(argv[arg], "-c"))
+	{
+		stats = 1;
+		arg++;
+	}
+
+	if(arg >= argc)
+	{
+		printf("usage: strace [-c] command [args]\n");
+		return 1;
+	}
+
+	if(stats)
+	{
+		int fd = open("/dev/syscallstats", O_WRONLY);
+		if(fd >= 0)
+		{
+			write(fd, "", 1);
+			close(fd);
+		}
+	}
+
+	/* The child waits until tracing is on before it runs the command */
+	int go[2];
+	if(pipe(go))
+	{
+		printf("strace: pipe failed.\n");
+		return 1;
+	}
+
+	int pid = fork();
+	if(pid < 0)
+	{
+		printf("strace: fork failed.\n");
+		return 1;
+	}
+
+	if(!pid)
+	{
+		char c;
+		close(go[1]);
+		read(go[0], &c, 1);
+		close(go[0]);
+		execvp(argv[arg], argv + arg);
+		printf("strace: %s: command not found.\n", argv[arg]);
+		exit(1);
+	}
+
+	close(go[0]);
+	if(__chronos_syscall(SYS_trace_ctl, pid, 1))
+		printf("strace: couldn't trace %d\n", pid);
+	close(go[1]);
+
+	/* Drain the ring until the child is gone and nothing is left */
+	struct trace_event events[EVENT_BATCH];
+	struct timespec nap = {0, 10000000};
+	int count;
+	while((count = __chronos_syscall(SYS_trace_read, pid, events,
+					EVENT_BATCH)) >= 0)
+	{
+		if(!count)
+		{
+			__chronos_syscall(SYS_nanosleep, &nap, NULL);
+			continue;
+		}
+
+		int x;
+		for(x = 0;x < count;x++)
+			print_event(pid, events + x);
+	}
+
+	int status;
+	waitpid(pid, &status, 0);
+
+	if(stats) print_stats();
+
+	return WEXITSTATUS(status);
+}
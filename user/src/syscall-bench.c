@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <chronos.h>
+
+/**
+ * Null system call benchmark. Calls getpid in a loop, once through the
+ * int $0x80 gate and once through the sysenter path of the vsyscall page,
+ * and prints how long a call took on average for each.
+ *
+ * usage: syscall-bench [calls]
+ */
+
+static int getpid_int(void)
+{
+	int ret;
+	/* The kernel skips a return address after the system call number */
+	asm volatile("pushl $0\n\t"
+			"pushl %1\n\t"
+			"int $0x80\n\t"
+			"addl $8, %%esp"
+			: "=a" (ret) : "i" (SYS_getpid) : "memory", "cc");
+	return ret;
+}
+
+static int getpid_vsyscall(void)
+{
+	int ret;
+	asm volatile("pushl $0\n\t"
+			"pushl %1\n\t"
+			"call *%2\n\t"
+			"addl $8, %%esp"
+			: "=a" (ret) : "i" (SYS_getpid), "0" (VSYSCALL_ENTRY)
+			: "memory", "cc");
+	return ret;
+}
+
+static unsigned long long rdtsc(void)
+{
+	unsigned int low, high;
+	asm volatile("rdtsc" : "=a" (low), "=d" (high));
+	return ((unsigned long long)high << 32) | low;
+}
+
+static void run(const char* name, int (*call)(void), int calls)
+{
+	struct timeval start, end;
+	int pid = getpid();
+
+	gettimeofday(&start, NULL);
+	unsigned long long cycles = rdtsc();
+
+	int x;
+	for(x = 0;x < calls;x++)
+	{
+		if(call() != pid)
+		{
+			printf("syscall-bench: %s returned the wrong pid.\n",
+					name);
+			exit(1);
+		}
+	}
+
+	cycles = rdtsc() - cycles;
+	gettimeofday(&end, NULL);
+
+	long usecs = (end.tv_sec - start.tv_sec) * 1000000
+		+ (end.tv_usec - start.tv_usec);
+	printf("%-9s %8d calls %8ld us %6d ns/call %8d cycles/call\n",
+			name, calls, usecs,
+			(int)(usecs * 1000LL / calls),
+			(int)(cycles / calls));
+}
+
+int main(int argc, char** argv)
+{
+	int calls = 100000;
+	if(argc > 1) calls = atoi(argv[1]);
+
+	if(calls < 1)
+	{
+		printf("usage: syscall-bench [calls]\n");
+		return 1;
+	}
+
+	run("int 0x80", getpid_int, calls);
+	run("sysenter", getpid_vsyscall, calls);
+
+	return 0;
+}